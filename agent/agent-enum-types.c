@@ -3,6 +3,7 @@
 //
 #include "agent-enum-types.h"
 #include "agent.h"
+#include "pseudotcp.h"
 #include "gobject/genums.h"
 unsigned long nice_nomination_mode_get_type() {
     static unsigned long type = 0;
@@ -14,4 +15,16 @@ unsigned long nice_nomination_mode_get_type() {
         type = g_enum_register_static("NiceNominationMode", values);
     }
     return type;
+}
+unsigned long pseudo_tcp_congestion_control_get_type() {
+    static unsigned long type = 0;
+    if (!type) {
+        static const GEnumValue values[] = {
+                {PSEUDO_TCP_CONGESTION_CONTROL_RENO, "PSEUDO_TCP_CONGESTION_CONTROL_RENO", "reno"},
+                {PSEUDO_TCP_CONGESTION_CONTROL_CUBIC, "PSEUDO_TCP_CONGESTION_CONTROL_CUBIC", "cubic"},
+                {PSEUDO_TCP_CONGESTION_CONTROL_BBR, "PSEUDO_TCP_CONGESTION_CONTROL_BBR", "bbr"},
+                {0, NULL, NULL}};
+        type = g_enum_register_static("PseudoTcpCongestionControl", values);
+    }
+    return type;
 }
\ No newline at end of file
@@ -6,4 +6,6 @@
 #define LIBNICE_AGENT_ENUM_TYPES_H
 unsigned long nice_nomination_mode_get_type();
 #define NICE_TYPE_NOMINATION_MODE nice_nomination_mode_get_type()
+unsigned long pseudo_tcp_congestion_control_get_type();
+#define NICE_TYPE_TCP_CONGESTION_CONTROL pseudo_tcp_congestion_control_get_type()
 #endif//LIBNICE_AGENT_ENUM_TYPES_H
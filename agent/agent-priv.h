@@ -109,12 +109,19 @@ nice_input_message_iter_compare(const NiceInputMessageIter *a,
 #define NICE_AGENT_TIMER_MIN_CONSENT_INTERVAL 4000     /* msec timer minimum for consent lost requests (RFC 7675) */
 #define NICE_AGENT_TIMER_KEEPALIVE_TIMEOUT 50000       /* msec timer for keepalive (without consent checks) to timeout and assume conection lost */
 #define NICE_AGENT_MAX_CONNECTIVITY_CHECKS_DEFAULT 100 /* see RFC 8445 6.1.2.5 */
+#define NICE_AGENT_RELIABLE_BUFFER_LIMIT_DEFAULT (64 * 1024 * 1024) /* bytes of pseudo-TCP buffer growth */
 
 
 /* An upper limit to size of STUN packets handled (based on Ethernet
  * MTU and estimated typical sizes of ICE STUN packet */
 #define MAX_STUN_DATAGRAM_PAYLOAD 1300
 
+/* Per-source budget for inbound STUN packets that fail authentication or
+ * match no pending transaction: sustained rate (packets/s) and burst size.
+ * Sources that exhaust it are dropped before any parsing or HMAC work. */
+#define NICE_AGENT_STUN_REJECT_RATE 50
+#define NICE_AGENT_STUN_REJECT_BURST 100
+
 #define NICE_COMPONENT_MAX_VALID_CANDIDATES 50 /* maximum number of validates remote candidates to keep, the number is arbitrary but hopefully large enough */
 
 /* A convenient macro to test if the agent is compatible with RFC5245
@@ -145,6 +152,8 @@ struct _NiceAgent {
     guint stun_max_retransmissions;     /* property: stun max retransmissions, Rc */
     guint stun_initial_timeout;         /* property: stun initial timeout, RTO */
     guint stun_reliable_timeout;        /* property: stun reliable timeout */
+    guint stun_max_transactions;        /* property: stun max transactions */
+    PseudoTcpBufferBudget tcp_buffer_budget; /* property: reliable buffer limit */
     NiceNominationMode nomination_mode; /* property: Nomination mode */
     gboolean support_renomination;      /* property: support RENOMINATION STUN attribute */
     guint idle_timeout;                 /* property: conncheck timeout before stop */
@@ -163,8 +172,12 @@ struct _NiceAgent {
     GSource *discovery_timer_source; /* source of discovery timer */
     GSource *conncheck_timer_source; /* source of conncheck timer */
     GSource *keepalive_timer_source; /* source of keepalive timer */
+    GSource *interfaces_watch_source; /* source of interface changes */
+    GList *watched_local_ips;         /* local IPs at the last change */
     GSList *refresh_list;            /* list of CandidateRefresh items */
     GSList *pruning_refreshes;       /* list of Refreshes current being shut down*/
+    GHashTable *discovery_transactions; /* pending discovery requests by ID */
+    GHashTable *refresh_transactions;   /* pending refresh requests by ID */
     guint64 tie_breaker;             /* tie breaker (ICE sect 5.2
 				     "Determining Role" ID-19) */
     NiceCompatibility compatibility; /* property: Compatibility mode */
@@ -177,6 +190,11 @@ struct _NiceAgent {
     gchar *software_attribute;    /* SOFTWARE attribute */
     gboolean reliable;            /* property: reliable */
     gboolean bytestream_tcp;      /* property: bytestream-tcp */
+    gboolean reliable_channels;   /* property: reliable-channels */
+    gboolean reliable_pacing;     /* property: reliable-pacing */
+    guint discovery_cache_ttl;    /* property: discovery-cache-ttl */
+    gboolean discovery_cache_port_prediction; /* property: discovery-cache-port-prediction */
+    guint relay_race_count;       /* property: relay-race-count */
     gboolean keepalive_conncheck; /* property: keepalive_conncheck */
 
     GQueue pending_signals;
@@ -258,6 +276,21 @@ void _priv_set_socket_tos(NiceAgent *agent, NiceSocket *sock, gint tos);
 
 void _tcp_sock_is_writable(NiceSocket *sock, gpointer user_data);
 
+/* Non-blocking I/O on the reliable channels other than 0, for the channel
+ * streams. See #NiceAgent:reliable-channels. */
+gssize agent_channel_send(NiceAgent *agent, guint stream_id,
+                          guint component_id, guint16 channel_id, const guint8 *buf, gsize len,
+                          GError **error);
+gssize agent_channel_recv(NiceAgent *agent, guint stream_id,
+                          guint component_id, guint16 channel_id, guint8 *buf, gsize len,
+                          GError **error);
+gboolean agent_channel_check(NiceAgent *agent, guint stream_id,
+                             guint component_id, guint16 channel_id, GIOCondition condition);
+GCancellable *agent_channel_dup_cancellable(NiceAgent *agent, guint stream_id,
+                                            guint component_id, guint16 channel_id, GIOCondition condition);
+void agent_channel_close(NiceAgent *agent, guint stream_id,
+                         guint component_id, guint16 channel_id);
+
 gboolean
 component_io_cb(
         GSocket *gsocket,
@@ -269,6 +302,9 @@ gsize memcpy_buffer_to_input_message(NiceInputMessage *message,
 guint8 *
 compact_input_message(const NiceInputMessage *message, gsize *buffer_length);
 
+gsize gather_input_message(const NiceInputMessage *message, guint8 *buffer,
+                           gsize buffer_length);
+
 guint8 *
 compact_output_message(const NiceOutputMessage *message, gsize *buffer_length);
 
@@ -304,6 +340,16 @@ nice_candidate_pair_priority(guint32 o_prio, guint32 a_prio);
 
 void nice_candidate_pair_priority_to_string(guint64 prio, gchar *string);
 
+/*
+ * nice_interfaces_watch_source_new:
+ *
+ * Creates a #GSource which calls its callback whenever a network link or
+ * address changes, or returns %NULL if that can't be watched on this system.
+ * All the watches share the process-wide subscription of the interfaces
+ * cache.
+ */
+GSource *nice_interfaces_watch_source_new(void);
+
 /*
  * nice_debug_init:
  *
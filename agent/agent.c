@@ -55,6 +55,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #endif
 
 #include "debug.h"
@@ -66,6 +67,7 @@
 #include "conncheck.h"
 #include "discovery.h"
 #include "iostream.h"
+#include "server-cache.h"
 #include "socket/socket.h"
 #include "stun/usages/turn.h"
 
@@ -80,6 +82,15 @@
 
 #define MAX_TCP_MTU 1400 /* Use 1400 because of VPNs and we assume IEE 802.3 */
 
+/* Bytes added to each pseudo-TCP packet on the wire */
+#define IPV4_HEADER_SIZE 20
+#define IPV6_HEADER_SIZE 40
+#define UDP_HEADER_SIZE 8
+/* A TURN Send indication: the STUN header, the XOR-PEER-ADDRESS and DATA
+ * attribute headers and the padding of the data, plus the peer address */
+#define TURN_SEND_INDICATION_HEADER_SIZE (20 + 4 + 4 + 3)
+#define TURN_PEER_ADDRESS_SIZE(v6) ((v6) ? 20 : 8)
+
 
 static void agent_consume_next_rfc4571_chunk(NiceAgent *agent,
                                              NiceComponent *component, NiceInputMessage *messages, guint n_messages,
@@ -127,6 +138,13 @@ enum {
     PROP_SUPPORT_RENOMINATION,
     PROP_IDLE_TIMEOUT,
     PROP_CONSENT_FRESHNESS,
+    PROP_STUN_MAX_TRANSACTIONS,
+    PROP_RELIABLE_BUFFER_LIMIT,
+    PROP_RELIABLE_CHANNELS,
+    PROP_RELIABLE_PACING,
+    PROP_DISCOVERY_CACHE_TTL,
+    PROP_RELAY_RACE_COUNT,
+    PROP_DISCOVERY_CACHE_PORT_PREDICTION,
 };
 
 
@@ -142,6 +160,7 @@ enum {
     SIGNAL_NEW_SELECTED_PAIR_FULL,
     SIGNAL_NEW_CANDIDATE_FULL,
     SIGNAL_NEW_REMOTE_CANDIDATE_FULL,
+    SIGNAL_LOCAL_ADDRESSES_CHANGED,
 
     N_SIGNALS,
 };
@@ -155,8 +174,19 @@ static void pseudo_tcp_socket_closed(PseudoTcpSocket *sock, guint32 err,
                                      gpointer user_data);
 static PseudoTcpWriteResult pseudo_tcp_socket_write_packet(PseudoTcpSocket *sock,
                                                            const gchar *buffer, guint32 len, gpointer user_data);
+static gint pseudo_tcp_socket_write_packets(PseudoTcpSocket *sock,
+                                            const NiceOutputMessage *messages, guint n_messages, gpointer user_data);
 static void adjust_tcp_clock(NiceAgent *agent, NiceStream *stream, NiceComponent *component);
-
+static gssize pseudo_tcp_mux_write(PseudoTcpMux *mux, const guint8 *buf,
+                                   gsize len, gpointer user_data);
+static void pseudo_tcp_mux_channel_readable(PseudoTcpMux *mux, guint16 channel,
+                                            gpointer user_data);
+static void pseudo_tcp_mux_channel_writable(PseudoTcpMux *mux, guint16 channel,
+                                            gpointer user_data);
+static void pseudo_tcp_mux_channel_closed(PseudoTcpMux *mux, guint16 channel,
+                                          gpointer user_data);
+
+static void priv_add_interfaces_watch(NiceAgent *agent);
 static void nice_agent_constructed(GObject *object);
 static void nice_agent_dispose(GObject *object);
 static void nice_agent_get_property(GObject *object,
@@ -901,6 +931,168 @@ nice_agent_class_init(NiceAgentClass *klass) {
                                             FALSE,
                                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
+    /**
+    * NiceAgent:stun-max-transactions
+    *
+    * The maximum number of STUN requests of a component that can wait for
+    * a response at the same time. When all of them are in use, new
+    * connectivity checks and keepalives of the component cannot be sent
+    * until a transaction completes or times out. Busy components with many
+    * candidate pairs may need a larger value than the default.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_STUN_MAX_TRANSACTIONS,
+                                    g_param_spec_uint(
+                                            "stun-max-transactions",
+                                            "STUN Max Transactions",
+                                            "Maximum number of ongoing STUN transactions per component.",
+                                            1, STUN_AGENT_MAX_SAVED_IDS_LIMIT,
+                                            STUN_AGENT_MAX_SAVED_IDS,
+                                            G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    /**
+    * NiceAgent:reliable-buffer-limit
+    *
+    * In reliable mode, the pseudo-TCP sockets of all the components grow
+    * their send and receive buffers with the bandwidth-delay product of
+    * their paths. This is the total number of bytes they may grow them by,
+    * so that an agent with many components cannot use an unbounded amount
+    * of memory. Lowering it stops further growth, but does not shrink the
+    * buffers already grown. Zero keeps the buffers at their initial sizes.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_RELIABLE_BUFFER_LIMIT,
+                                    g_param_spec_uint(
+                                            "reliable-buffer-limit",
+                                            "Reliable buffer limit",
+                                            "Total growth of the pseudo-TCP buffers, in bytes.",
+                                            0, G_MAXUINT,
+                                            NICE_AGENT_RELIABLE_BUFFER_LIMIT_DEFAULT,
+                                            G_PARAM_READWRITE));
+
+    /**
+    * NiceAgent:reliable-channels
+    *
+    * In reliable mode, multiplex independent channels over the pseudo-TCP
+    * connection of each component. Every channel has its own flow control,
+    * so a channel which is not being read does not stall the others, and a
+    * priority set with nice_agent_set_channel_priority(). Channel 0 is the
+    * component itself, as used by nice_agent_send(), nice_agent_recv() and
+    * nice_agent_get_io_stream(); the others are opened implicitly by either
+    * peer and used through nice_agent_get_channel_io_stream().
+    *
+    * The framing is negotiated when the pseudo-TCP connection is set up. If
+    * the peer does not enable this property as well, the component falls
+    * back to plain pseudo-TCP, and the other channels fail with
+    * %G_IO_ERROR_NOT_CONNECTED. Channels are only available when the selected
+    * pair uses pseudo-TCP, not when it is an ICE-TCP pair.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_RELIABLE_CHANNELS,
+                                    g_param_spec_boolean(
+                                            "reliable-channels",
+                                            "Reliable channels",
+                                            "Multiplex channels over each pseudo-TCP connection",
+                                            FALSE,
+                                            G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    /**
+    * NiceAgent:reliable-pacing
+    *
+    * In reliable mode, spread the data sent by the pseudo-TCP sockets over
+    * each round trip at the rate chosen by their congestion control, instead
+    * of sending it in bursts as acknowledgements open the window. This
+    * avoids overflowing the queues of TURN relays and wireless links. The
+    * pacing runs off the existing pseudo-TCP clock of each component.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_RELIABLE_PACING,
+                                    g_param_spec_boolean(
+                                            "reliable-pacing",
+                                            "Reliable pacing",
+                                            "Pace the pseudo-TCP data out over each round trip",
+                                            FALSE,
+                                            G_PARAM_READWRITE));
+
+    /**
+    * NiceAgent:discovery-cache-ttl
+    *
+    * Number of seconds for which the answers of STUN and TURN servers are
+    * shared with the other agents of the process which also set this
+    * property, or 0 to always ask the servers.
+    *
+    * A server-reflexive address already known for a local address and STUN
+    * server is used without sending a Binding request, so that gathering
+    * completes at once. It is known for the same local port only, unless
+    * #NiceAgent:discovery-cache-port-prediction is set. As NAT mappings of
+    * UDP ports usually expire after 30 seconds to a few minutes, the value
+    * should stay well below that unless there is no NAT or it maps ports 1:1.
+    *
+    * TURN Allocate requests carry the realm and nonce last returned by the
+    * server, which saves the round trip of the authentication challenge.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_DISCOVERY_CACHE_TTL,
+                                    g_param_spec_uint(
+                                            "discovery-cache-ttl",
+                                            "Discovery cache TTL",
+                                            "Seconds for which STUN and TURN answers are shared between agents",
+                                            0, NICE_SERVER_CACHE_MAX_AGE,
+                                            0,
+                                            G_PARAM_READWRITE));
+
+    /**
+    * NiceAgent:discovery-cache-port-prediction
+    *
+    * Whether a server-reflexive address shared through
+    * #NiceAgent:discovery-cache-ttl is also used for other local ports than
+    * the one the STUN server saw. This only happens after two consecutive
+    * answers showed that the NAT keeps the local port, and then gives the
+    * mapped IP address with the local port. It is wrong behind a NAT which
+    * only keeps ports as long as they are free, so it is off by default.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_DISCOVERY_CACHE_PORT_PREDICTION,
+                                    g_param_spec_boolean(
+                                            "discovery-cache-port-prediction",
+                                            "Discovery cache port prediction",
+                                            "Use cached server-reflexive addresses for other local ports",
+                                            FALSE,
+                                            G_PARAM_READWRITE));
+
+    /**
+    * NiceAgent:relay-race-count
+    *
+    * Number of TURN servers kept for each local address of a component, or 0
+    * to keep all of them.
+    *
+    * When several servers are set with nice_agent_set_relay_info(), the
+    * allocations are still sent to all of them, but only the first
+    * #NiceAgent:relay-race-count servers to answer give relayed candidates.
+    * The allocations that complete later are deleted at once, and the ones
+    * not sent yet are cancelled. This saves the refreshes of the allocations,
+    * the load on the servers and the connectivity checks of their candidates.
+    *
+    * The servers that answered first also get the highest priority among the
+    * relayed candidates, instead of their position in the list of servers.
+    *
+    * Since: 0.1.20
+    */
+    g_object_class_install_property(gobject_class, PROP_RELAY_RACE_COUNT,
+                                    g_param_spec_uint(
+                                            "relay-race-count",
+                                            "Relay race count",
+                                            "Number of TURN servers to keep out of the first to answer",
+                                            0, NICE_CANDIDATE_MAX_TURN_SERVERS,
+                                            0,
+                                            G_PARAM_READWRITE));
+
     /* install signals */
 
     /**
@@ -1197,6 +1389,33 @@ nice_agent_class_init(NiceAgentClass *klass) {
                     NICE_TYPE_CANDIDATE,
                     G_TYPE_INVALID);
 
+    /**
+   * NiceAgent::local-addresses-changed
+   * @agent: The #NiceAgent object
+   *
+   * This signal is fired when the set of local IP addresses used to gather
+   * host candidates changes, for example because an interface went down or
+   * got a new address. Other network events, which don't change the
+   * addresses, are not reported. Applications can use it to gather
+   * candidates again or to restart ICE with nice_agent_restart().
+   *
+   * It is only emitted on Linux, where it is driven by rtnetlink.
+   *
+   * Since: 0.1.20
+   */
+    signals[SIGNAL_LOCAL_ADDRESSES_CHANGED] =
+            g_signal_new(
+                    "local-addresses-changed",
+                    G_OBJECT_CLASS_TYPE(klass),
+                    G_SIGNAL_RUN_LAST,
+                    0,
+                    NULL,
+                    NULL,
+                    NULL,
+                    G_TYPE_NONE,
+                    0,
+                    G_TYPE_INVALID);
+
     /* Init debug options depending on env variables */
     nice_debug_init();
 }
@@ -1260,6 +1479,8 @@ nice_agent_init(NiceAgent *agent) {
     agent->nomination_mode = NICE_NOMINATION_MODE_AGGRESSIVE;
     agent->support_renomination = FALSE;
     agent->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    agent->tcp_buffer_budget.limit = NICE_AGENT_RELIABLE_BUFFER_LIMIT_DEFAULT;
+    agent->tcp_buffer_budget.used = 0;
 
     agent->discovery_list = NULL;
     agent->discovery_unsched_items = 0;
@@ -1291,6 +1512,8 @@ nice_agent_constructed(GObject *object) {
     if (agent->reliable && agent->compatibility == NICE_COMPATIBILITY_GOOGLE)
         agent->bytestream_tcp = TRUE;
 
+    priv_add_interfaces_watch(agent);
+
     G_OBJECT_CLASS(nice_agent_parent_class)->constructed(object);
 }
 
@@ -1316,6 +1539,7 @@ nice_agent_new_full(GMainContext *ctx,
                                     "main-context", ctx,
                                     "reliable", (flags & NICE_AGENT_OPTION_RELIABLE) ? TRUE : FALSE,
                                     "bytestream-tcp", (flags & NICE_AGENT_OPTION_BYTESTREAM_TCP) ? TRUE : FALSE,
+                                    "reliable-channels", (flags & NICE_AGENT_OPTION_RELIABLE_CHANNELS) ? TRUE : FALSE,
                                     "nomination-mode", (flags & NICE_AGENT_OPTION_REGULAR_NOMINATION) ? NICE_NOMINATION_MODE_REGULAR : NICE_NOMINATION_MODE_AGGRESSIVE,
                                     "full-mode", (flags & NICE_AGENT_OPTION_LITE_MODE) ? FALSE : TRUE,
                                     "ice-trickle", (flags & NICE_AGENT_OPTION_ICE_TRICKLE) ? TRUE : FALSE,
@@ -1470,6 +1694,34 @@ nice_agent_get_property(
             g_value_set_boolean(value, agent->consent_freshness);
             break;
 
+        case PROP_STUN_MAX_TRANSACTIONS:
+            g_value_set_uint(value, agent->stun_max_transactions);
+            break;
+
+        case PROP_RELIABLE_BUFFER_LIMIT:
+            g_value_set_uint(value, agent->tcp_buffer_budget.limit);
+            break;
+
+        case PROP_RELIABLE_CHANNELS:
+            g_value_set_boolean(value, agent->reliable_channels);
+            break;
+
+        case PROP_RELIABLE_PACING:
+            g_value_set_boolean(value, agent->reliable_pacing);
+            break;
+
+        case PROP_DISCOVERY_CACHE_TTL:
+            g_value_set_uint(value, agent->discovery_cache_ttl);
+            break;
+
+        case PROP_DISCOVERY_CACHE_PORT_PREDICTION:
+            g_value_set_boolean(value, agent->discovery_cache_port_prediction);
+            break;
+
+        case PROP_RELAY_RACE_COUNT:
+            g_value_set_uint(value, agent->relay_race_count);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     }
@@ -1517,6 +1769,9 @@ void nice_agent_init_stun_agent(NiceAgent *agent, StunAgent *stun_agent) {
                                 STUN_AGENT_USAGE_USE_FINGERPRINT);
     }
     stun_agent_set_software(stun_agent, agent->software_attribute);
+
+    if (agent->stun_max_transactions != STUN_AGENT_MAX_SAVED_IDS)
+        stun_agent_set_max_transactions(stun_agent, agent->stun_max_transactions);
 }
 
 static void
@@ -1527,15 +1782,22 @@ nice_agent_reset_all_stun_agents(NiceAgent *agent, gboolean only_software) {
          stream_item = stream_item->next) {
         NiceStream *stream = stream_item->data;
 
+        /* The templates embed the SOFTWARE attribute */
+        conn_check_reset_request_templates(stream);
+        /* and the cached credentials depend on the compatibility */
+        nice_stream_reset_credentials(stream);
+
         for (component_item = stream->components; component_item;
              component_item = component_item->next) {
             NiceComponent *component = component_item->data;
 
-            if (only_software)
+            if (only_software) {
                 stun_agent_set_software(&component->stun_agent,
                                         agent->software_attribute);
-            else
+            } else {
+                stun_agent_clear(&component->stun_agent);
                 nice_agent_init_stun_agent(agent, &component->stun_agent);
+            }
         }
     }
 }
@@ -1704,6 +1966,51 @@ nice_agent_set_property(
             agent->consent_freshness = g_value_get_boolean(value);
             break;
 
+        case PROP_STUN_MAX_TRANSACTIONS:
+            agent->stun_max_transactions = g_value_get_uint(value);
+            break;
+
+        case PROP_RELIABLE_BUFFER_LIMIT:
+            agent->tcp_buffer_budget.limit = g_value_get_uint(value);
+            break;
+
+        case PROP_RELIABLE_CHANNELS:
+            agent->reliable_channels = g_value_get_boolean(value);
+            break;
+
+        case PROP_RELIABLE_PACING: {
+            GSList *stream_item, *component_item;
+
+            agent->reliable_pacing = g_value_get_boolean(value);
+
+            for (stream_item = agent->streams; stream_item;
+                 stream_item = stream_item->next) {
+                NiceStream *stream = stream_item->data;
+
+                for (component_item = stream->components; component_item;
+                     component_item = component_item->next) {
+                    NiceComponent *component = component_item->data;
+
+                    if (component->tcp)
+                        g_object_set(component->tcp, "pacing",
+                                     agent->reliable_pacing, NULL);
+                }
+            }
+            break;
+        }
+
+        case PROP_DISCOVERY_CACHE_TTL:
+            agent->discovery_cache_ttl = g_value_get_uint(value);
+            break;
+
+        case PROP_DISCOVERY_CACHE_PORT_PREDICTION:
+            agent->discovery_cache_port_prediction = g_value_get_boolean(value);
+            break;
+
+        case PROP_RELAY_RACE_COUNT:
+            agent->relay_race_count = g_value_get_uint(value);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     }
@@ -1729,7 +2036,26 @@ pseudo_tcp_socket_create(NiceAgent *agent, NiceStream *stream, NiceComponent *co
                                         pseudo_tcp_socket_closed,
                                         pseudo_tcp_socket_write_packet};
     component->tcp = pseudo_tcp_socket_new(0, &tcp_callbacks);
+    pseudo_tcp_socket_set_write_packets_func(component->tcp,
+                                             pseudo_tcp_socket_write_packets);
+    g_object_set(component->tcp, "buffer-budget", &agent->tcp_buffer_budget,
+                 "pacing", agent->reliable_pacing, NULL);
     component->tcp_writable_cancellable = g_cancellable_new();
+
+    if (agent->reliable_channels) {
+        PseudoTcpMuxCallbacks mux_callbacks = {component,
+                                               pseudo_tcp_mux_write,
+                                               pseudo_tcp_mux_channel_readable,
+                                               pseudo_tcp_mux_channel_writable,
+                                               pseudo_tcp_mux_channel_closed};
+
+        /* A new connection starts a new framing, once the peer agreed on it
+         * in pseudo_tcp_socket_opened(). */
+        g_object_set(component->tcp, "support-channels", TRUE, NULL);
+        g_clear_pointer(&component->mux, pseudo_tcp_mux_free);
+        g_clear_pointer(&component->channels, g_hash_table_unref);
+        component->mux = pseudo_tcp_mux_new(&mux_callbacks);
+    }
     nice_debug("Agent %p: Create Pseudo Tcp Socket for component %d",
                agent, component->id);
 }
@@ -1754,6 +2080,38 @@ static void priv_pseudo_tcp_error(NiceAgent *agent, NiceComponent *component) {
     }
 }
 
+/* Starts the channels of the component if the peer asked for the same
+ * framing. Otherwise, the pseudo-TCP socket is used as is: what was queued on
+ * channel 0 is sent on it directly, and the other channels fail. */
+static void
+priv_pseudo_tcp_start_channels(NiceAgent *agent, NiceComponent *component) {
+    gboolean support_channels = FALSE;
+    GBytes *queued;
+
+    g_object_get(component->tcp, "support-channels", &support_channels, NULL);
+    if (support_channels) {
+        pseudo_tcp_mux_start(component->mux);
+        return;
+    }
+
+    nice_debug("Agent %p: s%d:%d peer does not support reliable channels",
+               agent, component->stream_id, component->id);
+
+    queued = pseudo_tcp_mux_take_send_queue(component->mux, 0);
+    g_clear_pointer(&component->mux, pseudo_tcp_mux_free);
+    g_clear_pointer(&component->channels, g_hash_table_unref);
+
+    /* The send queue of a channel is smaller than the send buffer of a new
+     * connection, so this all fits. */
+    if (queued) {
+        gsize len;
+        gconstpointer data = g_bytes_get_data(queued, &len);
+
+        pseudo_tcp_socket_send(component->tcp, data, len);
+        g_bytes_unref(queued);
+    }
+}
+
 static void
 pseudo_tcp_socket_opened(PseudoTcpSocket *sock, gpointer user_data) {
     NiceComponent *component = user_data;
@@ -1766,6 +2124,10 @@ pseudo_tcp_socket_opened(PseudoTcpSocket *sock, gpointer user_data) {
     nice_debug("Agent %p: s%d:%d pseudo Tcp socket Opened", agent,
                component->stream_id, component->id);
 
+    /* Channel data may have been queued before the connection was up. */
+    if (component->mux)
+        priv_pseudo_tcp_start_channels(agent, component);
+
     agent_signal_socket_writable(agent, component);
 
     g_object_unref(agent);
@@ -1781,7 +2143,7 @@ pseudo_tcp_socket_opened(PseudoTcpSocket *sock, gpointer user_data) {
  * the number of bytes sent
  */
 static gint
-pseudo_tcp_socket_send_messages(PseudoTcpSocket *self,
+pseudo_tcp_socket_send_messages(NiceComponent *component,
                                 const NiceOutputMessage *messages, guint n_messages, gboolean allow_partial,
                                 GError **error) {
     guint i;
@@ -1799,7 +2161,7 @@ pseudo_tcp_socket_send_messages(PseudoTcpSocket *self,
      * and indicating that a message was partially sent. */
         if (!allow_partial &&
             output_message_get_size(message) >
-                    pseudo_tcp_socket_get_available_send_space(self)) {
+                    nice_component_reliable_get_available_send_space(component)) {
             return i;
         }
 
@@ -1811,16 +2173,18 @@ pseudo_tcp_socket_send_messages(PseudoTcpSocket *self,
             gssize ret;
 
             /* Send on the pseudo-TCP socket. */
-            ret = pseudo_tcp_socket_send(self, buffer->buffer, buffer->size);
+            ret = nice_component_reliable_send(component, buffer->buffer,
+                                               buffer->size);
 
             /* In case of -1, the error is either EWOULDBLOCK or ENOTCONN, which both
        * need the user to wait for the reliable-transport-writable signal */
             if (ret < 0) {
-                if (pseudo_tcp_socket_get_error(self) == EWOULDBLOCK)
+                gint err = nice_component_reliable_get_error(component);
+
+                if (err == EWOULDBLOCK)
                     goto out;
 
-                if (pseudo_tcp_socket_get_error(self) == ENOTCONN ||
-                    pseudo_tcp_socket_get_error(self) == EPIPE)
+                if (err == ENOTCONN || err == EPIPE)
                     g_set_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
                                 "TCP connection is not yet established.");
                 else
@@ -1850,7 +2214,7 @@ out:
  * number on error (including if the request would have blocked returning no
  * messages). */
 static gint
-pseudo_tcp_socket_recv_messages(PseudoTcpSocket *self,
+pseudo_tcp_socket_recv_messages(NiceComponent *component,
                                 NiceInputMessage *messages, guint n_messages, NiceInputMessageIter *iter,
                                 GError **error) {
     for (; iter->message < n_messages; iter->message++) {
@@ -1869,9 +2233,9 @@ pseudo_tcp_socket_recv_messages(PseudoTcpSocket *self,
             do {
                 gssize len;
 
-                len = pseudo_tcp_socket_recv(self,
-                                             (gchar *) buffer->buffer + iter->offset,
-                                             buffer->size - iter->offset);
+                len = nice_component_reliable_recv(component,
+                                                   (guint8 *) buffer->buffer + iter->offset,
+                                                   buffer->size - iter->offset);
 
                 nice_debug_verbose("%s: Received %" G_GSSIZE_FORMAT " bytes into "
                                    "buffer %p (offset %" G_GSIZE_FORMAT ", length %" G_GSIZE_FORMAT
@@ -1882,7 +2246,7 @@ pseudo_tcp_socket_recv_messages(PseudoTcpSocket *self,
                     /* Reached EOS. */
                     goto done;
                 } else if (len < 0 &&
-                           pseudo_tcp_socket_get_error(self) == EWOULDBLOCK) {
+                           nice_component_reliable_get_error(component) == EWOULDBLOCK) {
                     /* EWOULDBLOCK. If we’ve already received something, return that;
            * otherwise, error. */
                     if (nice_input_message_iter_get_n_valid_messages(iter) > 0) {
@@ -1891,7 +2255,8 @@ pseudo_tcp_socket_recv_messages(PseudoTcpSocket *self,
                     g_set_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
                                 "Error reading data from pseudo-TCP socket: would block.");
                     return len;
-                } else if (len < 0 && pseudo_tcp_socket_get_error(self) == ENOTCONN) {
+                } else if (len < 0 &&
+                           nice_component_reliable_get_error(component) == ENOTCONN) {
                     g_set_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
                                 "Error reading data from pseudo-TCP socket: not connected.");
                     return len;
@@ -1916,6 +2281,37 @@ done:
     return nice_input_message_iter_get_n_valid_messages(iter);
 }
 
+/* Hand everything received on the pseudo-TCP socket over to the channels, so
+ * that none of them waits on another being read. Returns FALSE if the
+ * connection had to be torn down. */
+static gboolean
+pseudo_tcp_socket_demux(NiceAgent *agent, NiceComponent *component) {
+    for (;;) {
+        const guint8 *buf = NULL;
+        gint len;
+
+        len = pseudo_tcp_socket_peek(component->tcp, &buf);
+        if (len == 0) {
+            pseudo_tcp_mux_receive_eof(component->mux);
+            return TRUE;
+        } else if (len < 0) {
+            if (pseudo_tcp_socket_get_error(component->tcp) == EWOULDBLOCK)
+                return TRUE;
+            break;
+        }
+
+        if (!pseudo_tcp_mux_receive(component->mux, buf, len)) {
+            nice_debug("Agent %p: s%d:%d: invalid reliable channel data",
+                       agent, component->stream_id, component->id);
+            break;
+        }
+        pseudo_tcp_socket_consume(component->tcp, len);
+    }
+
+    priv_pseudo_tcp_error(agent, component);
+    return FALSE;
+}
+
 /* This is called with the agent lock held. */
 static void
 pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
@@ -1940,6 +2336,10 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
 
     component->tcp_readable = TRUE;
 
+    /* With channels, what follows delivers channel 0. */
+    if (component->mux && !pseudo_tcp_socket_demux(agent, component))
+        goto out;
+
     has_io_callback = nice_component_has_io_callback(component);
 
     /* Only dequeue pseudo-TCP data if we can reliably inform the client. The
@@ -1948,12 +2348,12 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
    * no data loss of packets already received and dequeued. */
     if (has_io_callback) {
         do {
+            const guint8 *buf = NULL;
             gssize len;
 
-            /* FIXME: Why copy into a temporary buffer here? Why can’t the I/O
-       * callbacks be emitted directly from the pseudo-TCP receive buffer? */
-            len = pseudo_tcp_socket_recv(sock, (gchar *) component->recv_buffer,
-                                         component->recv_buffer_size);
+            /* The I/O callback is emitted straight from the pseudo-TCP
+       * receive buffer; the data is only dropped from it afterwards. */
+            len = nice_component_reliable_peek(component, &buf);
 
             nice_debug("%s: I/O callback case: Received %" G_GSSIZE_FORMAT " bytes",
                        G_STRFUNC, len);
@@ -1961,11 +2361,14 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
             if (len == 0) {
                 /* Reached EOS. */
                 component->tcp_readable = FALSE;
-                pseudo_tcp_socket_close(component->tcp, FALSE);
+                if (!component->mux)
+                    pseudo_tcp_socket_close(component->tcp, FALSE);
                 break;
             } else if (len < 0) {
+                gint err = nice_component_reliable_get_error(component);
+
                 /* Handle errors. */
-                if (pseudo_tcp_socket_get_error(sock) != EWOULDBLOCK) {
+                if (err != EWOULDBLOCK) {
                     nice_debug("%s: calling priv_pseudo_tcp_error()", G_STRFUNC);
                     priv_pseudo_tcp_error(agent, component);
                 }
@@ -1973,9 +2376,9 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
                 if (component->recv_buf_error != NULL) {
                     GIOErrorEnum error_code;
 
-                    if (pseudo_tcp_socket_get_error(sock) == ENOTCONN)
+                    if (err == ENOTCONN)
                         error_code = G_IO_ERROR_BROKEN_PIPE;
-                    else if (pseudo_tcp_socket_get_error(sock) == EWOULDBLOCK)
+                    else if (err == EWOULDBLOCK)
                         error_code = G_IO_ERROR_WOULD_BLOCK;
                     else
                         error_code = G_IO_ERROR_FAILED;
@@ -1987,7 +2390,14 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
                 break;
             }
 
-            nice_component_emit_io_callback(agent, component, len);
+            /* Keep the receive buffer alive even if the component goes away
+       * from within the callback. */
+            g_object_ref(sock);
+            g_object_ref(component);
+            nice_component_emit_io_callback(agent, component, buf, len);
+            nice_component_reliable_consume(component, len);
+            g_object_unref(component);
+            g_object_unref(sock);
 
             if (!agent_find_component(agent, stream_id, component_id,
                                       &stream, &component)) {
@@ -2009,7 +2419,7 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
      * error occurs. Copy the data directly into the client’s receive message
      * array without making any callbacks. Update component->recv_messages_iter
      * as we go. */
-        n_valid_messages = pseudo_tcp_socket_recv_messages(sock,
+        n_valid_messages = pseudo_tcp_socket_recv_messages(component,
                                                            component->recv_messages, component->n_recv_messages,
                                                            &component->recv_messages_iter, &child_error);
 
@@ -2034,7 +2444,8 @@ pseudo_tcp_socket_readable(PseudoTcpSocket *sock, gpointer user_data) {
         } else if (n_valid_messages == 0) {
             /* Reached EOS. */
             component->tcp_readable = FALSE;
-            pseudo_tcp_socket_close(component->tcp, FALSE);
+            if (!component->mux)
+                pseudo_tcp_socket_close(component->tcp, FALSE);
         }
     } else {
         nice_debug("%s: no data read", G_STRFUNC);
@@ -2061,11 +2472,65 @@ pseudo_tcp_socket_writable(PseudoTcpSocket *sock, gpointer user_data) {
     nice_debug_verbose("Agent %p: s%d:%d pseudo Tcp socket writable", agent,
                        component->stream_id, component->id);
 
+    /* With channels, writability is signalled per channel as the frames
+   * queued on them go out. */
+    if (component->mux)
+        pseudo_tcp_mux_flush(component->mux);
+    else
+        agent_signal_socket_writable(agent, component);
+
+    g_object_unref(agent);
+}
+
+static gssize
+pseudo_tcp_mux_write(PseudoTcpMux *mux, const guint8 *buf, gsize len,
+                     gpointer user_data) {
+    NiceComponent *component = user_data;
+
+    return pseudo_tcp_socket_send(component->tcp, (const gchar *) buf, len);
+}
+
+static void
+pseudo_tcp_mux_channel_readable(PseudoTcpMux *mux, guint16 channel,
+                                gpointer user_data) {
+    NiceComponent *component = user_data;
+
+    /* Channel 0 is delivered by pseudo_tcp_socket_readable(). */
+    if (channel != 0)
+        g_cancellable_cancel(
+                nice_component_get_channel(component, channel)->readable);
+}
+
+static void
+pseudo_tcp_mux_channel_writable(PseudoTcpMux *mux, guint16 channel,
+                                gpointer user_data) {
+    NiceComponent *component = user_data;
+    NiceAgent *agent;
+
+    if (channel != 0) {
+        g_cancellable_cancel(
+                nice_component_get_channel(component, channel)->writable);
+        return;
+    }
+
+    agent = g_weak_ref_get(&component->agent_ref);
+    if (agent == NULL)
+        return;
+
     agent_signal_socket_writable(agent, component);
 
     g_object_unref(agent);
 }
 
+static void
+pseudo_tcp_mux_channel_closed(PseudoTcpMux *mux, guint16 channel,
+                              gpointer user_data) {
+    NiceComponent *component = user_data;
+
+    if (channel != 0)
+        nice_component_remove_channel(component, channel);
+}
+
 static void
 pseudo_tcp_socket_closed(PseudoTcpSocket *sock, guint32 err,
                          gpointer user_data) {
@@ -2135,6 +2600,50 @@ pseudo_tcp_socket_write_packet(PseudoTcpSocket *psocket,
     return WR_FAIL;
 }
 
+/* Send a burst of pseudo-TCP packets in as few system calls as the socket
+ * allows (sendmmsg() for UDP). As in pseudo_tcp_socket_write_packet(), packets
+ * not sent because of EWOULDBLOCK are left for the state machine to retransmit. */
+static gint
+pseudo_tcp_socket_write_packets(PseudoTcpSocket *psocket,
+                                const NiceOutputMessage *messages, guint n_messages, gpointer user_data) {
+    NiceComponent *component = user_data;
+    NiceAgent *agent;
+    gint n_sent = -1;
+
+    agent = g_weak_ref_get(&component->agent_ref);
+    if (agent == NULL)
+        return -1;
+
+    if (component->selected_pair.local != NULL) {
+        NiceSocket *sock;
+        NiceAddress *addr;
+
+        sock = component->selected_pair.local->sockptr;
+        addr = &component->selected_pair.remote->c.addr;
+
+        if (nice_debug_is_enabled()) {
+            gchar tmpbuf[INET6_ADDRSTRLEN];
+            nice_address_to_string(addr, tmpbuf);
+
+            nice_debug_verbose(
+                    "Agent %p : s%d:%d: sending %u packets on socket %p (FD %d) to [%s]:%d",
+                    agent, component->stream_id, component->id, n_messages,
+                    sock->fileno, g_socket_get_fd(sock->fileno), tmpbuf,
+                    nice_address_get_port(addr));
+        }
+
+        n_sent = nice_socket_send_messages(sock, addr, messages, n_messages);
+    } else {
+        nice_debug("%s: WARNING: Failed to send pseudo-TCP packets from agent %p "
+                   "as no pair has been selected yet.",
+                   G_STRFUNC, agent);
+    }
+
+    g_object_unref(agent);
+
+    return n_sent;
+}
+
 
 static gboolean
 notify_pseudo_tcp_socket_clock_agent_locked(NiceAgent *agent,
@@ -2404,6 +2913,90 @@ process_queued_tcp_packets(NiceAgent *agent, NiceStream *stream,
     }
 }
 
+/* Returns the MTU of the route from @local to @remote, as known to the kernel
+ * (including any path MTU it learnt from ICMP), or 0 if unknown. Connecting a
+ * UDP socket sends nothing, but is needed for IP_MTU to be available. */
+static guint
+get_route_mtu(const NiceAddress *local, const NiceAddress *remote) {
+#if defined(IP_MTU) && defined(IPV6_MTU)
+    struct sockaddr_storage sa;
+    gboolean ipv6 = (nice_address_ip_version(remote) == 6);
+    socklen_t sa_len = ipv6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    int fd, mtu = 0;
+    socklen_t len = sizeof(mtu);
+
+    fd = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return 0;
+
+    /* Bind to the local address, if any, so the route goes out of the right
+   * interface. */
+    if (local != NULL && nice_address_ip_version(local) ==
+                                 nice_address_ip_version(remote)) {
+        NiceAddress any_port = *local;
+
+        nice_address_set_port(&any_port, 0);
+        nice_address_copy_to_sockaddr(&any_port, (struct sockaddr *) &sa);
+        if (bind(fd, (struct sockaddr *) &sa, sa_len) < 0)
+            nice_debug("Failed to bind MTU lookup socket: %s", g_strerror(errno));
+    }
+
+    nice_address_copy_to_sockaddr(remote, (struct sockaddr *) &sa);
+    if (connect(fd, (struct sockaddr *) &sa, sa_len) < 0 ||
+        getsockopt(fd, ipv6 ? IPPROTO_IPV6 : IPPROTO_IP,
+                   ipv6 ? IPV6_MTU : IP_MTU, &mtu, &len) < 0)
+        mtu = 0;
+
+    close(fd);
+
+    return MAX(mtu, 0);
+#else
+    return 0;
+#endif
+}
+
+/* Sizes the segments of the pseudo-TCP socket for the selected pair: the
+ * overhead depends on the address family and on whether the data goes through
+ * a TURN relay, and the MTU of the route lets the socket probe for larger
+ * segments than the conservative MAX_TCP_MTU. */
+static void
+adjust_tcp_mtu(NiceAgent *agent, NiceComponent *component,
+               NiceCandidateImpl *lc, NiceCandidate *rcandidate) {
+    const NiceAddress *remote = &rcandidate->addr;
+    const NiceAddress *local = &lc->c.base_addr;
+    guint overhead = UDP_HEADER_SIZE;
+    guint route_mtu;
+
+    if (lc->c.type == NICE_CANDIDATE_TYPE_RELAYED && lc->turn != NULL) {
+        /* Data goes out in Send indications until the TURN socket has bound a
+         * channel to the peer, and the agent isn't told when that happens, so
+         * allow for them rather than for the 4 bytes of ChannelData. */
+        overhead += TURN_SEND_INDICATION_HEADER_SIZE +
+                    TURN_PEER_ADDRESS_SIZE(nice_address_ip_version(remote) == 6);
+
+        /* The kernel only knows the route to the TURN server; probing finds out
+     * about the rest of the path. */
+        remote = &lc->turn->server;
+        local = NULL;
+    }
+
+    overhead += (nice_address_ip_version(remote) == 6) ? IPV6_HEADER_SIZE : IPV4_HEADER_SIZE;
+
+    /* The route to a TURN server over TCP says nothing about datagram sizes. */
+    if (lc->turn != NULL && lc->turn->type != NICE_RELAY_TYPE_TURN_UDP)
+        route_mtu = 0;
+    else
+        route_mtu = get_route_mtu(local, remote);
+
+    nice_debug("Agent %p: pseudo-TCP transport overhead %u bytes, route MTU %u",
+               agent, overhead, route_mtu);
+
+    g_object_set(component->tcp, "transport-overhead", overhead,
+                 "max-mtu", route_mtu, NULL);
+    pseudo_tcp_socket_notify_mtu(component->tcp,
+                                 route_mtu ? MIN(route_mtu, MAX_TCP_MTU) : MAX_TCP_MTU);
+}
+
 void agent_signal_new_selected_pair(NiceAgent *agent, guint stream_id,
                                     guint component_id, NiceCandidate *lcandidate, NiceCandidate *rcandidate) {
     NiceComponent *component;
@@ -2424,7 +3017,7 @@ void agent_signal_new_selected_pair(NiceAgent *agent, guint stream_id,
         process_queued_tcp_packets(agent, stream, component);
 
         pseudo_tcp_socket_connect(component->tcp);
-        pseudo_tcp_socket_notify_mtu(component->tcp, MAX_TCP_MTU);
+        adjust_tcp_mtu(agent, component, lc, rcandidate);
         adjust_tcp_clock(agent, stream, component);
     }
 
@@ -2581,6 +3174,17 @@ priv_add_new_candidate_discovery_stun(NiceAgent *agent,
                                       NiceSocket *nicesock, NiceAddress server,
                                       NiceStream *stream, guint component_id) {
     CandidateDiscovery *cdisco;
+    NiceAddress mapped;
+
+    if (agent->discovery_cache_ttl &&
+        nice_server_cache_lookup_mapped(&nicesock->addr, &server,
+                                        agent->discovery_cache_ttl,
+                                        agent->discovery_cache_port_prediction, &mapped)) {
+        nice_debug("Agent %p : Using cached server-reflexive address", agent);
+        discovery_add_known_server_reflexive_candidates(agent, stream->id,
+                                                        component_id, &mapped, nicesock, &server);
+        return;
+    }
 
     /* note: no need to check for redundant candidates, as this is
    *       done later on in the process */
@@ -2766,6 +3370,19 @@ priv_add_new_candidate_discovery_turn(NiceAgent *agent,
     }
     stun_agent_set_software(&cdisco->stun_agent, agent->software_attribute);
 
+    if (agent->discovery_cache_ttl &&
+        agent->compatibility == NICE_COMPATIBILITY_RFC5245) {
+        gsize len = nice_server_cache_lookup_challenge(&turn->server,
+                                                       agent->discovery_cache_ttl, cdisco->stun_resp_buffer,
+                                                       sizeof(cdisco->stun_resp_buffer));
+
+        if (len > 0) {
+            cdisco->stun_resp_msg.buffer = cdisco->stun_resp_buffer;
+            cdisco->stun_resp_msg.buffer_len = sizeof(cdisco->stun_resp_buffer);
+            cdisco->cached_challenge = TRUE;
+        }
+    }
+
     nice_debug("Agent %p : Adding new relay-rflx candidate discovery %p",
                agent, cdisco);
     agent->discovery_list = g_slist_append(agent->discovery_list, cdisco);
@@ -3226,6 +3843,8 @@ priv_host_candidate_result_to_string(HostCandidateResult result) {
             return "redundant";
         case HOST_CANDIDATE_DUPLICATE_PORT:
             return "duplicate port";
+        case HOST_CANDIDATE_PORT_RANGE_FULL:
+            return "port range full";
         default:
             g_assert_not_reached();
     }
@@ -3322,6 +3941,8 @@ nice_agent_gather_candidates(
                 guint current_port;
                 guint start_port;
                 gboolean accept_duplicate = FALSE;
+                gboolean pooled;
+                guint attempts;
                 HostCandidateResult res = HOST_CANDIDATE_CANT_CREATE_SOCKET;
 
                 if ((agent->use_ice_udp == FALSE && add_type == ADD_HOST_UDP) ||
@@ -3341,8 +3962,16 @@ nice_agent_gather_candidates(
                         break;
                 }
 
+                /* UDP and passive TCP ports of a range come from the port
+                 * pool, which skips the ports known to be taken. */
+                pooled = component->min_port != 0 &&
+                         transport != NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE;
+                attempts = 0;
+
                 start_port = component->min_port;
-                if (component->min_port != 0) {
+                if (pooled) {
+                    start_port = 0;
+                } else if (component->min_port != 0) {
                     start_port = nice_rng_generate_int(agent->rng, component->min_port, component->max_port + 1);
                 }
                 current_port = start_port;
@@ -3364,6 +3993,19 @@ nice_agent_gather_candidates(
                                    priv_host_candidate_result_to_string(res),
                                    accept_duplicate ? " (accept duplicate)" : "");
                     }
+                    if (pooled) {
+                        /* A duplicate port goes back to the pool, and the
+                         * next attempt gets the following one. */
+                        if (res != HOST_CANDIDATE_DUPLICATE_PORT)
+                            break;
+                        if (++attempts <= component->max_port - component->min_port)
+                            continue;
+                        attempts = 0;
+                        if (accept_duplicate)
+                            break;
+                        accept_duplicate = TRUE;
+                        continue;
+                    }
                     if (current_port > 0)
                         current_port++;
                     if (current_port > component->max_port)
@@ -3381,7 +4023,8 @@ nice_agent_gather_candidates(
                     res == HOST_CANDIDATE_FAILED ||
                     res == HOST_CANDIDATE_CANT_CREATE_SOCKET)
                     continue;
-                else if (res == HOST_CANDIDATE_DUPLICATE_PORT) {
+                else if (res == HOST_CANDIDATE_DUPLICATE_PORT ||
+                         res == HOST_CANDIDATE_PORT_RANGE_FULL) {
                     ret = FALSE;
                     goto error;
                 }
@@ -3494,6 +4137,7 @@ error:
             g_slist_free_full(component->local_candidates,
                               (GDestroyNotify) nice_candidate_free);
             component->local_candidates = NULL;
+            nice_component_reset_credentials(component);
         }
         discovery_prune_stream(agent, stream_id);
     }
@@ -3770,9 +4414,11 @@ static gboolean priv_add_remote_candidate(
      * our list of candidates.. this 'update' will make the peer-rflx a
      * server-rflx/host candidate again */
         if (username) {
-            if (candidate->username == NULL)
+            if (candidate->username == NULL) {
                 candidate->username = g_strdup(username);
-            else if (g_strcmp0(username, candidate->username))
+                conn_check_reset_request_templates(stream);
+                nice_stream_reset_credentials(stream);
+            } else if (g_strcmp0(username, candidate->username))
                 nice_debug("Agent %p : Candidate username '%s' is not allowed "
                            "to change to '%s' now (ICE restart only).",
                            agent,
@@ -3915,6 +4561,7 @@ nice_agent_set_remote_credentials(
 
         g_strlcpy(stream->remote_ufrag, ufrag, NICE_STREAM_MAX_UFRAG);
         g_strlcpy(stream->remote_password, pwd, NICE_STREAM_MAX_PWD);
+        nice_stream_reset_credentials(stream);
 
         conn_check_remote_credentials_set(agent, stream);
 
@@ -3947,6 +4594,8 @@ nice_agent_set_local_credentials(
     if (stream && ufrag && pwd) {
         g_strlcpy(stream->local_ufrag, ufrag, NICE_STREAM_MAX_UFRAG);
         g_strlcpy(stream->local_password, pwd, NICE_STREAM_MAX_PWD);
+        conn_check_reset_request_templates(stream);
+        nice_stream_reset_credentials(stream);
 
         ret = TRUE;
         goto done;
@@ -4381,46 +5030,50 @@ agent_recv_message_unlocked(
     if (retval == RECV_OOB)
         goto done;
 
-    /* If the message’s stated length is equal to its actual length, it’s probably
-   * a STUN message; otherwise it’s probably data. */
-    if (stun_message_validate_buffer_length_fast(
+    /* If the message’s stated length is equal to its actual length, and its
+   * attributes add up to it, it’s probably a STUN message; otherwise it’s
+   * probably data. This is checked on the buffers as they are. */
+    if (stun_message_validate_buffer_length_vectored(
                 (StunInputVector *) message->buffers, message->n_buffers, message->length,
                 (agent->compatibility != NICE_COMPATIBILITY_OC2007 &&
                  agent->compatibility != NICE_COMPATIBILITY_OC2007R2)) == (ssize_t) message->length) {
-        /* Slow path: If this message isn’t obviously *not* a STUN packet, compact
-     * its buffers
-     * into a single monolithic one and parse the packet properly. */
+        /* Parse the packet in place when it fits in the first buffer, which
+     * is the common case. Otherwise gather it, on the stack if it is small
+     * enough. */
+        guint8 stack_buf[STUN_MAX_MESSAGE_SIZE_IPV6];
         guint8 *big_buf;
         gsize big_buf_len;
-        int validated_len;
-
-        big_buf = compact_input_message(message, &big_buf_len);
-
-        validated_len = stun_message_validate_buffer_length(big_buf, big_buf_len,
-                                                            (agent->compatibility != NICE_COMPATIBILITY_OC2007 &&
-                                                             agent->compatibility != NICE_COMPATIBILITY_OC2007R2));
+        gboolean allocated_buf = FALSE;
+        gboolean handled;
+
+        if (message->buffers[0].size >= message->length) {
+            big_buf = message->buffers[0].buffer;
+            big_buf_len = message->length;
+        } else if (message->length <= sizeof(stack_buf)) {
+            big_buf = stack_buf;
+            big_buf_len = gather_input_message(message, stack_buf, sizeof(stack_buf));
+        } else {
+            big_buf = compact_input_message(message, &big_buf_len);
+            allocated_buf = TRUE;
+        }
 
-        if (validated_len == (gint) big_buf_len) {
-            gboolean handled;
+        handled =
+                conn_check_handle_inbound_stun(agent, stream, component, nicesock,
+                                               message->from, (gchar *) big_buf, big_buf_len);
 
-            handled =
-                    conn_check_handle_inbound_stun(agent, stream, component, nicesock,
-                                                   message->from, (gchar *) big_buf, big_buf_len);
+        if (allocated_buf)
+            g_free(big_buf);
 
-            if (handled) {
-                /* Handled STUN message. */
-                nice_debug("%s: Valid STUN packet received.", G_STRFUNC);
-                retval = RECV_OOB;
-                g_free(big_buf);
-                goto done;
-            }
+        if (handled) {
+            /* Handled STUN message. */
+            nice_debug("%s: Valid STUN packet received.", G_STRFUNC);
+            retval = RECV_OOB;
+            goto done;
         }
 
-        nice_debug("%s: Packet passed fast STUN validation but failed "
-                   "slow validation.",
+        nice_debug("%s: Packet passed STUN length validation but was not "
+                   "handled as STUN.",
                    G_STRFUNC);
-
-        g_free(big_buf);
     }
 
     if (!nice_component_verify_remote_candidate(component,
@@ -4634,6 +5287,30 @@ compact_input_message(const NiceInputMessage *message, gsize *buffer_length) {
     return compact_message((NiceOutputMessage *) message, *buffer_length);
 }
 
+/* Copies the buffers of @message into @buffer, which is @buffer_length bytes
+ * long, without allocating. Returns the number of bytes copied, which is
+ * less than @message->length only if @buffer is too small. */
+gsize gather_input_message(const NiceInputMessage *message, guint8 *buffer,
+                           gsize buffer_length) {
+    gsize offset = 0;
+    guint i;
+
+    for (i = 0;
+         offset < message->length && offset < buffer_length &&
+         ((message->n_buffers >= 0 && i < (guint) message->n_buffers) ||
+          (message->n_buffers < 0 && message->buffers[i].buffer != NULL));
+         i++) {
+        gsize len;
+
+        len = MIN(message->buffers[i].size, message->length - offset);
+        len = MIN(len, buffer_length - offset);
+        memcpy(buffer + offset, message->buffers[i].buffer, len);
+        offset += len;
+    }
+
+    return offset;
+}
+
 /* Returns the number of bytes copied. Silently drops any data from @buffer
  * which doesn’t fit in @message. */
 gsize memcpy_buffer_to_input_message(NiceInputMessage *message,
@@ -5014,8 +5691,8 @@ nice_agent_recv_messages_blocking_or_nonblocking(NiceAgent *agent,
     /* For a reliable stream, grab any data from the pseudo-TCP input buffer
    * before trying the sockets. */
     if (agent->reliable &&
-        pseudo_tcp_socket_get_available_bytes(component->tcp) > 0) {
-        pseudo_tcp_socket_recv_messages(component->tcp,
+        nice_component_reliable_get_available_bytes(component) > 0) {
+        pseudo_tcp_socket_recv_messages(component,
                                         component->recv_messages, component->n_recv_messages,
                                         &component->recv_messages_iter, &child_error);
         adjust_tcp_clock(agent, stream, component);
@@ -5072,7 +5749,7 @@ nice_agent_recv_messages_blocking_or_nonblocking(NiceAgent *agent,
         error_reported = (child_error != NULL &&
                           !g_error_matches(child_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK));
         reached_eos = (agent->reliable &&
-                       pseudo_tcp_socket_is_closed_remotely(component->tcp) &&
+                       nice_component_reliable_is_eof(component) &&
                        nice_input_message_iter_compare(&prev_recv_messages_iter,
                                                        &component->recv_messages_iter));
         all_sockets_would_block = (!blocking && !reached_eos &&
@@ -5272,11 +5949,13 @@ nice_agent_send_messages_nonblocking_internal(
             !nice_socket_is_reliable(component->selected_pair.local->sockptr)) {
             if (!pseudo_tcp_socket_is_closed(component->tcp)) {
                 /* Send on the pseudo-TCP socket. */
-                n_sent = pseudo_tcp_socket_send_messages(component->tcp, messages,
+                n_sent = pseudo_tcp_socket_send_messages(component, messages,
                                                          n_messages, allow_partial, &child_error);
                 adjust_tcp_clock(agent, stream, component);
 
-                if (!pseudo_tcp_socket_can_send(component->tcp))
+                if (component->mux ?
+                    nice_component_reliable_get_available_send_space(component) == 0 :
+                    !pseudo_tcp_socket_can_send(component->tcp))
                     g_cancellable_reset(component->tcp_writable_cancellable);
                 if (n_sent < 0 && !g_error_matches(child_error, G_IO_ERROR,
                                                    G_IO_ERROR_WOULD_BLOCK)) {
@@ -5599,6 +6278,14 @@ nice_agent_dispose(GObject *object) {
 
     priv_remove_keepalive_timer(agent);
 
+    if (agent->interfaces_watch_source != NULL) {
+        g_source_destroy(agent->interfaces_watch_source);
+        g_source_unref(agent->interfaces_watch_source);
+        agent->interfaces_watch_source = NULL;
+    }
+    g_list_free_full(agent->watched_local_ips, g_free);
+    agent->watched_local_ips = NULL;
+
     for (i = agent->local_addresses; i; i = i->next) {
         NiceAddress *a = i->data;
 
@@ -5627,6 +6314,9 @@ nice_agent_dispose(GObject *object) {
         i = next;
     }
 
+    g_clear_pointer(&agent->discovery_transactions, g_hash_table_unref);
+    g_clear_pointer(&agent->refresh_transactions, g_hash_table_unref);
+
     while (agent->streams) {
         NiceStream *s = agent->streams->data;
 
@@ -5766,25 +6456,13 @@ component_io_cb(GSocket *gsocket, GIOCondition condition, gpointer user_data) {
     if (agent->reliable && !nice_socket_is_reliable(socket_source->socket)) {
 #define TCP_HEADER_SIZE 24 /* bytes */
         guint8 local_header_buf[TCP_HEADER_SIZE];
-        /* FIXME: Currently, the critical path for reliable packet delivery has two
-     * memcpy()s: one into the pseudo-TCP receive buffer, and one out of it.
-     * This could moderately easily be reduced to one memcpy() in the common
-     * case of in-order packet delivery, by replacing local_body_buf with a
-     * pointer into the pseudo-TCP receive buffer. If it turns out the packet
-     * is out-of-order (which we can only know after parsing its header), the
-     * data will need to be moved in the buffer. If the packet *is* in order,
-     * however, the only memcpy() then needed is from the pseudo-TCP receive
-     * buffer to the client’s message buffers.
-     *
-     * In fact, in the case of a reliable agent with I/O callbacks, zero
-     * memcpy()s can be achieved (for in-order packet delivery) by emittin the
-     * I/O callback directly from the pseudo-TCP receive buffer. */
-        GInputVector local_bufs[] = {
-                {local_header_buf, sizeof(local_header_buf)},
-                {component->recv_buffer, component->recv_buffer_size},
-        };
-        NiceInputMessage local_message = {
-                local_bufs, G_N_ELEMENTS(local_bufs), NULL, 0};
+        /* Packets are received straight into the free part of the pseudo-TCP
+     * receive buffer when possible, so in-order data is only copied once,
+     * out of it (or not at all with I/O callbacks). Out-of-order data is
+     * moved within the buffer after its header has been parsed, and
+     * anything which does not fit in the region spills into recv_buffer. */
+        GInputVector local_bufs[3];
+        NiceInputMessage local_message = {local_bufs, 0, NULL, 0};
         RecvStatus retval = 0;
 
         if (pseudo_tcp_socket_is_closed(component->tcp)) {
@@ -5796,10 +6474,36 @@ component_io_cb(GSocket *gsocket, GIOCondition condition, gpointer user_data) {
             goto done;
         }
 
-        while (has_io_callback ||
+        /* Channels are always read, each up to its own window. */
+        while (has_io_callback || component->mux != NULL ||
                (component->recv_messages != NULL &&
                 !nice_input_message_iter_is_at_end(&component->recv_messages_iter,
                                                    component->recv_messages, component->n_recv_messages))) {
+            guint8 *region = NULL;
+            gsize region_len = 0;
+
+            /* Packets queued before a pair was selected get written to the
+       * receive buffer first, so the region can't be used then. */
+            if (component->selected_pair.local != NULL &&
+                g_queue_is_empty(&component->queued_tcp_packets))
+                region = pseudo_tcp_socket_get_receive_region(component->tcp,
+                                                              &region_len);
+
+            local_bufs[0].buffer = local_header_buf;
+            local_bufs[0].size = sizeof(local_header_buf);
+            if (region) {
+                local_bufs[1].buffer = region;
+                local_bufs[1].size = region_len;
+                local_bufs[2].buffer = component->recv_buffer;
+                local_bufs[2].size = component->recv_buffer_size;
+                local_message.n_buffers = 3;
+            } else {
+                local_bufs[1].buffer = component->recv_buffer;
+                local_bufs[1].size = component->recv_buffer_size;
+                local_message.n_buffers = 2;
+            }
+            local_message.length = 0;
+
             /* Receive a single message. This will receive it into the given
        * @local_bufs then, for pseudo-TCP, emit I/O callbacks or copy it into
        * component->recv_messages in pseudo_tcp_socket_readable(). STUN packets
@@ -5904,7 +6608,8 @@ component_io_cb(GSocket *gsocket, GIOCondition condition, gpointer user_data) {
             if (msg->length > 0) {
                 nice_debug_verbose("%s: %p: received a valid message with %" G_GSIZE_FORMAT " bytes", G_STRFUNC, agent, msg->length);
                 if (has_io_callback) {
-                    nice_component_emit_io_callback(agent, component, msg->length);
+                    nice_component_emit_io_callback(agent, component,
+                                                    component->recv_buffer, msg->length);
                 } else {
                     iter->message++;
                 }
@@ -5956,7 +6661,7 @@ component_io_cb(GSocket *gsocket, GIOCondition condition, gpointer user_data) {
 
                 if (local_message.length > 0) {
                     nice_component_emit_io_callback(agent, component,
-                                                    local_message.length);
+                                                    component->recv_buffer, local_message.length);
                 }
             }
 
@@ -6343,6 +7048,49 @@ void agent_timeout_add_seconds_with_context(NiceAgent *agent,
                                             function, user_data);
 }
 
+static gboolean
+priv_interfaces_changed(NiceAgent *agent, gpointer user_data) {
+    GList *ips = nice_interfaces_get_local_ips(FALSE);
+    GList *i;
+    gboolean changed;
+
+    changed = g_list_length(ips) != g_list_length(agent->watched_local_ips);
+    for (i = ips; i && !changed; i = i->next) {
+        if (!g_list_find_custom(agent->watched_local_ips, i->data,
+                                (GCompareFunc) g_strcmp0))
+            changed = TRUE;
+    }
+
+    g_list_free_full(agent->watched_local_ips, g_free);
+    agent->watched_local_ips = ips;
+
+    if (changed) {
+        nice_debug("Agent %p : local addresses changed", agent);
+        agent_queue_signal(agent, signals[SIGNAL_LOCAL_ADDRESSES_CHANGED]);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Watches the network interfaces for #NiceAgent::local-addresses-changed,
+ * starting from the addresses they have now. */
+static void
+priv_add_interfaces_watch(NiceAgent *agent) {
+    GSource *source = nice_interfaces_watch_source_new();
+
+    if (source == NULL)
+        return;
+
+    agent->watched_local_ips = nice_interfaces_get_local_ips(FALSE);
+
+    g_source_set_name(source, "Agent interfaces watch");
+    g_source_set_callback(source, timeout_cb,
+                          timeout_data_new(agent, priv_interfaces_changed, NULL),
+                          (GDestroyNotify) timeout_data_destroy);
+    g_source_attach(source, agent->main_context);
+    agent->interfaces_watch_source = source;
+}
+
 NICEAPI_EXPORT gboolean
 nice_agent_set_selected_remote_candidate(
         NiceAgent *agent,
@@ -6864,6 +7612,8 @@ nice_agent_parse_remote_sdp(NiceAgent *agent, const gchar *sdp) {
             }
             g_strlcpy(current_stream->remote_ufrag, sdp_lines[i] + 12,
                       NICE_STREAM_MAX_UFRAG);
+            conn_check_reset_request_templates(current_stream);
+            nice_stream_reset_credentials(current_stream);
         } else if (g_str_has_prefix(sdp_lines[i], "a=ice-pwd:")) {
             if (current_stream == NULL) {
                 ret = -1;
@@ -7117,6 +7867,264 @@ done:
     return iostream;
 }
 
+NICEAPI_EXPORT GIOStream *
+nice_agent_get_channel_io_stream(NiceAgent *agent, guint stream_id,
+                                 guint component_id, guint channel_id) {
+    GIOStream *iostream = NULL;
+    NiceComponent *component;
+    NiceComponentChannel *channel;
+
+    g_return_val_if_fail(NICE_IS_AGENT(agent), NULL);
+    g_return_val_if_fail(stream_id >= 1, NULL);
+    g_return_val_if_fail(component_id >= 1, NULL);
+    g_return_val_if_fail(channel_id <= G_MAXUINT16, NULL);
+
+    g_return_val_if_fail(agent->reliable && agent->reliable_channels, NULL);
+
+    if (channel_id == 0)
+        return nice_agent_get_io_stream(agent, stream_id, component_id);
+
+    agent_lock(agent);
+
+    if (!agent_find_component(agent, stream_id, component_id, NULL, &component))
+        goto done;
+
+    channel = nice_component_get_channel(component, channel_id);
+    iostream = g_weak_ref_get(&channel->iostream);
+    if (iostream == NULL) {
+        iostream = g_object_new(NICE_TYPE_IO_STREAM,
+                                "agent", agent,
+                                "stream-id", stream_id,
+                                "component-id", component_id,
+                                "channel-id", channel_id,
+                                NULL);
+        g_weak_ref_set(&channel->iostream, iostream);
+    }
+
+done:
+    agent_unlock_and_emit(agent);
+
+    return iostream;
+}
+
+NICEAPI_EXPORT gboolean
+nice_agent_set_channel_priority(NiceAgent *agent, guint stream_id,
+                                guint component_id, guint channel_id, guint8 priority) {
+    NiceComponent *component;
+    gboolean ret = FALSE;
+
+    g_return_val_if_fail(NICE_IS_AGENT(agent), FALSE);
+    g_return_val_if_fail(stream_id >= 1, FALSE);
+    g_return_val_if_fail(component_id >= 1, FALSE);
+    g_return_val_if_fail(channel_id <= G_MAXUINT16, FALSE);
+
+    agent_lock(agent);
+
+    if (agent_find_component(agent, stream_id, component_id, NULL, &component) &&
+        component->mux) {
+        pseudo_tcp_mux_set_priority(component->mux, channel_id, priority);
+        ret = TRUE;
+    }
+
+    agent_unlock_and_emit(agent);
+
+    return ret;
+}
+
+/* Finds the component of a channel, with the agent lock held. */
+static gboolean
+agent_find_channel_component(NiceAgent *agent, guint stream_id,
+                             guint component_id, NiceStream **stream, NiceComponent **component,
+                             GError **error) {
+    if (!agent_find_component(agent, stream_id, component_id, stream,
+                              component)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                    "Invalid stream/component.");
+        return FALSE;
+    }
+
+    if ((*component)->mux == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+                    "Reliable channels are only available over pseudo-TCP, "
+                    "with a peer which supports them.");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Process what the sockets of the component have already received without
+ * blocking, as nice_agent_recv_nonblocking() does, in case nobody else
+ * iterates its I/O context. This drops the agent lock, so the component must
+ * be looked up again afterwards. */
+static void
+agent_channel_pump(NiceAgent *agent, NiceComponent *component) {
+    GMainContext *context;
+
+    context = nice_component_dup_io_context(component);
+    agent_unlock(agent);
+    g_main_context_iteration(context, FALSE);
+    g_main_context_unref(context);
+    agent_lock(agent);
+}
+
+static void
+agent_channel_set_error(NiceComponent *component, GError **error) {
+    switch (pseudo_tcp_mux_get_error(component->mux)) {
+        case EPIPE:
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                        "Channel is closed.");
+            break;
+        case EMFILE:
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_TOO_MANY_OPEN_FILES,
+                        "Too many channels.");
+            break;
+        default:
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                        "Reliable channel connection failed.");
+            break;
+    }
+}
+
+gssize
+agent_channel_send(NiceAgent *agent, guint stream_id, guint component_id,
+                   guint16 channel_id, const guint8 *buf, gsize len, GError **error) {
+    NiceStream *stream;
+    NiceComponent *component;
+    gboolean pumped = FALSE;
+    gssize ret = -1;
+
+    agent_lock(agent);
+
+    while (agent_find_channel_component(agent, stream_id, component_id,
+                                        &stream, &component, error)) {
+        ret = pseudo_tcp_mux_send(component->mux, channel_id, buf, len);
+        if (ret >= 0) {
+            adjust_tcp_clock(agent, stream, component);
+            break;
+        }
+
+        if (pseudo_tcp_mux_get_error(component->mux) != EWOULDBLOCK) {
+            agent_channel_set_error(component, error);
+            break;
+        } else if (pumped) {
+            g_cancellable_reset(
+                    nice_component_get_channel(component, channel_id)->writable);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                        "Channel send queue is full.");
+            break;
+        }
+
+        /* Acknowledgements and window updates may be waiting. */
+        agent_channel_pump(agent, component);
+        pumped = TRUE;
+    }
+
+    agent_unlock_and_emit(agent);
+
+    return ret;
+}
+
+gssize
+agent_channel_recv(NiceAgent *agent, guint stream_id, guint component_id,
+                   guint16 channel_id, guint8 *buf, gsize len, GError **error) {
+    NiceStream *stream;
+    NiceComponent *component;
+    gboolean pumped = FALSE;
+    gssize ret = -1;
+
+    agent_lock(agent);
+
+    while (agent_find_channel_component(agent, stream_id, component_id,
+                                        &stream, &component, error)) {
+        ret = pseudo_tcp_mux_recv(component->mux, channel_id, buf, len);
+        if (ret >= 0) {
+            /* A window update may have been queued. */
+            adjust_tcp_clock(agent, stream, component);
+            break;
+        }
+
+        if (pseudo_tcp_mux_get_error(component->mux) != EWOULDBLOCK) {
+            agent_channel_set_error(component, error);
+            break;
+        } else if (pumped) {
+            g_cancellable_reset(
+                    nice_component_get_channel(component, channel_id)->readable);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
+                        "No data available on the channel.");
+            break;
+        }
+
+        agent_channel_pump(agent, component);
+        pumped = TRUE;
+    }
+
+    agent_unlock_and_emit(agent);
+
+    return ret;
+}
+
+gboolean
+agent_channel_check(NiceAgent *agent, guint stream_id, guint component_id,
+                    guint16 channel_id, GIOCondition condition) {
+    NiceComponent *component;
+    gboolean ret = FALSE;
+
+    agent_lock(agent);
+
+    if (agent_find_channel_component(agent, stream_id, component_id, NULL,
+                                     &component, NULL)) {
+        if (condition == G_IO_IN)
+            ret = pseudo_tcp_mux_get_available_bytes(component->mux, channel_id) > 0 ||
+                  pseudo_tcp_mux_is_eof(component->mux, channel_id);
+        else
+            ret = pseudo_tcp_mux_get_available_send_space(component->mux,
+                                                          channel_id) > 0;
+    }
+
+    agent_unlock(agent);
+
+    return ret;
+}
+
+GCancellable *
+agent_channel_dup_cancellable(NiceAgent *agent, guint stream_id,
+                              guint component_id, guint16 channel_id, GIOCondition condition) {
+    NiceComponent *component;
+    NiceComponentChannel *channel;
+    GCancellable *ret = NULL;
+
+    agent_lock(agent);
+
+    if (agent_find_channel_component(agent, stream_id, component_id, NULL,
+                                     &component, NULL)) {
+        channel = nice_component_get_channel(component, channel_id);
+        ret = g_object_ref(condition == G_IO_IN ? channel->readable :
+                                                  channel->writable);
+    }
+
+    agent_unlock(agent);
+
+    return ret;
+}
+
+void
+agent_channel_close(NiceAgent *agent, guint stream_id, guint component_id,
+                    guint16 channel_id) {
+    NiceStream *stream;
+    NiceComponent *component;
+
+    agent_lock(agent);
+
+    if (agent_find_channel_component(agent, stream_id, component_id, &stream,
+                                     &component, NULL)) {
+        pseudo_tcp_mux_close_channel(component->mux, channel_id);
+        adjust_tcp_clock(agent, stream, component);
+    }
+
+    agent_unlock_and_emit(agent);
+}
+
 NICEAPI_EXPORT gboolean
 nice_agent_forget_relays(NiceAgent *agent, guint stream_id, guint component_id) {
     NiceComponent *component;
@@ -406,6 +406,8 @@ typedef enum {
  * proposed here: https://tools.ietf.org/html/draft-thatcher-ice-renomination-00
  * @NICE_AGENT_OPTION_CONSENT_FRESHNESS: Enable RFC 7675 consent freshness support. (Since: 0.1.19)
  * @NICE_AGENT_OPTION_BYTESTREAM_TCP: Use bytestream mode for reliable TCP connections. (Since: 0.1.20)
+ * @NICE_AGENT_OPTION_RELIABLE_CHANNELS: Multiplex channels over pseudo-TCP
+ *  connections, see #NiceAgent:reliable-channels. (Since: 0.1.20)
  *
  * These are options that can be passed to nice_agent_new_full(). They set
  * various properties on the agent. Not including them sets the property to
@@ -422,6 +424,7 @@ typedef enum {
     NICE_AGENT_OPTION_SUPPORT_RENOMINATION = 1 << 4,
     NICE_AGENT_OPTION_CONSENT_FRESHNESS = 1 << 5,
     NICE_AGENT_OPTION_BYTESTREAM_TCP = 1 << 6,
+    NICE_AGENT_OPTION_RELIABLE_CHANNELS = 1 << 7,
 } NiceAgentOption;
 
 /**
@@ -1583,6 +1586,64 @@ nice_agent_get_io_stream(
         guint stream_id,
         guint component_id);
 
+/**
+ * nice_agent_get_channel_io_stream:
+ * @agent: A #NiceAgent
+ * @stream_id: The ID of the stream to wrap
+ * @component_id: The ID of the component to wrap
+ * @channel_id: The channel of the component, up to 65535
+ *
+ * Gets a #GIOStream wrapper around the given reliable channel of a stream
+ * and component in @agent, which must have #NiceAgent:reliable-channels set.
+ * Both peers use the same channel numbers, and a channel exists as soon as
+ * either of them uses it. Channel 0 is the component itself, so this is the
+ * same as nice_agent_get_io_stream() for it.
+ *
+ * Closing the output stream ends the channel for the peer, which reads the
+ * end of the stream once it has read everything sent before. The other
+ * channels of the component carry on.
+ *
+ * Data for every channel is only received while either the I/O context of
+ * the component is iterated (see nice_agent_attach_recv()), or one of its
+ * streams is being read from or written to.
+ *
+ * Returns: (transfer full): A #GIOStream.
+ *
+ * Since: 0.1.20
+ */
+GIOStream *
+nice_agent_get_channel_io_stream(
+        NiceAgent *agent,
+        guint stream_id,
+        guint component_id,
+        guint channel_id);
+
+/**
+ * nice_agent_set_channel_priority:
+ * @agent: A #NiceAgent
+ * @stream_id: The ID of the stream
+ * @component_id: The ID of the component
+ * @channel_id: The channel of the component, up to 65535
+ * @priority: The new priority of the channel
+ *
+ * Sets the priority of a reliable channel when sending, see
+ * #NiceAgent:reliable-channels. Data queued on channels with a higher
+ * priority is always sent first, and channels of equal priority take turns.
+ * Channels start with priority 0.
+ *
+ * Returns: %TRUE on success, %FALSE if the component could not be found or
+ * does not carry reliable channels
+ *
+ * Since: 0.1.20
+ */
+gboolean
+nice_agent_set_channel_priority(
+        NiceAgent *agent,
+        guint stream_id,
+        guint component_id,
+        guint channel_id,
+        guint8 priority);
+
 /**
  * nice_component_state_to_string:
  * @state: a #NiceComponentState
@@ -78,7 +78,16 @@ typedef struct _TurnServer TurnServer;
  * @decoded_username_len: The length of @decoded_username
  * @decoded_password_len: The length of @decoded_password
  * @type: The #NiceRelayType of the server
- * @preference: A unique identifier used to compute priority
+ * @preference: A unique identifier used to compute the priority of the
+ * relayed candidates, which keep their own copy of it
+ * @long_term_realm: The REALM @long_term_key was derived for
+ * @long_term_realm_len: The length of @long_term_realm
+ * @long_term_username: The username @long_term_key was derived for
+ * @long_term_username_len: The length of @long_term_username
+ * @long_term_password: The password @long_term_key was derived from
+ * @long_term_password_len: The length of @long_term_password
+ * @long_term_key: The long-term credential key, shared by all the
+ * allocations made on this server
  *
  * A structure to store the TURN relay settings
  */
@@ -94,6 +103,13 @@ struct _TurnServer {
     gsize decoded_password_len;
     NiceRelayType type;
     guint preference;
+    guint8 *long_term_realm;
+    gsize long_term_realm_len;
+    guint8 *long_term_username;
+    gsize long_term_username_len;
+    guint8 *long_term_password;
+    gsize long_term_password_len;
+    guint8 long_term_key[16];
 };
 
 
@@ -112,6 +128,7 @@ struct _TurnServer {
 struct _NiceCandidateImpl {
     NiceCandidate c;
     TurnServer *turn;
+    guint turn_preference;       /* preference bits of a relayed candidate */
     NiceSocket *sockptr;
     guint64 keepalive_next_tick; /* next tick timestamp */
     NiceAddress *stun_server;
@@ -240,7 +240,7 @@ nice_candidate_ice_local_preference(const NiceCandidate *candidate) {
    */
     if (candidate->type == NICE_CANDIDATE_TYPE_RELAYED) {
         g_assert(c->turn);
-        turn_preference = c->turn->preference;
+        turn_preference = c->turn_preference;
     }
 
     return nice_candidate_ice_local_preference_full(direction_preference,
@@ -295,7 +295,7 @@ nice_candidate_ms_ice_local_preference(const NiceCandidate *candidate) {
    */
     if (candidate->type == NICE_CANDIDATE_TYPE_RELAYED) {
         g_assert(c->turn);
-        turn_preference = c->turn->preference;
+        turn_preference = c->turn_preference;
     }
 
     return nice_candidate_ms_ice_local_preference_full(transport_preference,
@@ -58,6 +58,7 @@ static volatile unsigned int n_components_destroyed = 0;
 #include "agent-priv.h"
 #include "component.h"
 #include "discovery.h"
+#include "stun/stunhmac.h"
 
 G_DEFINE_TYPE(NiceComponent, nice_component, G_TYPE_OBJECT);
 
@@ -218,6 +219,7 @@ void nice_component_remove_socket(NiceAgent *agent, NiceComponent *cmp,
         i = next;
     }
 
+    nice_component_reset_credentials(cmp);
     nice_component_detach_socket(cmp, nsocket);
 }
 
@@ -244,6 +246,7 @@ void nice_component_clean_turn_servers(NiceAgent *agent, NiceComponent *cmp) {
 
     g_list_free_full(cmp->turn_servers, (GDestroyNotify) turn_server_unref);
     cmp->turn_servers = NULL;
+    nice_component_reset_credentials(cmp);
 
     for (i = cmp->local_candidates; i;) {
         NiceCandidateImpl *candidate = i->data;
@@ -293,6 +296,86 @@ void nice_component_clean_turn_servers(NiceAgent *agent, NiceComponent *cmp) {
     }
 }
 
+/*
+ * Finds the cached credentials whose ufrag is a prefix of @username, in the
+ * local or the remote table. Usernames of the "ufrag:ufrag" form are
+ * looked up directly, others by comparing the prefix of each entry.
+ */
+const NiceComponentCredentials *
+nice_component_find_credentials(NiceComponent *component, gboolean remote,
+                                const guint8 *username, gsize username_len) {
+    GHashTable *table = component->credentials[remote ? 1 : 0];
+    NiceComponentCredentials key;
+    gpointer found;
+    const guint8 *sep;
+    GHashTableIter iter;
+
+    sep = memchr(username, ':', username_len);
+    if (sep) {
+        key.ufrag = username;
+        key.ufrag_len = sep - username;
+        if (g_hash_table_lookup_extended(table, &key, &found, NULL))
+            return found;
+    }
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, &found, NULL)) {
+        const NiceComponentCredentials *creds = found;
+
+        if (username_len >= creds->ufrag_len &&
+            memcmp(username, creds->ufrag, creds->ufrag_len) == 0)
+            return creds;
+    }
+
+    return NULL;
+}
+
+/*
+ * Caches a copy of @ufrag and @password, which may be NULL. Returns the
+ * cached entry, which stays valid until nice_component_reset_credentials()
+ * is called.
+ */
+const NiceComponentCredentials *
+nice_component_add_credentials(NiceComponent *component, gboolean remote,
+                               const guint8 *ufrag, gsize ufrag_len,
+                               const guint8 *password, gsize password_len) {
+    GHashTable *table = component->credentials[remote ? 1 : 0];
+    NiceComponentCredentials key = {ufrag, ufrag_len, NULL, 0};
+    NiceComponentCredentials *creds;
+    gpointer found;
+    guint8 *data;
+
+    if (g_hash_table_lookup_extended(table, &key, &found, NULL))
+        return found;
+
+    creds = g_malloc(sizeof(NiceComponentCredentials) + ufrag_len + password_len);
+    data = (guint8 *) (creds + 1);
+
+    memcpy(data, ufrag, ufrag_len);
+    creds->ufrag = data;
+    creds->ufrag_len = ufrag_len;
+    if (password) {
+        memcpy(data + ufrag_len, password, password_len);
+        creds->password = data + ufrag_len;
+        creds->password_len = password_len;
+    } else {
+        creds->password = NULL;
+        creds->password_len = 0;
+    }
+
+    g_hash_table_add(table, creds);
+    return creds;
+}
+
+/*
+ * Forgets the cached credentials, to be called whenever the local or remote
+ * credentials change or candidates carrying their own go away.
+ */
+void nice_component_reset_credentials(NiceComponent *component) {
+    g_hash_table_remove_all(component->credentials[0]);
+    g_hash_table_remove_all(component->credentials[1]);
+}
+
 static void
 nice_component_clear_selected_pair(NiceComponent *component) {
     if (component->selected_pair.remote_consent.tick_source != NULL) {
@@ -301,6 +384,10 @@ nice_component_clear_selected_pair(NiceComponent *component) {
         component->selected_pair.remote_consent.tick_source = NULL;
     }
 
+    stun_usage_ice_conncheck_template_free(
+            component->selected_pair.keepalive.request_template);
+    g_free(component->selected_pair.keepalive.stun_buffer);
+
     memset(&component->selected_pair, 0, sizeof(CandidatePair));
 }
 
@@ -323,6 +410,8 @@ void nice_component_close(NiceAgent *agent, NiceStream *stream, NiceComponent *c
    * all its callers) async, so we can properly block on closure. */
     if (cmp->tcp) {
         pseudo_tcp_socket_close(cmp->tcp, TRUE);
+        /* The budget belongs to the agent, which the socket may outlive. */
+        g_object_set(cmp->tcp, "buffer-budget", NULL, NULL);
     }
 
     if (cmp->restart_candidate)
@@ -343,6 +432,7 @@ void nice_component_close(NiceAgent *agent, NiceStream *stream, NiceComponent *c
     g_slist_free_full(cmp->remote_candidates,
                       (GDestroyNotify) nice_candidate_free);
     cmp->remote_candidates = NULL;
+    nice_component_reset_credentials(cmp);
     nice_component_free_socket_sources(cmp);
 
     while ((c = g_queue_pop_head(&cmp->incoming_checks)))
@@ -359,6 +449,7 @@ void nice_component_close(NiceAgent *agent, NiceStream *stream, NiceComponent *c
         g_cancellable_cancel(cmp->tcp_writable_cancellable);
         g_clear_object(&cmp->tcp_writable_cancellable);
     }
+    g_clear_pointer(&cmp->channels, g_hash_table_unref);
 
     while ((data = g_queue_pop_head(&cmp->pending_io_messages)) != NULL)
         io_callback_data_free(data);
@@ -384,7 +475,12 @@ void nice_component_shutdown(NiceComponent *component, gboolean shutdown_read,
 
     g_assert(shutdown_read || shutdown_write);
 
-    if (!pseudo_tcp_socket_is_closed(component->tcp)) {
+    if (component->mux) {
+        /* Only channel 0 belongs to the component-level streams; the other
+     * channels keep the pseudo-TCP connection open. */
+        if (shutdown_write)
+            pseudo_tcp_mux_close_channel(component->mux, 0);
+    } else if (!pseudo_tcp_socket_is_closed(component->tcp)) {
         PseudoTcpShutdown how;
 
         if (shutdown_read && shutdown_write)
@@ -467,6 +563,7 @@ void nice_component_restart(NiceComponent *cmp, NiceAgent *agent) {
     }
     g_slist_free(cmp->remote_candidates),
             cmp->remote_candidates = NULL;
+    nice_component_reset_credentials(cmp);
 
     while ((c = g_queue_pop_head(&cmp->incoming_checks)))
         incoming_check_free(c);
@@ -481,6 +578,7 @@ void nice_component_restart(NiceComponent *cmp, NiceAgent *agent) {
    * keep-alive stun requests. The stun agent must be reset to get rid
    * of these references.
    */
+    stun_agent_clear(&cmp->stun_agent);
     nice_agent_init_stun_agent(agent, &cmp->stun_agent);
 
     /* note: component state managed by agent */
@@ -918,7 +1016,7 @@ done:
 
 /* This must be called with the agent lock *held*. */
 void nice_component_emit_io_callback(NiceAgent *agent, NiceComponent *component,
-                                     gsize buf_len) {
+                                     const guint8 *buf, gsize buf_len) {
     guint stream_id, component_id;
     NiceAgentRecvFunc io_callback;
     gpointer io_user_data;
@@ -950,7 +1048,7 @@ void nice_component_emit_io_callback(NiceAgent *agent, NiceComponent *component,
         /* Thread owns the main context, so invoke the callback directly. */
         agent_unlock_and_emit(agent);
         io_callback(agent, stream_id,
-                    component_id, buf_len, (gchar *) component->recv_buffer, io_user_data);
+                    component_id, buf_len, (gchar *) buf, io_user_data);
         agent_lock(agent);
     } else {
         IOCallbackData *data;
@@ -959,7 +1057,7 @@ void nice_component_emit_io_callback(NiceAgent *agent, NiceComponent *component,
 
         /* Slow path: Current thread doesn’t own the Component’s context at the
      * moment, so schedule the callback in an idle handler. */
-        data = io_callback_data_new(component->recv_buffer, buf_len);
+        data = io_callback_data_new(buf, buf_len);
         g_queue_push_tail(&component->pending_io_messages,
                           data); /* transfer ownership */
 
@@ -1069,6 +1167,27 @@ source_set_dummy_callback(GSource *source) {
     g_source_set_callback(source, dummy_callback, NULL, NULL);
 }
 
+static guint
+credentials_hash(gconstpointer key) {
+    const NiceComponentCredentials *creds = key;
+    guint hash = 5381;
+    gsize i;
+
+    for (i = 0; i < creds->ufrag_len; i++)
+        hash = hash * 33 + creds->ufrag[i];
+
+    return hash;
+}
+
+static gboolean
+credentials_equal(gconstpointer a, gconstpointer b) {
+    const NiceComponentCredentials *ca = a;
+    const NiceComponentCredentials *cb = b;
+
+    return ca->ufrag_len == cb->ufrag_len &&
+           memcmp(ca->ufrag, cb->ufrag, ca->ufrag_len) == 0;
+}
+
 static void
 nice_component_init(NiceComponent *component) {
     g_atomic_int_inc(&n_components_created);
@@ -1102,6 +1221,11 @@ nice_component_init(NiceComponent *component) {
     g_queue_init(&component->queued_tcp_packets);
     g_queue_init(&component->incoming_checks);
 
+    component->credentials[0] = g_hash_table_new_full(credentials_hash,
+                                                      credentials_equal, g_free, NULL);
+    component->credentials[1] = g_hash_table_new_full(credentials_hash,
+                                                      credentials_equal, g_free, NULL);
+
     component->have_local_consent = TRUE;
 
 /* Maximum size of a UDP packet’s payload, as the packet’s length field is 16b
@@ -1211,7 +1335,14 @@ nice_component_finalize(GObject *obj) {
     g_list_free_full(cmp->valid_candidates,
                      (GDestroyNotify) nice_candidate_free);
 
+    stun_agent_clear(&cmp->stun_agent);
+
+    g_hash_table_unref(cmp->credentials[0]);
+    g_hash_table_unref(cmp->credentials[1]);
+
     g_clear_object(&cmp->tcp);
+    g_clear_pointer(&cmp->mux, pseudo_tcp_mux_free);
+    g_clear_pointer(&cmp->channels, g_hash_table_unref);
     g_clear_object(&cmp->stop_cancellable);
     g_clear_object(&cmp->iostream);
     g_mutex_clear(&cmp->io_mutex);
@@ -1452,21 +1583,18 @@ static GSourceFuncs component_source_funcs = {
  *
  * Returns: (transfer full): a new #ComponentSource; unref with g_source_unref()
  */
-GSource *
-nice_component_input_source_new(NiceAgent *agent, guint stream_id,
-                                guint component_id, GPollableInputStream *pollable_istream,
-                                GCancellable *cancellable) {
+static GSource *
+component_source_new(NiceAgent *agent, guint stream_id, guint component_id,
+                     GObject *pollable_stream, GCancellable *cancellable) {
     ComponentSource *component_source;
 
-    g_assert(G_IS_POLLABLE_INPUT_STREAM(pollable_istream));
-
     component_source =
             (ComponentSource *)
                     g_source_new(&component_source_funcs, sizeof(ComponentSource));
     g_source_set_name((GSource *) component_source, "ComponentSource");
 
     component_source->component_socket_sources_age = 0;
-    component_source->pollable_stream = g_object_ref(pollable_istream);
+    component_source->pollable_stream = g_object_ref(pollable_stream);
     g_weak_ref_init(&component_source->agent_ref, agent);
     component_source->stream_id = stream_id;
     component_source->component_id = component_id;
@@ -1485,6 +1613,28 @@ nice_component_input_source_new(NiceAgent *agent, guint stream_id,
     return (GSource *) component_source;
 }
 
+GSource *
+nice_component_input_source_new(NiceAgent *agent, guint stream_id,
+                                guint component_id, GPollableInputStream *pollable_istream,
+                                GCancellable *cancellable) {
+    g_assert(G_IS_POLLABLE_INPUT_STREAM(pollable_istream));
+
+    return component_source_new(agent, stream_id, component_id,
+                                G_OBJECT(pollable_istream), cancellable);
+}
+
+/* Like nice_component_input_source_new(), for output streams which need
+ * incoming packets to be processed before they can make progress. */
+GSource *
+nice_component_output_source_new(NiceAgent *agent, guint stream_id,
+                                 guint component_id, GPollableOutputStream *pollable_ostream,
+                                 GCancellable *cancellable) {
+    g_assert(G_IS_POLLABLE_OUTPUT_STREAM(pollable_ostream));
+
+    return component_source_new(agent, stream_id, component_id,
+                                G_OBJECT(pollable_ostream), cancellable);
+}
+
 
 TurnServer *
 turn_server_new(const gchar *server_ip, guint server_port,
@@ -1507,6 +1657,12 @@ turn_server_new(const gchar *server_ip, guint server_port,
     turn->decoded_password =
             g_base64_decode((gchar *) password, &turn->decoded_password_len);
     turn->type = type;
+    turn->long_term_realm = NULL;
+    turn->long_term_realm_len = 0;
+    turn->long_term_username = NULL;
+    turn->long_term_username_len = 0;
+    turn->long_term_password = NULL;
+    turn->long_term_password_len = 0;
 
     return turn;
 }
@@ -1526,10 +1682,60 @@ void turn_server_unref(TurnServer *turn) {
         g_free(turn->password);
         g_free(turn->decoded_username);
         g_free(turn->decoded_password);
+        g_free(turn->long_term_realm);
+        g_free(turn->long_term_username);
+        g_free(turn->long_term_password);
         g_slice_free(TurnServer, turn);
     }
 }
 
+/*
+ * Gives @stun_agent the long-term credential key for the REALM of @msg, so
+ * that it is derived once per (username, realm, password) for all the
+ * allocations on this server. @username and @password are the credentials
+ * @stun_agent signs its requests with, either the plain or the base64 decoded
+ * ones of @turn.
+ */
+void turn_server_set_long_term_key(TurnServer *turn, StunAgent *stun_agent,
+                                   const StunMessage *msg,
+                                   const guint8 *username, gsize username_len,
+                                   const guint8 *password, gsize password_len) {
+    const guint8 *realm;
+    uint16_t realm_len;
+
+    if (msg == NULL || msg->buffer == NULL || username == NULL ||
+        password == NULL)
+        return;
+
+    realm = stun_message_find(msg, STUN_ATTRIBUTE_REALM, &realm_len);
+    if (realm == NULL)
+        return;
+
+    if (turn->long_term_realm == NULL ||
+        turn->long_term_realm_len != realm_len ||
+        memcmp(turn->long_term_realm, realm, realm_len) != 0 ||
+        turn->long_term_username_len != username_len ||
+        memcmp(turn->long_term_username, username, username_len) != 0 ||
+        turn->long_term_password_len != password_len ||
+        memcmp(turn->long_term_password, password, password_len) != 0) {
+        g_free(turn->long_term_realm);
+        g_free(turn->long_term_username);
+        g_free(turn->long_term_password);
+        turn->long_term_realm = g_memdup(realm, realm_len);
+        turn->long_term_realm_len = realm_len;
+        turn->long_term_username = g_memdup(username, username_len);
+        turn->long_term_username_len = username_len;
+        turn->long_term_password = g_memdup(password, password_len);
+        turn->long_term_password_len = password_len;
+        stun_hash_creds(realm, realm_len, username, username_len,
+                        password, password_len, turn->long_term_key);
+    }
+
+    stun_agent_set_long_term_key(stun_agent, realm, realm_len,
+                                 username, username_len, password, password_len,
+                                 turn->long_term_key);
+}
+
 void nice_component_add_valid_candidate(NiceAgent *agent, NiceComponent *component,
                                         const NiceCandidate *candidate) {
     guint count = 0;
@@ -1630,3 +1836,110 @@ nice_component_get_sockets(NiceComponent *component) {
 guint nice_component_compute_rfc4571_headroom(NiceComponent *component) {
     return component->rfc4571_buffer_offset - component->rfc4571_frame_offset;
 }
+
+static void
+channel_free(NiceComponentChannel *channel) {
+    g_cancellable_cancel(channel->readable);
+    g_cancellable_cancel(channel->writable);
+    g_object_unref(channel->readable);
+    g_object_unref(channel->writable);
+    g_weak_ref_clear(&channel->iostream);
+    g_slice_free(NiceComponentChannel, channel);
+}
+
+NiceComponentChannel *
+nice_component_get_channel(NiceComponent *component, guint16 channel_id) {
+    NiceComponentChannel *channel;
+
+    g_assert(channel_id != 0);
+
+    if (component->channels == NULL)
+        component->channels = g_hash_table_new_full(NULL, NULL, NULL,
+                                                    (GDestroyNotify) channel_free);
+
+    channel = g_hash_table_lookup(component->channels,
+                                  GUINT_TO_POINTER(channel_id));
+    if (channel == NULL) {
+        channel = g_slice_new0(NiceComponentChannel);
+        channel->readable = g_cancellable_new();
+        channel->writable = g_cancellable_new();
+        g_weak_ref_init(&channel->iostream, NULL);
+        /* Data can be queued until the send queue fills up. */
+        g_cancellable_cancel(channel->writable);
+        g_hash_table_insert(component->channels, GUINT_TO_POINTER(channel_id),
+                            channel);
+    }
+
+    return channel;
+}
+
+/* The multiplexer forgot the channel. Freeing it wakes up its streams, which
+ * then find the channel at its end. */
+void
+nice_component_remove_channel(NiceComponent *component, guint16 channel_id) {
+    if (component->channels)
+        g_hash_table_remove(component->channels, GUINT_TO_POINTER(channel_id));
+}
+
+gssize
+nice_component_reliable_send(NiceComponent *component, const guint8 *buf,
+                             gsize len) {
+    if (component->mux)
+        return pseudo_tcp_mux_send(component->mux, 0, buf, len);
+
+    return pseudo_tcp_socket_send(component->tcp, (const gchar *) buf, len);
+}
+
+gssize
+nice_component_reliable_recv(NiceComponent *component, guint8 *buf,
+                             gsize len) {
+    if (component->mux)
+        return pseudo_tcp_mux_recv(component->mux, 0, buf, len);
+
+    return pseudo_tcp_socket_recv(component->tcp, (gchar *) buf, len);
+}
+
+gssize
+nice_component_reliable_peek(NiceComponent *component, const guint8 **buf) {
+    if (component->mux)
+        return pseudo_tcp_mux_peek(component->mux, 0, buf);
+
+    return pseudo_tcp_socket_peek(component->tcp, buf);
+}
+
+void nice_component_reliable_consume(NiceComponent *component, gsize len) {
+    if (component->mux)
+        pseudo_tcp_mux_consume(component->mux, 0, len);
+    else
+        pseudo_tcp_socket_consume(component->tcp, len);
+}
+
+gint nice_component_reliable_get_error(NiceComponent *component) {
+    if (component->mux)
+        return pseudo_tcp_mux_get_error(component->mux);
+
+    return pseudo_tcp_socket_get_error(component->tcp);
+}
+
+gint nice_component_reliable_get_available_bytes(NiceComponent *component) {
+    if (component->mux)
+        return pseudo_tcp_mux_get_available_bytes(component->mux, 0);
+
+    return pseudo_tcp_socket_get_available_bytes(component->tcp);
+}
+
+gsize nice_component_reliable_get_available_send_space(
+        NiceComponent *component) {
+    if (component->mux)
+        return pseudo_tcp_mux_get_available_send_space(component->mux, 0);
+
+    return pseudo_tcp_socket_get_available_send_space(component->tcp);
+}
+
+gboolean
+nice_component_reliable_is_eof(NiceComponent *component) {
+    if (component->mux)
+        return pseudo_tcp_mux_is_eof(component->mux, 0);
+
+    return pseudo_tcp_socket_is_closed_remotely(component->tcp);
+}
@@ -47,10 +47,12 @@ typedef struct _NiceComponent NiceComponent;
 #include "agent-priv.h"
 #include "agent.h"
 #include "candidate-priv.h"
+#include "pseudotcp-mux.h"
 #include "pseudotcp.h"
 #include "socket/socket.h"
 #include "stream.h"
 #include "stun/stunagent.h"
+#include "stun/usages/ice.h"
 #include "stun/usages/timer.h"
 
 G_BEGIN_DECLS
@@ -73,6 +75,9 @@ struct _CandidatePairKeepalive {
     guint stream_id;
     guint component_id;
     StunTimer timer;
+    StunUsageIceConncheckTemplate *request_template; /* keepalive checks */
+    uint8_t *stun_buffer; /* last keepalive indication, refreshed in place */
+    StunMessage stun_message;
 };
 
 struct _CandidatePairConsentCheck {
@@ -151,6 +156,25 @@ void io_callback_data_free(IOCallbackData *data);
 #define NICE_COMPONENT_GET_CLASS(obj) \
     (G_TYPE_INSTANCE_GET_CLASS((obj), NICE_TYPE_COMPONENT, NiceComponentClass))
 
+/* Decoded ufrag and password of a local or remote candidate, as the STUN
+ * validater needs them. */
+typedef struct {
+    const guint8 *ufrag;
+    gsize ufrag_len;
+    const guint8 *password; /* NULL if there is no password */
+    gsize password_len;
+} NiceComponentCredentials;
+
+/* Number of per-source token buckets used to throttle rejected STUN
+ * packets; sources hashing to the same slot evict each other. */
+#define NICE_COMPONENT_STUN_RATE_BUCKETS 64
+
+typedef struct {
+    NiceAddress from;  /* source transport address */
+    gint64 refill_time; /* monotonic time of the last refill, 0 if unused */
+    guint tokens;       /* packets left in the bucket */
+} StunRateBucket;
+
 struct _NiceComponent {
     /*< private >*/
     GObject parent;
@@ -205,6 +229,10 @@ struct _NiceComponent {
     guint stream_id;
 
     StunAgent stun_agent; /* This stun agent is used to validate all stun requests */
+    StunRateBucket stun_rate_buckets[NICE_COMPONENT_STUN_RATE_BUCKETS]; /* rejected STUN budget per source */
+    GHashTable *credentials[2]; /* local (0) and remote (1) ufrag ->
+                                    NiceComponentCredentials, filled by
+                                    the STUN validater */
 
 
     GCancellable *stop_cancellable;
@@ -215,6 +243,11 @@ struct _NiceComponent {
     guint64 last_clock_timeout;
     gboolean tcp_readable;
     GCancellable *tcp_writable_cancellable;
+    PseudoTcpMux *mux;    /* channels over tcp, if the agent has
+                             reliable-channels set */
+    GHashTable *channels; /* channel number -> owned
+                             NiceComponentChannel, for channels
+                             other than 0 */
 
     GIOStream *iostream;
 
@@ -247,6 +280,15 @@ struct _NiceComponent {
     gboolean rfc4571_wakeup_needed;
 };
 
+/* Channel 0 of the multiplexer is the component itself, and is used through
+ * the component-level API; the other channels are only reachable through
+ * their own #NiceIOStream. */
+typedef struct {
+    GCancellable *readable; /* cancelled while data or EOF can be read */
+    GCancellable *writable; /* cancelled while data can be queued */
+    GWeakRef iostream;      /* of the #NiceIOStream, while in use */
+} NiceComponentChannel;
+
 typedef struct {
     GObjectClass parent_class;
 } NiceComponentClass;
@@ -292,6 +334,11 @@ nice_component_input_source_new(NiceAgent *agent, guint stream_id,
                                 guint component_id, GPollableInputStream *pollable_istream,
                                 GCancellable *cancellable);
 
+GSource *
+nice_component_output_source_new(NiceAgent *agent, guint stream_id,
+                                 guint component_id, GPollableOutputStream *pollable_ostream,
+                                 GCancellable *cancellable);
+
 GMainContext *
 nice_component_dup_io_context(NiceComponent *component);
 void nice_component_set_io_context(NiceComponent *component, GMainContext *context);
@@ -300,11 +347,20 @@ void nice_component_set_io_callback(NiceComponent *component,
                                     NiceInputMessage *recv_messages, guint n_recv_messages,
                                     GError **error);
 void nice_component_emit_io_callback(NiceAgent *agent, NiceComponent *component,
-                                     gsize buf_len);
+                                     const guint8 *buf, gsize buf_len);
 gboolean
 nice_component_has_io_callback(NiceComponent *component);
 void nice_component_clean_turn_servers(NiceAgent *agent, NiceComponent *component);
 
+const NiceComponentCredentials *
+nice_component_find_credentials(NiceComponent *component, gboolean remote,
+                                const guint8 *username, gsize username_len);
+const NiceComponentCredentials *
+nice_component_add_credentials(NiceComponent *component, gboolean remote,
+                               const guint8 *ufrag, gsize ufrag_len,
+                               const guint8 *password, gsize password_len);
+void nice_component_reset_credentials(NiceComponent *component);
+
 
 TurnServer *
 turn_server_new(const gchar *server_ip, guint server_port,
@@ -315,6 +371,11 @@ turn_server_ref(TurnServer *turn);
 
 void turn_server_unref(TurnServer *turn);
 
+void turn_server_set_long_term_key(TurnServer *turn, StunAgent *stun_agent,
+                                   const StunMessage *msg,
+                                   const guint8 *username, gsize username_len,
+                                   const guint8 *password, gsize password_len);
+
 void nice_component_add_valid_candidate(NiceAgent *agent, NiceComponent *component,
                                         const NiceCandidate *candidate);
 
@@ -327,6 +388,28 @@ nice_component_get_sockets(NiceComponent *component);
 
 guint nice_component_compute_rfc4571_headroom(NiceComponent *component);
 
+NiceComponentChannel *
+nice_component_get_channel(NiceComponent *component, guint16 channel_id);
+
+void
+nice_component_remove_channel(NiceComponent *component, guint16 channel_id);
+
+/* The reliable byte stream of the component: the pseudo-TCP socket, or
+ * channel 0 of the multiplexer on top of it. Errors follow the pseudo-TCP
+ * socket's conventions. */
+gssize nice_component_reliable_send(NiceComponent *component,
+                                    const guint8 *buf, gsize len);
+gssize nice_component_reliable_recv(NiceComponent *component, guint8 *buf,
+                                    gsize len);
+gssize nice_component_reliable_peek(NiceComponent *component,
+                                    const guint8 **buf);
+void nice_component_reliable_consume(NiceComponent *component, gsize len);
+gint nice_component_reliable_get_error(NiceComponent *component);
+gint nice_component_reliable_get_available_bytes(NiceComponent *component);
+gsize nice_component_reliable_get_available_send_space(
+        NiceComponent *component);
+gboolean nice_component_reliable_is_eof(NiceComponent *component);
+
 G_END_DECLS
 
 #endif /* _NICE_COMPONENT_H */
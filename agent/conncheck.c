@@ -57,6 +57,7 @@
 #include "agent.h"
 #include "conncheck.h"
 #include "discovery.h"
+#include "server-cache.h"
 #include "socket/socket.h"
 #include "stun/stun5389.h"
 #include "stun/usages/bind.h"
@@ -1404,11 +1405,6 @@ static gboolean priv_conn_keepalive_tick_unlocked(NiceAgent *agent) {
                 }
 
                 if (NICE_AGENT_DO_KEEPALIVE_CONNCHECKS(agent)) {
-                    uint8_t uname[NICE_STREAM_MAX_UNAME];
-                    size_t uname_len =
-                            priv_create_username(agent, agent_find_stream(agent, stream->id),
-                                                 component->id, (NiceCandidate *) p->remote,
-                                                 (NiceCandidate *) p->local, uname, sizeof(uname), FALSE);
                     uint8_t *password = NULL;
                     size_t password_len = priv_get_password(agent,
                                                             agent_find_stream(agent, stream->id),
@@ -1416,27 +1412,44 @@ static gboolean priv_conn_keepalive_tick_unlocked(NiceAgent *agent) {
                     uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE_IPV6];
                     StunMessage stun_message;
 
-                    if (uname_len > 0) {
+                    if (p->keepalive.request_template == NULL) {
+                        uint8_t uname[NICE_STREAM_MAX_UNAME];
+                        size_t uname_len =
+                                priv_create_username(agent, agent_find_stream(agent, stream->id),
+                                                     component->id, (NiceCandidate *) p->remote,
+                                                     (NiceCandidate *) p->local, uname, sizeof(uname), FALSE);
+
+                        if (uname_len > 0) {
+                            nice_debug("Agent %p : keepalive conncheck template for "
+                                       "s%d/c%d with username='%.*s' (%" G_GSIZE_FORMAT ").",
+                                       agent, stream->id, component->id,
+                                       (int) uname_len, uname, uname_len);
+                            p->keepalive.request_template =
+                                    stun_usage_ice_conncheck_template_new(&component->stun_agent,
+                                                                          uname, uname_len, p->stun_priority, NULL,
+                                                                          agent_to_ice_compatibility(agent));
+                        }
+                    }
+
+                    if (p->keepalive.request_template != NULL) {
                         if (nice_debug_is_enabled()) {
                             gchar tmpbuf[INET6_ADDRSTRLEN];
                             nice_address_to_string(&p->remote->c.addr, tmpbuf);
                             nice_debug("Agent %p : Keepalive STUN-CC REQ to '%s:%u', "
-                                       "(c-id:%u), username='%.*s' (%" G_GSIZE_FORMAT "), "
+                                       "(c-id:%u), "
                                        "password='%.*s' (%" G_GSIZE_FORMAT "), priority=%08x.",
                                        agent, tmpbuf, nice_address_get_port(&p->remote->c.addr),
-                                       component->id, (int) uname_len, uname, uname_len,
+                                       component->id,
                                        (int) password_len, password, password_len,
                                        p->stun_priority);
                         }
 
-                        buf_len = stun_usage_ice_conncheck_create(&component->stun_agent,
-                                                                  &stun_message, stun_buffer, sizeof(stun_buffer),
-                                                                  uname, uname_len, password, password_len,
-                                                                  agent->controlling_mode, agent->controlling_mode,
-                                                                  p->stun_priority,
-                                                                  agent->tie_breaker,
-                                                                  NULL,
-                                                                  agent_to_ice_compatibility(agent));
+                        buf_len = stun_usage_ice_conncheck_create_from_template(&component->stun_agent,
+                                                                                p->keepalive.request_template,
+                                                                                &stun_message, stun_buffer, sizeof(stun_buffer),
+                                                                                password, password_len,
+                                                                                agent->controlling_mode, agent->controlling_mode,
+                                                                                agent->tie_breaker);
 
                         nice_debug("Agent %p: conncheck created %zd - %p",
                                    agent, buf_len, stun_message.buffer);
@@ -1472,20 +1485,26 @@ static gboolean priv_conn_keepalive_tick_unlocked(NiceAgent *agent) {
                         }
                     }
                 } else {
-                    uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE_IPV6];
-                    StunMessage stun_message;
-
-                    buf_len = stun_usage_bind_keepalive(&component->stun_agent,
-                                                        &stun_message, stun_buffer, sizeof(stun_buffer));
+                    /* The indication is built once, and then only gets a new
+                     * transaction ID and fingerprint on each keepalive */
+                    if (p->keepalive.stun_buffer == NULL) {
+                        p->keepalive.stun_buffer = g_malloc(STUN_MAX_MESSAGE_SIZE_IPV6);
+                        buf_len = stun_usage_bind_keepalive(&component->stun_agent,
+                                                            &p->keepalive.stun_message, p->keepalive.stun_buffer,
+                                                            STUN_MAX_MESSAGE_SIZE_IPV6);
+                    } else {
+                        buf_len = stun_usage_bind_keepalive_refresh(&component->stun_agent,
+                                                                    &p->keepalive.stun_message);
+                    }
 
                     if (buf_len > 0) {
                         agent_socket_send(p->local->sockptr, &p->remote->c.addr, buf_len,
-                                          (gchar *) stun_buffer);
+                                          (gchar *) p->keepalive.stun_buffer);
 
                         p->keepalive.next_tick = now + 1000 * NICE_AGENT_TIMER_TR_DEFAULT;
 
                         if (agent->compatibility == NICE_COMPATIBILITY_OC2007R2) {
-                            ms_ice2_legacy_conncheck_send(&stun_message,
+                            ms_ice2_legacy_conncheck_send(&p->keepalive.stun_message,
                                                           p->local->sockptr, &p->remote->c.addr);
                         }
 
@@ -1531,6 +1550,8 @@ static gboolean priv_conn_keepalive_tick_unlocked(NiceAgent *agent) {
 
                     buffer_len = stun_usage_bind_create(&stun_agent,
                                                         &stun_message, stun_buffer, sizeof(stun_buffer));
+                    /* The responses are not validated with this agent */
+                    stun_agent_clear(&stun_agent);
 
                     for (k = component->local_candidates; k; k = k->next) {
                         NiceCandidateImpl *candidate = (NiceCandidateImpl *) k->data;
@@ -1666,6 +1687,10 @@ static void priv_turn_allocate_refresh_tick_unlocked(NiceAgent *agent,
         password_len = cand->candidate->turn->decoded_password_len;
     }
 
+    turn_server_set_long_term_key(cand->candidate->turn, &cand->stun_agent,
+                                  &cand->stun_resp_msg, username, username_len,
+                                  password, password_len);
+
     buffer_len = stun_usage_turn_create_refresh(&cand->stun_agent,
                                                 &cand->stun_message, cand->stun_buffer, sizeof(cand->stun_buffer),
                                                 cand->stun_resp_msg.buffer == NULL ? NULL : &cand->stun_resp_msg,
@@ -1684,6 +1709,7 @@ static void priv_turn_allocate_refresh_tick_unlocked(NiceAgent *agent,
     }
 
     if (buffer_len > 0) {
+        refresh_index_transaction(agent, cand);
         stun_timer_start(&cand->timer,
                          agent->stun_initial_timeout,
                          agent->stun_max_retransmissions);
@@ -1964,6 +1990,8 @@ void conn_check_remote_candidates_set(NiceAgent *agent, NiceStream *stream,
 void conn_check_remote_credentials_set(NiceAgent *agent, NiceStream *stream) {
     GSList *j;
 
+    conn_check_reset_request_templates(stream);
+
     for (j = stream->components; j; j = j->next) {
         NiceComponent *component = j->data;
 
@@ -2559,9 +2587,35 @@ static void candidate_check_pair_free(NiceAgent *agent,
                                       CandidateCheckPair *pair) {
     priv_remove_pair_from_triggered_check_queue(agent, pair);
     priv_free_all_stun_transactions(pair, NULL);
+    stun_usage_ice_conncheck_template_free(pair->request_template);
     g_slice_free(CandidateCheckPair, pair);
 }
 
+/*
+ * Drops the connectivity check templates of the stream, so that they get
+ * rebuilt with the current credentials on the next check.
+ */
+void conn_check_reset_request_templates(NiceStream *stream) {
+    GSList *i;
+
+    for (i = stream->conncheck_list; i; i = i->next) {
+        CandidateCheckPair *p = i->data;
+
+        stun_usage_ice_conncheck_template_free(p->request_template);
+        p->request_template = NULL;
+    }
+
+    for (i = stream->components; i; i = i->next) {
+        NiceComponent *component = i->data;
+        CandidatePairKeepalive *keepalive = &component->selected_pair.keepalive;
+
+        stun_usage_ice_conncheck_template_free(keepalive->request_template);
+        keepalive->request_template = NULL;
+        g_free(keepalive->stun_buffer);
+        keepalive->stun_buffer = NULL;
+    }
+}
+
 /*
  * Frees all resources of all connectivity checks.
  */
@@ -2822,10 +2876,8 @@ int conn_check_send(NiceAgent *agent, CandidateCheckPair *pair) {
    *  - USE-CANDIDATE (if sent by the controlling agent)
    */
 
-    uint8_t uname[NICE_STREAM_MAX_UNAME];
     NiceStream *stream;
     NiceComponent *component;
-    gsize uname_len;
     uint8_t *password = NULL;
     uint8_t *free_password = NULL;
     gsize password_len;
@@ -2840,8 +2892,6 @@ int conn_check_send(NiceAgent *agent, CandidateCheckPair *pair) {
                               &stream, &component))
         return -1;
 
-    uname_len = priv_create_username(agent, stream, pair->component_id,
-                                     pair->remote, pair->local, uname, sizeof(uname), FALSE);
     password_len = priv_get_password(agent, stream, pair->remote, &password);
 
     if (password != NULL &&
@@ -2857,7 +2907,7 @@ int conn_check_send(NiceAgent *agent, CandidateCheckPair *pair) {
         nice_address_to_string(&pair->local->addr, tmpbuf1);
         nice_address_to_string(&pair->remote->addr, tmpbuf2);
         nice_debug("Agent %p : STUN-CC REQ [%s]:%u --> [%s]:%u, socket=%u, "
-                   "pair=%p (c-id:%u), tie=%llu, username='%.*s' (%" G_GSIZE_FORMAT "), "
+                   "pair=%p (c-id:%u), tie=%llu, "
                    "password='%.*s' (%" G_GSIZE_FORMAT "), prio=%08x, %s.",
                    agent,
                    tmpbuf1, nice_address_get_port(&pair->local->addr),
@@ -2865,7 +2915,6 @@ int conn_check_send(NiceAgent *agent, CandidateCheckPair *pair) {
                    pair->sockptr->fileno ? g_socket_get_fd(pair->sockptr->fileno) : -1,
                    pair, pair->component_id,
                    (unsigned long long) agent->tie_breaker,
-                   (int) uname_len, uname, uname_len,
                    (int) password_len, password, password_len,
                    pair->stun_priority,
                    controlling ? "controlling" : "controlled");
@@ -2900,21 +2949,42 @@ int conn_check_send(NiceAgent *agent, CandidateCheckPair *pair) {
     } else if (cand_use)
         pair->nominated = controlling;
 
-    if (uname_len == 0) {
-        nice_debug("Agent %p: no credentials found, cancelling conncheck", agent);
-        g_free(free_password);
-        return -1;
+    /* The username and the other attributes that stay the same for all
+     * the checks of the pair are only encoded once */
+    if (pair->request_template == NULL) {
+        uint8_t uname[NICE_STREAM_MAX_UNAME];
+        gsize uname_len;
+
+        uname_len = priv_create_username(agent, stream, pair->component_id,
+                                         pair->remote, pair->local, uname, sizeof(uname), FALSE);
+        if (uname_len == 0) {
+            nice_debug("Agent %p: no credentials found, cancelling conncheck", agent);
+            g_free(free_password);
+            return -1;
+        }
+
+        nice_debug("Agent %p : pair %p conncheck template with username='%.*s' "
+                   "(%" G_GSIZE_FORMAT ").",
+                   agent, pair, (int) uname_len, uname, uname_len);
+
+        pair->request_template = stun_usage_ice_conncheck_template_new(
+                &component->stun_agent, uname, uname_len, pair->stun_priority,
+                pair->local->foundation, agent_to_ice_compatibility(agent));
+        if (pair->request_template == NULL) {
+            nice_debug("Agent %p: conncheck template failed, cancelling conncheck", agent);
+            g_free(free_password);
+            return -1;
+        }
     }
 
     stun = priv_add_stun_transaction(pair);
 
-    buffer_len = stun_usage_ice_conncheck_create(&component->stun_agent,
-                                                 &stun->message, stun->buffer, sizeof(stun->buffer),
-                                                 uname, uname_len, password, password_len,
-                                                 cand_use, controlling, pair->stun_priority,
-                                                 agent->tie_breaker,
-                                                 pair->local->foundation,
-                                                 agent_to_ice_compatibility(agent));
+    buffer_len = stun_usage_ice_conncheck_create_from_template(&component->stun_agent,
+                                                               pair->request_template, &stun->message,
+                                                               stun->buffer, sizeof(stun->buffer),
+                                                               password, password_len,
+                                                               cand_use, controlling,
+                                                               agent->tie_breaker);
 
     nice_debug("Agent %p: conncheck created %zd - %p", agent, buffer_len,
                stun->message.buffer);
@@ -3783,6 +3853,9 @@ static gboolean priv_map_reply_to_discovery_request(NiceAgent *agent, StunMessag
                         NiceAddress niceaddr;
 
                         nice_address_set_from_sockaddr(&niceaddr, &sockaddr.addr);
+                        if (agent->discovery_cache_ttl)
+                            nice_server_cache_add_mapped(&d->nicesock->addr,
+                                                         &d->server, &niceaddr);
                         discovery_add_server_reflexive_candidate(
                                 agent,
                                 d->stream_id,
@@ -3845,7 +3918,7 @@ priv_add_new_turn_refresh(NiceAgent *agent, CandidateDiscovery *cdisco,
     cand->server = cdisco->server;
     cand->stream_id = cdisco->stream_id;
     cand->component_id = cdisco->component_id;
-    memcpy(&cand->stun_agent, &cdisco->stun_agent, sizeof(StunAgent));
+    stun_agent_copy(&cand->stun_agent, &cdisco->stun_agent);
 
     /* Use previous stun response for authentication credentials */
     if (cdisco->stun_resp_msg.buffer != NULL) {
@@ -3875,10 +3948,10 @@ priv_add_new_turn_refresh(NiceAgent *agent, CandidateDiscovery *cdisco,
                    "for refresh %p",
                    agent, cand);
         cand->disposing = TRUE;
+        /* The candidate was not added, it is only kept for the credentials
+         * of the deletion and freed with the refresh */
+        cand->owns_candidate = TRUE;
         priv_turn_allocate_refresh_tick_unlocked(agent, cand);
-        if (relay_cand->sockptr)
-            nice_socket_free(relay_cand->sockptr);
-        nice_candidate_free((NiceCandidate *) relay_cand);
     }
 
     return;
@@ -4043,6 +4116,10 @@ static gboolean priv_map_reply_to_relay_request(NiceAgent *agent, StunMessage *r
                         }
                     }
 
+                    nice_debug("Agent %p : TURN allocation on server %p took %"
+                               G_GINT64_FORMAT " ms", agent, d->turn,
+                               (g_get_monotonic_time() - d->send_time) / 1000);
+
                     if (nice_socket_is_reliable(d->nicesock)) {
                         relay_cand = discovery_add_relay_candidate(
                                 agent,
@@ -4065,15 +4142,20 @@ static gboolean priv_map_reply_to_relay_request(NiceAgent *agent, StunMessage *r
                             priv_add_new_turn_refresh(agent, d, relay_cand, lifetime);
                         }
 
-                        relay_cand = discovery_add_relay_candidate(
-                                agent,
-                                d->stream_id,
-                                d->component_id,
-                                &niceaddr,
-                                NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE,
-                                d->nicesock,
-                                d->turn,
-                                &lifetime);
+                        /* A lifetime of 0 means the allocation is already
+                         * being deleted, don't delete it a second time */
+                        if (lifetime > 0)
+                            relay_cand = discovery_add_relay_candidate(
+                                    agent,
+                                    d->stream_id,
+                                    d->component_id,
+                                    &niceaddr,
+                                    NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE,
+                                    d->nicesock,
+                                    d->turn,
+                                    &lifetime);
+                        else
+                            relay_cand = NULL;
                     } else {
                         relay_cand = discovery_add_relay_candidate(
                                 agent,
@@ -4087,9 +4169,12 @@ static gboolean priv_map_reply_to_relay_request(NiceAgent *agent, StunMessage *r
                     }
 
                     if (relay_cand) {
-                        if (d->stun_resp_msg.buffer)
+                        if (d->stun_resp_msg.buffer) {
                             nice_udp_turn_socket_cache_realm_nonce(relay_cand->sockptr,
                                                                    &d->stun_resp_msg);
+                            nice_udp_turn_socket_share_long_term_key(relay_cand->sockptr,
+                                                                     d->turn, &d->stun_resp_msg);
+                        }
                         if (agent->compatibility == NICE_COMPATIBILITY_OC2007 ||
                             agent->compatibility == NICE_COMPATIBILITY_OC2007R2) {
                             /* These data are needed on TURN socket when sending requests,
@@ -4142,11 +4227,19 @@ static gboolean priv_map_reply_to_relay_request(NiceAgent *agent, StunMessage *r
                                 STUN_MESSAGE_RETURN_SUCCESS &&
                         recv_realm != NULL && recv_realm_len > 0) {
 
+                        /* A challenge shared by another agent may be stale
+                         * in ways the server only reports as unauthorized. */
                         if (code == STUN_ERROR_STALE_NONCE ||
                             (code == STUN_ERROR_UNAUTHORIZED &&
-                             !(recv_realm_len == sent_realm_len &&
-                               sent_realm != NULL &&
-                               memcmp(sent_realm, recv_realm, sent_realm_len) == 0))) {
+                             (d->cached_challenge ||
+                              !(recv_realm_len == sent_realm_len &&
+                                sent_realm != NULL &&
+                                memcmp(sent_realm, recv_realm, sent_realm_len) == 0)))) {
+                            if (agent->discovery_cache_ttl &&
+                                agent->compatibility == NICE_COMPATIBILITY_RFC5245)
+                                nice_server_cache_add_challenge(&d->server,
+                                                                resp->buffer, stun_message_length(resp));
+                            d->cached_challenge = FALSE;
                             d->stun_resp_msg = *resp;
                             memcpy(d->stun_resp_buffer, resp->buffer,
                                    stun_message_length(resp));
@@ -4182,6 +4275,46 @@ static gboolean priv_map_reply_to_relay_request(NiceAgent *agent, StunMessage *r
  * 
  * @return TRUE if a matching transaction is found
  */
+/*
+ * Returns TRUE if the error response 'resp' to the TURN refresh of 'cand'
+ * carries a new nonce or realm, in which case the refresh must be sent
+ * again with them, and keeps the response for that.
+ */
+static gboolean priv_turn_refresh_take_challenge(NiceAgent *agent,
+                                                 CandidateRefresh *cand, StunMessage *resp) {
+    int code = -1;
+    uint8_t *sent_realm = NULL;
+    uint8_t *recv_realm = NULL;
+    uint16_t sent_realm_len = 0;
+    uint16_t recv_realm_len = 0;
+
+    sent_realm = (uint8_t *) stun_message_find(&cand->stun_message,
+                                               STUN_ATTRIBUTE_REALM, &sent_realm_len);
+    recv_realm = (uint8_t *) stun_message_find(resp,
+                                               STUN_ATTRIBUTE_REALM, &recv_realm_len);
+
+    /* check for unauthorized error response */
+    if (agent->compatibility == NICE_COMPATIBILITY_RFC5245 &&
+        stun_message_get_class(resp) == STUN_ERROR &&
+        stun_message_find_error(resp, &code) ==
+                STUN_MESSAGE_RETURN_SUCCESS &&
+        recv_realm != NULL && recv_realm_len > 0 &&
+        (code == STUN_ERROR_STALE_NONCE ||
+         (code == STUN_ERROR_UNAUTHORIZED &&
+          !(recv_realm_len == sent_realm_len &&
+            sent_realm != NULL &&
+            memcmp(sent_realm, recv_realm, sent_realm_len) == 0)))) {
+        cand->stun_resp_msg = *resp;
+        memcpy(cand->stun_resp_buffer, resp->buffer,
+               stun_message_length(resp));
+        cand->stun_resp_msg.buffer = cand->stun_resp_buffer;
+        cand->stun_resp_msg.buffer_len = sizeof(cand->stun_resp_buffer);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
 static gboolean priv_map_reply_to_relay_refresh(NiceAgent *agent, StunMessage *resp) {
     uint32_t lifetime;
     GSList *i;
@@ -4215,41 +4348,10 @@ static gboolean priv_map_reply_to_relay_refresh(NiceAgent *agent, StunMessage *r
                     cand->tick_source = NULL;
                     trans_found = TRUE;
                 } else if (res == STUN_USAGE_TURN_RETURN_ERROR) {
-                    int code = -1;
-                    uint8_t *sent_realm = NULL;
-                    uint8_t *recv_realm = NULL;
-                    uint16_t sent_realm_len = 0;
-                    uint16_t recv_realm_len = 0;
-
-                    sent_realm = (uint8_t *) stun_message_find(&cand->stun_message,
-                                                               STUN_ATTRIBUTE_REALM, &sent_realm_len);
-                    recv_realm = (uint8_t *) stun_message_find(resp,
-                                                               STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-                    /* check for unauthorized error response */
-                    if (agent->compatibility == NICE_COMPATIBILITY_RFC5245 &&
-                        stun_message_get_class(resp) == STUN_ERROR &&
-                        stun_message_find_error(resp, &code) ==
-                                STUN_MESSAGE_RETURN_SUCCESS &&
-                        recv_realm != NULL && recv_realm_len > 0) {
-
-                        if (code == STUN_ERROR_STALE_NONCE ||
-                            (code == STUN_ERROR_UNAUTHORIZED &&
-                             !(recv_realm_len == sent_realm_len &&
-                               sent_realm != NULL &&
-                               memcmp(sent_realm, recv_realm, sent_realm_len) == 0))) {
-                            cand->stun_resp_msg = *resp;
-                            memcpy(cand->stun_resp_buffer, resp->buffer,
-                                   stun_message_length(resp));
-                            cand->stun_resp_msg.buffer = cand->stun_resp_buffer;
-                            cand->stun_resp_msg.buffer_len = sizeof(cand->stun_resp_buffer);
-                            priv_turn_allocate_refresh_tick_unlocked(agent, cand);
-                        } else {
-                            /* case: a real unauthorized error */
-                            refresh_free(agent, cand);
-                        }
+                    if (priv_turn_refresh_take_challenge(agent, cand, resp)) {
+                        priv_turn_allocate_refresh_tick_unlocked(agent, cand);
                     } else {
-                        /* case: STUN error, the check STUN context was freed */
+                        /* case: a real error, the check STUN context was freed */
                         refresh_free(agent, cand);
                     }
                     trans_found = TRUE;
@@ -4262,41 +4364,43 @@ static gboolean priv_map_reply_to_relay_refresh(NiceAgent *agent, StunMessage *r
     return trans_found;
 }
 
+/*
+ * Handles the answer to the deletion of a TURN allocation. The refresh is
+ * looked up in the transaction index, which also covers the deletions that
+ * are only in agent->pruning_refreshes.
+ */
 static gboolean priv_map_reply_to_relay_remove(NiceAgent *agent,
                                                StunMessage *resp) {
     StunTransactionId response_id;
-    GSList *i;
+    CandidateRefresh *cand;
+    StunUsageTurnReturn res;
+    uint32_t lifetime;
 
     stun_message_id(resp, response_id);
 
-    for (i = agent->refresh_list; i; i = i->next) {
-        CandidateRefresh *cand = i->data;
-        StunTransactionId request_id;
-        StunUsageTurnReturn res;
-        uint32_t lifetime;
-
-        if (!cand->disposing || !cand->stun_message.buffer) {
-            continue;
-        }
+    cand = refresh_find_transaction(agent, response_id);
+    if (cand == NULL || !cand->disposing)
+        return FALSE;
 
-        stun_message_id(&cand->stun_message, request_id);
+    res = stun_usage_turn_refresh_process(resp, &lifetime,
+                                          agent_to_turn_compatibility(agent));
 
-        if (memcmp(request_id, response_id, sizeof(StunTransactionId)) == 0) {
-            res = stun_usage_turn_refresh_process(resp, &lifetime,
-                                                  agent_to_turn_compatibility(agent));
+    nice_debug("Agent %p : priv_map_reply_to_relay_remove for %p res %d "
+               "with lifetime %u.",
+               agent, cand, res, lifetime);
 
-            nice_debug("Agent %p : priv_map_reply_to_relay_remove for %p res %d "
-                       "with lifetime %u.",
-                       agent, cand, res, lifetime);
+    if (res == STUN_USAGE_TURN_RETURN_INVALID)
+        return FALSE;
 
-            if (res != STUN_USAGE_TURN_RETURN_INVALID) {
-                refresh_free(agent, cand);
-                return TRUE;
-            }
-        }
+    if (res == STUN_USAGE_TURN_RETURN_ERROR &&
+        priv_turn_refresh_take_challenge(agent, cand, resp)) {
+        /* case: the server wants the deletion with a new nonce */
+        priv_turn_allocate_refresh_tick_unlocked(agent, cand);
+        return TRUE;
     }
 
-    return FALSE;
+    refresh_free(agent, cand);
+    return TRUE;
 }
 
 static gboolean priv_map_reply_to_keepalive_conncheck(NiceAgent *agent,
@@ -4316,13 +4420,16 @@ typedef struct {
     NiceAgent *agent;
     NiceStream *stream;
     NiceComponent *component;
-    uint8_t *password;
 } conncheck_validater_data;
 
-static bool conncheck_stun_validater(StunAgent *agent,
-                                     StunMessage *message, uint8_t *username, uint16_t username_len,
-                                     uint8_t **password, size_t *password_len, void *user_data) {
-    conncheck_validater_data *data = (conncheck_validater_data *) user_data;
+/*
+ * Looks for the candidate whose ufrag prefixes @username by walking the
+ * candidate list, and caches its decoded credentials in the component.
+ */
+static const NiceComponentCredentials *
+conncheck_cache_credentials(conncheck_validater_data *data, gboolean remote,
+                            const uint8_t *username, uint16_t username_len) {
+    const NiceComponentCredentials *creds = NULL;
     GSList *i;
     gchar *ufrag = NULL;
     gsize ufrag_len;
@@ -4331,8 +4438,7 @@ static bool conncheck_stun_validater(StunAgent *agent,
             data->agent->compatibility == NICE_COMPATIBILITY_MSN ||
             data->agent->compatibility == NICE_COMPATIBILITY_OC2007;
 
-    if (data->agent->compatibility == NICE_COMPATIBILITY_OC2007 &&
-        stun_message_get_class(message) == STUN_RESPONSE)
+    if (remote)
         i = data->component->remote_candidates;
     else
         i = data->component->local_candidates;
@@ -4360,6 +4466,8 @@ static bool conncheck_stun_validater(StunAgent *agent,
         if (ufrag_len > 0 && username_len >= ufrag_len &&
             memcmp(username, ufrag, ufrag_len) == 0) {
             gchar *pass = NULL;
+            guint8 *decoded = NULL;
+            gsize pass_len = 0;
 
             if (cand->password)
                 pass = cand->password;
@@ -4367,30 +4475,59 @@ static bool conncheck_stun_validater(StunAgent *agent,
                 pass = data->stream->local_password;
 
             if (pass) {
-                *password = (uint8_t *) pass;
-                *password_len = strlen(pass);
-
-                if (msn_msoc_nice_compatibility) {
-                    gsize pass_len;
-
-                    data->password = g_base64_decode(pass, &pass_len);
-                    *password = data->password;
-                    *password_len = pass_len;
-                }
+                pass_len = strlen(pass);
+                if (msn_msoc_nice_compatibility)
+                    pass = (gchar *) (decoded = g_base64_decode(pass, &pass_len));
             }
 
+            creds = nice_component_add_credentials(data->component, remote,
+                                                   (const guint8 *) ufrag, ufrag_len,
+                                                   (const guint8 *) pass, pass_len);
+
+            g_free(decoded);
             if (msn_msoc_nice_compatibility)
                 g_free(ufrag);
-
-            stun_debug("Found valid username, returning password: '%s'", *password);
-            return TRUE;
+            break;
         }
 
         if (msn_msoc_nice_compatibility)
             g_free(ufrag);
     }
 
-    return FALSE;
+    return creds;
+}
+
+/*
+ * Resolves the password of an inbound STUN message. The decoded
+ * credentials are cached per component, so that after the first message
+ * of a given ufrag this neither walks the candidates nor allocates.
+ */
+static bool conncheck_stun_validater(StunAgent *agent,
+                                     StunMessage *message, uint8_t *username, uint16_t username_len,
+                                     uint8_t **password, size_t *password_len, void *user_data) {
+    conncheck_validater_data *data = (conncheck_validater_data *) user_data;
+    const NiceComponentCredentials *creds;
+    gboolean remote;
+
+    remote = data->agent->compatibility == NICE_COMPATIBILITY_OC2007 &&
+             stun_message_get_class(message) == STUN_RESPONSE;
+
+    creds = nice_component_find_credentials(data->component, remote,
+                                            username, username_len);
+    if (creds == NULL)
+        creds = conncheck_cache_credentials(data, remote, username, username_len);
+    if (creds == NULL)
+        return FALSE;
+
+    if (creds->password) {
+        *password = (uint8_t *) creds->password;
+        *password_len = creds->password_len;
+    }
+
+    stun_debug("Found valid username, returning password: '%.*s'",
+               (int) creds->password_len,
+               creds->password ? (const char *) creds->password : "");
+    return TRUE;
 }
 
 /*
@@ -4463,6 +4600,96 @@ static gboolean conn_check_handle_renomination(NiceAgent *agent, NiceStream *str
     return FALSE;
 }
 
+/*
+ * Returns the rate bucket slot for the transport address @from.
+ */
+static StunRateBucket *priv_stun_rate_bucket(NiceComponent *component,
+                                             const NiceAddress *from) {
+    guint hash = nice_address_get_port(from);
+    const guint8 *bytes;
+    gsize len, k;
+
+    if (from->s.addr.sa_family == AF_INET6) {
+        bytes = (const guint8 *) &from->s.ip6.sin6_addr;
+        len = sizeof(from->s.ip6.sin6_addr);
+    } else {
+        bytes = (const guint8 *) &from->s.ip4.sin_addr;
+        len = sizeof(from->s.ip4.sin_addr);
+    }
+
+    for (k = 0; k < len; k++)
+        hash = hash * 31 + bytes[k];
+
+    return &component->stun_rate_buckets[hash % NICE_COMPONENT_STUN_RATE_BUCKETS];
+}
+
+/*
+ * Charges one rejection reply to the bucket of @from, taking the slot over
+ * if it belonged to another source. Returns FALSE if the source already
+ * spent its budget, in which case the reply should not be sent: the
+ * message that failed validation is then dropped silently.
+ */
+static gboolean priv_stun_source_may_reply(NiceComponent *component,
+                                           const NiceAddress *from) {
+    StunRateBucket *bucket = priv_stun_rate_bucket(component, from);
+    gint64 now = g_get_monotonic_time();
+    gint64 refill;
+
+    if (bucket->refill_time == 0 || !nice_address_equal(&bucket->from, from)) {
+        bucket->from = *from;
+        bucket->refill_time = now;
+        bucket->tokens = NICE_AGENT_STUN_REJECT_BURST;
+    }
+
+    refill = (now - bucket->refill_time) * NICE_AGENT_STUN_REJECT_RATE /
+             G_USEC_PER_SEC;
+    if (refill > 0) {
+        if (bucket->tokens + refill >= NICE_AGENT_STUN_REJECT_BURST) {
+            bucket->tokens = NICE_AGENT_STUN_REJECT_BURST;
+            bucket->refill_time = now;
+        } else {
+            bucket->tokens += refill;
+            bucket->refill_time += refill * G_USEC_PER_SEC /
+                                   NICE_AGENT_STUN_REJECT_RATE;
+        }
+    }
+
+    if (bucket->tokens == 0)
+        return FALSE;
+
+    bucket->tokens--;
+    return TRUE;
+}
+
+/*
+ * Checks the USERNAME of an inbound request against the local ufrags
+ * without running the integrity check. Returns FALSE if the request
+ * carries a username that cannot belong to this component, in which case
+ * the HMAC computation can be skipped altogether.
+ */
+static gboolean priv_stun_username_plausible(NiceStream *stream,
+                                             NiceComponent *component, const StunMessage *msg) {
+    const uint8_t *username;
+    uint16_t username_len;
+    GSList *i;
+
+    username = stun_message_find(msg, STUN_ATTRIBUTE_USERNAME, &username_len);
+    if (username == NULL)
+        return TRUE;
+
+    for (i = component->local_candidates; i; i = i->next) {
+        NiceCandidate *cand = i->data;
+        const gchar *ufrag = cand->username ? cand->username : stream->local_ufrag;
+        gsize ufrag_len = strlen(ufrag);
+
+        if (ufrag_len > 0 && username_len >= ufrag_len &&
+            memcmp(username, ufrag, ufrag_len) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
 /*
  * Processing an incoming STUN message.
  *
@@ -4495,8 +4722,11 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
     uint16_t username_len;
     StunMessage req;
     StunMessage msg;
+    StunMessage raw = {0};
+    StunTransactionId raw_id;
+    StunClass raw_class;
     StunValidationStatus valid;
-    conncheck_validater_data validater_data = {agent, stream, component, NULL};
+    conncheck_validater_data validater_data = {agent, stream, component};
     GSList *i, *j;
     NiceCandidate *remote_candidate = NULL;
     NiceCandidate *remote_candidate2 = NULL;
@@ -4516,14 +4746,65 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
                    agent, stream->id, component->id, tmpbuf, nice_address_get_port(from), len);
     }
 
+    /* A raw view of the message, used by the cheap checks which run
+   * before the full validation */
+    raw.agent = &component->stun_agent;
+    raw.buffer = (uint8_t *) buf;
+    raw.buffer_len = len;
+    raw_class = stun_message_get_class(&raw);
+    stun_message_id(&raw, raw_id);
+
+    if (raw_class == STUN_REQUEST &&
+        NICE_AGENT_IS_COMPATIBLE_WITH_RFC5245_OR_OC2007R2(agent) &&
+        !priv_stun_username_plausible(stream, component, &raw)) {
+        nice_debug("Agent %p : Username does not match any local ufrag.", agent);
+
+        if (priv_stun_source_may_reply(component, from) &&
+            stun_agent_init_error(&component->stun_agent, &msg, rbuf, rbuf_len,
+                                  &raw, STUN_ERROR_UNAUTHORIZED)) {
+            rbuf_len = stun_agent_finish_message(&component->stun_agent, &msg, NULL, 0);
+            if (rbuf_len > 0)
+                agent_socket_send(nicesock, from, rbuf_len, (const gchar *) rbuf);
+        }
+        return TRUE;
+    }
+
     /* note: ICE  7.2. "STUN Server Procedures" (ID-19) */
 
     valid = stun_agent_validate(&component->stun_agent, &req,
                                 (uint8_t *) buf, len, conncheck_stun_validater, &validater_data);
 
-    /* Check for discovery candidates stun agents */
-    if (valid == STUN_VALIDATION_BAD_REQUEST ||
-        valid == STUN_VALIDATION_UNMATCHED_RESPONSE) {
+    /* Check for discovery candidates stun agents. Responses are only
+   * validated by the agent whose pending request has the same
+   * transaction id, looked up in the agent's transaction index. */
+    if ((valid == STUN_VALIDATION_BAD_REQUEST ||
+         valid == STUN_VALIDATION_UNMATCHED_RESPONSE) &&
+        (raw_class == STUN_RESPONSE || raw_class == STUN_ERROR)) {
+        CandidateDiscovery *d = discovery_find_transaction(agent, raw_id);
+        CandidateRefresh *r = NULL;
+
+        if (d != NULL && d->stream_id == stream->id &&
+            d->component_id == component->id && d->nicesock == nicesock) {
+            valid = stun_agent_validate(&d->stun_agent, &req,
+                                        (uint8_t *) buf, len, conncheck_stun_validater, &validater_data);
+            if (valid != STUN_VALIDATION_UNMATCHED_RESPONSE)
+                discovery_msg = TRUE;
+        }
+
+        if (!discovery_msg)
+            r = refresh_find_transaction(agent, raw_id);
+        if (r != NULL && r->stream_id == stream->id &&
+            r->component_id == component->id &&
+            (r->nicesock == nicesock || r->candidate->sockptr == nicesock)) {
+            valid = stun_agent_validate(&r->stun_agent, &req,
+                                        (uint8_t *) buf, len, conncheck_stun_validater, &validater_data);
+            nice_debug("Validating gave %d", valid);
+            if (valid != STUN_VALIDATION_UNMATCHED_RESPONSE)
+                discovery_msg = TRUE;
+        }
+    }
+    if (valid == STUN_VALIDATION_BAD_REQUEST &&
+        raw_class != STUN_RESPONSE && raw_class != STUN_ERROR) {
         for (i = agent->discovery_list; i; i = i->next) {
             CandidateDiscovery *d = i->data;
             if (d->stream_id == stream->id && d->component_id == component->id &&
@@ -4540,8 +4821,8 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
         }
     }
     /* Check for relay refresh stun agents */
-    if (valid == STUN_VALIDATION_BAD_REQUEST ||
-        valid == STUN_VALIDATION_UNMATCHED_RESPONSE) {
+    if (valid == STUN_VALIDATION_BAD_REQUEST &&
+        raw_class != STUN_RESPONSE && raw_class != STUN_ERROR) {
         for (i = agent->refresh_list; i; i = i->next) {
             CandidateRefresh *r = i->data;
 
@@ -4562,8 +4843,6 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
         }
     }
 
-    g_free(validater_data.password);
-
     if (valid == STUN_VALIDATION_NOT_STUN ||
         valid == STUN_VALIDATION_INCOMPLETE_STUN ||
         valid == STUN_VALIDATION_BAD_REQUEST) {
@@ -4576,7 +4855,8 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
         nice_debug("Agent %p : Unknown mandatory attributes in message.", agent);
 
         if (agent->compatibility != NICE_COMPATIBILITY_MSN &&
-            agent->compatibility != NICE_COMPATIBILITY_OC2007) {
+            agent->compatibility != NICE_COMPATIBILITY_OC2007 &&
+            priv_stun_source_may_reply(component, from)) {
             rbuf_len = stun_agent_build_unknown_attributes_error(&component->stun_agent,
                                                                  &msg, rbuf, rbuf_len, &req);
             if (rbuf_len != 0)
@@ -4588,7 +4868,8 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
     if (valid == STUN_VALIDATION_UNAUTHORIZED) {
         nice_debug("Agent %p : Integrity check failed.", agent);
 
-        if (stun_agent_init_error(&component->stun_agent, &msg, rbuf, rbuf_len,
+        if (priv_stun_source_may_reply(component, from) &&
+            stun_agent_init_error(&component->stun_agent, &msg, rbuf, rbuf_len,
                                   &req, STUN_ERROR_UNAUTHORIZED)) {
             rbuf_len = stun_agent_finish_message(&component->stun_agent, &msg, NULL, 0);
             if (rbuf_len > 0 && agent->compatibility != NICE_COMPATIBILITY_MSN &&
@@ -4599,7 +4880,8 @@ gboolean conn_check_handle_inbound_stun(NiceAgent *agent, NiceStream *stream,
     }
     if (valid == STUN_VALIDATION_UNAUTHORIZED_BAD_REQUEST) {
         nice_debug("Agent %p : Integrity check failed - bad request.", agent);
-        if (stun_agent_init_error(&component->stun_agent, &msg, rbuf, rbuf_len,
+        if (priv_stun_source_may_reply(component, from) &&
+            stun_agent_init_error(&component->stun_agent, &msg, rbuf, rbuf_len,
                                   &req, STUN_ERROR_BAD_REQUEST)) {
             rbuf_len = stun_agent_finish_message(&component->stun_agent, &msg, NULL, 0);
             if (rbuf_len > 0 && agent->compatibility != NICE_COMPATIBILITY_MSN &&
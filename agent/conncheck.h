@@ -45,6 +45,7 @@
 #include "agent.h"
 #include "stream.h"
 #include "stun/stunagent.h"
+#include "stun/usages/ice.h"
 #include "stun/usages/timer.h"
 
 #define NICE_CANDIDATE_PAIR_MAX_FOUNDATION NICE_CANDIDATE_MAX_FOUNDATION * 2
@@ -102,6 +103,7 @@ struct _CandidateCheckPair {
     guint64 priority;
     guint32 stun_priority;
     GSList *stun_transactions; /* a list of ongoing stun requests */
+    StunUsageIceConncheckTemplate *request_template; /* built on first check */
 };
 
 int conn_check_add_for_candidate(NiceAgent *agent, guint stream_id, NiceComponent *component, NiceCandidate *remote);
@@ -125,6 +127,7 @@ void conn_check_update_check_list_state_for_ready(NiceAgent *agent,
                                                   NiceStream *stream, NiceComponent *component);
 void conn_check_unfreeze_related(NiceAgent *agent, CandidateCheckPair *pair);
 guint conn_check_stun_transactions_count(NiceAgent *agent);
+void conn_check_reset_request_templates(NiceStream *stream);
 
 
 #endif /*_NICE_CONNCHECK_H */
@@ -57,19 +57,130 @@
 #include "agent-priv.h"
 #include "component.h"
 #include "discovery.h"
+#include "port-pool.h"
 #include "stun/usages/bind.h"
 #include "stun/usages/turn.h"
 #include "socket/socket.h"
 
 /*
- * Frees the CandidateDiscovery structure pointed to
- * by 'user data'. Compatible with g_slist_free_full().
+ * The pending requests of the discovery and refresh items are indexed by
+ * transaction ID, so that an inbound response is handed to the one item
+ * that sent it. Each item is found by the ID of the last request it created,
+ * which it keeps in indexed_id, and is removed from the index when freed.
  */
-static void discovery_free_item (CandidateDiscovery *cand)
+static guint
+priv_transaction_id_hash (gconstpointer key)
 {
+  const guint8 *id = key;
+  guint32 h;
+
+  /* Transaction IDs are random, their last bytes are enough. The first
+   * ones are the magic cookie in RFC 5389 messages. */
+  memcpy (&h, id + sizeof (StunTransactionId) - sizeof (h), sizeof (h));
+  return h;
+}
+
+static gboolean
+priv_transaction_id_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, sizeof (StunTransactionId)) == 0;
+}
+
+static void
+priv_transaction_unindex (GHashTable *table, gpointer owner,
+    StunTransactionId indexed_id, gboolean *indexed)
+{
+  if (*indexed && table != NULL &&
+      g_hash_table_lookup (table, indexed_id) == owner)
+    g_hash_table_remove (table, indexed_id);
+  *indexed = FALSE;
+}
+
+static void
+priv_transaction_index (GHashTable **table, gpointer owner,
+    const StunMessage *msg, StunTransactionId indexed_id, gboolean *indexed)
+{
+  priv_transaction_unindex (*table, owner, indexed_id, indexed);
+
+  if (msg->buffer == NULL)
+    return;
+
+  if (*table == NULL)
+    *table = g_hash_table_new (priv_transaction_id_hash,
+        priv_transaction_id_equal);
+
+  stun_message_id (msg, indexed_id);
+  g_hash_table_replace (*table, indexed_id, owner);
+  *indexed = TRUE;
+}
+
+/*
+ * Indexes the request just created in 'cand->stun_message'.
+ */
+void discovery_index_transaction (NiceAgent *agent, CandidateDiscovery *cand)
+{
+  priv_transaction_index (&agent->discovery_transactions, cand,
+      &cand->stun_message, cand->indexed_id, &cand->indexed);
+}
+
+/*
+ * @return the discovery item waiting for the response to request 'id',
+ * or NULL
+ */
+CandidateDiscovery *
+discovery_find_transaction (NiceAgent *agent, const StunTransactionId id)
+{
+  CandidateDiscovery *cand;
+
+  if (agent->discovery_transactions == NULL)
+    return NULL;
+
+  cand = g_hash_table_lookup (agent->discovery_transactions, id);
+  if (cand == NULL || cand->stun_message.buffer == NULL)
+    return NULL;
+
+  return cand;
+}
+
+/*
+ * Indexes the request just created in 'cand->stun_message'.
+ */
+void refresh_index_transaction (NiceAgent *agent, CandidateRefresh *cand)
+{
+  priv_transaction_index (&agent->refresh_transactions, cand,
+      &cand->stun_message, cand->indexed_id, &cand->indexed);
+}
+
+/*
+ * @return the refresh waiting for the response to request 'id', or NULL
+ */
+CandidateRefresh *
+refresh_find_transaction (NiceAgent *agent, const StunTransactionId id)
+{
+  CandidateRefresh *cand;
+
+  if (agent->refresh_transactions == NULL)
+    return NULL;
+
+  cand = g_hash_table_lookup (agent->refresh_transactions, id);
+  if (cand == NULL || cand->stun_message.buffer == NULL)
+    return NULL;
+
+  return cand;
+}
+
+/*
+ * Frees the CandidateDiscovery structure 'cand'.
+ */
+static void discovery_free_item (NiceAgent *agent, CandidateDiscovery *cand)
+{
+  priv_transaction_unindex (agent->discovery_transactions, cand,
+      cand->indexed_id, &cand->indexed);
+
   if (cand->turn)
     turn_server_unref (cand->turn);
 
+  stun_agent_clear (&cand->stun_agent);
   g_slice_free (CandidateDiscovery, cand);
 }
 
@@ -78,8 +189,11 @@ static void discovery_free_item (CandidateDiscovery *cand)
  */
 void discovery_free (NiceAgent *agent)
 {
-  g_slist_free_full (agent->discovery_list,
-      (GDestroyNotify) discovery_free_item);
+  GSList *i;
+
+  for (i = agent->discovery_list; i; i = i->next)
+    discovery_free_item (agent, i->data);
+  g_slist_free (agent->discovery_list);
   agent->discovery_list = NULL;
   agent->discovery_unsched_items = 0;
 
@@ -106,7 +220,7 @@ void discovery_prune_stream (NiceAgent *agent, guint stream_id)
 
     if (cand->stream_id == stream_id) {
       agent->discovery_list = g_slist_remove (agent->discovery_list, cand);
-      discovery_free_item (cand);
+      discovery_free_item (agent, cand);
     }
     i = next;
   }
@@ -133,7 +247,7 @@ void discovery_prune_socket (NiceAgent *agent, NiceSocket *sock)
 
     if (discovery->nicesock == sock) {
       agent->discovery_list = g_slist_remove (agent->discovery_list, discovery);
-      discovery_free_item (discovery);
+      discovery_free_item (agent, discovery);
     }
     i = next;
   }
@@ -153,6 +267,8 @@ void refresh_free (NiceAgent *agent, CandidateRefresh *cand)
 
   agent->refresh_list = g_slist_remove (agent->refresh_list, cand);
   agent->pruning_refreshes = g_slist_remove (agent->pruning_refreshes, cand);
+  priv_transaction_unindex (agent->refresh_transactions, cand,
+      cand->indexed_id, &cand->indexed);
 
   if (cand->timer_source != NULL) {
     g_source_destroy (cand->timer_source);
@@ -173,6 +289,13 @@ void refresh_free (NiceAgent *agent, CandidateRefresh *cand)
     cand->destroy_cb (cand->destroy_cb_data);
   }
 
+  if (cand->owns_candidate) {
+    if (cand->candidate->sockptr)
+      nice_socket_free (cand->candidate->sockptr);
+    nice_candidate_free ((NiceCandidate *) cand->candidate);
+  }
+
+  stun_agent_clear (&cand->stun_agent);
   g_slice_free (CandidateRefresh, cand);
 }
 
@@ -263,6 +386,7 @@ static gboolean refresh_remove_async (NiceAgent *agent, gpointer pointer)
       agent_to_turn_compatibility (agent));
 
   if (buffer_len > 0) {
+    refresh_index_transaction (agent, cand);
     agent_socket_send (cand->nicesock, &cand->server, buffer_len,
         (gchar *)cand->stun_buffer);
 
@@ -744,9 +868,26 @@ priv_local_host_candidate_duplicate_port (NiceAgent *agent,
   return FALSE;
 }
 
+static NiceSocket *
+priv_bind_udp_host_socket (NiceAddress *address, gpointer user_data,
+    GError **error)
+{
+  return nice_udp_bsd_socket_new (address, error);
+}
+
+static NiceSocket *
+priv_bind_tcp_passive_host_socket (NiceAddress *address, gpointer user_data,
+    GError **error)
+{
+  NiceAgent *agent = user_data;
+
+  return nice_tcp_passive_socket_new (agent->main_context, address, error);
+}
+
 /*
  * Creates a local host candidate for 'component_id' of stream
- * 'stream_id'.
+ * 'stream_id'. If 'address' has no port but the component has a port
+ * range, the port is picked by the process-wide port pool.
  *
  * @return pointer to the created candidate, or NULL on error
  */
@@ -795,7 +936,18 @@ HostCandidateResult discovery_add_local_host_candidate (
 
   /* note: candidate username and password are left NULL as stream
      level ufrag/password are used */
-  if (transport == NICE_CANDIDATE_TRANSPORT_UDP) {
+  if (component->min_port != 0 && nice_address_get_port (address) == 0 &&
+      transport == NICE_CANDIDATE_TRANSPORT_UDP) {
+    nicesock = nice_port_pool_acquire (NICE_SOCKET_TYPE_UDP_BSD, address,
+        component->min_port, component->max_port,
+        priv_bind_udp_host_socket, agent, &error);
+  } else if (component->min_port != 0 &&
+      nice_address_get_port (address) == 0 &&
+      transport == NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE) {
+    nicesock = nice_port_pool_acquire (NICE_SOCKET_TYPE_TCP_PASSIVE, address,
+        component->min_port, component->max_port,
+        priv_bind_tcp_passive_host_socket, agent, &error);
+  } else if (transport == NICE_CANDIDATE_TRANSPORT_UDP) {
     nicesock = nice_udp_bsd_socket_new (address, &error);
   } else if (transport == NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE) {
     nicesock = nice_tcp_active_socket_new (agent->main_context, address);
@@ -807,6 +959,8 @@ HostCandidateResult discovery_add_local_host_candidate (
   if (!nicesock) {
     if (error && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_ADDRESS_IN_USE))
       res = HOST_CANDIDATE_DUPLICATE_PORT;
+    else if (error && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+      res = HOST_CANDIDATE_PORT_RANGE_FULL;
     else
       res = HOST_CANDIDATE_CANT_CREATE_SOCKET;
     g_clear_error (&error);
@@ -848,8 +1002,8 @@ errors:
  *
  * @return pointer to the created candidate, or NULL on error
  */
-void
-discovery_add_server_reflexive_candidate (
+static void
+priv_add_server_reflexive_candidate (
   NiceAgent *agent,
   guint stream_id,
   guint component_id,
@@ -857,7 +1011,8 @@ discovery_add_server_reflexive_candidate (
   NiceCandidateTransport transport,
   NiceSocket *base_socket,
   const NiceAddress *server_address,
-  gboolean nat_assisted)
+  gboolean nat_assisted,
+  gboolean signal_new)
 {
   NiceCandidate *candidate;
   NiceCandidateImpl *c;
@@ -900,7 +1055,8 @@ discovery_add_server_reflexive_candidate (
 
   result = priv_add_local_candidate_pruned (agent, stream_id, component, candidate);
   if (result) {
-    agent_signal_new_candidate (agent, candidate);
+    if (signal_new)
+      agent_signal_new_candidate (agent, candidate);
   }
   else {
     /* error: duplicate candidate */
@@ -908,6 +1064,21 @@ discovery_add_server_reflexive_candidate (
   }
 }
 
+void
+discovery_add_server_reflexive_candidate (
+  NiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  NiceAddress *address,
+  NiceCandidateTransport transport,
+  NiceSocket *base_socket,
+  const NiceAddress *server_address,
+  gboolean nat_assisted)
+{
+  priv_add_server_reflexive_candidate (agent, stream_id, component_id,
+      address, transport, base_socket, server_address, nat_assisted, TRUE);
+}
+
 /*
  * Creates a server reflexive candidate for 'component_id' of stream
  * 'stream_id' for each TCP_PASSIVE and TCP_ACTIVE candidates for each
@@ -915,14 +1086,15 @@ discovery_add_server_reflexive_candidate (
  *
  * @return pointer to the created candidate, or NULL on error
  */
-void
-discovery_discover_tcp_server_reflexive_candidates (
+static void
+priv_discover_tcp_server_reflexive_candidates (
   NiceAgent *agent,
   guint stream_id,
   guint component_id,
   NiceAddress *address,
   NiceSocket *base_socket,
-  const NiceAddress *server_addr)
+  const NiceAddress *server_addr,
+  gboolean signal_new)
 {
   NiceComponent *component;
   NiceStream *stream;
@@ -944,7 +1116,7 @@ discovery_discover_tcp_server_reflexive_candidates (
         c->type == NICE_CANDIDATE_TYPE_HOST &&
         nice_address_equal (&base_addr, &caddr)) {
       nice_address_set_port (address, nice_address_get_port (&c->addr));
-      discovery_add_server_reflexive_candidate (
+      priv_add_server_reflexive_candidate (
           agent,
           stream_id,
           component_id,
@@ -952,14 +1124,122 @@ discovery_discover_tcp_server_reflexive_candidates (
           c->transport,
           ((NiceCandidateImpl *) c)->sockptr,
           server_addr,
-          FALSE);
+          FALSE,
+          signal_new);
     }
   }
 }
 
+void
+discovery_discover_tcp_server_reflexive_candidates (
+  NiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  NiceAddress *address,
+  NiceSocket *base_socket,
+  const NiceAddress *server_addr)
+{
+  priv_discover_tcp_server_reflexive_candidates (agent, stream_id,
+      component_id, address, base_socket, server_addr, TRUE);
+}
+
 /*
- * Creates a server reflexive candidate for 'component_id' of stream
- * 'stream_id'.
+ * Adds the server reflexive candidates of 'base_socket' from an address
+ * 'mapped' known before the gathering started, such as a cached answer of
+ * the STUN server. They are not signalled here, but with the host
+ * candidates once the gathering has started.
+ */
+void
+discovery_add_known_server_reflexive_candidates (
+  NiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  NiceAddress *mapped,
+  NiceSocket *base_socket,
+  const NiceAddress *server_addr)
+{
+  priv_add_server_reflexive_candidate (agent, stream_id, component_id,
+      mapped, NICE_CANDIDATE_TRANSPORT_UDP, base_socket, server_addr, FALSE,
+      FALSE);
+
+  if (agent->use_ice_tcp)
+    priv_discover_tcp_server_reflexive_candidates (agent, stream_id,
+        component_id, mapped, base_socket, server_addr, FALSE);
+}
+
+/*
+ * Returns the number of TURN servers which already gave a relayed candidate
+ * on the local address of 'base_socket', that is the rank of 'turn' in the
+ * relay race. 'sibling' is set to the candidate of 'turn' if it is one of
+ * them, which happens for the second candidate of a TCP allocation.
+ */
+static guint
+priv_relay_race_rank (NiceComponent *component, NiceSocket *base_socket,
+    TurnServer *turn, NiceCandidateImpl **sibling)
+{
+  TurnServer *seen[NICE_CANDIDATE_MAX_TURN_SERVERS];
+  guint n_seen = 0;
+  GSList *i;
+
+  *sibling = NULL;
+
+  for (i = component->local_candidates; i; i = i->next) {
+    NiceCandidateImpl *c = i->data;
+    guint j;
+
+    if (c->c.type != NICE_CANDIDATE_TYPE_RELAYED || c->turn == NULL ||
+        !nice_address_equal_no_port (&c->c.base_addr, &base_socket->addr))
+      continue;
+
+    if (c->turn == turn)
+      *sibling = c;
+
+    for (j = 0; j < n_seen; j++)
+      if (seen[j] == c->turn)
+        break;
+    if (j == n_seen && n_seen < G_N_ELEMENTS (seen))
+      seen[n_seen++] = c->turn;
+  }
+
+  return n_seen;
+}
+
+/*
+ * Cancels the TURN allocations of the component on the local address of
+ * 'base_socket' which were not sent yet, once the relay race is over.
+ * Those already sent are deleted when their answer arrives.
+ */
+static void
+priv_relay_race_cancel_unsent (NiceAgent *agent, guint stream_id,
+    guint component_id, NiceSocket *base_socket)
+{
+  GSList *i;
+
+  for (i = agent->discovery_list; i; i = i->next) {
+    CandidateDiscovery *d = i->data;
+
+    if (d->type != NICE_CANDIDATE_TYPE_RELAYED || d->pending || d->done ||
+        d->stream_id != stream_id || d->component_id != component_id ||
+        !nice_address_equal_no_port (&d->nicesock->addr, &base_socket->addr))
+      continue;
+
+    nice_debug ("Agent %p : relay race over, cancelling allocation on TURN "
+        "server %p", agent, d->turn);
+    d->pending = TRUE;
+    d->done = TRUE;
+    d->stun_message.buffer = NULL;
+    d->stun_message.buffer_len = 0;
+    if (agent->discovery_unsched_items)
+      --agent->discovery_unsched_items;
+  }
+}
+
+/*
+ * Creates a relayed candidate for 'component_id' of stream 'stream_id'.
+ *
+ * If the agent races its TURN servers and this one answered too late,
+ * the candidate is not added and 'lifetime' is set to 0 so that the caller
+ * deletes the allocation.
  *
  * @return pointer to the created candidate, or NULL on error
  */
@@ -1001,6 +1281,28 @@ discovery_add_relay_candidate (
 
   c->sockptr = relay_socket;
   candidate->base_addr = base_socket->addr;
+  c->turn_preference = turn->preference;
+
+  if (agent->relay_race_count > 0) {
+    NiceCandidateImpl *sibling;
+    guint rank = priv_relay_race_rank (component, base_socket, turn, &sibling);
+
+    if (sibling) {
+      c->turn_preference = sibling->turn_preference;
+    } else if (rank >= agent->relay_race_count) {
+      nice_debug ("Agent %p : TURN server %p lost the relay race, "
+          "deleting its allocation", agent, turn);
+      if (lifetime)
+        *lifetime = 0;
+      return c;
+    } else {
+      /* The first servers to answer are the closest ones, prefer them */
+      c->turn_preference = NICE_CANDIDATE_MAX_TURN_SERVERS - 1 - rank;
+      if (rank + 1 == agent->relay_race_count)
+        priv_relay_race_cancel_unsent (agent, stream_id, component_id,
+            base_socket);
+    }
+  }
 
   if (agent->compatibility == NICE_COMPATIBILITY_GOOGLE) {
     candidate->priority = nice_candidate_jingle_priority (candidate);
@@ -1302,6 +1604,10 @@ static gboolean priv_discovery_tick_unlocked (NiceAgent *agent)
             password_len = cand->turn->decoded_password_len;
           }
 
+          turn_server_set_long_term_key (cand->turn, &cand->stun_agent,
+              &cand->stun_resp_msg, username, username_len,
+              password, password_len);
+
           buffer_len = stun_usage_turn_create (&cand->stun_agent,
               &cand->stun_message,  cand->stun_buffer, sizeof(cand->stun_buffer),
               cand->stun_resp_msg.buffer == NULL ? NULL : &cand->stun_resp_msg,
@@ -1312,6 +1618,9 @@ static gboolean priv_discovery_tick_unlocked (NiceAgent *agent)
               turn_compat);
         }
 
+        if (buffer_len > 0)
+          discovery_index_transaction (agent, cand);
+
         if (buffer_len > 0 &&
             agent_socket_send (cand->nicesock, &cand->server, buffer_len,
                 (gchar *)cand->stun_buffer) >= 0) {
@@ -1325,6 +1634,7 @@ static gboolean priv_discovery_tick_unlocked (NiceAgent *agent)
           }
 
           cand->next_tick = g_get_monotonic_time ();
+          cand->send_time = cand->next_tick;
           ++need_pacing;
         } else {
           /* case: error in starting discovery, start the next discovery */
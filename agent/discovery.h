@@ -51,8 +51,12 @@ typedef struct
     NiceSocket *nicesock;   /* XXX: should be taken from local cand: existing socket to use */
     NiceAddress server;     /* STUN/TURN server address */
     gint64 next_tick;       /* next tick timestamp */
+    gint64 send_time;       /* when the current request was first sent */
     gboolean pending;       /* is discovery in progress? */
     gboolean done;          /* is discovery complete? */
+    gboolean cached_challenge; /* stun_resp_msg is a shared TURN challenge */
+    gboolean indexed;       /* indexed_id is in agent->discovery_transactions */
+    StunTransactionId indexed_id;
     guint stream_id;
     guint component_id;
     TurnServer *turn;
@@ -81,6 +85,9 @@ typedef struct
     StunMessage stun_resp_msg;
 
     gboolean disposing;
+    gboolean owns_candidate;      /* candidate was never added, free it here */
+    gboolean indexed;             /* indexed_id is in agent->refresh_transactions */
+    StunTransactionId indexed_id;
     GDestroyNotify destroy_cb;
     gpointer destroy_cb_data;
     GSource *destroy_source;
@@ -95,19 +102,26 @@ void refresh_prune_candidate(NiceAgent *agent, NiceCandidateImpl *candidate);
 void refresh_prune_candidate_async(NiceAgent *agent, NiceCandidateImpl *cand,
                                    NiceTimeoutLockedCallback function);
 void refresh_prune_socket(NiceAgent *agent, NiceSocket *nicesock);
+void refresh_index_transaction(NiceAgent *agent, CandidateRefresh *refresh);
+CandidateRefresh *refresh_find_transaction(NiceAgent *agent,
+                                           const StunTransactionId id);
 
 
 void discovery_free(NiceAgent *agent);
 void discovery_prune_stream(NiceAgent *agent, guint stream_id);
 void discovery_prune_socket(NiceAgent *agent, NiceSocket *sock);
 void discovery_schedule(NiceAgent *agent);
+void discovery_index_transaction(NiceAgent *agent, CandidateDiscovery *cand);
+CandidateDiscovery *discovery_find_transaction(NiceAgent *agent,
+                                               const StunTransactionId id);
 
 typedef enum {
     HOST_CANDIDATE_SUCCESS,
     HOST_CANDIDATE_FAILED,
     HOST_CANDIDATE_CANT_CREATE_SOCKET,
     HOST_CANDIDATE_REDUNDANT,
-    HOST_CANDIDATE_DUPLICATE_PORT
+    HOST_CANDIDATE_DUPLICATE_PORT,
+    HOST_CANDIDATE_PORT_RANGE_FULL
 } HostCandidateResult;
 
 HostCandidateResult
@@ -149,6 +163,14 @@ void discovery_discover_tcp_server_reflexive_candidates(
         NiceSocket *base_socket,
         const NiceAddress *server_address);
 
+void discovery_add_known_server_reflexive_candidates(
+        NiceAgent *agent,
+        guint stream_id,
+        guint component_id,
+        NiceAddress *mapped,
+        NiceSocket *base_socket,
+        const NiceAddress *server_address);
+
 NiceCandidate *
 discovery_add_peer_reflexive_candidate(
         NiceAgent *agent,
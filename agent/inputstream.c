@@ -53,6 +53,9 @@
  * and underlying #NiceAgent stream will be closed, but the underlying stream
  * will not be removed. Use nice_agent_remove_stream() to do that.
  *
+ * With #NiceAgent:reliable-channels, a #NiceInputStream may instead read a
+ * single channel of the component, see nice_agent_get_channel_io_stream().
+ *
  * Since: 0.1.5
  */
 
@@ -79,12 +82,14 @@ enum {
     PROP_AGENT = 1,
     PROP_STREAM_ID,
     PROP_COMPONENT_ID,
+    PROP_CHANNEL_ID,
 };
 
 struct _NiceInputStreamPrivate {
     GWeakRef /*<NiceAgent>*/ agent_ref;
     guint stream_id;
     guint component_id;
+    guint channel_id;
 };
 
 static void nice_input_stream_dispose(GObject *object);
@@ -166,6 +171,23 @@ nice_input_stream_class_init(NiceInputStreamClass *klass) {
                                             0, G_MAXUINT,
                                             0,
                                             G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /***
+   * NiceInputStream:channel-id:
+   *
+   * Reliable channel of the component to read, or 0 for the component
+   * itself. See #NiceAgent:reliable-channels.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(gobject_class, PROP_CHANNEL_ID,
+                                    g_param_spec_uint(
+                                            "channel-id",
+                                            "Component’s channel ID",
+                                            "The reliable channel of the component to wrap.",
+                                            0, G_MAXUINT16,
+                                            0,
+                                            G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -204,6 +226,9 @@ nice_input_stream_get_property(GObject *object, guint prop_id,
         case PROP_COMPONENT_ID:
             g_value_set_uint(value, self->priv->component_id);
             break;
+        case PROP_CHANNEL_ID:
+            g_value_set_uint(value, self->priv->channel_id);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -239,6 +264,10 @@ nice_input_stream_set_property(GObject *object, guint prop_id,
             /* Construct only. */
             self->priv->component_id = g_value_get_uint(value);
             break;
+        case PROP_CHANNEL_ID:
+            /* Construct only. */
+            self->priv->channel_id = g_value_get_uint(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -289,6 +318,46 @@ nice_input_stream_new(NiceAgent *agent, guint stream_id, guint component_id) {
                         NULL);
 }
 
+/* nice_agent_recv() blocks in the I/O context of the component, which can't
+ * wake up for a single channel, so channels block on their pollable source
+ * instead. */
+static gssize
+nice_input_stream_read_channel(GInputStream *stream, void *buffer,
+                               gsize count, GCancellable *cancellable, GError **error) {
+    GPollableInputStream *pollable = G_POLLABLE_INPUT_STREAM(stream);
+    GMainContext *context = g_main_context_new();
+    gssize len;
+
+    for (;;) {
+        GError *child_error = NULL;
+        GSource *source;
+
+        len = nice_input_stream_read_nonblocking(pollable, buffer, count,
+                                                 &child_error);
+        if (len >= 0 || !g_error_matches(child_error, G_IO_ERROR,
+                                         G_IO_ERROR_WOULD_BLOCK)) {
+            if (child_error)
+                g_propagate_error(error, child_error);
+            break;
+        }
+        g_clear_error(&child_error);
+
+        if (g_cancellable_set_error_if_cancelled(cancellable, error))
+            break;
+
+        source = nice_input_stream_create_source(pollable, cancellable);
+        g_source_set_dummy_callback(source);
+        g_source_attach(source, context);
+        g_main_context_iteration(context, TRUE);
+        g_source_destroy(source);
+        g_source_unref(source);
+    }
+
+    g_main_context_unref(context);
+
+    return len;
+}
+
 static gssize
 nice_input_stream_read(GInputStream *stream, void *buffer, gsize count,
                        GCancellable *cancellable, GError **error) {
@@ -301,6 +370,10 @@ nice_input_stream_read(GInputStream *stream, void *buffer, gsize count,
         return 0;
     }
 
+    if (priv->channel_id != 0)
+        return nice_input_stream_read_channel(stream, buffer, count, cancellable,
+                                              error);
+
     /* Has the agent disappeared? */
     agent = g_weak_ref_get(&priv->agent_ref);
     if (agent == NULL) {
@@ -324,6 +397,10 @@ nice_input_stream_close(GInputStream *stream, GCancellable *cancellable,
     NiceComponent *component = NULL;
     NiceAgent *agent; /* owned */
 
+    /* Channels can only be ended by their sender. */
+    if (priv->channel_id != 0)
+        return TRUE;
+
     /* Has the agent disappeared? */
     agent = g_weak_ref_get(&priv->agent_ref);
     if (agent == NULL)
@@ -362,6 +439,13 @@ nice_input_stream_is_readable(GPollableInputStream *stream) {
     if (agent == NULL)
         return FALSE;
 
+    if (priv->channel_id != 0) {
+        retval = agent_channel_check(agent, priv->stream_id, priv->component_id,
+                                     priv->channel_id, G_IO_IN);
+        g_object_unref(agent);
+        return retval;
+    }
+
     agent_lock(agent);
 
     if (!agent_find_component(agent, priv->stream_id, priv->component_id,
@@ -374,7 +458,7 @@ nice_input_stream_is_readable(GPollableInputStream *stream) {
     /* If it’s a reliable agent, see if there’s any pending data in the pseudo-TCP
    * buffer. */
     if (agent->reliable &&
-        pseudo_tcp_socket_get_available_bytes(component->tcp) > 0) {
+        nice_component_reliable_get_available_bytes(component) > 0) {
         retval = TRUE;
         goto done;
     }
@@ -418,8 +502,12 @@ nice_input_stream_read_nonblocking(GPollableInputStream *stream, void *buffer,
         return -1;
     }
 
-    len = nice_agent_recv_nonblocking(agent, priv->stream_id,
-                                      priv->component_id, (guint8 *) buffer, count, NULL, error);
+    if (priv->channel_id != 0)
+        len = agent_channel_recv(agent, priv->stream_id, priv->component_id,
+                                 priv->channel_id, buffer, count, error);
+    else
+        len = nice_agent_recv_nonblocking(agent, priv->stream_id,
+                                          priv->component_id, (guint8 *) buffer, count, NULL, error);
 
     g_object_unref(agent);
 
@@ -445,6 +533,22 @@ nice_input_stream_create_source(GPollableInputStream *stream,
     component_source = nice_component_input_source_new(agent, priv->stream_id,
                                                        priv->component_id, stream, cancellable);
 
+    /* Another reader of the component may have received data for the
+   * channel. */
+    if (priv->channel_id != 0) {
+        GCancellable *readable = agent_channel_dup_cancellable(agent,
+                                                               priv->stream_id, priv->component_id, priv->channel_id, G_IO_IN);
+
+        if (readable) {
+            GSource *readable_source = g_cancellable_source_new(readable);
+
+            g_source_set_dummy_callback(readable_source);
+            g_source_add_child_source(component_source, readable_source);
+            g_source_unref(readable_source);
+            g_object_unref(readable);
+        }
+    }
+
     g_object_unref(agent);
 
     return component_source;
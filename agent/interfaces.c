@@ -74,6 +74,11 @@
 #endif
 #include <arpa/inet.h>
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
 #endif /* G_OS_UNIX */
 
 #ifdef IGNORED_IFACE_PREFIX
@@ -429,8 +434,8 @@ get_local_if_index_by_addr_ioctl(NiceAddress *addr) {
 
 #ifdef HAVE_GETIFADDRS
 
-GList *
-nice_interfaces_get_local_ips(gboolean include_loopback) {
+static GList *
+get_local_ips_uncached(gboolean include_loopback) {
     GList *ips = NULL;
     struct ifaddrs *ifa, *results;
     int sockfd = -1;
@@ -555,7 +560,8 @@ nice_interfaces_get_local_ips(gboolean include_loopback) {
     return ips;
 }
 
-guint nice_interfaces_get_if_index_by_addr(NiceAddress *addr) {
+static guint
+get_if_index_by_addr_uncached(NiceAddress *addr) {
     struct ifaddrs *ifa, *results;
     guint if_index = 0;
 
@@ -597,18 +603,277 @@ guint nice_interfaces_get_if_index_by_addr(NiceAddress *addr) {
 
 #else /* ! HAVE_GETIFADDRS */
 
-GList *
-nice_interfaces_get_local_ips(gboolean include_loopback) {
+static GList *
+get_local_ips_uncached(gboolean include_loopback) {
     return get_local_ips_ioctl(include_loopback);
 }
 
 
-guint nice_interfaces_get_if_index_by_addr(NiceAddress *addr) {
+static guint
+get_if_index_by_addr_uncached(NiceAddress *addr) {
     return get_local_if_index_by_addr_ioctl(addr);
 }
 
 #endif /* HAVE_GETIFADDRS */
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+
+/* Enumerating the interfaces takes several system calls, and is done for
+ * every stream gathered and every socket created. The results are kept
+ * process-wide until rtnetlink reports that a link or an address changed.
+ * The same subscription wakes up the watches of all the agents, whichever
+ * of them or of the lookups reads the notification first. */
+
+typedef struct {
+    NiceAddress addr;
+    guint if_index;
+} CachedIfIndex;
+
+static GMutex interfaces_cache_mutex;
+static gint interfaces_cache_fd = -2; /* -2 until opened, -1 if unavailable */
+static GList *cached_local_ips[2];    /* indexed by include_loopback */
+static gboolean cached_local_ips_valid[2];
+static GSList *cached_if_indexes;     /* of CachedIfIndex */
+static guint interfaces_generation;   /* bumped on every change */
+static GSList *interfaces_watches;    /* of InterfacesWatchSource */
+
+typedef struct {
+    GSource source;
+    GPollFD pollfd;
+    guint generation; /* last generation dispatched */
+} InterfacesWatchSource;
+
+static gint
+netlink_open(void) {
+    struct sockaddr_nl snl;
+    gint fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                NETLINK_ROUTE);
+    if (fd < 0) {
+        nice_debug("Could not open rtnetlink socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if (bind(fd, (struct sockaddr *) &snl, sizeof(snl)) < 0) {
+        nice_debug("Could not subscribe to rtnetlink: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Reads every pending notification, and returns TRUE if there was any. The
+ * notifications are not parsed: they are only sent for links and addresses,
+ * which both affect the enumeration. */
+static gboolean
+netlink_drain(gint fd) {
+    gchar buf[8192];
+    gboolean changed = FALSE;
+
+    for (;;) {
+        gssize len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+        if (len > 0) {
+            changed = TRUE;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0 && errno == ENOBUFS) {
+            /* The queue overflowed and notifications were lost. */
+            changed = TRUE;
+        } else {
+            break;
+        }
+    }
+
+    return changed;
+}
+
+/* Must be called with the cache lock held. Returns FALSE if the cache can't
+ * be used because there is no way to know when it goes stale. */
+static gboolean
+interfaces_cache_validate(void) {
+    GSList *l;
+    guint i;
+
+    if (interfaces_cache_fd == -2)
+        interfaces_cache_fd = netlink_open();
+    if (interfaces_cache_fd < 0)
+        return FALSE;
+
+    if (!netlink_drain(interfaces_cache_fd))
+        return TRUE;
+
+    nice_debug("Network interfaces changed, flushing the cache");
+    for (i = 0; i < G_N_ELEMENTS(cached_local_ips); i++) {
+        g_list_free_full(cached_local_ips[i], g_free);
+        cached_local_ips[i] = NULL;
+        cached_local_ips_valid[i] = FALSE;
+    }
+    g_slist_free_full(cached_if_indexes, g_free);
+    cached_if_indexes = NULL;
+
+    /* The watches in other contexts won't see the notification on the
+     * socket any more, so they are woken up explicitly. */
+    interfaces_generation++;
+    for (l = interfaces_watches; l; l = l->next)
+        g_source_set_ready_time(l->data, 0);
+
+    return TRUE;
+}
+
+GList *
+nice_interfaces_get_local_ips(gboolean include_loopback) {
+    guint i = include_loopback ? 1 : 0;
+    GList *ips;
+
+    g_mutex_lock(&interfaces_cache_mutex);
+
+    if (!interfaces_cache_validate()) {
+        g_mutex_unlock(&interfaces_cache_mutex);
+        return get_local_ips_uncached(include_loopback);
+    }
+
+    if (!cached_local_ips_valid[i]) {
+        cached_local_ips[i] = get_local_ips_uncached(include_loopback);
+        cached_local_ips_valid[i] = TRUE;
+    }
+    ips = g_list_copy_deep(cached_local_ips[i], (GCopyFunc) g_strdup, NULL);
+
+    g_mutex_unlock(&interfaces_cache_mutex);
+
+    return ips;
+}
+
+guint nice_interfaces_get_if_index_by_addr(NiceAddress *addr) {
+    CachedIfIndex *entry;
+    GSList *i;
+    guint if_index;
+
+    g_mutex_lock(&interfaces_cache_mutex);
+
+    if (!interfaces_cache_validate()) {
+        g_mutex_unlock(&interfaces_cache_mutex);
+        return get_if_index_by_addr_uncached(addr);
+    }
+
+    for (i = cached_if_indexes; i; i = i->next) {
+        entry = i->data;
+
+        if (nice_address_equal_no_port(&entry->addr, addr)) {
+            if_index = entry->if_index;
+            g_mutex_unlock(&interfaces_cache_mutex);
+            return if_index;
+        }
+    }
+
+    if_index = get_if_index_by_addr_uncached(addr);
+
+    entry = g_new(CachedIfIndex, 1);
+    entry->addr = *addr;
+    entry->if_index = if_index;
+    cached_if_indexes = g_slist_prepend(cached_if_indexes, entry);
+
+    g_mutex_unlock(&interfaces_cache_mutex);
+
+    return if_index;
+}
+
+static gboolean
+interfaces_watch_prepare(GSource *source, gint *timeout) {
+    *timeout = -1;
+    return FALSE;
+}
+
+static gboolean
+interfaces_watch_check(GSource *source) {
+    InterfacesWatchSource *watch = (InterfacesWatchSource *) source;
+
+    return watch->pollfd.revents != 0;
+}
+
+static gboolean
+interfaces_watch_dispatch(GSource *source, GSourceFunc callback,
+                          gpointer user_data) {
+    InterfacesWatchSource *watch = (InterfacesWatchSource *) source;
+    gboolean changed;
+
+    g_source_set_ready_time(source, -1);
+
+    g_mutex_lock(&interfaces_cache_mutex);
+    interfaces_cache_validate();
+    changed = watch->generation != interfaces_generation;
+    watch->generation = interfaces_generation;
+    g_mutex_unlock(&interfaces_cache_mutex);
+
+    if (!changed || callback == NULL)
+        return G_SOURCE_CONTINUE;
+
+    return callback(user_data);
+}
+
+static void
+interfaces_watch_finalize(GSource *source) {
+    g_mutex_lock(&interfaces_cache_mutex);
+    interfaces_watches = g_slist_remove(interfaces_watches, source);
+    g_mutex_unlock(&interfaces_cache_mutex);
+}
+
+static GSourceFuncs interfaces_watch_funcs = {
+        interfaces_watch_prepare,
+        interfaces_watch_check,
+        interfaces_watch_dispatch,
+        interfaces_watch_finalize,
+};
+
+GSource *
+nice_interfaces_watch_source_new(void) {
+    InterfacesWatchSource *watch;
+    GSource *source;
+
+    g_mutex_lock(&interfaces_cache_mutex);
+
+    if (!interfaces_cache_validate()) {
+        g_mutex_unlock(&interfaces_cache_mutex);
+        return NULL;
+    }
+
+    source = g_source_new(&interfaces_watch_funcs,
+                          sizeof(InterfacesWatchSource));
+    watch = (InterfacesWatchSource *) source;
+    watch->pollfd.fd = interfaces_cache_fd;
+    watch->pollfd.events = G_IO_IN | G_IO_ERR | G_IO_HUP;
+    watch->generation = interfaces_generation;
+    g_source_add_poll(source, &watch->pollfd);
+    interfaces_watches = g_slist_prepend(interfaces_watches, source);
+
+    g_mutex_unlock(&interfaces_cache_mutex);
+
+    return source;
+}
+
+#else /* ! HAVE_LINUX_RTNETLINK_H */
+
+GList *
+nice_interfaces_get_local_ips(gboolean include_loopback) {
+    return get_local_ips_uncached(include_loopback);
+}
+
+guint nice_interfaces_get_if_index_by_addr(NiceAddress *addr) {
+    return get_if_index_by_addr_uncached(addr);
+}
+
+GSource *
+nice_interfaces_watch_source_new(void) {
+    return NULL;
+}
+
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
 gchar *
 nice_interfaces_get_ip_for_interface(gchar *interface_name) {
     struct ifreq ifr;
@@ -923,6 +1188,11 @@ out:
     return if_index;
 }
 
+GSource *
+nice_interfaces_watch_source_new(void) {
+    return NULL;
+}
+
 
 #else /* G_OS_WIN32 */
 #error Can not use this method for retreiving ip list from OS other than unix or windows
@@ -73,12 +73,14 @@ enum {
     PROP_AGENT = 1,
     PROP_STREAM_ID,
     PROP_COMPONENT_ID,
+    PROP_CHANNEL_ID,
 };
 
 struct _NiceIOStreamPrivate {
     GWeakRef /*<NiceAgent>*/ agent_ref;
     guint stream_id;
     guint component_id;
+    guint channel_id;
 
     GInputStream *input_stream;   /* owned */
     GOutputStream *output_stream; /* owned */
@@ -159,6 +161,22 @@ nice_io_stream_class_init(NiceIOStreamClass *klass) {
                                             0, G_MAXUINT,
                                             0,
                                             G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /*
+   * NiceIOStream:channel-id:
+   *
+   * Reliable channel of the component to use, or 0 for the component itself.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(gobject_class, PROP_CHANNEL_ID,
+                                    g_param_spec_uint(
+                                            "channel-id",
+                                            "Component’s channel ID",
+                                            "The reliable channel of the component to wrap.",
+                                            0, G_MAXUINT16,
+                                            0,
+                                            G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -171,6 +189,7 @@ nice_io_stream_init(NiceIOStream *self) {
     /* Invalidate the stream/component IDs to begin with. */
     self->priv->stream_id = 0;
     self->priv->component_id = 0;
+    self->priv->channel_id = 0;
 }
 
 static void
@@ -220,6 +239,9 @@ nice_io_stream_get_property(GObject *object, guint prop_id,
         case PROP_COMPONENT_ID:
             g_value_set_uint(value, self->priv->component_id);
             break;
+        case PROP_CHANNEL_ID:
+            g_value_set_uint(value, self->priv->channel_id);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -249,6 +271,10 @@ nice_io_stream_set_property(GObject *object, guint prop_id,
             /* Construct only. */
             self->priv->component_id = g_value_get_uint(value);
             break;
+        case PROP_CHANNEL_ID:
+            /* Construct only. */
+            self->priv->channel_id = g_value_get_uint(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -294,8 +320,12 @@ nice_io_stream_get_input_stream(GIOStream *stream) {
         /* Note that agent may be NULL here. NiceInputStream must support
      * construction with a NULL agent. */
         agent = g_weak_ref_get(&self->priv->agent_ref);
-        self->priv->input_stream = G_INPUT_STREAM(nice_input_stream_new(
-                agent, self->priv->stream_id, self->priv->component_id));
+        self->priv->input_stream = g_object_new(NICE_TYPE_INPUT_STREAM,
+                                                "agent", agent,
+                                                "stream-id", self->priv->stream_id,
+                                                "component-id", self->priv->component_id,
+                                                "channel-id", self->priv->channel_id,
+                                                NULL);
         if (agent != NULL)
             g_object_unref(agent);
     }
@@ -317,6 +347,7 @@ nice_io_stream_get_output_stream(GIOStream *stream) {
                                                  "agent", agent,
                                                  "stream-id", self->priv->stream_id,
                                                  "component-id", self->priv->component_id,
+                                                 "channel-id", self->priv->channel_id,
                                                  NULL);
 
         if (agent != NULL)
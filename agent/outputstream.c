@@ -58,6 +58,11 @@
  * stream/component pair. Any calls to g_output_stream_write() before then will
  * return %G_IO_ERROR_BROKEN_PIPE.
  *
+ * With #NiceAgent:reliable-channels, a #NiceOutputStream may instead write to
+ * a single channel of the component, see nice_agent_get_channel_io_stream().
+ * Data written to a channel is queued until the connection is up, and closing
+ * the stream ends the channel rather than the component.
+ *
  * Since: 0.1.5
  */
 
@@ -84,12 +89,14 @@ enum {
     PROP_AGENT = 1,
     PROP_STREAM_ID,
     PROP_COMPONENT_ID,
+    PROP_CHANNEL_ID,
 };
 
 struct _NiceOutputStreamPrivate {
     GWeakRef /*<NiceAgent>*/ agent_ref;
     guint stream_id;
     guint component_id;
+    guint channel_id;
 
     GCancellable *closed_cancellable;
 };
@@ -177,6 +184,23 @@ nice_output_stream_class_init(NiceOutputStreamClass *klass) {
                                             0, G_MAXUINT,
                                             0,
                                             G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /***
+   * NiceOutputStream:channel-id:
+   *
+   * Reliable channel of the component to write to, or 0 for the component
+   * itself. See #NiceAgent:reliable-channels.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(gobject_class, PROP_CHANNEL_ID,
+                                    g_param_spec_uint(
+                                            "channel-id",
+                                            "Component’s channel ID",
+                                            "The reliable channel of the component to wrap.",
+                                            0, G_MAXUINT16,
+                                            0,
+                                            G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -217,6 +241,9 @@ nice_output_stream_get_property(GObject *object, guint prop_id,
         case PROP_COMPONENT_ID:
             g_value_set_uint(value, self->priv->component_id);
             break;
+        case PROP_CHANNEL_ID:
+            g_value_set_uint(value, self->priv->channel_id);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -252,6 +279,10 @@ nice_output_stream_set_property(GObject *object, guint prop_id,
             /* Construct only. */
             self->priv->component_id = g_value_get_uint(value);
             break;
+        case PROP_CHANNEL_ID:
+            /* Construct only. */
+            self->priv->channel_id = g_value_get_uint(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -349,6 +380,45 @@ reliable_transport_writeable_cb(NiceAgent *agent, guint stream_id,
     g_mutex_unlock(&write_data->mutex);
 }
 
+/* Channels have their own writability, so they block on their pollable source
+ * rather than on #NiceAgent::reliable-transport-writable. */
+static gssize
+nice_output_stream_write_channel(GOutputStream *stream, const void *buffer,
+                                 gsize count, GCancellable *cancellable, GError **error) {
+    GPollableOutputStream *pollable = G_POLLABLE_OUTPUT_STREAM(stream);
+    GMainContext *context = g_main_context_new();
+    gssize len;
+
+    for (;;) {
+        GError *child_error = NULL;
+        GSource *source;
+
+        len = nice_output_stream_write_nonblocking(pollable, buffer, count,
+                                                   &child_error);
+        if (len >= 0 || !g_error_matches(child_error, G_IO_ERROR,
+                                         G_IO_ERROR_WOULD_BLOCK)) {
+            if (child_error)
+                g_propagate_error(error, child_error);
+            break;
+        }
+        g_clear_error(&child_error);
+
+        if (g_cancellable_set_error_if_cancelled(cancellable, error))
+            break;
+
+        source = nice_output_stream_create_source(pollable, cancellable);
+        g_source_set_dummy_callback(source);
+        g_source_attach(source, context);
+        g_main_context_iteration(context, TRUE);
+        g_source_destroy(source);
+        g_source_unref(source);
+    }
+
+    g_main_context_unref(context);
+
+    return len;
+}
+
 static gssize
 nice_output_stream_write(GOutputStream *stream, const void *buffer, gsize count,
                          GCancellable *cancellable, GError **error) {
@@ -380,6 +450,12 @@ nice_output_stream_write(GOutputStream *stream, const void *buffer, gsize count,
         return 0;
     }
 
+    if (self->priv->channel_id != 0) {
+        g_object_unref(agent);
+        return nice_output_stream_write_channel(stream, buffer, count,
+                                                cancellable, error);
+    }
+
     /* FIXME: nice_agent_send() is non-blocking, which is a bit unexpected
    * since nice_agent_recv() is blocking. Currently this uses a fairly dodgy
    * GCond solution; would be much better for nice_agent_send() to block
@@ -469,6 +545,13 @@ nice_output_stream_close(GOutputStream *stream, GCancellable *cancellable,
     if (agent == NULL)
         return TRUE;
 
+    if (priv->channel_id != 0) {
+        agent_channel_close(agent, priv->stream_id, priv->component_id,
+                            priv->channel_id);
+        g_object_unref(agent);
+        return TRUE;
+    }
+
     agent_lock(agent);
 
     /* Shut down the write side of the TCP stream. */
@@ -501,6 +584,13 @@ nice_output_stream_is_writable(GPollableOutputStream *stream) {
     if (agent == NULL)
         return FALSE;
 
+    if (priv->channel_id != 0) {
+        retval = agent_channel_check(agent, priv->stream_id, priv->component_id,
+                                     priv->channel_id, G_IO_OUT);
+        g_object_unref(agent);
+        return retval;
+    }
+
     agent_lock(agent);
 
     if (!agent_find_component(agent, priv->stream_id, priv->component_id,
@@ -515,7 +605,9 @@ nice_output_stream_is_writable(GPollableOutputStream *stream) {
         /* If it’s a reliable agent, see if there’s any space in the pseudo-TCP
      * output buffer. */
         if (!nice_socket_is_reliable(sockptr)) {
-            retval = pseudo_tcp_socket_can_send(component->tcp);
+            retval = component->mux ?
+                     nice_component_reliable_get_available_send_space(component) > 0 :
+                     pseudo_tcp_socket_can_send(component->tcp);
         } else {
             retval = (g_socket_condition_check(sockptr->fileno, G_IO_OUT) != 0);
         }
@@ -556,6 +648,12 @@ nice_output_stream_write_nonblocking(GPollableOutputStream *stream,
         goto done;
     }
 
+    if (priv->channel_id != 0) {
+        n_sent = agent_channel_send(agent, priv->stream_id, priv->component_id,
+                                    priv->channel_id, buffer, count, error);
+        goto done;
+    }
+
     n_sent = nice_agent_send(agent, priv->stream_id, priv->component_id,
                              count, buffer);
 
@@ -570,6 +668,52 @@ done:
     return n_sent;
 }
 
+/* Channels also need incoming acknowledgements and window updates to be
+ * processed before they become writable, so their sources wake up on the
+ * sockets of the component too. */
+static GSource *
+nice_output_stream_create_channel_source(GPollableOutputStream *stream,
+                                         GCancellable *cancellable) {
+    NiceOutputStreamPrivate *priv = NICE_OUTPUT_STREAM(stream)->priv;
+    GSource *component_source;
+    GCancellable *writable = NULL;
+    NiceAgent *agent; /* owned */
+
+    agent = g_weak_ref_get(&priv->agent_ref);
+
+    /* Closed streams cannot have sources. */
+    if (agent == NULL || g_output_stream_is_closed(G_OUTPUT_STREAM(stream))) {
+        component_source = g_pollable_source_new(G_OBJECT(stream));
+        if (cancellable) {
+            GSource *cancellable_source = g_cancellable_source_new(cancellable);
+
+            g_source_set_dummy_callback(cancellable_source);
+            g_source_add_child_source(component_source, cancellable_source);
+            g_source_unref(cancellable_source);
+        }
+        g_clear_object(&agent);
+        return component_source;
+    }
+
+    component_source = nice_component_output_source_new(agent, priv->stream_id,
+                                                        priv->component_id, stream, cancellable);
+
+    writable = agent_channel_dup_cancellable(agent, priv->stream_id,
+                                             priv->component_id, priv->channel_id, G_IO_OUT);
+    if (writable) {
+        GSource *writable_source = g_cancellable_source_new(writable);
+
+        g_source_set_dummy_callback(writable_source);
+        g_source_add_child_source(component_source, writable_source);
+        g_source_unref(writable_source);
+        g_object_unref(writable);
+    }
+
+    g_object_unref(agent);
+
+    return component_source;
+}
+
 static GSource *
 nice_output_stream_create_source(GPollableOutputStream *stream,
                                  GCancellable *cancellable) {
@@ -579,6 +723,9 @@ nice_output_stream_create_source(GPollableOutputStream *stream,
     NiceStream *_stream = NULL;
     NiceAgent *agent; /* owned */
 
+    if (priv->channel_id != 0)
+        return nice_output_stream_create_channel_source(stream, cancellable);
+
     component_source = g_pollable_source_new(G_OBJECT(stream));
 
     if (cancellable) {
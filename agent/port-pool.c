@@ -0,0 +1,239 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "port-pool.h"
+
+typedef struct {
+    NiceSocketType type;
+    NiceAddress addr; /* without port */
+    guint min_port, max_port;
+    guint n_words;
+    guint32 *leased;  /* open sockets of this process, and the padding bits */
+    guint32 *busy;    /* failed to bind since @busy_reset */
+    guint n_leased;
+    guint cursor;     /* offset of the next port to try */
+    gint64 busy_reset;
+} PortRange;
+
+static GMutex port_pool_mutex;
+static GSList *port_ranges; /* of PortRange */
+
+static void
+port_range_free(PortRange *range) {
+    g_free(range->leased);
+    g_free(range->busy);
+    g_slice_free(PortRange, range);
+}
+
+static PortRange *
+port_range_new(NiceSocketType type, const NiceAddress *addr,
+               guint min_port, guint max_port, gint64 now) {
+    PortRange *range = g_slice_new0(PortRange);
+    guint n_ports = max_port - min_port + 1;
+
+    range->type = type;
+    range->addr = *addr;
+    nice_address_set_port(&range->addr, 0);
+    range->min_port = min_port;
+    range->max_port = max_port;
+    range->n_words = (n_ports + 31) / 32;
+    range->leased = g_new0(guint32, range->n_words);
+    range->busy = g_new0(guint32, range->n_words);
+    range->cursor = g_random_int_range(0, n_ports);
+    range->busy_reset = now;
+
+    /* The bits past the end of the range are never free. */
+    if (n_ports % 32)
+        range->leased[range->n_words - 1] = ~0U << (n_ports % 32);
+
+    return range;
+}
+
+/* Drops the ranges which no longer hold anything worth remembering. */
+static void
+port_pool_expire(gint64 now) {
+    GSList *i = port_ranges;
+
+    while (i) {
+        PortRange *range = i->data;
+        GSList *next = i->next;
+
+        if (range->n_leased == 0 &&
+            now - range->busy_reset >= NICE_PORT_POOL_BUSY_TIMEOUT) {
+            port_ranges = g_slist_delete_link(port_ranges, i);
+            port_range_free(range);
+        }
+        i = next;
+    }
+}
+
+static PortRange *
+port_pool_find_range(NiceSocketType type, const NiceAddress *addr,
+                     guint min_port, guint max_port) {
+    GSList *i;
+
+    for (i = port_ranges; i; i = i->next) {
+        PortRange *range = i->data;
+
+        if (range->type == type && range->min_port == min_port &&
+            range->max_port == max_port &&
+            nice_address_equal_no_port(&range->addr, addr))
+            return range;
+    }
+
+    return NULL;
+}
+
+/* Returns the offset of the first free port at or after the cursor, wrapping
+ * around at the end of the range, or -1 if there is none. */
+static gint
+port_range_find_free(PortRange *range) {
+    guint start = range->cursor / 32;
+    guint32 start_mask = ~0U << (range->cursor % 32);
+    guint i;
+
+    for (i = 0; i <= range->n_words; i++) {
+        guint w = (start + i) % range->n_words;
+        guint32 free_bits = ~(range->leased[w] | range->busy[w]);
+
+        if (i == 0)
+            free_bits &= start_mask;
+        else if (i == range->n_words)
+            free_bits &= ~start_mask;
+
+        if (free_bits)
+            return w * 32 + g_bit_nth_lsf(free_bits, -1);
+    }
+
+    return -1;
+}
+
+/* Release hook of the sockets handed out by the pool, giving their port back
+ * to the ranges which leased it. */
+static void
+port_pool_release(NiceSocket *sock) {
+    NiceAddress *addr = &sock->addr;
+    NiceSocketType type = sock->type;
+    guint port = nice_address_get_port(addr);
+    GSList *i;
+
+    g_mutex_lock(&port_pool_mutex);
+
+    for (i = port_ranges; i; i = i->next) {
+        PortRange *range = i->data;
+        guint offset = port - range->min_port;
+        guint32 bit = 1U << (offset % 32);
+
+        if (range->type != type || port < range->min_port ||
+            port > range->max_port ||
+            !nice_address_equal_no_port(&range->addr, addr))
+            continue;
+
+        if (range->leased[offset / 32] & bit) {
+            range->leased[offset / 32] &= ~bit;
+            range->n_leased--;
+        }
+    }
+
+    g_mutex_unlock(&port_pool_mutex);
+}
+
+NiceSocket *
+nice_port_pool_acquire(NiceSocketType type, const NiceAddress *addr,
+                       guint min_port, guint max_port,
+                       NicePortPoolBindFunc bind_func, gpointer user_data,
+                       GError **error) {
+    PortRange *range;
+    NiceAddress bind_addr = *addr;
+    NiceSocket *sock = NULL;
+    GError *local_error = NULL;
+    gint64 now = g_get_monotonic_time();
+    gint offset;
+
+    g_return_val_if_fail(min_port > 0 && min_port <= max_port, NULL);
+
+    g_mutex_lock(&port_pool_mutex);
+
+    port_pool_expire(now);
+    range = port_pool_find_range(type, addr, min_port, max_port);
+    if (range == NULL) {
+        range = port_range_new(type, addr, min_port, max_port, now);
+        port_ranges = g_slist_prepend(port_ranges, range);
+    } else if (now - range->busy_reset >= NICE_PORT_POOL_BUSY_TIMEOUT) {
+        memset(range->busy, 0, range->n_words * sizeof(guint32));
+        range->busy_reset = now;
+    }
+
+    /* Binding with the lock held keeps two agents of this process from
+     * racing for the same port. */
+    while ((offset = port_range_find_free(range)) >= 0) {
+        guint32 bit = 1U << (offset % 32);
+
+        range->cursor = (offset + 1) % (max_port - min_port + 1);
+        nice_address_set_port(&bind_addr, min_port + offset);
+        sock = bind_func(&bind_addr, user_data, &local_error);
+        if (sock) {
+            sock->release = port_pool_release;
+            range->leased[offset / 32] |= bit;
+            range->n_leased++;
+            break;
+        }
+
+        if (!g_error_matches(local_error, G_IO_ERROR,
+                             G_IO_ERROR_ADDRESS_IN_USE) &&
+            !g_error_matches(local_error, G_IO_ERROR,
+                             G_IO_ERROR_PERMISSION_DENIED)) {
+            /* Not a problem of this port, the others would fail as well. */
+            break;
+        }
+
+        range->busy[offset / 32] |= bit;
+        g_clear_error(&local_error);
+    }
+
+    g_mutex_unlock(&port_pool_mutex);
+
+    if (local_error) {
+        g_propagate_error(error, local_error);
+    } else if (sock == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "No free port between %u and %u", min_port, max_port);
+    }
+
+    return sock;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifndef __LIBNICE_PORT_POOL_H__
+#define __LIBNICE_PORT_POOL_H__
+
+/* Process-wide allocator for the ports of a local port range.
+ *
+ * Every (socket type, local address, port range) triple gets a bitmap of the
+ * ports handed out to sockets of this process and still open, and a bitmap
+ * of the ports which could not be bound when they were last tried, most
+ * likely because another process owns them. Neither kind of port is tried
+ * again until, respectively, its socket is freed or the busy bitmap expires,
+ * so gathering candidates on a mostly used range only pays for the binds
+ * which can succeed instead of walking the whole range every time. Ports are
+ * handed out in sequence from a random starting point. */
+
+#include <glib.h>
+
+#include "address.h"
+#include "socket/socket.h"
+
+G_BEGIN_DECLS
+
+/* How long a port which failed to bind is skipped, in microseconds. */
+#define NICE_PORT_POOL_BUSY_TIMEOUT (30 * G_USEC_PER_SEC)
+
+/* Creates a socket of the pool's type bound to @addr, whose port is set. */
+typedef NiceSocket *(*NicePortPoolBindFunc)(NiceAddress *addr,
+                                            gpointer user_data, GError **error);
+
+/* Binds a socket to a free port between @min_port and @max_port of @addr
+ * with @bind_func. Fails with %G_IO_ERROR_NO_SPACE if every port of the range
+ * is either in use by this process or known to be busy, or with the error of
+ * @bind_func if it failed for a reason which does not depend on the port.
+ * The port is given back to the range when the socket is freed. */
+NiceSocket *
+nice_port_pool_acquire(NiceSocketType type, const NiceAddress *addr,
+                       guint min_port, guint max_port,
+                       NicePortPoolBindFunc bind_func, gpointer user_data,
+                       GError **error);
+
+G_END_DECLS
+
+#endif /* __LIBNICE_PORT_POOL_H__ */
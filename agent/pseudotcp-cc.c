@@ -0,0 +1,547 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "pseudotcp-cc.h"
+
+//////////////////////////////////////////////////////////////////////
+// Pacing
+//////////////////////////////////////////////////////////////////////
+
+/* Window-based algorithms pace one window per smoothed round trip, with
+ * headroom so that pacing never limits the window growth: twice the rate in
+ * slow start, and 1.2 times afterwards (as Linux does). */
+static void
+window_update_pacing_rate(PseudoTcpCongestion *cc) {
+    guint64 rate;
+
+    if (cc->srtt == 0) {
+        cc->pacing_rate = 0;
+        return;
+    }
+
+    rate = (guint64) cc->cwnd * 1000 / cc->srtt;
+    if (cc->cwnd < cc->ssthresh / 2)
+        rate *= 2;
+    else
+        rate = rate * 6 / 5;
+
+    cc->pacing_rate = MIN(rate, G_MAXUINT32);
+}
+
+//////////////////////////////////////////////////////////////////////
+// NewReno (RFC 5681, RFC 6582)
+//////////////////////////////////////////////////////////////////////
+
+static void
+reno_init(PseudoTcpCongestion *cc, guint32 now) {
+    window_update_pacing_rate(cc);
+}
+
+static void
+reno_on_ack(PseudoTcpCongestion *cc, guint32 acked, guint32 in_flight,
+            gboolean in_recovery, guint32 now) {
+    if (in_recovery) {
+        /* Partial ACK: deflate the window by the amount of new data
+     * acknowledged, and add back one segment (RFC 6582, §3.2, step 5). */
+        cc->cwnd += (acked > cc->mss ? cc->mss : 0) - MIN(acked, cc->cwnd);
+    } else if (cc->cwnd < cc->ssthresh) {
+        // Slow start
+        cc->cwnd += cc->mss;
+    } else {
+        // Congestion avoidance
+        cc->cwnd += MAX(1, cc->mss * cc->mss / cc->cwnd);
+    }
+
+    window_update_pacing_rate(cc);
+}
+
+static void
+reno_on_dup_ack(PseudoTcpCongestion *cc, guint32 now) {
+    /* Each duplicate ACK means a segment has left the network. */
+    cc->cwnd += cc->mss;
+}
+
+static void
+reno_enter_recovery(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    cc->ssthresh = MAX(in_flight / 2, 2 * cc->mss);
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+    window_update_pacing_rate(cc);
+}
+
+static void
+reno_exit_recovery(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    cc->cwnd = MIN(cc->ssthresh, MAX(in_flight, cc->mss) + cc->mss);
+    window_update_pacing_rate(cc);
+}
+
+static void
+reno_on_timeout(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    cc->ssthresh = MAX(in_flight / 2, 2 * cc->mss);
+    cc->cwnd = cc->mss;
+    window_update_pacing_rate(cc);
+}
+
+static void
+reno_on_idle(PseudoTcpCongestion *cc, guint32 now) {
+    // Restart window (RFC 5681, §4.1)
+    cc->cwnd = cc->mss;
+    window_update_pacing_rate(cc);
+}
+
+static const PseudoTcpCongestionOps reno_ops = {
+    "reno",
+    reno_init,
+    reno_on_ack,
+    reno_on_dup_ack,
+    reno_enter_recovery,
+    reno_exit_recovery,
+    reno_on_timeout,
+    reno_on_idle,
+};
+
+//////////////////////////////////////////////////////////////////////
+// CUBIC (RFC 8312)
+//////////////////////////////////////////////////////////////////////
+
+/* Multiplicative decrease factor, in 1/1024ths (0.7). */
+#define CUBIC_BETA 717
+/* Scaling constant of the cubic function, in segments per second cubed. */
+#define CUBIC_C 0.4
+
+/* Avoids pulling in libm for cbrt(). */
+static gdouble
+cube_root(gdouble x) {
+    gdouble r = 1.0;
+    guint i;
+
+    if (x <= 0.0)
+        return 0.0;
+
+    while (r * r * r < x)
+        r *= 2.0;
+
+    for (i = 0; i < 8; i++)
+        r = (2.0 * r + x / (r * r)) / 3.0;
+
+    return r;
+}
+
+static void
+cubic_init(PseudoTcpCongestion *cc, guint32 now) {
+    window_update_pacing_rate(cc);
+}
+
+static void
+cubic_on_ack(PseudoTcpCongestion *cc, guint32 acked, guint32 in_flight,
+             gboolean in_recovery, guint32 now) {
+    PseudoTcpCubic *cubic = &cc->u.cubic;
+    gdouble t, target;
+
+    if (in_recovery || cc->cwnd < cc->ssthresh) {
+        reno_on_ack(cc, acked, in_flight, in_recovery, now);
+        return;
+    }
+
+    if (cubic->epoch_start == 0) {
+        cubic->epoch_start = MAX(now, 1);
+        cubic->w_est = cc->cwnd;
+        if (cc->cwnd < cubic->w_max) {
+            cubic->k = cube_root((gdouble) (cubic->w_max - cc->cwnd) /
+                                 cc->mss / CUBIC_C) *
+                       1000;
+            cubic->origin = cubic->w_max;
+        } else {
+            cubic->k = 0;
+            cubic->origin = cc->cwnd;
+        }
+    }
+
+    /* Window the cubic function reaches one round trip from now (§4.1). */
+    t = ((gdouble) (now - cubic->epoch_start + cc->srtt) - cubic->k) / 1000.0;
+    target = cubic->origin + CUBIC_C * t * t * t * cc->mss;
+    target = CLAMP(target, 0.0, 1.5 * cc->cwnd);
+
+    if (target > cc->cwnd)
+        cc->cwnd += (guint32) ((target - cc->cwnd) * acked / cc->cwnd);
+    else
+        cc->cwnd += MAX(1, (guint64) acked * cc->mss / (100 * (guint64) cc->cwnd));
+
+    /* Never grow slower than Reno would (§4.2). */
+    cubic->w_est += (guint64) acked * cc->mss * 3 * (1024 - CUBIC_BETA) /
+                    ((1024 + CUBIC_BETA) * (guint64) cc->cwnd);
+    if (cubic->w_est > cc->cwnd)
+        cc->cwnd = cubic->w_est;
+
+    window_update_pacing_rate(cc);
+}
+
+static void
+cubic_reduce(PseudoTcpCongestion *cc, guint32 in_flight) {
+    PseudoTcpCubic *cubic = &cc->u.cubic;
+    guint32 w = MAX(in_flight, 2 * cc->mss);
+
+    cubic->epoch_start = 0;
+
+    /* Fast convergence (§4.6): release bandwidth to newer flows. */
+    if (w < cubic->w_last_max) {
+        cubic->w_last_max = w;
+        cubic->w_max = (guint64) w * (1024 + CUBIC_BETA) / 2048;
+    } else {
+        cubic->w_last_max = cubic->w_max = w;
+    }
+
+    cc->ssthresh = MAX((guint64) w * CUBIC_BETA / 1024, 2 * cc->mss);
+}
+
+static void
+cubic_enter_recovery(PseudoTcpCongestion *cc, guint32 in_flight,
+                     guint32 now) {
+    cubic_reduce(cc, in_flight);
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+    window_update_pacing_rate(cc);
+}
+
+static void
+cubic_on_timeout(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    cubic_reduce(cc, in_flight);
+    cc->cwnd = cc->mss;
+    window_update_pacing_rate(cc);
+}
+
+static void
+cubic_on_idle(PseudoTcpCongestion *cc, guint32 now) {
+    cc->u.cubic.epoch_start = 0;
+    reno_on_idle(cc, now);
+}
+
+static const PseudoTcpCongestionOps cubic_ops = {
+    "cubic",
+    cubic_init,
+    cubic_on_ack,
+    reno_on_dup_ack,
+    cubic_enter_recovery,
+    reno_exit_recovery,
+    cubic_on_timeout,
+    cubic_on_idle,
+};
+
+//////////////////////////////////////////////////////////////////////
+// BBR-style model-based control
+//////////////////////////////////////////////////////////////////////
+
+/* This follows the structure of BBR (draft-cardwell-iccrg-bbr-congestion-
+ * control) on the information available to the socket: the bottleneck
+ * bandwidth is the maximum ACK rate measured over the last
+ * PSEUDO_TCP_BBR_BW_ROUNDS round trips, and the propagation delay the minimum
+ * RTT over BBR_MIN_RTT_WINDOW. The window is a multiple of their product, and
+ * the pacing rate a multiple of the bandwidth, cycling through the STARTUP,
+ * DRAIN, PROBE_BW and PROBE_RTT phases. Losses do not shrink the model. */
+
+enum {
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW,
+    BBR_PROBE_RTT,
+};
+
+#define BBR_UNIT 256
+#define BBR_HIGH_GAIN (BBR_UNIT * 2885 / 1000 + 1) /* 2/ln(2) */
+#define BBR_DRAIN_GAIN (BBR_UNIT * 1000 / 2885)
+#define BBR_CWND_GAIN (BBR_UNIT * 2)
+#define BBR_MIN_CWND_SEGMENTS 4
+#define BBR_MIN_RTT_WINDOW 10000 /* milliseconds */
+#define BBR_PROBE_RTT_TIME 200   /* milliseconds */
+#define BBR_FULL_BW_THRESH (BBR_UNIT * 5 / 4)
+#define BBR_FULL_BW_ROUNDS 3
+#define BBR_CYCLE_LEN 8
+
+static const guint32 bbr_pacing_gain[BBR_CYCLE_LEN] = {
+    BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4, BBR_UNIT, BBR_UNIT,
+    BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+
+static guint32
+bbr_max_bw(const PseudoTcpBbr *bbr) {
+    guint32 bw = 0;
+    guint i;
+
+    for (i = 0; i < PSEUDO_TCP_BBR_BW_ROUNDS; i++)
+        bw = MAX(bw, bbr->bw[i]);
+
+    return bw;
+}
+
+/* The window needed to fill the pipe at the estimated bandwidth, scaled by
+ * @gain; 0 until both parts of the model have been measured. */
+static guint32
+bbr_target_cwnd(PseudoTcpCongestion *cc, guint32 gain) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+    guint64 bdp;
+
+    if (bbr->min_rtt == 0 || bbr_max_bw(bbr) == 0)
+        return 0;
+
+    bdp = (guint64) bbr_max_bw(bbr) * bbr->min_rtt / 1000;
+    bdp = bdp * gain / BBR_UNIT + 3 * cc->mss;
+
+    return MIN(MAX(bdp, BBR_MIN_CWND_SEGMENTS * cc->mss), G_MAXUINT32);
+}
+
+static void
+bbr_set_mode(PseudoTcpCongestion *cc, guint8 mode, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+
+    bbr->mode = mode;
+
+    switch (mode) {
+        case BBR_STARTUP:
+            bbr->pacing_gain = BBR_HIGH_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_DRAIN:
+            bbr->pacing_gain = BBR_DRAIN_GAIN;
+            bbr->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_PROBE_BW:
+            /* Start cruising rather than probing, as the queue was just
+       * drained. */
+            bbr->cycle_index = 2;
+            bbr->cycle_stamp = now;
+            bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_index];
+            bbr->cwnd_gain = BBR_CWND_GAIN;
+            break;
+        case BBR_PROBE_RTT:
+            bbr->pacing_gain = BBR_UNIT;
+            bbr->cwnd_gain = BBR_UNIT;
+            bbr->probe_rtt_done = 0;
+            break;
+        default:
+            g_assert_not_reached();
+    }
+}
+
+static void
+bbr_update_pacing_rate(PseudoTcpCongestion *cc) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+    guint64 rate = bbr_max_bw(bbr);
+
+    /* Until the first bandwidth sample, pace the window over the RTT. */
+    if (rate == 0 && cc->srtt > 0)
+        rate = (guint64) cc->cwnd * 1000 / cc->srtt;
+
+    rate = rate * bbr->pacing_gain / BBR_UNIT;
+    cc->pacing_rate = MIN(rate, G_MAXUINT32);
+}
+
+static void
+bbr_init(PseudoTcpCongestion *cc, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+
+    bbr->round_start = now;
+    bbr->min_rtt_stamp = now;
+    bbr_set_mode(cc, BBR_STARTUP, now);
+    bbr_update_pacing_rate(cc);
+}
+
+/* Called once per round trip: take a bandwidth sample, and move through the
+ * state machine. */
+static void
+bbr_on_round(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+    guint32 elapsed = now - bbr->round_start;
+    guint32 bw;
+
+    bbr->bw[bbr->round_count % PSEUDO_TCP_BBR_BW_ROUNDS] =
+        MIN((guint64) bbr->round_delivered * 1000 / elapsed, G_MAXUINT32);
+    bbr->round_count++;
+    bbr->round_start = now;
+    bbr->round_delivered = 0;
+
+    /* The pipe is full once the bandwidth stops growing by 25% per round. */
+    bw = bbr_max_bw(bbr);
+    if (!bbr->full_bw_reached) {
+        if ((guint64) bw * BBR_UNIT >= (guint64) bbr->full_bw * BBR_FULL_BW_THRESH) {
+            bbr->full_bw = bw;
+            bbr->full_bw_count = 0;
+        } else if (++bbr->full_bw_count >= BBR_FULL_BW_ROUNDS) {
+            bbr->full_bw_reached = TRUE;
+        }
+    }
+
+    switch (bbr->mode) {
+        case BBR_STARTUP:
+            if (bbr->full_bw_reached)
+                bbr_set_mode(cc, BBR_DRAIN, now);
+            break;
+        case BBR_DRAIN:
+            if (in_flight <= bbr_target_cwnd(cc, BBR_UNIT))
+                bbr_set_mode(cc, BBR_PROBE_BW, now);
+            break;
+        case BBR_PROBE_BW:
+            if (now - bbr->cycle_stamp > bbr->min_rtt) {
+                bbr->cycle_index = (bbr->cycle_index + 1) % BBR_CYCLE_LEN;
+                bbr->cycle_stamp = now;
+                bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_index];
+            }
+            break;
+        case BBR_PROBE_RTT:
+        default:
+            break;
+    }
+}
+
+static void
+bbr_on_ack(PseudoTcpCongestion *cc, guint32 acked, guint32 in_flight,
+           gboolean in_recovery, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+    guint32 round_time;
+    gboolean min_rtt_expired;
+
+    /* Propagation delay. When the estimate has not been refreshed for
+   * BBR_MIN_RTT_WINDOW, drain the queue to measure it again. */
+    min_rtt_expired = (now - bbr->min_rtt_stamp > BBR_MIN_RTT_WINDOW);
+    if (cc->rtt > 0 &&
+        (bbr->min_rtt == 0 || cc->rtt <= bbr->min_rtt || min_rtt_expired)) {
+        bbr->min_rtt = cc->rtt;
+        bbr->min_rtt_stamp = now;
+    }
+
+    if (min_rtt_expired && bbr->mode != BBR_PROBE_RTT && !bbr->in_recovery) {
+        bbr->prior_cwnd = cc->cwnd;
+        bbr_set_mode(cc, BBR_PROBE_RTT, now);
+    }
+
+    bbr->round_delivered += acked;
+    round_time = bbr->min_rtt ? bbr->min_rtt : cc->srtt;
+    if (round_time > 0 && now - bbr->round_start >= round_time)
+        bbr_on_round(cc, in_flight, now);
+
+    if (bbr->mode == BBR_PROBE_RTT) {
+        cc->cwnd = MIN(cc->cwnd, BBR_MIN_CWND_SEGMENTS * cc->mss);
+
+        if (bbr->probe_rtt_done == 0 &&
+            in_flight <= BBR_MIN_CWND_SEGMENTS * cc->mss) {
+            bbr->probe_rtt_done = MAX(now + BBR_PROBE_RTT_TIME, 1);
+        } else if (bbr->probe_rtt_done != 0 &&
+                   (gint32) (now - bbr->probe_rtt_done) >= 0) {
+            bbr->min_rtt_stamp = now;
+            cc->cwnd = MAX(cc->cwnd, bbr->prior_cwnd);
+            bbr_set_mode(cc, bbr->full_bw_reached ? BBR_PROBE_BW : BBR_STARTUP,
+                         now);
+        }
+    } else if (!in_recovery && !bbr->in_recovery) {
+        guint32 target = bbr_target_cwnd(cc, bbr->cwnd_gain);
+
+        if (target == 0 || (!bbr->full_bw_reached && cc->cwnd < target))
+            cc->cwnd += acked;
+        else
+            cc->cwnd = MIN(cc->cwnd + acked, target);
+
+        cc->cwnd = MAX(cc->cwnd, BBR_MIN_CWND_SEGMENTS * cc->mss);
+    }
+
+    bbr_update_pacing_rate(cc);
+}
+
+static void
+bbr_enter_recovery(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+
+    /* Packet conservation for the first round of recovery; the window is then
+   * inflated by the duplicate ACKs as segments leave the network. */
+    bbr->in_recovery = TRUE;
+    bbr->prior_cwnd = MAX(bbr->prior_cwnd, cc->cwnd);
+    cc->cwnd = MAX(in_flight, BBR_MIN_CWND_SEGMENTS * cc->mss);
+}
+
+static void
+bbr_exit_recovery(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+
+    bbr->in_recovery = FALSE;
+    cc->cwnd = MAX(bbr->prior_cwnd, BBR_MIN_CWND_SEGMENTS * cc->mss);
+    bbr->prior_cwnd = 0;
+}
+
+static void
+bbr_on_timeout(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now) {
+    PseudoTcpBbr *bbr = &cc->u.bbr;
+
+    /* Start again from one segment; the model lets the window regrow within a
+   * round trip or so. */
+    bbr->in_recovery = FALSE;
+    bbr->prior_cwnd = MAX(bbr->prior_cwnd, cc->cwnd);
+    cc->cwnd = cc->mss;
+}
+
+static void
+bbr_on_idle(PseudoTcpCongestion *cc, guint32 now) {
+    /* Pacing at the estimated bandwidth makes a restart window unnecessary. */
+}
+
+static const PseudoTcpCongestionOps bbr_ops = {
+    "bbr",
+    bbr_init,
+    bbr_on_ack,
+    reno_on_dup_ack,
+    bbr_enter_recovery,
+    bbr_exit_recovery,
+    bbr_on_timeout,
+    bbr_on_idle,
+};
+
+//////////////////////////////////////////////////////////////////////
+
+void
+pseudo_tcp_congestion_set_algorithm(PseudoTcpCongestion *cc,
+                                    PseudoTcpCongestionControl algorithm,
+                                    guint32 now) {
+    switch (algorithm) {
+        case PSEUDO_TCP_CONGESTION_CONTROL_CUBIC:
+            cc->ops = &cubic_ops;
+            break;
+        case PSEUDO_TCP_CONGESTION_CONTROL_BBR:
+            cc->ops = &bbr_ops;
+            break;
+        case PSEUDO_TCP_CONGESTION_CONTROL_RENO:
+        default:
+            cc->ops = &reno_ops;
+            break;
+    }
+
+    cc->algorithm = algorithm;
+    memset(&cc->u, 0, sizeof(cc->u));
+    cc->ops->init(cc, now);
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef __LIBNICE_PSEUDOTCP_CC_H__
+#define __LIBNICE_PSEUDOTCP_CC_H__
+
+/* Congestion control for the pseudo-TCP socket.
+ *
+ * The socket owns the loss detection and recovery machinery (duplicate ACKs,
+ * NewReno partial ACKs, SACK and retransmission timeouts) and reports those
+ * events to the selected algorithm through a #PseudoTcpCongestionOps vtable.
+ * The algorithm owns the congestion window and slow start threshold, and
+ * computes the rate at which the window should be paced out. All times are in
+ * milliseconds of the socket clock, and all sizes in bytes. */
+
+#include <glib.h>
+
+#include "pseudotcp.h"
+
+G_BEGIN_DECLS
+
+typedef struct _PseudoTcpCongestion PseudoTcpCongestion;
+
+typedef struct {
+    const gchar *name;
+
+    /* Called when the algorithm is selected, with @cwnd and @ssthresh already
+   * set to their current values. */
+    void (*init)(PseudoTcpCongestion *cc, guint32 now);
+
+    /* @acked bytes were newly acknowledged, leaving @in_flight bytes
+   * outstanding. @in_recovery is set for the partial ACKs of fast recovery. */
+    void (*on_ack)(PseudoTcpCongestion *cc, guint32 acked, guint32 in_flight,
+                   gboolean in_recovery, guint32 now);
+
+    /* A further duplicate ACK arrived during fast recovery. */
+    void (*on_dup_ack)(PseudoTcpCongestion *cc, guint32 now);
+
+    /* Fast retransmit: a loss was detected with @in_flight bytes outstanding. */
+    void (*enter_recovery)(PseudoTcpCongestion *cc, guint32 in_flight,
+                           guint32 now);
+
+    /* Every segment outstanding when recovery started has been acknowledged. */
+    void (*exit_recovery)(PseudoTcpCongestion *cc, guint32 in_flight,
+                          guint32 now);
+
+    /* The retransmission timer expired with @in_flight bytes outstanding. */
+    void (*on_timeout)(PseudoTcpCongestion *cc, guint32 in_flight, guint32 now);
+
+    /* Nothing was sent for longer than the retransmission timeout. */
+    void (*on_idle)(PseudoTcpCongestion *cc, guint32 now);
+} PseudoTcpCongestionOps;
+
+/* Number of delivery rate samples (one per round trip) kept by BBR. */
+#define PSEUDO_TCP_BBR_BW_ROUNDS 10
+
+typedef struct {
+    guint32 w_max;       /* window just before the last reduction */
+    guint32 w_last_max;  /* previous value of @w_max, for fast convergence */
+    guint32 w_est;       /* window a Reno flow would have reached */
+    guint32 origin;      /* window at the plateau of the cubic function */
+    guint32 k;           /* time to reach @origin from the epoch start */
+    guint32 epoch_start; /* start of the current growth epoch, or 0 */
+} PseudoTcpCubic;
+
+typedef struct {
+    guint8 mode;
+    guint8 cycle_index;
+    guint8 full_bw_count;
+    gboolean full_bw_reached;
+    gboolean in_recovery;
+    guint32 full_bw;
+    guint32 bw[PSEUDO_TCP_BBR_BW_ROUNDS]; /* bytes per second */
+    guint32 round_count;
+    guint32 round_start;
+    guint32 round_delivered;
+    guint32 min_rtt;
+    guint32 min_rtt_stamp;
+    guint32 probe_rtt_done;
+    guint32 cycle_stamp;
+    guint32 prior_cwnd;
+    guint32 pacing_gain; /* in 1/256ths */
+    guint32 cwnd_gain;   /* in 1/256ths */
+} PseudoTcpBbr;
+
+struct _PseudoTcpCongestion {
+    const PseudoTcpCongestionOps *ops;
+    PseudoTcpCongestionControl algorithm;
+
+    /* Maintained by the socket. */
+    guint32 mss;
+    guint32 srtt;   /* smoothed round-trip time, or 0 if not measured yet */
+    guint32 rtt;    /* latest round-trip time sample, or 0 */
+
+    /* Maintained by the algorithm. */
+    guint32 cwnd, ssthresh;
+    guint32 pacing_rate; /* bytes per second, or 0 if unknown */
+
+    union {
+        PseudoTcpCubic cubic;
+        PseudoTcpBbr bbr;
+    } u;
+};
+
+void
+pseudo_tcp_congestion_set_algorithm(PseudoTcpCongestion *cc,
+                                    PseudoTcpCongestionControl algorithm,
+                                    guint32 now);
+
+G_END_DECLS
+
+#endif /* __LIBNICE_PSEUDOTCP_CC_H__ */
@@ -0,0 +1,639 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "pseudotcp-mux.h"
+
+#define FRAME_HEADER_SIZE 8
+
+typedef enum {
+    FRAME_DATA = 0,
+    FRAME_WINDOW = 1,
+    FRAME_FIN = 2,
+} FrameType;
+
+typedef struct _Channel {
+    guint16 id;
+    guint8 priority;
+    gboolean want_write;
+    gboolean readable_pending, writable_pending;
+    gboolean fin_queued, fin_sent;
+    gboolean fin_received, eof_seen;
+
+    GByteArray *send_buf;
+    guint send_off;
+    guint32 send_credit;   /* data the peer still accepts */
+
+    GByteArray *recv_buf;
+    guint recv_off;
+    guint32 recv_window;   /* data the peer may still send */
+    guint32 recv_consumed; /* data read since the last window update */
+    guint32 window_update; /* credit not yet granted to the peer */
+
+    /* Channel the peer opened with the same number after it forgot this one,
+     * which takes over once this one is forgotten too. */
+    struct _Channel *next;
+} Channel;
+
+struct _PseudoTcpMux {
+    PseudoTcpMuxCallbacks callbacks;
+
+    GPtrArray *channels;   /* of Channel, in creation order */
+    GHashTable *by_id;     /* channel number -> Channel of channels */
+    guint rr_next;         /* index of the next channel in round robin order */
+    gint error;
+    gboolean eof;
+    gboolean started;
+    gboolean flushing;
+
+    /* Frame being parsed */
+    guint8 rx_header[FRAME_HEADER_SIZE];
+    guint rx_header_len;
+    Channel *rx_channel;
+    guint32 rx_left;
+
+    /* Frame being written */
+    guint8 tx_frame[FRAME_HEADER_SIZE + PSEUDO_TCP_MUX_MAX_FRAME];
+    guint tx_off, tx_len;
+};
+
+static void
+channel_free(Channel *ch) {
+    if (ch->next)
+        channel_free(ch->next);
+    g_byte_array_unref(ch->send_buf);
+    g_byte_array_unref(ch->recv_buf);
+    g_slice_free(Channel, ch);
+}
+
+static Channel *
+channel_new(guint16 id) {
+    Channel *ch = g_slice_new0(Channel);
+
+    ch->id = id;
+    ch->send_buf = g_byte_array_new();
+    ch->send_credit = PSEUDO_TCP_MUX_WINDOW;
+    ch->recv_buf = g_byte_array_new();
+    ch->recv_window = PSEUDO_TCP_MUX_WINDOW;
+
+    return ch;
+}
+
+static Channel *
+channel_get(PseudoTcpMux *mux, guint16 id, gboolean create) {
+    Channel *ch;
+
+    ch = g_hash_table_lookup(mux->by_id, GUINT_TO_POINTER(id));
+    if (ch)
+        return ch;
+
+    if (!create || mux->channels->len >= PSEUDO_TCP_MUX_MAX_CHANNELS)
+        return NULL;
+
+    ch = channel_new(id);
+    g_ptr_array_add(mux->channels, ch);
+    g_hash_table_insert(mux->by_id, GUINT_TO_POINTER(id), ch);
+
+    return ch;
+}
+
+/* A channel is forgotten once it was closed both ways and the application saw
+ * its end, so that its number can be used again. If the peer already reopened
+ * it, the new channel takes its place. */
+static void
+channel_maybe_free(PseudoTcpMux *mux, Channel *ch) {
+    Channel *next = ch->next;
+    guint16 id = ch->id;
+    guint index;
+
+    if (!ch->fin_sent || !ch->eof_seen)
+        return;
+
+    if (!g_ptr_array_find(mux->channels, ch, &index))
+        return;
+
+    /* Keep the round robin on the channel which was next. */
+    if (index < mux->rr_next)
+        mux->rr_next--;
+
+    ch->next = NULL;
+    g_hash_table_remove(mux->by_id, GUINT_TO_POINTER(id));
+    g_ptr_array_remove_index(mux->channels, index);
+
+    if (next) {
+        g_ptr_array_add(mux->channels, next);
+        g_hash_table_insert(mux->by_id, GUINT_TO_POINTER(id), next);
+    }
+
+    mux->callbacks.channel_closed(mux, id, mux->callbacks.user_data);
+
+    if (next && (next->readable_pending || mux->eof)) {
+        next->readable_pending = FALSE;
+        mux->callbacks.channel_readable(mux, id, mux->callbacks.user_data);
+    }
+}
+
+static guint
+channel_queued(Channel *ch) {
+    return ch->send_buf->len - ch->send_off;
+}
+
+/* Drop @len bytes from the front of @buf, which starts at *@off. The array is
+ * only compacted once the dead space dominates, to keep the copies linear. */
+static void
+byte_array_advance(GByteArray *buf, guint *off, gsize len) {
+    *off += len;
+    if (*off == buf->len) {
+        g_byte_array_set_size(buf, 0);
+        *off = 0;
+    } else if (*off > 4096 && *off > buf->len / 2) {
+        g_byte_array_remove_range(buf, 0, *off);
+        *off = 0;
+    }
+}
+
+static void
+write_header(guint8 *header, FrameType type, guint16 channel, guint32 length) {
+    header[0] = type;
+    header[1] = 0;
+    header[2] = channel >> 8;
+    header[3] = channel;
+    header[4] = length >> 24;
+    header[5] = length >> 16;
+    header[6] = length >> 8;
+    header[7] = length;
+}
+
+PseudoTcpMux *
+pseudo_tcp_mux_new(const PseudoTcpMuxCallbacks *callbacks) {
+    PseudoTcpMux *mux = g_slice_new0(PseudoTcpMux);
+
+    mux->callbacks = *callbacks;
+    mux->channels = g_ptr_array_new_with_free_func((GDestroyNotify) channel_free);
+    mux->by_id = g_hash_table_new(NULL, NULL);
+
+    return mux;
+}
+
+void
+pseudo_tcp_mux_free(PseudoTcpMux *mux) {
+    g_hash_table_unref(mux->by_id);
+    g_ptr_array_unref(mux->channels);
+    g_slice_free(PseudoTcpMux, mux);
+}
+
+void
+pseudo_tcp_mux_start(PseudoTcpMux *mux) {
+    mux->started = TRUE;
+    pseudo_tcp_mux_flush(mux);
+}
+
+GBytes *
+pseudo_tcp_mux_take_send_queue(PseudoTcpMux *mux, guint16 channel) {
+    Channel *ch = channel_get(mux, channel, FALSE);
+    GBytes *bytes;
+
+    /* Nothing is serialized before the mux is started, so all of the data is
+   * still in the send queue. */
+    g_return_val_if_fail(!mux->started, NULL);
+
+    if (!ch || channel_queued(ch) == 0)
+        return NULL;
+
+    bytes = g_bytes_new(ch->send_buf->data + ch->send_off, channel_queued(ch));
+    g_byte_array_set_size(ch->send_buf, 0);
+    ch->send_off = 0;
+
+    return bytes;
+}
+
+gint
+pseudo_tcp_mux_get_error(PseudoTcpMux *mux) {
+    return mux->error;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Receiving
+//////////////////////////////////////////////////////////////////////
+
+static gboolean
+process_header(PseudoTcpMux *mux) {
+    const guint8 *header = mux->rx_header;
+    guint16 id = (header[2] << 8) | header[3];
+    guint32 length = ((guint32) header[4] << 24) | (header[5] << 16) |
+                     (header[6] << 8) | header[7];
+    Channel *ch;
+
+    ch = channel_get(mux, id, TRUE);
+    if (!ch)
+        return FALSE;
+
+    /* The peer forgets a channel once it saw our FIN, and may use its number
+     * again before the application here read the end: data and FIN frames
+     * coming after both FINs are for a new channel. Window updates still are
+     * for this one, we cannot have sent anything on the new one yet. */
+    if (ch->fin_received && ch->fin_sent && header[0] != FRAME_WINDOW) {
+        if (!ch->next)
+            ch->next = channel_new(id);
+        ch = ch->next;
+    }
+
+    switch (header[0]) {
+        case FRAME_DATA:
+            if (length == 0 || length > PSEUDO_TCP_MUX_MAX_FRAME ||
+                length > ch->recv_window || ch->fin_received)
+                return FALSE;
+            ch->recv_window -= length;
+            mux->rx_channel = ch;
+            mux->rx_left = length;
+            return TRUE;
+
+        case FRAME_WINDOW:
+            if (length > G_MAXUINT32 - ch->send_credit)
+                return FALSE;
+            ch->send_credit += length;
+            return TRUE;
+
+        case FRAME_FIN:
+            if (ch->fin_received)
+                return FALSE;
+            ch->fin_received = TRUE;
+            ch->readable_pending = TRUE;
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/* The callbacks may read or close channels, which can free them, so the
+ * channels to notify are collected beforehand, and skipped if they were freed
+ * in the meantime. */
+static void
+notify_readable(PseudoTcpMux *mux) {
+    guint16 ids[PSEUDO_TCP_MUX_MAX_CHANNELS];
+    guint i, n = 0;
+
+    for (i = 0; i < mux->channels->len; i++) {
+        Channel *ch = g_ptr_array_index(mux->channels, i);
+
+        if (ch->readable_pending) {
+            ch->readable_pending = FALSE;
+            ids[n++] = ch->id;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (channel_get(mux, ids[i], FALSE))
+            mux->callbacks.channel_readable(mux, ids[i], mux->callbacks.user_data);
+}
+
+gboolean
+pseudo_tcp_mux_receive(PseudoTcpMux *mux, const guint8 *buf, gsize len) {
+    while (len > 0) {
+        gsize n;
+
+        if (mux->rx_left > 0) {
+            Channel *ch = mux->rx_channel;
+
+            n = MIN(len, mux->rx_left);
+            g_byte_array_append(ch->recv_buf, buf, n);
+            ch->readable_pending = TRUE;
+            mux->rx_left -= n;
+        } else {
+            n = MIN(len, FRAME_HEADER_SIZE - mux->rx_header_len);
+            memcpy(mux->rx_header + mux->rx_header_len, buf, n);
+            mux->rx_header_len += n;
+
+            if (mux->rx_header_len == FRAME_HEADER_SIZE) {
+                mux->rx_header_len = 0;
+                if (!process_header(mux)) {
+                    mux->error = ECONNABORTED;
+                    return FALSE;
+                }
+            }
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    notify_readable(mux);
+
+    /* Window updates may have unblocked some channels. */
+    pseudo_tcp_mux_flush(mux);
+
+    return TRUE;
+}
+
+void
+pseudo_tcp_mux_receive_eof(PseudoTcpMux *mux) {
+    guint i;
+
+    mux->eof = TRUE;
+    for (i = 0; i < mux->channels->len; i++) {
+        Channel *ch = g_ptr_array_index(mux->channels, i);
+        ch->readable_pending = TRUE;
+    }
+
+    notify_readable(mux);
+}
+
+gssize
+pseudo_tcp_mux_peek(PseudoTcpMux *mux, guint16 channel, const guint8 **buf) {
+    Channel *ch = channel_get(mux, channel, FALSE);
+
+    if (!ch && mux->eof)
+        return 0;
+
+    if (!ch)
+        ch = channel_get(mux, channel, TRUE);
+    if (!ch) {
+        mux->error = EMFILE;
+        return -1;
+    }
+
+    if (ch->recv_buf->len > ch->recv_off) {
+        *buf = ch->recv_buf->data + ch->recv_off;
+        return ch->recv_buf->len - ch->recv_off;
+    }
+
+    if (ch->fin_received || mux->eof) {
+        ch->eof_seen = TRUE;
+        channel_maybe_free(mux, ch);
+        return 0;
+    }
+
+    mux->error = EWOULDBLOCK;
+    return -1;
+}
+
+void
+pseudo_tcp_mux_consume(PseudoTcpMux *mux, guint16 channel, gsize len) {
+    Channel *ch = channel_get(mux, channel, FALSE);
+
+    g_return_if_fail(ch != NULL);
+    g_return_if_fail(len <= ch->recv_buf->len - ch->recv_off);
+
+    byte_array_advance(ch->recv_buf, &ch->recv_off, len);
+
+    if (ch->fin_received)
+        return;
+
+    /* Grant the peer more credit once half of the window has been read, so
+   * that updates stay rare without the sender ever running dry. */
+    ch->recv_consumed += len;
+    if (ch->recv_consumed >= PSEUDO_TCP_MUX_WINDOW / 2) {
+        ch->window_update += ch->recv_consumed;
+        ch->recv_window += ch->recv_consumed;
+        ch->recv_consumed = 0;
+        pseudo_tcp_mux_flush(mux);
+    }
+}
+
+gssize
+pseudo_tcp_mux_recv(PseudoTcpMux *mux, guint16 channel, guint8 *buf,
+                    gsize len) {
+    const guint8 *data = NULL;
+    gssize available;
+
+    available = pseudo_tcp_mux_peek(mux, channel, &data);
+    if (available <= 0)
+        return available;
+
+    len = MIN(len, (gsize) available);
+    memcpy(buf, data, len);
+    pseudo_tcp_mux_consume(mux, channel, len);
+
+    return len;
+}
+
+gsize
+pseudo_tcp_mux_get_available_bytes(PseudoTcpMux *mux, guint16 channel) {
+    Channel *ch = channel_get(mux, channel, FALSE);
+
+    return ch ? ch->recv_buf->len - ch->recv_off : 0;
+}
+
+gboolean
+pseudo_tcp_mux_is_eof(PseudoTcpMux *mux, guint16 channel) {
+    Channel *ch = channel_get(mux, channel, FALSE);
+
+    if (!ch)
+        return mux->eof;
+
+    return (ch->fin_received || mux->eof) &&
+           ch->recv_buf->len == ch->recv_off;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Sending
+//////////////////////////////////////////////////////////////////////
+
+static gboolean
+channel_ready(Channel *ch) {
+    if (channel_queued(ch) > 0)
+        return ch->send_credit > 0;
+
+    return ch->fin_queued && !ch->fin_sent;
+}
+
+/* Serialize the next frame into tx_frame. Returns FALSE if nothing can be
+ * sent. */
+static gboolean
+next_frame(PseudoTcpMux *mux) {
+    Channel *best = NULL;
+    guint best_index = 0;
+    guint n = mux->channels->len;
+    guint i, len;
+
+    /* Window updates are tiny and unblock the peer, so they go first. */
+    for (i = 0; i < n; i++) {
+        Channel *ch = g_ptr_array_index(mux->channels, i);
+
+        if (ch->window_update > 0) {
+            write_header(mux->tx_frame, FRAME_WINDOW, ch->id, ch->window_update);
+            mux->tx_len = FRAME_HEADER_SIZE;
+            mux->tx_off = 0;
+            ch->window_update = 0;
+            return TRUE;
+        }
+    }
+
+    /* Strict priority; the scan starts after the channel served last, so that
+   * channels of equal priority take turns. */
+    for (i = 0; i < n; i++) {
+        guint index = (mux->rr_next + i) % n;
+        Channel *ch = g_ptr_array_index(mux->channels, index);
+
+        if (channel_ready(ch) && (!best || ch->priority > best->priority)) {
+            best = ch;
+            best_index = index;
+        }
+    }
+
+    if (!best)
+        return FALSE;
+
+    mux->rr_next = best_index + 1;
+    mux->tx_off = 0;
+
+    len = MIN(channel_queued(best), best->send_credit);
+    len = MIN(len, PSEUDO_TCP_MUX_MAX_FRAME);
+    if (len > 0) {
+        write_header(mux->tx_frame, FRAME_DATA, best->id, len);
+        memcpy(mux->tx_frame + FRAME_HEADER_SIZE,
+               best->send_buf->data + best->send_off, len);
+        mux->tx_len = FRAME_HEADER_SIZE + len;
+        byte_array_advance(best->send_buf, &best->send_off, len);
+        best->send_credit -= len;
+
+        if (best->want_write &&
+            channel_queued(best) <= PSEUDO_TCP_MUX_SEND_QUEUE / 2)
+            best->writable_pending = TRUE;
+    } else {
+        write_header(mux->tx_frame, FRAME_FIN, best->id, 0);
+        mux->tx_len = FRAME_HEADER_SIZE;
+        best->fin_sent = TRUE;
+        channel_maybe_free(mux, best);
+    }
+
+    return TRUE;
+}
+
+void
+pseudo_tcp_mux_flush(PseudoTcpMux *mux) {
+    guint16 ids[PSEUDO_TCP_MUX_MAX_CHANNELS];
+    guint i, n = 0;
+
+    /* Callbacks may send from within the write callback. */
+    if (!mux->started || mux->flushing)
+        return;
+    mux->flushing = TRUE;
+
+    for (;;) {
+        if (mux->tx_off < mux->tx_len) {
+            gssize n = mux->callbacks.write(mux, mux->tx_frame + mux->tx_off,
+                                            mux->tx_len - mux->tx_off, mux->callbacks.user_data);
+            if (n <= 0)
+                break;
+            mux->tx_off += n;
+        } else if (!next_frame(mux)) {
+            break;
+        }
+    }
+
+    mux->flushing = FALSE;
+
+    /* As in notify_readable(). */
+    for (i = 0; i < mux->channels->len; i++) {
+        Channel *ch = g_ptr_array_index(mux->channels, i);
+
+        if (ch->writable_pending) {
+            ch->writable_pending = FALSE;
+            ch->want_write = FALSE;
+            ids[n++] = ch->id;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (channel_get(mux, ids[i], FALSE))
+            mux->callbacks.channel_writable(mux, ids[i], mux->callbacks.user_data);
+}
+
+gssize
+pseudo_tcp_mux_send(PseudoTcpMux *mux, guint16 channel, const guint8 *buf,
+                    gsize len) {
+    Channel *ch = channel_get(mux, channel, TRUE);
+    gsize space;
+
+    if (!ch) {
+        mux->error = EMFILE;
+        return -1;
+    }
+
+    if (ch->fin_queued) {
+        mux->error = EPIPE;
+        return -1;
+    }
+
+    space = PSEUDO_TCP_MUX_SEND_QUEUE - channel_queued(ch);
+    if (space == 0) {
+        ch->want_write = TRUE;
+        mux->error = EWOULDBLOCK;
+        return -1;
+    }
+
+    len = MIN(len, space);
+    g_byte_array_append(ch->send_buf, buf, len);
+    pseudo_tcp_mux_flush(mux);
+
+    return len;
+}
+
+gsize
+pseudo_tcp_mux_get_available_send_space(PseudoTcpMux *mux, guint16 channel) {
+    Channel *ch = channel_get(mux, channel, FALSE);
+
+    if (!ch)
+        return mux->channels->len < PSEUDO_TCP_MUX_MAX_CHANNELS ?
+               PSEUDO_TCP_MUX_SEND_QUEUE : 0;
+
+    if (ch->fin_queued)
+        return 0;
+
+    return PSEUDO_TCP_MUX_SEND_QUEUE - channel_queued(ch);
+}
+
+void
+pseudo_tcp_mux_set_priority(PseudoTcpMux *mux, guint16 channel,
+                            guint8 priority) {
+    Channel *ch = channel_get(mux, channel, TRUE);
+
+    if (ch)
+        ch->priority = priority;
+}
+
+void
+pseudo_tcp_mux_close_channel(PseudoTcpMux *mux, guint16 channel) {
+    Channel *ch = channel_get(mux, channel, TRUE);
+
+    if (!ch || ch->fin_queued)
+        return;
+
+    ch->fin_queued = TRUE;
+    pseudo_tcp_mux_flush(mux);
+}
@@ -0,0 +1,176 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifndef __LIBNICE_PSEUDOTCP_MUX_H__
+#define __LIBNICE_PSEUDOTCP_MUX_H__
+
+/* Reliable channels multiplexed over one pseudo-TCP byte stream.
+ *
+ * Every chunk of channel data is framed with an 8-byte header: the frame type,
+ * a reserved flags byte, the 16-bit channel number and a 32-bit length, all in
+ * network byte order. DATA frames carry up to PSEUDO_TCP_MUX_MAX_FRAME bytes of
+ * payload; WINDOW frames grant the peer @length more bytes of credit on the
+ * channel; FIN frames end the channel in one direction.
+ *
+ * Each channel has its own credit-based flow control, so a channel which is
+ * not being read only stalls itself rather than the whole connection, and its
+ * own send queue. Queued data is interleaved frame by frame: channels with a
+ * higher priority are always served first, and channels of equal priority
+ * take turns. Channels are created implicitly by either side the first time
+ * they are used, and are all ordered: a single byte stream cannot deliver data
+ * out of order, so the pseudo-TCP head-of-line blocking on loss is shared by
+ * every channel.
+ *
+ * Both peers must agree on the framing before any of it is sent: data is only
+ * queued until pseudo_tcp_mux_start() is called. */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Largest payload of a DATA frame. Smaller frames interleave channels more
+ * finely, at the cost of more header overhead. */
+#define PSEUDO_TCP_MUX_MAX_FRAME 8192
+
+/* Initial receive window of every channel, which is also the most data the
+ * receiving side buffers for a channel which is not being read. */
+#define PSEUDO_TCP_MUX_WINDOW (64 * 1024)
+
+/* Most data queued for sending on a single channel. */
+#define PSEUDO_TCP_MUX_SEND_QUEUE (64 * 1024)
+
+/* Most channels alive at once on a multiplexer. */
+#define PSEUDO_TCP_MUX_MAX_CHANNELS 256
+
+typedef struct _PseudoTcpMux PseudoTcpMux;
+
+typedef struct {
+    gpointer user_data;
+
+    /* Queue @len bytes of framed data on the underlying byte stream. Returns
+   * the number of bytes accepted, or a negative value if none could be. */
+    gssize (*write)(PseudoTcpMux *mux, const guint8 *buf, gsize len,
+                    gpointer user_data);
+
+    /* Data or the end of the stream can be read from @channel. */
+    void (*channel_readable)(PseudoTcpMux *mux, guint16 channel,
+                             gpointer user_data);
+
+    /* A send on @channel previously failed with EWOULDBLOCK, and there is now
+   * room in its send queue again. */
+    void (*channel_writable)(PseudoTcpMux *mux, guint16 channel,
+                             gpointer user_data);
+
+    /* @channel was closed both ways and forgotten, so that its number may be
+   * used again. The peer may reuse it as soon as it saw both ends, so data it
+   * sent on the new channel can already be readable, in which case
+   * @channel_readable follows. */
+    void (*channel_closed)(PseudoTcpMux *mux, guint16 channel,
+                           gpointer user_data);
+} PseudoTcpMuxCallbacks;
+
+PseudoTcpMux *
+pseudo_tcp_mux_new(const PseudoTcpMuxCallbacks *callbacks);
+
+void
+pseudo_tcp_mux_free(PseudoTcpMux *mux);
+
+/* The underlying byte stream is connected and the peer agreed on the
+ * framing: start writing the queued frames. */
+void
+pseudo_tcp_mux_start(PseudoTcpMux *mux);
+
+/* Remove the data queued on @channel which was not sent yet, for when the
+ * peer turned out not to use the framing. Returns %NULL if there is none. */
+GBytes *
+pseudo_tcp_mux_take_send_queue(PseudoTcpMux *mux, guint16 channel);
+
+/* Parse @len bytes read from the underlying byte stream. Returns FALSE if the
+ * peer broke the framing or flow control, after which the connection should
+ * be torn down. */
+gboolean
+pseudo_tcp_mux_receive(PseudoTcpMux *mux, const guint8 *buf, gsize len);
+
+/* The underlying byte stream reached its end: every channel is at EOF once
+ * its buffered data has been read. */
+void
+pseudo_tcp_mux_receive_eof(PseudoTcpMux *mux);
+
+/* Write as many queued frames to the underlying byte stream as it accepts. */
+void
+pseudo_tcp_mux_flush(PseudoTcpMux *mux);
+
+/* The following return -1 and set the error returned by
+ * pseudo_tcp_mux_get_error() on failure, as the pseudo-TCP socket does:
+ * EWOULDBLOCK if nothing can be queued or read right now, EPIPE if sending on
+ * a closed channel, and EMFILE if too many channels are in use. */
+gint
+pseudo_tcp_mux_get_error(PseudoTcpMux *mux);
+
+gssize
+pseudo_tcp_mux_send(PseudoTcpMux *mux, guint16 channel, const guint8 *buf,
+                    gsize len);
+
+/* Returns 0 at the end of the channel. */
+gssize
+pseudo_tcp_mux_recv(PseudoTcpMux *mux, guint16 channel, guint8 *buf,
+                    gsize len);
+
+/* Zero-copy variant of pseudo_tcp_mux_recv(): returns the buffered data of
+ * @channel through @buf, which stays valid until the next call into the
+ * multiplexer, then pseudo_tcp_mux_consume() drops what was used. */
+gssize
+pseudo_tcp_mux_peek(PseudoTcpMux *mux, guint16 channel, const guint8 **buf);
+
+void
+pseudo_tcp_mux_consume(PseudoTcpMux *mux, guint16 channel, gsize len);
+
+gsize
+pseudo_tcp_mux_get_available_bytes(PseudoTcpMux *mux, guint16 channel);
+
+gsize
+pseudo_tcp_mux_get_available_send_space(PseudoTcpMux *mux, guint16 channel);
+
+/* Whether the peer ended @channel and all of its data has been read. */
+gboolean
+pseudo_tcp_mux_is_eof(PseudoTcpMux *mux, guint16 channel);
+
+/* Channels default to priority 0. */
+void
+pseudo_tcp_mux_set_priority(PseudoTcpMux *mux, guint16 channel,
+                            guint8 priority);
+
+/* End the sending side of @channel once its queued data has been sent. */
+void
+pseudo_tcp_mux_close_channel(PseudoTcpMux *mux, guint16 channel);
+
+G_END_DECLS
+
+#endif /* __LIBNICE_PSEUDOTCP_MUX_H__ */
@@ -75,7 +75,9 @@
 #endif
 
 #include "agent-priv.h"
+#include "agent-enum-types.h"
 #include "pseudotcp.h"
+#include "pseudotcp-cc.h"
 
 struct _PseudoTcpSocketClass {
     GObjectClass parent_class;
@@ -118,7 +120,8 @@ const guint16 PACKET_MAXIMUMS[] = {
         0,// End of list marker
 };
 
-// FIXME: This is a reasonable MTU, but we should get it from the lower layer
+// A reasonable MTU until the lower layer provides one (see
+// pseudo_tcp_socket_notify_mtu() and PseudoTcpSocket:max-mtu)
 #define DEF_MTU 1400
 #define MAX_PACKET 65532
 // Note: we removed lowest level because packet overhead was larger!
@@ -156,13 +159,22 @@ const guint16 PACKET_MAXIMUMS[] = {
 // 24 |                             data                              |
 //    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 //
+// When SACK has been negotiated (TCP_OPT_SACK), the Control field of an empty
+// segment carries the number of SACK blocks which follow the header, each one
+// being a pair of 32-bit sequence numbers: the left edge of a block of data
+// received out of order, and the sequence number following its last byte
+// (RFC 2018, §3).
+//
 //////////////////////////////////////////////////////////////////////
 
 #define MAX_SEQ 0xFFFFFFFF
 #define HEADER_SIZE 24
 
-#define PACKET_OVERHEAD (HEADER_SIZE + UDP_HEADER_SIZE + \
-                         IP_HEADER_SIZE + JINGLE_HEADER_SIZE)
+// Bytes added by the transport below the pseudo-TCP header, unless the
+// lower layer says otherwise (PseudoTcpSocket:transport-overhead)
+#define DEF_TRANSPORT_OVERHEAD (UDP_HEADER_SIZE + IP_HEADER_SIZE + \
+                                JINGLE_HEADER_SIZE)
+#define PACKET_OVERHEAD(priv) (HEADER_SIZE + (priv)->transport_overhead)
 
 // MIN_RTO = 1 second (RFC6298, Sec 2.4)
 #define MIN_RTO 1000
@@ -171,8 +183,37 @@ const guint16 PACKET_MAXIMUMS[] = {
 #define DEFAULT_ACK_DELAY 100 /* 100 milliseconds */
 #define DEFAULT_NO_DELAY TRUE
 
+// Packetization layer path MTU discovery (RFC 4821): the search stops within
+// PMTU_SEARCH_GRANULARITY bytes of the largest working MTU, and starts again
+// after PMTU_RAISE_TIMER in case the path has changed.
+#define PMTU_SEARCH_GRANULARITY 32
+#define PMTU_RAISE_TIMER 600000 /* 10 minutes (RFC 4821 sect 7.7) */
+
 #define DEFAULT_RCV_BUF_SIZE (60 * 1024)
 #define DEFAULT_SND_BUF_SIZE (90 * 1024)
+// Ceilings for buffer auto-tuning, enough for about 300 Mbit/s at 100 ms
+#define DEFAULT_RCV_BUF_MAX (4 * 1024 * 1024)
+#define DEFAULT_SND_BUF_MAX (4 * 1024 * 1024)
+
+/* Maximum number of SACK blocks carried by a single acknowledgement. */
+#define MAX_SACK_BLOCKS 4
+/* Number of segments which must be selectively acknowledged above a hole
+ * before it is considered lost (DupThresh, RFC 6675, §2). */
+#define SACK_DUP_THRESH 3
+
+/* Pacing: the longest burst, in milliseconds of the pacing rate, and in
+ * segments when that is less. */
+#define PACING_BURST_MS 2
+#define PACING_MIN_BURST 2
+
+/* Version of the framing of PseudoTcpSocket:support-channels, carried by
+ * the TCP_OPT_CHANNELS option; peers only use it if both sent the same. */
+#define CHANNELS_VERSION 1
+
+/* Packets collected by attempt_send() for a single call to the
+ * #PseudoTcpWritePacketsFunc: at most this many, in this many bytes. */
+#define TX_BATCH_PACKETS 32
+#define TX_BATCH_SIZE (64 * 1024)
 
 /* NOTE: This must fit in 8 bits. This is used on the wire. */
 typedef enum {
@@ -182,6 +223,8 @@ typedef enum {
     TCP_OPT_MSS = 2,       /* maximum segment size */
     TCP_OPT_WND_SCALE = 3, /* window scale factor */
     /* libnice extensions: */
+    TCP_OPT_CHANNELS = 252, /* multiplexed channel framing */
+    TCP_OPT_SACK = 253,    /* selective acknowledgement support */
     TCP_OPT_FIN_ACK = 254, /* FIN-ACK support */
 } TcpOption;
 
@@ -356,6 +399,11 @@ pseudo_tcp_fifo_read_offset(PseudoTcpFifo *b, guint8 *buffer, gsize bytes,
     return copy;
 }
 
+/* @buffer may point into the free space of the FIFO itself, as returned by
+ * pseudo_tcp_fifo_get_write_region(): data received there in order is
+ * already in place and is not copied, otherwise it is moved. The wrapped
+ * part is written first, as it can never overlap @buffer, while the rest
+ * can. */
 static gsize
 pseudo_tcp_fifo_write_offset(PseudoTcpFifo *b, const guint8 *buffer,
                              gsize bytes, gsize offset) {
@@ -368,12 +416,35 @@ pseudo_tcp_fifo_write_offset(PseudoTcpFifo *b, const guint8 *buffer,
         return 0;
     }
 
-    memcpy(&b->buffer[write_position], buffer, tail_copy);
-    memcpy(&b->buffer[0], buffer + tail_copy, copy - tail_copy);
+    if (copy > tail_copy)
+        memmove(&b->buffer[0], buffer + tail_copy, copy - tail_copy);
+    if (&b->buffer[write_position] != buffer)
+        memmove(&b->buffer[write_position], buffer, tail_copy);
 
     return copy;
 }
 
+/* Returns the contiguous free space where the next in-order data will be
+ * written, and its length in @len. */
+static guint8 *
+pseudo_tcp_fifo_get_write_region(PseudoTcpFifo *b, gsize *len) {
+    gsize write_position = (b->read_position + b->data_length) % b->buffer_length;
+
+    *len = min(b->buffer_length - b->data_length,
+               b->buffer_length - write_position);
+
+    return &b->buffer[write_position];
+}
+
+/* Returns the contiguous buffered data at the read position, and its length
+ * in @len. */
+static const guint8 *
+pseudo_tcp_fifo_get_read_region(PseudoTcpFifo *b, gsize *len) {
+    *len = min(b->data_length, b->buffer_length - b->read_position);
+
+    return &b->buffer[b->read_position];
+}
+
 static gsize
 pseudo_tcp_fifo_read(PseudoTcpFifo *b, guint8 *buffer, gsize bytes) {
     gsize copy;
@@ -424,14 +495,22 @@ typedef struct {
     const gchar *data;
     guint32 len;
     guint32 tsval, tsecr;
+    guint8 n_sack;
+    guint32 sack[2 * MAX_SACK_BLOCKS]; /* left and right edges */
 } Segment;
 
 typedef struct {
+    GList link;        /* in slist, or in the pool when free */
+    GList unsent_link; /* in unsent_slist, until first transmitted */
     guint32 seq, len;
     guint8 xmit;
     TcpFlags flags;
+    gboolean sacked; /* selectively acknowledged by the peer */
+    gboolean lost;   /* found lost by RACK, and not retransmitted since */
+    guint32 xmit_time; /* time of the latest transmission */
 } SSegment;
 
+/* A range of sequence numbers received out of order. */
 typedef struct {
     guint32 seq, len;
 } RSegment;
@@ -466,22 +545,46 @@ struct _PseudoTcpSocketPrivate {
     guint32 last_traffic;
 
     // Incoming data
-    GList *rlist;
+    // Data held out of order in the receive buffer: the ranges are sorted,
+    // and neither overlap nor touch, so there is one per hole in the sequence
+    RSegment *rlist;
+    guint rlist_len, rlist_size;
     guint32 rbuf_len, rcv_nxt, rcv_wnd, lastrecv;
     guint8 rwnd_scale;// Window scale factor
     PseudoTcpFifo rbuf;
     guint32 rcv_fin; /* sequence number of the received FIN octet, or 0 */
+    // Receive buffer auto-tuning: the largest size to grow to (0 to disable),
+    // the receiver's round-trip time estimate and the window it is timing,
+    // and the bytes read by the application in the current round trip
+    guint32 rbuf_max;
+    guint32 rcv_rtt, rcv_rtt_seq, rcv_rtt_time;
+    guint32 rcvq_space, rcvq_copied, rcvq_time;
 
     // Outgoing data
     GQueue slist;
     GQueue unsent_slist;
+    GQueue sseg_pool; /* segments freed for reuse */
     guint32 sbuf_len, snd_nxt, snd_wnd, lastsend;
     guint32 snd_una;  /* oldest unacknowledged sequence number */
+    guint32 sacked_bytes; /* bytes of slist selectively acknowledged */
+    guint32 sack_rexmit;  /* end of the last hole retransmitted in recovery */
     guint8 swnd_scale;// Window scale factor
     PseudoTcpFifo sbuf;
+    guint32 sbuf_max; // largest size for send buffer auto-tuning
+
+    // Shared budget for buffer growth, and the bytes charged to it
+    PseudoTcpBufferBudget *budget;
+    gsize budget_charged;
 
     // Maximum segment size, estimated protocol level, largest segment sent
     guint32 mss, msslevel, largest, mtu_advise;
+    // Bytes added to each packet by the transport (IP, UDP, relay framing)
+    guint32 transport_overhead;
+    // Path MTU search (RFC 4821): the largest MTU to probe for (0 to disable),
+    // the smallest MTU known not to work, the probe in flight (0 if none) and
+    // when the last one finished
+    guint32 pmtu_max, pmtu_high;
+    guint32 pmtu_probe, pmtu_probe_seq, pmtu_last_probe;
     // Retransmit timer
     guint32 rto_base;
 
@@ -490,15 +593,34 @@ struct _PseudoTcpSocketPrivate {
 
     // Round-trip calculation
     guint32 rx_rttvar, rx_srtt, rx_rto;
+    guint32 min_rto;
 
     // Congestion avoidance, Fast retransmit/recovery, Delayed ACKs
-    guint32 ssthresh, cwnd;
+    PseudoTcpCongestion cc;
     guint8 dup_acks;
     guint32 recover;
     gboolean fast_recovery;
     guint32 t_ack; /* time a delayed ack was scheduled; 0 if no acks scheduled */
     guint32 last_acked_ts;
 
+    // RACK-TLP loss detection (RFC 8985): the send time and end of the most
+    // recently sent segment known to have arrived, the round-trip time it
+    // measured and the smallest one seen, the reordering window in quarters
+    // of that and the recoveries left before it shrinks back, when to look
+    // for losses again and when to send a tail loss probe (0 if not armed),
+    // and the snd_nxt a probe in flight was sent at
+    gboolean use_rack;
+    guint32 rack_xmit_time, rack_end_seq, rack_rtt, rack_min_rtt;
+    guint8 rack_reo_wnd_mult, rack_reo_wnd_persist;
+    guint32 rack_timer, tlp_timer;
+    gboolean tlp_in_flight;
+    guint32 tlp_end_seq;
+
+    // Pacing: the bytes which may be sent before waiting, when they were last
+    // topped up, and when to try sending again (0 if not waiting)
+    gboolean use_pacing;
+    guint32 pace_credit, pace_stamp, t_pace;
+
     gboolean use_nagling;
     guint32 ack_delay;
 
@@ -514,6 +636,26 @@ struct _PseudoTcpSocketPrivate {
    * option) to enable correct FIN-ACK connection termination. Defaults to
    * TRUE unless no compatible option is received. */
     gboolean support_fin_ack;
+
+    /* Whether selective acknowledgements (the TCP_OPT_SACK option) are in use.
+   * Defaults to TRUE unless disabled, or no compatible option is received. */
+    gboolean support_sack;
+
+    /* Whether the application data is framed into channels (the
+   * TCP_OPT_CHANNELS option). Defaults to FALSE, and is reset to FALSE
+   * unless the peer sends the same framing version. */
+    gboolean support_channels;
+
+    /* Packets waiting to be handed to write_packets together, while tx_corked
+   * is non-zero. tx_buf holds their contents, allocated on first use. */
+    PseudoTcpWritePacketsFunc write_packets;
+    guint tx_corked;
+    gboolean tx_failed;
+    guint8 *tx_buf;
+    gsize tx_buf_used;
+    guint tx_n;
+    GOutputVector tx_vectors[TX_BATCH_PACKETS];
+    NiceOutputMessage tx_messages[TX_BATCH_PACKETS];
 };
 
 #define LARGER(a, b) (((a) - (b) -1) < (G_MAXUINT32 >> 1))
@@ -531,6 +673,18 @@ enum {
     PROP_RCV_BUF,
     PROP_SND_BUF,
     PROP_SUPPORT_FIN_ACK,
+    PROP_SUPPORT_SACK,
+    PROP_CONGESTION_CONTROL,
+    PROP_PACING_RATE,
+    PROP_TRANSPORT_OVERHEAD,
+    PROP_MAX_MTU,
+    PROP_RCV_BUF_MAX,
+    PROP_SND_BUF_MAX,
+    PROP_BUFFER_BUDGET,
+    PROP_MIN_RTO,
+    PROP_RACK,
+    PROP_PACING,
+    PROP_SUPPORT_CHANNELS,
     LAST_PROPERTY
 };
 
@@ -552,14 +706,37 @@ static gboolean parse(PseudoTcpSocket *self,
                       const guint8 *data_buf, gsize data_buf_len);
 static gboolean process(PseudoTcpSocket *self, Segment *seg);
 static int transmit(PseudoTcpSocket *self, SSegment *sseg, guint32 now);
+static void sack_update_scoreboard(PseudoTcpSocket *self, const Segment *seg,
+                                   guint32 now);
+static gboolean sack_head_lost(PseudoTcpSocket *self);
+static int sack_retransmit(PseudoTcpSocket *self, guint32 now);
+static int fast_retransmit(PseudoTcpSocket *self, guint32 now);
+static void rack_update(PseudoTcpSocket *self, const SSegment *sseg,
+                        guint32 now);
+static void rack_detect_loss(PseudoTcpSocket *self, guint32 now);
+static void rack_reordering_seen(PseudoTcpSocket *self);
+static gboolean rack_head_lost(PseudoTcpSocket *self);
+static void tlp_arm(PseudoTcpSocket *self, guint32 now);
+static int tlp_send_probe(PseudoTcpSocket *self, guint32 now);
+static void rlist_add(PseudoTcpSocket *self, guint32 seq, guint32 len);
+static gboolean rlist_recover(PseudoTcpSocket *self);
+static gboolean pacing_allows(PseudoTcpSocket *self, guint32 len,
+                              guint32 now);
 static void attempt_send(PseudoTcpSocket *self, SendFlags sflags);
 static void closedown(PseudoTcpSocket *self, guint32 err,
                       ClosedownSource source);
 static void adjustMTU(PseudoTcpSocket *self);
+static guint32 pmtu_next_probe(PseudoTcpSocket *self, guint32 now);
+static void pmtu_probe_done(PseudoTcpSocket *self, gboolean success,
+                            guint32 now);
 static void parse_options(PseudoTcpSocket *self, const guint8 *data,
                           guint32 len);
 static void resize_send_buffer(PseudoTcpSocket *self, guint32 new_size);
 static void resize_receive_buffer(PseudoTcpSocket *self, guint32 new_size);
+static void budget_release(PseudoTcpSocket *self);
+static void rcv_rtt_measure(PseudoTcpSocket *self, guint32 now);
+static void rcv_space_adjust(PseudoTcpSocket *self, gsize copied);
+static void grow_send_buffer(PseudoTcpSocket *self);
 static void set_state(PseudoTcpSocket *self, PseudoTcpState new_state);
 static void set_state_established(PseudoTcpSocket *self);
 static void set_state_closed(PseudoTcpSocket *self, guint32 err);
@@ -661,6 +838,219 @@ pseudo_tcp_socket_class_init(PseudoTcpSocketClass *cls) {
                                                          "Whether to enable the optional FIN–ACK support.",
                                                          TRUE,
                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:support-sack:
+   *
+   * Whether to support selective acknowledgements (RFC 2018) for this socket.
+   * With them, the peer reports the segments it holds out of order, and only
+   * the missing ones are retransmitted on loss. Like
+   * #PseudoTcpSocket:support-fin-ack, this is a libnice extension negotiated
+   * on connection setup, so it is safe to use against a peer without it.
+   *
+   * Support is enabled by default.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_SUPPORT_SACK,
+                                    g_param_spec_boolean("support-sack", "Support SACK",
+                                                         "Whether to enable selective acknowledgements.",
+                                                         TRUE,
+                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:congestion-control:
+   *
+   * The congestion control algorithm used when sending. It only affects the
+   * local side of the connection, so it needs no negotiation and may be
+   * changed at any time; the current congestion window is kept across the
+   * change.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_CONGESTION_CONTROL,
+                                    g_param_spec_enum("congestion-control", "Congestion control",
+                                                      "Congestion control algorithm for sending.",
+                                                      NICE_TYPE_TCP_CONGESTION_CONTROL,
+                                                      PSEUDO_TCP_CONGESTION_CONTROL_RENO,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:pacing-rate:
+   *
+   * The rate, in bytes per second, at which the congestion control algorithm
+   * would have the data spread out over a round trip, or zero before the
+   * round-trip time has been measured.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_PACING_RATE,
+                                    g_param_spec_uint("pacing-rate", "Pacing rate",
+                                                      "Sending rate chosen by the congestion control, in bytes per second.",
+                                                      0, G_MAXUINT, 0,
+                                                      G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:transport-overhead:
+   *
+   * The number of bytes the transport adds to each pseudo-TCP packet: IP and
+   * UDP headers, plus any relay framing. It is subtracted from the MTU, along
+   * with the pseudo-TCP header, to size segments. The default allows for IPv4,
+   * UDP and 64 bytes of framing.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_TRANSPORT_OVERHEAD,
+                                    g_param_spec_uint("transport-overhead", "Transport overhead",
+                                                      "Bytes added to each packet below the pseudo-TCP header.",
+                                                      0, G_MAXUINT16, DEF_TRANSPORT_OVERHEAD,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:max-mtu:
+   *
+   * The largest MTU the path may support, typically that of the local link.
+   * When it is above the MTU given to pseudo_tcp_socket_notify_mtu(), the
+   * socket sends some full segments at larger sizes once connected, and grows
+   * its segment size to the largest one acknowledged (packetization layer path
+   * MTU discovery, RFC 4821). Probes are retried every ten minutes in case the
+   * path changes. Zero, the default, disables probing.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_MAX_MTU,
+                                    g_param_spec_uint("max-mtu", "Maximum MTU",
+                                                      "Largest MTU to probe the path for, or 0 to disable probing.",
+                                                      0, G_MAXUINT16, 0,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:rcv-buf-max:
+   *
+   * The size up to which the receive buffer may grow. Once a round trip, the
+   * buffer is made twice as large as what the application read during the
+   * previous one, so that the advertised window keeps ahead of the sender
+   * (dynamic right-sizing). The window scale is negotiated for this size on
+   * connection setup, so it can only be changed before connecting. Zero, or a
+   * value no larger than #PseudoTcpSocket:rcv-buf, disables auto-tuning.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_RCV_BUF_MAX,
+                                    g_param_spec_uint("rcv-buf-max", "Maximum receive buffer",
+                                                      "Largest size of the auto-tuned receive buffer.",
+                                                      0, G_MAXUINT, DEFAULT_RCV_BUF_MAX,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:snd-buf-max:
+   *
+   * The size up to which the send buffer may grow. While the application keeps
+   * it full, it is grown to twice the congestion window. Zero, or a value no
+   * larger than #PseudoTcpSocket:snd-buf, disables auto-tuning.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_SND_BUF_MAX,
+                                    g_param_spec_uint("snd-buf-max", "Maximum send buffer",
+                                                      "Largest size of the auto-tuned send buffer.",
+                                                      0, G_MAXUINT, DEFAULT_SND_BUF_MAX,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:buffer-budget:
+   *
+   * A #PseudoTcpBufferBudget shared with other sockets, which auto-tuning
+   * takes the growth of the buffers beyond their initial sizes from. It must
+   * outlive the socket, or be unset first. %NULL, the default, leaves growth
+   * limited only by #PseudoTcpSocket:rcv-buf-max and
+   * #PseudoTcpSocket:snd-buf-max.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_BUFFER_BUDGET,
+                                    g_param_spec_pointer("buffer-budget", "Buffer budget",
+                                                         "Memory budget shared for growing buffers.",
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:min-rto:
+   *
+   * The lower bound of the retransmission timeout, in milliseconds. The
+   * default of one second follows RFC 6298; on paths with short and steady
+   * round-trip times, lower values shorten the stalls after a loss that
+   * nothing else detects.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_MIN_RTO,
+                                    g_param_spec_uint("min-rto", "Minimum RTO",
+                                                      "Lower bound of the retransmission timeout (in milliseconds).",
+                                                      1, MAX_RTO, MIN_RTO,
+                                                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:rack:
+   *
+   * Whether to detect losses from the time segments were sent (RACK, RFC
+   * 8985): a segment is lost once one sent after it has been selectively
+   * acknowledged and a quarter of the minimum round-trip time has passed
+   * since. When the last segments of a burst go unacknowledged, one of them
+   * is resent after two round-trip times as a tail loss probe, so that the
+   * loss is found without waiting for the retransmission timeout. Only the
+   * local side is concerned, but detection needs #PseudoTcpSocket:support-sack
+   * to be negotiated.
+   *
+   * Enabled by default.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_RACK,
+                                    g_param_spec_boolean("rack", "RACK-TLP",
+                                                         "Whether to use time-based loss detection and tail loss probes.",
+                                                         TRUE,
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:pacing:
+   *
+   * Whether to spread the segments sent over each round trip at the
+   * #PseudoTcpSocket:pacing-rate, rather than sending whatever the congestion
+   * window allows back to back. This avoids overflowing the queues of relays
+   * and wireless links each time the window opens. Bursts are limited to
+   * about two milliseconds of data, as the socket clock has a resolution of
+   * one millisecond; pseudo_tcp_socket_get_next_clock() returns when the next
+   * one is due.
+   *
+   * Disabled by default.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_PACING,
+                                    g_param_spec_boolean("pacing", "Pacing",
+                                                         "Whether to pace segments out at the congestion control rate.",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    /**
+   * PseudoTcpSocket:support-channels:
+   *
+   * Whether the application data is split into the channel frames of
+   * #NiceAgent:reliable-channels. The socket does not look at the data
+   * itself: this only negotiates the framing with the peer, like
+   * #PseudoTcpSocket:support-fin-ack, so that both ends agree on how to read
+   * the byte stream. It must be set before connecting, and reads %FALSE once
+   * connected if the peer did not ask for the same framing.
+   *
+   * Disabled by default.
+   *
+   * Since: 0.1.20
+   */
+    g_object_class_install_property(object_class, PROP_SUPPORT_CHANNELS,
+                                    g_param_spec_boolean("support-channels", "Support channels",
+                                                         "Whether the data is framed into reliable channels.",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 
@@ -696,6 +1086,42 @@ pseudo_tcp_socket_get_property(GObject *object,
         case PROP_SUPPORT_FIN_ACK:
             g_value_set_boolean(value, self->priv->support_fin_ack);
             break;
+        case PROP_SUPPORT_SACK:
+            g_value_set_boolean(value, self->priv->support_sack);
+            break;
+        case PROP_CONGESTION_CONTROL:
+            g_value_set_enum(value, self->priv->cc.algorithm);
+            break;
+        case PROP_PACING_RATE:
+            g_value_set_uint(value, self->priv->cc.pacing_rate);
+            break;
+        case PROP_TRANSPORT_OVERHEAD:
+            g_value_set_uint(value, self->priv->transport_overhead);
+            break;
+        case PROP_MAX_MTU:
+            g_value_set_uint(value, self->priv->pmtu_max);
+            break;
+        case PROP_RCV_BUF_MAX:
+            g_value_set_uint(value, self->priv->rbuf_max);
+            break;
+        case PROP_SND_BUF_MAX:
+            g_value_set_uint(value, self->priv->sbuf_max);
+            break;
+        case PROP_BUFFER_BUDGET:
+            g_value_set_pointer(value, self->priv->budget);
+            break;
+        case PROP_MIN_RTO:
+            g_value_set_uint(value, self->priv->min_rto);
+            break;
+        case PROP_RACK:
+            g_value_set_boolean(value, self->priv->use_rack);
+            break;
+        case PROP_PACING:
+            g_value_set_boolean(value, self->priv->use_pacing);
+            break;
+        case PROP_SUPPORT_CHANNELS:
+            g_value_set_boolean(value, self->priv->support_channels);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
             break;
@@ -734,6 +1160,63 @@ pseudo_tcp_socket_set_property(GObject *object,
         case PROP_SUPPORT_FIN_ACK:
             self->priv->support_fin_ack = g_value_get_boolean(value);
             break;
+        case PROP_SUPPORT_SACK:
+            self->priv->support_sack = g_value_get_boolean(value);
+            break;
+        case PROP_CONGESTION_CONTROL:
+            pseudo_tcp_congestion_set_algorithm(&self->priv->cc,
+                                                g_value_get_enum(value),
+                                                get_current_time(self));
+            break;
+        case PROP_TRANSPORT_OVERHEAD:
+            self->priv->transport_overhead = g_value_get_uint(value);
+            if (self->priv->state == PSEUDO_TCP_ESTABLISHED)
+                adjustMTU(self);
+            break;
+        case PROP_MAX_MTU:
+            /* Restart the search, forgetting any probe in flight. */
+            self->priv->pmtu_max = min(g_value_get_uint(value), MAX_PACKET);
+            self->priv->pmtu_high = self->priv->pmtu_max + 1;
+            self->priv->pmtu_probe = 0;
+            break;
+        case PROP_RCV_BUF_MAX:
+            g_return_if_fail(self->priv->state == PSEUDO_TCP_LISTEN);
+            self->priv->rbuf_max = g_value_get_uint(value);
+            break;
+        case PROP_SND_BUF_MAX:
+            self->priv->sbuf_max = g_value_get_uint(value);
+            break;
+        case PROP_BUFFER_BUDGET: {
+            gsize charged = self->priv->budget_charged;
+
+            /* Move the growth already charged over to the new budget. */
+            budget_release(self);
+            self->priv->budget = g_value_get_pointer(value);
+            self->priv->budget_charged = charged;
+            if (self->priv->budget != NULL)
+                self->priv->budget->used += charged;
+        } break;
+        case PROP_MIN_RTO:
+            self->priv->min_rto = g_value_get_uint(value);
+            if (self->priv->rx_srtt != 0)
+                self->priv->rx_rto = bound(self->priv->min_rto,
+                                           self->priv->rx_srtt + max(1LU, 4 * self->priv->rx_rttvar),
+                                           MAX_RTO);
+            break;
+        case PROP_RACK:
+            self->priv->use_rack = g_value_get_boolean(value);
+            if (!self->priv->use_rack)
+                self->priv->rack_timer = self->priv->tlp_timer = 0;
+            break;
+        case PROP_PACING:
+            self->priv->use_pacing = g_value_get_boolean(value);
+            if (!self->priv->use_pacing)
+                self->priv->t_pace = 0;
+            break;
+        case PROP_SUPPORT_CHANNELS:
+            g_return_if_fail(self->priv->state == PSEUDO_TCP_LISTEN);
+            self->priv->support_channels = g_value_get_boolean(value);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
             break;
@@ -744,24 +1227,22 @@ static void
 pseudo_tcp_socket_finalize(GObject *object) {
     PseudoTcpSocket *self = PSEUDO_TCP_SOCKET(object);
     PseudoTcpSocketPrivate *priv = self->priv;
-    GList *i;
-    SSegment *sseg;
+    GList *link;
 
     if (priv == NULL)
         return;
 
-    while ((sseg = g_queue_pop_head(&priv->slist)))
-        g_slice_free(SSegment, sseg);
-    g_queue_clear(&priv->unsent_slist);
-    for (i = priv->rlist; i; i = i->next) {
-        RSegment *rseg = i->data;
-        g_slice_free(RSegment, rseg);
-    }
-    g_list_free(priv->rlist);
+    while ((link = g_queue_pop_head_link(&priv->slist)))
+        g_slice_free(SSegment, link->data);
+    while ((link = g_queue_pop_head_link(&priv->sseg_pool)))
+        g_slice_free(SSegment, link->data);
+    g_free(priv->rlist);
     priv->rlist = NULL;
+    g_free(priv->tx_buf);
 
     pseudo_tcp_fifo_clear(&priv->rbuf);
     pseudo_tcp_fifo_clear(&priv->sbuf);
+    budget_release(self);
 
     g_free(priv);
     self->priv = NULL;
@@ -787,11 +1268,18 @@ pseudo_tcp_socket_init(PseudoTcpSocket *obj) {
     pseudo_tcp_fifo_init(&priv->rbuf, priv->rbuf_len);
     priv->sbuf_len = DEFAULT_SND_BUF_SIZE;
     pseudo_tcp_fifo_init(&priv->sbuf, priv->sbuf_len);
+    priv->rbuf_max = DEFAULT_RCV_BUF_MAX;
+    priv->sbuf_max = DEFAULT_SND_BUF_MAX;
+    priv->budget = NULL;
+    priv->budget_charged = 0;
+    priv->rcv_rtt = priv->rcv_rtt_seq = priv->rcv_rtt_time = 0;
+    priv->rcvq_space = priv->rcvq_copied = priv->rcvq_time = 0;
 
     priv->state = PSEUDO_TCP_LISTEN;
     priv->conv = 0;
     g_queue_init(&priv->slist);
     g_queue_init(&priv->unsent_slist);
+    g_queue_init(&priv->sseg_pool);
     priv->rcv_wnd = priv->rbuf_len;
     priv->rwnd_scale = priv->swnd_scale = 0;
     priv->snd_nxt = 0;
@@ -805,13 +1293,19 @@ pseudo_tcp_socket_init(PseudoTcpSocket *obj) {
 
     priv->msslevel = 0;
     priv->largest = 0;
-    priv->mss = MIN_PACKET - PACKET_OVERHEAD;
+    priv->transport_overhead = DEF_TRANSPORT_OVERHEAD;
+    priv->mss = MIN_PACKET - PACKET_OVERHEAD(priv);
     priv->mtu_advise = DEF_MTU;
+    priv->pmtu_max = priv->pmtu_high = 0;
+    priv->pmtu_probe = priv->pmtu_probe_seq = priv->pmtu_last_probe = 0;
 
     priv->rto_base = 0;
 
-    priv->cwnd = 2 * priv->mss;
-    priv->ssthresh = priv->rbuf_len;
+    priv->cc.mss = priv->mss;
+    priv->cc.cwnd = 2 * priv->mss;
+    priv->cc.ssthresh = priv->rbuf_len;
+    pseudo_tcp_congestion_set_algorithm(&priv->cc,
+                                        PSEUDO_TCP_CONGESTION_CONTROL_RENO, 0);
     priv->lastrecv = priv->lastsend = priv->last_traffic = 0;
     priv->bOutgoing = FALSE;
 
@@ -823,12 +1317,27 @@ pseudo_tcp_socket_init(PseudoTcpSocket *obj) {
 
     priv->rx_rto = DEF_RTO;
     priv->rx_srtt = priv->rx_rttvar = 0;
+    priv->min_rto = MIN_RTO;
+
+    priv->use_rack = TRUE;
+    priv->rack_xmit_time = priv->rack_end_seq = priv->rack_rtt = 0;
+    priv->rack_min_rtt = G_MAXUINT32;
+    priv->rack_reo_wnd_mult = 1;
+    priv->rack_reo_wnd_persist = 0;
+    priv->rack_timer = priv->tlp_timer = 0;
+    priv->tlp_in_flight = FALSE;
+    priv->tlp_end_seq = 0;
+
+    priv->use_pacing = FALSE;
+    priv->pace_credit = priv->pace_stamp = priv->t_pace = 0;
 
     priv->ack_delay = DEFAULT_ACK_DELAY;
     priv->use_nagling = !DEFAULT_NO_DELAY;
 
     priv->support_wnd_scale = TRUE;
     priv->support_fin_ack = TRUE;
+    priv->support_sack = TRUE;
+    priv->support_channels = FALSE;
 }
 
 PseudoTcpSocket *pseudo_tcp_socket_new(guint32 conversation,
@@ -843,15 +1352,27 @@ PseudoTcpSocket *pseudo_tcp_socket_new(guint32 conversation,
 static void
 queue_connect_message(PseudoTcpSocket *self) {
     PseudoTcpSocketPrivate *priv = self->priv;
-    guint8 buf[8];
+    guint8 buf[14];
     gsize size = 0;
 
     buf[size++] = CTL_CONNECT;
 
     if (priv->support_wnd_scale) {
+        guint8 scale_factor = 0;
+
+        // The scale can't change once negotiated, so pick one which lets the
+        // window grow to the auto-tuning ceiling (at most 14, RFC 7323 §2.3).
+        while ((max(priv->rbuf_len, priv->rbuf_max) >> scale_factor) > 0xFFFF &&
+               scale_factor < 14)
+            ++scale_factor;
+        priv->rwnd_scale = max(priv->rwnd_scale, scale_factor);
+        priv->rbuf_max = min(priv->rbuf_max, 0xFFFFU << priv->rwnd_scale);
+
         buf[size++] = TCP_OPT_WND_SCALE;
         buf[size++] = 1;
         buf[size++] = priv->rwnd_scale;
+    } else {
+        priv->rbuf_max = 0;
     }
 
     if (priv->support_fin_ack) {
@@ -860,6 +1381,18 @@ queue_connect_message(PseudoTcpSocket *self) {
         buf[size++] = 0; /* currently unused */
     }
 
+    if (priv->support_sack) {
+        buf[size++] = TCP_OPT_SACK;
+        buf[size++] = 1;
+        buf[size++] = 0; /* currently unused */
+    }
+
+    if (priv->support_channels) {
+        buf[size++] = TCP_OPT_CHANNELS;
+        buf[size++] = 1;
+        buf[size++] = CHANNELS_VERSION;
+    }
+
     priv->snd_wnd = size;
 
     queue(self, (char *) buf, size, FLAG_CTL);
@@ -906,6 +1439,11 @@ void pseudo_tcp_socket_notify_mtu(PseudoTcpSocket *self, guint16 mtu) {
     }
 }
 
+void pseudo_tcp_socket_set_write_packets_func(PseudoTcpSocket *self,
+                                              PseudoTcpWritePacketsFunc func) {
+    self->priv->write_packets = func;
+}
+
 void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self) {
     PseudoTcpSocketPrivate *priv = self->priv;
     guint32 now = get_current_time(self);
@@ -933,6 +1471,36 @@ void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self) {
         attempt_send(self, sfFin);
     }
 
+    /* Segments held back by the reordering window may be lost by now. */
+    if (priv->rack_timer && (time_diff(priv->rack_timer, now) <= 0)) {
+        int transmit_status = 0;
+
+        rack_detect_loss(self, now);
+        if (priv->dup_acks < 3 &&
+            LARGER_OR_EQUAL(priv->snd_una, priv->recover) && rack_head_lost(self))
+            transmit_status = fast_retransmit(self, now);
+        else if (priv->dup_acks >= 3 || SMALLER(priv->snd_una, priv->recover))
+            transmit_status = sack_retransmit(self, now);
+
+        if (transmit_status != 0) {
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+                  "Error transmitting segment. Closing down.");
+            closedown(self, transmit_status, CLOSEDOWN_LOCAL);
+            return;
+        }
+    }
+
+    if (priv->tlp_timer && (time_diff(priv->tlp_timer, now) <= 0)) {
+        int transmit_status = tlp_send_probe(self, now);
+
+        if (transmit_status != 0) {
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+                  "Error transmitting segment. Closing down.");
+            closedown(self, transmit_status, CLOSEDOWN_LOCAL);
+            return;
+        }
+    }
+
     // Check if it's time to retransmit a segment
     if (priv->rto_base &&
         (time_diff(priv->rto_base + priv->rx_rto, now) <= 0)) {
@@ -944,26 +1512,27 @@ void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self) {
             guint32 nInFlight;
             guint32 rto_limit;
             int transmit_status;
+            SSegment *head = g_queue_peek_head(&priv->slist);
 
             DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "timeout retransmit (rto: %u) "
                                            "(rto_base: %u) (now: %u) (dup_acks: %u)",
                   priv->rx_rto, priv->rto_base, now, (guint) priv->dup_acks);
 
-            transmit_status = transmit(self, g_queue_peek_head(&priv->slist), now);
+            transmit_status = transmit(self, head, now);
             if (transmit_status != 0) {
                 DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
                       "Error transmitting segment. Closing down.");
                 closedown(self, transmit_status, CLOSEDOWN_LOCAL);
                 return;
             }
+            priv->sack_rexmit = head->seq + head->len;
 
             nInFlight = priv->snd_nxt - priv->snd_una;
-            priv->ssthresh = max(nInFlight / 2, 2 * priv->mss);
-            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "ssthresh: %u = (nInFlight: %u / 2) + "
-                                           "2 * mss: %u",
-                  priv->ssthresh, nInFlight, priv->mss);
-            //LOG(LS_INFO) << "priv->ssthresh: " << priv->ssthresh << "  nInFlight: " << nInFlight << "  priv->mss: " << priv->mss;
-            priv->cwnd = priv->mss;
+            priv->cc.ops->on_timeout(&priv->cc, nInFlight, now);
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "%s: cwnd: %u ssthresh: %u "
+                                           "(nInFlight: %u mss: %u)",
+                  priv->cc.ops->name, priv->cc.cwnd, priv->cc.ssthresh,
+                  nInFlight, priv->mss);
 
             // Back off retransmit timer.  Note: the limit is lower when connecting.
             rto_limit = (priv->state < PSEUDO_TCP_ESTABLISHED) ? DEF_RTO : MAX_RTO;
@@ -971,6 +1540,8 @@ void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self) {
             priv->rto_base = now;
 
             priv->recover = priv->snd_nxt;
+            priv->tlp_timer = 0;
+            priv->tlp_in_flight = FALSE;
             if (priv->dup_acks >= 3) {
                 priv->dup_acks = 0;
                 priv->fast_recovery = FALSE;
@@ -999,6 +1570,12 @@ void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self) {
     if (priv->t_ack && (time_diff(priv->t_ack + priv->ack_delay, now) <= 0)) {
         packet(self, priv->snd_nxt, 0, 0, 0, now);
     }
+
+    // Check if it's time to send the next paced segments
+    if (priv->t_pace && (time_diff(priv->t_pace, now) <= 0)) {
+        priv->t_pace = 0;
+        attempt_send(self, sfNone);
+    }
 }
 
 gboolean
@@ -1027,11 +1604,16 @@ pseudo_tcp_socket_notify_packet(PseudoTcpSocket *self,
 }
 
 /* Assume there are two buffers in the given #NiceInputMessage: a 24-byte one
- * containing the header, and a bigger one for the data. */
+ * containing the header, and a bigger one for the data. A third buffer may
+ * follow when the second one is the receive region of the socket, to catch
+ * the data which did not fit in it; the data is then gathered into that
+ * third buffer, which must be large enough to hold all of it. */
 gboolean
 pseudo_tcp_socket_notify_message(PseudoTcpSocket *self,
                                  NiceInputMessage *message) {
     gboolean retval;
+    guint8 *data;
+    gsize data_len;
 
     g_assert(message->n_buffers > 0);
 
@@ -1039,7 +1621,7 @@ pseudo_tcp_socket_notify_message(PseudoTcpSocket *self,
         return pseudo_tcp_socket_notify_packet(self, message->buffers[0].buffer,
                                                message->buffers[0].size);
 
-    g_assert(message->n_buffers == 2);
+    g_assert(message->n_buffers == 2 || message->n_buffers == 3);
     g_assert(message->buffers[0].size == HEADER_SIZE);
 
     if (message->length > MAX_PACKET) {
@@ -1050,11 +1632,26 @@ pseudo_tcp_socket_notify_message(PseudoTcpSocket *self,
         return FALSE;
     }
 
+    data = message->buffers[1].buffer;
+    data_len = message->length - message->buffers[0].size;
+
+    if (data_len > message->buffers[1].size) {
+        GInputVector *spill = &message->buffers[2];
+        gsize head = message->buffers[1].size;
+
+        g_assert(message->n_buffers == 3);
+        g_assert(spill->size >= data_len);
+
+        memmove((guint8 *) spill->buffer + head, spill->buffer, data_len - head);
+        memcpy(spill->buffer, data, head);
+        data = spill->buffer;
+    }
+
     /* Hold a reference to the PseudoTcpSocket during parsing, since it may be
    * closed from within a callback. */
     g_object_ref(self);
     retval = parse(self, message->buffers[0].buffer, message->buffers[0].size,
-                   message->buffers[1].buffer, message->length - message->buffers[0].size);
+                   data, data_len);
     g_object_unref(self);
 
     return retval;
@@ -1127,49 +1724,75 @@ pseudo_tcp_socket_get_next_clock(PseudoTcpSocket *self, guint64 *timeout) {
     if (priv->rto_base) {
         *timeout = min(*timeout, priv->rto_base + priv->rx_rto);
     }
+    if (priv->rack_timer) {
+        *timeout = min(*timeout, priv->rack_timer);
+    }
+    if (priv->tlp_timer) {
+        *timeout = min(*timeout, priv->tlp_timer);
+    }
     if (priv->snd_wnd == 0) {
         *timeout = min(*timeout, priv->lastsend + priv->rx_rto);
     }
+    if (priv->t_pace) {
+        *timeout = min(*timeout, priv->t_pace);
+    }
 
     return TRUE;
 }
 
 
-gint pseudo_tcp_socket_recv(PseudoTcpSocket *self, char *buffer, size_t len) {
+/* Returns TRUE if reading from the socket must not touch the receive buffer
+ * and return @ret instead. */
+static gboolean
+recv_is_blocked(PseudoTcpSocket *self, gint *ret) {
     PseudoTcpSocketPrivate *priv = self->priv;
-    gsize bytesread;
-    gsize available_space;
 
     /* Received a FIN from the peer, so return 0. RFC 793, §3.5, Case 2. */
     if (priv->support_fin_ack && priv->shutdown_reads) {
-        return 0;
+        *ret = 0;
+        return TRUE;
     }
 
     /* Return 0 if FIN-ACK is not supported but the socket has been closed. */
     if (!priv->support_fin_ack && pseudo_tcp_socket_is_closed(self)) {
-        return 0;
+        *ret = 0;
+        return TRUE;
     }
 
     /* Return ENOTCONN if FIN-ACK is not supported and the connection is not
    * ESTABLISHED. */
     if (!priv->support_fin_ack && priv->state != PSEUDO_TCP_ESTABLISHED) {
         priv->error = ENOTCONN;
-        return -1;
+        *ret = -1;
+        return TRUE;
     }
 
-    if (len == 0)
+    return FALSE;
+}
+
+/* Called when there is nothing to read: returns 0 at the end of the stream,
+ * and -1 with EWOULDBLOCK otherwise. */
+static gint
+recv_nothing(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    if (pseudo_tcp_state_has_received_fin(priv->state) ||
+        pseudo_tcp_state_has_received_fin_ack(priv->state))
         return 0;
 
-    bytesread = pseudo_tcp_fifo_read(&priv->rbuf, (guint8 *) buffer, len);
+    priv->bReadEnable = TRUE;
+    priv->error = EWOULDBLOCK;
+    return -1;
+}
 
-    // If there's no data in |m_rbuf|.
-    if (bytesread == 0 &&
-        !(pseudo_tcp_state_has_received_fin(priv->state) ||
-          pseudo_tcp_state_has_received_fin_ack(priv->state))) {
-        priv->bReadEnable = TRUE;
-        priv->error = EWOULDBLOCK;
-        return -1;
-    }
+/* Reopens the receive window once the application made enough room, after
+ * it read @copied bytes. */
+static void
+recv_update_window(PseudoTcpSocket *self, gsize copied) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    gsize available_space;
+
+    rcv_space_adjust(self, copied);
 
     available_space = pseudo_tcp_fifo_get_write_remaining(&priv->rbuf);
 
@@ -1184,10 +1807,70 @@ gint pseudo_tcp_socket_recv(PseudoTcpSocket *self, char *buffer, size_t len) {
             attempt_send(self, sfImmediateAck);
         }
     }
+}
+
+gint pseudo_tcp_socket_recv(PseudoTcpSocket *self, char *buffer, size_t len) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    gsize bytesread;
+    gint ret;
+
+    if (recv_is_blocked(self, &ret))
+        return ret;
+
+    if (len == 0)
+        return 0;
+
+    bytesread = pseudo_tcp_fifo_read(&priv->rbuf, (guint8 *) buffer, len);
+
+    // If there's no data in |m_rbuf|.
+    if (bytesread == 0)
+        return recv_nothing(self);
+
+    recv_update_window(self, bytesread);
 
     return bytesread;
 }
 
+gint pseudo_tcp_socket_peek(PseudoTcpSocket *self, const guint8 **buffer) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    gsize len;
+    gint ret;
+
+    if (recv_is_blocked(self, &ret))
+        return ret;
+
+    *buffer = pseudo_tcp_fifo_get_read_region(&priv->rbuf, &len);
+
+    if (len == 0)
+        return recv_nothing(self);
+
+    return (gint) MIN(len, (gsize) G_MAXINT);
+}
+
+void pseudo_tcp_socket_consume(PseudoTcpSocket *self, gsize len) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    pseudo_tcp_fifo_consume_read_data(&priv->rbuf, len);
+    recv_update_window(self, len);
+}
+
+guint8 *
+pseudo_tcp_socket_get_receive_region(PseudoTcpSocket *self, gsize *len) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint8 *region;
+
+    /* Out-of-order data is stored in the free space beyond the next in-order
+   * byte, which a received packet must not overwrite. */
+    if (priv->rlist_len > 0 || priv->state != PSEUDO_TCP_ESTABLISHED)
+        return NULL;
+
+    region = pseudo_tcp_fifo_get_write_region(&priv->rbuf, len);
+    if (*len < priv->mss)
+        return NULL;
+
+    return region;
+}
+
 gint pseudo_tcp_socket_send(PseudoTcpSocket *self, const char *buffer, guint32 len) {
     PseudoTcpSocketPrivate *priv = self->priv;
     gint written;
@@ -1315,6 +1998,46 @@ int pseudo_tcp_socket_get_error(PseudoTcpSocket *self) {
 // Internal Implementation
 //
 
+/* Segments are linked into slist and unsent_slist through their own list
+ * nodes, and recycled through a pool, so that queueing, splitting and
+ * acknowledging data allocates nothing once the pool has warmed up. */
+static SSegment *
+sseg_new(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    GList *link = g_queue_pop_head_link(&priv->sseg_pool);
+    SSegment *sseg;
+
+    if (link != NULL) {
+        sseg = link->data;
+        memset(sseg, 0, sizeof(SSegment));
+    } else {
+        sseg = g_slice_new0(SSegment);
+    }
+
+    sseg->link.data = sseg;
+    sseg->unsent_link.data = sseg;
+
+    return sseg;
+}
+
+static void
+sseg_free(PseudoTcpSocket *self, SSegment *sseg) {
+    g_queue_push_head_link(&self->priv->sseg_pool, &sseg->link);
+}
+
+/* g_queue_insert_after_link() needs GLib 2.62. */
+static void
+queue_insert_after_link(GQueue *q, GList *sibling, GList *link) {
+    link->prev = sibling;
+    link->next = sibling->next;
+    if (sibling->next != NULL)
+        sibling->next->prev = link;
+    else
+        q->tail = link;
+    sibling->next = link;
+    q->length++;
+}
+
 static guint32
 queue(PseudoTcpSocket *self, const gchar *data, guint32 len, TcpFlags flags) {
     PseudoTcpSocketPrivate *priv = self->priv;
@@ -1333,14 +2056,14 @@ queue(PseudoTcpSocket *self, const gchar *data, guint32 len, TcpFlags flags) {
         (((SSegment *) g_queue_peek_tail(&priv->slist))->xmit == 0)) {
         ((SSegment *) g_queue_peek_tail(&priv->slist))->len += len;
     } else {
-        SSegment *sseg = g_slice_new0(SSegment);
+        SSegment *sseg = sseg_new(self);
         gsize snd_buffered = pseudo_tcp_fifo_get_buffered(&priv->sbuf);
 
         sseg->seq = priv->snd_una + snd_buffered;
         sseg->len = len;
         sseg->flags = flags;
-        g_queue_push_tail(&priv->slist, sseg);
-        g_queue_push_tail(&priv->unsent_slist, sseg);
+        g_queue_push_tail_link(&priv->slist, &sseg->link);
+        g_queue_push_tail_link(&priv->unsent_slist, &sseg->unsent_link);
     }
 
     //LOG(LS_INFO) << "PseudoTcp::queue - priv->slen = " << priv->slen;
@@ -1348,6 +2071,70 @@ queue(PseudoTcpSocket *self, const gchar *data, guint32 len, TcpFlags flags) {
     ;
 }
 
+/* Hand the packets collected so far to write_packets. */
+static void
+tx_flush(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    gint n_sent;
+
+    if (priv->tx_n == 0)
+        return;
+
+    n_sent = priv->write_packets(self, priv->tx_messages, priv->tx_n,
+                                 priv->callbacks.user_data);
+    if (n_sent < 0) {
+        DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Sending %u packets failed", priv->tx_n);
+        priv->tx_failed = TRUE;
+    } else if ((guint) n_sent < priv->tx_n) {
+        DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "Only %d of %u packets sent", n_sent,
+              priv->tx_n);
+    }
+
+    priv->tx_n = 0;
+    priv->tx_buf_used = 0;
+}
+
+/* Return where to build a packet of up to @size bytes in the batch, flushing
+ * it first if full, or NULL if the packet has to be sent on its own. */
+static guint8 *
+tx_reserve(PseudoTcpSocket *self, gsize size) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    if (priv->tx_corked == 0 || priv->write_packets == NULL)
+        return NULL;
+
+    if (priv->tx_n == TX_BATCH_PACKETS ||
+        priv->tx_buf_used + size > TX_BATCH_SIZE)
+        tx_flush(self);
+
+    /* Keep the packets in order around a path MTU probe too large for the
+   * batch. */
+    if (size > TX_BATCH_SIZE)
+        return NULL;
+
+    if (priv->tx_buf == NULL)
+        priv->tx_buf = g_malloc(TX_BATCH_SIZE);
+
+    return priv->tx_buf + priv->tx_buf_used;
+}
+
+/* Add the packet of @size bytes built at tx_reserve() to the batch. */
+static void
+tx_push(PseudoTcpSocket *self, gsize size) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    GOutputVector *vec = &priv->tx_vectors[priv->tx_n];
+    NiceOutputMessage *message = &priv->tx_messages[priv->tx_n];
+
+    vec->buffer = priv->tx_buf + priv->tx_buf_used;
+    vec->size = size;
+    message->buffers = vec;
+    message->n_buffers = 1;
+    priv->tx_n++;
+
+    /* The header is written as 32-bit words. */
+    priv->tx_buf_used += (size + 3) & ~3;
+}
+
 // Creates a packet and submits it to the network. This method can either
 // send payload or just an ACK packet.
 //
@@ -1361,15 +2148,21 @@ static PseudoTcpWriteResult
 packet(PseudoTcpSocket *self, guint32 seq, TcpFlags flags,
        guint32 offset, guint32 len, guint32 now) {
     PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 packet_buf[MAX_PACKET / 4];
     union {
-        guint8 u8[MAX_PACKET];
-        guint16 u16[MAX_PACKET / 2];
-        guint32 u32[MAX_PACKET / 4];
+        guint8 *u8;
+        guint16 *u16;
+        guint32 *u32;
     } buffer;
     PseudoTcpWriteResult wres = WR_SUCCESS;
+    guint8 n_sack = 0;
 
     g_assert(HEADER_SIZE + len <= MAX_PACKET);
 
+    buffer.u8 = tx_reserve(self, HEADER_SIZE + (len ? len : MAX_SACK_BLOCKS * 8));
+    if (buffer.u8 == NULL)
+        buffer.u32 = packet_buf;
+
     *buffer.u32 = htonl(priv->conv);
     *(buffer.u32 + 1) = htonl(seq);
     *(buffer.u32 + 2) = htonl(priv->rcv_nxt);
@@ -1388,15 +2181,32 @@ packet(PseudoTcpSocket *self, guint32 seq, TcpFlags flags,
         bytes_read = pseudo_tcp_fifo_read_offset(&priv->sbuf, buffer.u8 + HEADER_SIZE,
                                                  len, offset);
         g_assert(bytes_read == len);
-    }
+    } else if (priv->support_sack && priv->rlist_len > 0) {
+        /* Report the data held out of order, which @rlist already keeps as
+       * separate blocks. */
+        guint32 *blocks = buffer.u32 + HEADER_SIZE / 4;
 
-    DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "Sending <CONV=%u><FLG=%u><SEQ=%u:%u><ACK=%u>"
-                                    "<WND=%u><TS=%u><TSR=%u><LEN=%u>",
-          priv->conv, (unsigned) flags, seq, seq + len, priv->rcv_nxt, priv->rcv_wnd,
-          now % 10000, priv->ts_recent % 10000, len);
+        for (; n_sack < min(priv->rlist_len, MAX_SACK_BLOCKS); n_sack++) {
+            RSegment *rseg = &priv->rlist[n_sack];
+
+            blocks[2 * n_sack] = htonl(rseg->seq);
+            blocks[2 * n_sack + 1] = htonl(rseg->seq + rseg->len);
+        }
 
-    wres = priv->callbacks.WritePacket(self, (gchar *) buffer.u8, len + HEADER_SIZE,
-                                       priv->callbacks.user_data);
+        buffer.u8[12] = n_sack;
+    }
+
+    DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "Sending <CONV=%u><FLG=%u><SEQ=%u:%u><ACK=%u>"
+                                    "<WND=%u><TS=%u><TSR=%u><LEN=%u><SACK=%u>",
+          priv->conv, (unsigned) flags, seq, seq + len, priv->rcv_nxt, priv->rcv_wnd,
+          now % 10000, priv->ts_recent % 10000, len, n_sack);
+
+    if (buffer.u32 != packet_buf)
+        tx_push(self, len + HEADER_SIZE + n_sack * 8);
+    else
+        wres = priv->callbacks.WritePacket(self, (gchar *) buffer.u8,
+                                           len + HEADER_SIZE + n_sack * 8,
+                                           priv->callbacks.user_data);
     /* Note: When len is 0, this is an ACK packet.  We don't read the
      return value for those, and thus we won't retry.  So go ahead and treat
      the packet as a success (basically simulate as if it were dropped),
@@ -1439,14 +2249,35 @@ parse(PseudoTcpSocket *self, const guint8 *_header_buf, gsize header_buf_len,
     seg.tsval = ntohl(*(header_buf.u32 + 4));
     seg.tsecr = ntohl(*(header_buf.u32 + 5));
 
+    /* SACK blocks precede the data, if any; the Control field is always zero
+   * from peers which have not negotiated them. */
+    seg.n_sack = 0;
+    if (header_buf.u8[12] != 0 && self->priv->support_sack) {
+        guint8 i;
+
+        seg.n_sack = header_buf.u8[12];
+        if (seg.n_sack > MAX_SACK_BLOCKS || data_buf_len < seg.n_sack * 8u)
+            return FALSE;
+
+        for (i = 0; i < 2 * seg.n_sack; i++) {
+            guint32 edge;
+
+            memcpy(&edge, data_buf + 4 * i, sizeof(edge));
+            seg.sack[i] = ntohl(edge);
+        }
+
+        data_buf += seg.n_sack * 8;
+        data_buf_len -= seg.n_sack * 8;
+    }
+
     seg.data = (const gchar *) data_buf;
     seg.len = data_buf_len;
 
     DEBUG(PSEUDO_TCP_DEBUG_VERBOSE,
           "Received <CONV=%u><FLG=%u><SEQ=%u:%u><ACK=%u>"
-          "<WND=%u><TS=%u><TSR=%u><LEN=%u>",
+          "<WND=%u><TS=%u><TSR=%u><LEN=%u><SACK=%u>",
           seg.conv, (unsigned) seg.flags, seg.seq, seg.seq + seg.len, seg.ack,
-          seg.wnd, seg.tsval % 10000, seg.tsecr % 10000, seg.len);
+          seg.wnd, seg.tsval % 10000, seg.tsecr % 10000, seg.len, seg.n_sack);
 
     return process(self, &seg);
 }
@@ -1604,11 +2435,16 @@ process(PseudoTcpSocket *self, Segment *seg) {
                        SMALLER_OR_EQUAL(seg->ack, priv->snd_nxt));
     is_duplicate_ack = (seg->ack == priv->snd_una);
 
+    if (seg->n_sack > 0 && (is_valuable_ack || is_duplicate_ack))
+        sack_update_scoreboard(self, seg, now);
+
     if (is_valuable_ack) {
         guint32 nAcked;
         guint32 nFree;
+        gboolean spurious_rexmit = FALSE;
 
         // Calculate round-trip time
+        priv->cc.rtt = 0;
         if (seg->tsecr) {
             long rtt = time_diff(now, seg->tsecr);
             if (rtt >= 0) {
@@ -1621,8 +2457,10 @@ process(PseudoTcpSocket *self, Segment *seg) {
                                       4;
                     priv->rx_srtt = (7 * priv->rx_srtt + rtt) / 8;
                 }
-                priv->rx_rto = bound(MIN_RTO,
+                priv->rx_rto = bound(priv->min_rto,
                                      priv->rx_srtt + max(1LU, 4 * priv->rx_rttvar), MAX_RTO);
+                priv->cc.srtt = priv->rx_srtt;
+                priv->cc.rtt = MAX(rtt, 1);
 
                 DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "rtt: %ld srtt: %u rttvar: %u rto: %u",
                       rtt, priv->rx_srtt, priv->rx_rttvar, priv->rx_rto);
@@ -1639,6 +2477,11 @@ process(PseudoTcpSocket *self, Segment *seg) {
         nAcked = seg->ack - priv->snd_una;
         priv->snd_una = seg->ack;
 
+        /* Datagrams are delivered whole, so any of the probe being
+     * acknowledged means the path carried it. */
+        if (priv->pmtu_probe != 0 && LARGER(seg->ack, priv->pmtu_probe_seq))
+            pmtu_probe_done(self, TRUE, now);
+
         priv->rto_base = (priv->snd_una == priv->snd_nxt) ? 0 : now;
 
         /* ACKs for FIN segments give an increment on nAcked, but there is no
@@ -1657,8 +2500,18 @@ process(PseudoTcpSocket *self, Segment *seg) {
 
             g_assert(g_queue_get_length(&priv->slist) != 0);
             data = (SSegment *) g_queue_peek_head(&priv->slist);
+            rack_update(self, data, now);
+
+            /* The peer echoes the timestamp of the segment which filled
+       * the hole: if that was sent before the retransmission, the
+       * retransmission was not needed (RFC 3522). */
+            if (data->xmit > 1 && seg->tsecr != 0 &&
+                time_diff(seg->tsecr, data->xmit_time) < 0)
+                spurious_rexmit = TRUE;
 
             if (nFree < data->len) {
+                if (data->sacked)
+                    priv->sacked_bytes -= nFree;
                 data->len -= nFree;
                 data->seq += nFree;
                 nFree = 0;
@@ -1666,70 +2519,112 @@ process(PseudoTcpSocket *self, Segment *seg) {
                 if (data->len > priv->largest) {
                     priv->largest = data->len;
                 }
+                if (data->sacked)
+                    priv->sacked_bytes -= data->len;
                 nFree -= data->len;
-                g_slice_free(SSegment, data);
-                g_queue_pop_head(&priv->slist);
+                g_queue_pop_head_link(&priv->slist);
+                sseg_free(self, data);
             }
         }
 
+        if (priv->tlp_in_flight && LARGER_OR_EQUAL(priv->snd_una, priv->tlp_end_seq))
+            priv->tlp_in_flight = FALSE;
+        if (spurious_rexmit)
+            rack_reordering_seen(self);
+        rack_detect_loss(self, now);
+
         if (priv->dup_acks >= 3) {
             if (LARGER_OR_EQUAL(priv->snd_una, priv->recover)) {// NewReno
                 guint32 nInFlight = priv->snd_nxt - priv->snd_una;
                 // (Fast Retransmit)
-                priv->cwnd = min(priv->ssthresh,
-                                 max(nInFlight, priv->mss) + priv->mss);
-                DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "exit recovery cwnd=%d ssthresh=%d nInFlight=%d mss: %d", priv->cwnd, priv->ssthresh, nInFlight, priv->mss);
+                priv->cc.ops->exit_recovery(&priv->cc, nInFlight, now);
+                if (priv->rack_reo_wnd_persist > 0 &&
+                    --priv->rack_reo_wnd_persist == 0)
+                    priv->rack_reo_wnd_mult = 1;
+                DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "exit recovery cwnd=%d ssthresh=%d nInFlight=%d mss: %d", priv->cc.cwnd, priv->cc.ssthresh, nInFlight, priv->mss);
                 priv->fast_recovery = FALSE;
                 priv->dup_acks = 0;
             } else {
+                SSegment *head = g_queue_peek_head(&priv->slist);
                 int transmit_status;
 
-                DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
-                transmit_status = transmit(self, g_queue_peek_head(&priv->slist), now);
+                if (priv->support_sack && SMALLER(head->seq, priv->sack_rexmit)) {
+                    /* The hole at snd_una has already been retransmitted during
+           * this recovery; fill the next one instead of repeating it. */
+                    transmit_status = sack_retransmit(self, now);
+                } else {
+                    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
+                    transmit_status = transmit(self, head, now);
+                    priv->sack_rexmit = head->seq + head->len;
+                }
                 if (transmit_status != 0) {
                     DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
                           "Error transmitting recovery retransmit segment. Closing down.");
                     closedown(self, transmit_status, CLOSEDOWN_LOCAL);
                     return FALSE;
                 }
-                priv->cwnd += (nAcked > priv->mss ? priv->mss : 0) -
-                              min(nAcked, priv->cwnd);
+                priv->cc.ops->on_ack(&priv->cc, nAcked,
+                                     priv->snd_nxt - priv->snd_una, TRUE, now);
+            }
+        } else if (LARGER_OR_EQUAL(priv->snd_una, priv->recover) &&
+                   rack_head_lost(self)) {
+            /* Data sent after the new snd_una arrived without it. */
+            int transmit_status = fast_retransmit(self, now);
+
+            if (transmit_status != 0) {
+                DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+                      "Error transmitting recovery retransmit segment. Closing down.");
+                closedown(self, transmit_status, CLOSEDOWN_LOCAL);
+                return FALSE;
             }
         } else {
             priv->dup_acks = 0;
-            // Slow start, congestion avoidance
-            if (priv->cwnd < priv->ssthresh) {
-                priv->cwnd += priv->mss;
-            } else {
-                priv->cwnd += max(1LU, priv->mss * priv->mss / priv->cwnd);
+
+            /* Recovering from a timeout: retransmit the holes reported by the
+       * peer as they are uncovered, rather than waiting for further timeouts. */
+            if (priv->support_sack && SMALLER(priv->snd_una, priv->recover) &&
+                priv->sacked_bytes > 0) {
+                int transmit_status = sack_retransmit(self, now);
+
+                if (transmit_status != 0) {
+                    DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+                          "Error transmitting SACK retransmit segment. Closing down.");
+                    closedown(self, transmit_status, CLOSEDOWN_LOCAL);
+                    return FALSE;
+                }
             }
+
+            // Slow start, congestion avoidance
+            priv->cc.ops->on_ack(&priv->cc, nAcked,
+                                 priv->snd_nxt - priv->snd_una, FALSE, now);
         }
+
+        tlp_arm(self, now);
     } else if (is_duplicate_ack) {
         /* !?! Note, tcp says don't do this... but otherwise how does a
        closed window become open? */
         priv->snd_wnd = seg->wnd << priv->swnd_scale;
+        rack_detect_loss(self, now);
 
         // Check duplicate acks
         if (seg->len > 0) {
             // it's a dup ack, but with a data payload, so don't modify priv->dup_acks
         } else if (priv->snd_una != priv->snd_nxt) {
-            guint32 nInFlight;
-
             priv->dup_acks += 1;
             DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "Received dup ack (dups: %u)",
                   priv->dup_acks);
+            if (priv->dup_acks < 3 && sack_head_lost(self)) {
+                DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "SACK shows snd_una lost (dups: %u)",
+                      priv->dup_acks);
+                priv->dup_acks = 3;
+            }
             if (priv->dup_acks == 3) {// (Fast Retransmit)
                 int transmit_status;
 
 
                 if (LARGER_OR_EQUAL(priv->snd_una, priv->recover) ||
                     seg->tsecr == priv->last_acked_ts) { /* NewReno */
-                    /* Invoke fast retransmit  RFC3782 section 3 step 1A*/
-                    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "enter recovery");
-                    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
-
-                    transmit_status = transmit(self, g_queue_peek_head(&priv->slist),
-                                               now);
+                    transmit_status = fast_retransmit(self, now);
                     if (transmit_status != 0) {
                         DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
                               "Error transmitting recovery retransmit segment. Closing down.");
@@ -1737,22 +2632,26 @@ process(PseudoTcpSocket *self, Segment *seg) {
                         closedown(self, transmit_status, CLOSEDOWN_LOCAL);
                         return FALSE;
                     }
-                    priv->recover = priv->snd_nxt;
-                    nInFlight = priv->snd_nxt - priv->snd_una;
-                    priv->ssthresh = max(nInFlight / 2, 2 * priv->mss);
-                    DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
-                          "ssthresh: %u = max((nInFlight: %u / 2), 2 * mss: %u)",
-                          priv->ssthresh, nInFlight, priv->mss);
-                    priv->cwnd = priv->ssthresh + 3 * priv->mss;
-                    priv->fast_recovery = TRUE;
                 } else {
                     DEBUG(PSEUDO_TCP_DEBUG_VERBOSE,
                           "Skipping fast recovery: recover: %u snd_una: %u", priv->recover,
                           priv->snd_una);
                 }
             } else if (priv->dup_acks > 3) {
-                if (priv->fast_recovery)
-                    priv->cwnd += priv->mss;
+                if (priv->fast_recovery) {
+                    priv->cc.ops->on_dup_ack(&priv->cc, now);
+
+                    if (priv->support_sack) {
+                        int transmit_status = sack_retransmit(self, now);
+
+                        if (transmit_status != 0) {
+                            DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+                                  "Error transmitting SACK retransmit segment. Closing down.");
+                            closedown(self, transmit_status, CLOSEDOWN_LOCAL);
+                            return FALSE;
+                        }
+                    }
+                }
             }
         } else {
             priv->dup_acks = 0;
@@ -1853,6 +2752,10 @@ process(PseudoTcpSocket *self, Segment *seg) {
               "Invalid FIN-ACK received when FIN-ACK support is disabled");
     }
 
+    // The application keeps the send buffer full, so let it hold more
+    if (is_valuable_ack && priv->bWriteEnable)
+        grow_send_buffer(self);
+
     // If we make room in the send queue, notify the user
     // The goal it to make sure we always have at least enough data to fill the
     // window.  We'd like to notify the app when we are halfway to that point.
@@ -1940,43 +2843,18 @@ process(PseudoTcpSocket *self, Segment *seg) {
             g_assert(res == seg->len);
 
             if (seg->seq == priv->rcv_nxt) {
-                GList *iter = NULL;
-
                 pseudo_tcp_fifo_consume_write_buffer(&priv->rbuf, seg->len);
                 priv->rcv_nxt += seg->len;
                 priv->rcv_wnd -= seg->len;
                 bNewData = TRUE;
+                rcv_rtt_measure(self, now);
 
-                iter = priv->rlist;
-                while (iter &&
-                       SMALLER_OR_EQUAL(((RSegment *) iter->data)->seq, priv->rcv_nxt)) {
-                    RSegment *data = (RSegment *) (iter->data);
-                    if (LARGER(data->seq + data->len, priv->rcv_nxt)) {
-                        guint32 nAdjust = (data->seq + data->len) - priv->rcv_nxt;
-                        sflags = sfImmediateAck;// (Fast Recovery)
-                        DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Recovered %u bytes (%u -> %u)",
-                              nAdjust, priv->rcv_nxt, priv->rcv_nxt + nAdjust);
-                        pseudo_tcp_fifo_consume_write_buffer(&priv->rbuf, nAdjust);
-                        priv->rcv_nxt += nAdjust;
-                        priv->rcv_wnd -= nAdjust;
-                    }
-                    g_slice_free(RSegment, priv->rlist->data);
-                    priv->rlist = g_list_delete_link(priv->rlist, priv->rlist);
-                    iter = priv->rlist;
-                }
+                if (rlist_recover(self))
+                    sflags = sfImmediateAck;// (Fast Recovery)
             } else {
-                GList *iter = NULL;
-                RSegment *rseg = g_slice_new0(RSegment);
-
                 DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Saving %u bytes (%u -> %u)",
                       seg->len, seg->seq, seg->seq + seg->len);
-                rseg->seq = seg->seq;
-                rseg->len = seg->len;
-                iter = priv->rlist;
-                while (iter && SMALLER(((RSegment *) iter->data)->seq, rseg->seq)) {
-                    iter = g_list_next(iter);
-                }
-                priv->rlist = g_list_insert_before(priv->rlist, iter, rseg);
+                rlist_add(self, seg->seq, seg->len);
             }
         }
     }
@@ -2006,6 +2884,17 @@ static gboolean
 transmit(PseudoTcpSocket *self, SSegment *segment, guint32 now) {
     PseudoTcpSocketPrivate *priv = self->priv;
     guint32 nTransmit = min(segment->len, priv->mss);
+    guint32 lost_probe_end = 0;
+
+    if (priv->pmtu_probe != 0 && segment->seq == priv->pmtu_probe_seq) {
+        if (segment->xmit == 0) {
+            nTransmit = segment->len;
+        } else {
+            /* The probe was lost; resend its data in segments which fit. */
+            pmtu_probe_done(self, FALSE, now);
+            lost_probe_end = segment->seq + segment->len;
+        }
+    }
 
     if (segment->xmit >= ((priv->state == PSEUDO_TCP_ESTABLISHED) ? 15 : 30)) {
         DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "too many retransmits");
@@ -2034,6 +2923,13 @@ transmit(PseudoTcpSocket *self, SSegment *segment, guint32 now) {
 
         g_assert(wres == WR_TOO_LARGE);
 
+        if (nTransmit > priv->mss) {
+            /* A path MTU probe larger than the lower layer allows. */
+            pmtu_probe_done(self, FALSE, now);
+            nTransmit = min(segment->len, priv->mss);
+            continue;
+        }
+
         while (TRUE) {
             if (PACKET_MAXIMUMS[priv->msslevel + 1] == 0) {
                 DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "MTU too small");
@@ -2042,9 +2938,10 @@ transmit(PseudoTcpSocket *self, SSegment *segment, guint32 now) {
             /* !?! We need to break up all outstanding and pending packets
          and then retransmit!?! */
 
-            priv->mss = PACKET_MAXIMUMS[++priv->msslevel] - PACKET_OVERHEAD;
+            priv->mss = PACKET_MAXIMUMS[++priv->msslevel] - PACKET_OVERHEAD(priv);
+            priv->cc.mss = priv->mss;
             // I added this... haven't researched actual formula
-            priv->cwnd = 2 * priv->mss;
+            priv->cc.cwnd = 2 * priv->mss;
 
             if (priv->mss < nTransmit) {
                 nTransmit = priv->mss;
@@ -2055,25 +2952,25 @@ transmit(PseudoTcpSocket *self, SSegment *segment, guint32 now) {
     }
 
     if (nTransmit < segment->len) {
-        SSegment *subseg = g_slice_new0(SSegment);
+        SSegment *subseg = sseg_new(self);
         subseg->seq = segment->seq + nTransmit;
         subseg->len = segment->len - nTransmit;
         subseg->flags = segment->flags;
         subseg->xmit = segment->xmit;
+        subseg->xmit_time = segment->xmit_time;
 
         DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "mss reduced to %u", priv->mss);
 
         segment->len = nTransmit;
-        g_queue_insert_after(&priv->slist,
-                             g_queue_find(&priv->slist, segment), subseg);
+        queue_insert_after_link(&priv->slist, &segment->link, &subseg->link);
         if (subseg->xmit == 0)
-            g_queue_insert_after(&priv->unsent_slist,
-                                 g_queue_find(&priv->unsent_slist, segment), subseg);
+            queue_insert_after_link(&priv->unsent_slist, &segment->unsent_link,
+                                    &subseg->unsent_link);
     }
 
     if (segment->xmit == 0) {
         g_assert(g_queue_peek_head(&priv->unsent_slist) == segment);
-        g_queue_pop_head(&priv->unsent_slist);
+        g_queue_pop_head_link(&priv->unsent_slist);
         priv->snd_nxt += segment->len;
 
         /* FIN flags require acknowledgement. */
@@ -2081,16 +2978,469 @@ transmit(PseudoTcpSocket *self, SSegment *segment, guint32 now) {
             priv->snd_nxt++;
     }
     segment->xmit += 1;
+    segment->xmit_time = now;
+    segment->lost = FALSE;
+
+    /* Retransmissions take their share of the pacing rate too. */
+    priv->pace_credit -= min(priv->pace_credit, segment->len);
 
     if (priv->rto_base == 0) {
         priv->rto_base = now;
     }
+    if (segment->xmit == 1)
+        tlp_arm(self, now);
+
+    /* None of a lost probe arrived, so resend all of it now rather than one
+   * segment per round trip. */
+    if (lost_probe_end != 0) {
+        GList *link = segment->link.next;
+
+        for (; link != NULL &&
+               SMALLER(((SSegment *) link->data)->seq, lost_probe_end);
+             link = link->next) {
+            int transmit_status = transmit(self, link->data, now);
+
+            if (transmit_status != 0)
+                return transmit_status;
+        }
+    }
 
     return 0;
 }
 
+/* Mark the segments of @slist covered by the SACK blocks of @seg. Blocks
+ * outside of the data in flight are ignored. */
 static void
-attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
+sack_update_scoreboard(PseudoTcpSocket *self, const Segment *seg, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint8 i;
+
+    for (i = 0; i < seg->n_sack; i++) {
+        guint32 left = seg->sack[2 * i];
+        guint32 right = seg->sack[2 * i + 1];
+        GList *iter;
+
+        if (!LARGER(right, left) || SMALLER(left, priv->snd_una) ||
+            LARGER(right, priv->snd_nxt)) {
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Ignoring SACK block %u:%u", left, right);
+            continue;
+        }
+
+        for (iter = g_queue_peek_head_link(&priv->slist); iter;
+             iter = g_list_next(iter)) {
+            SSegment *sseg = iter->data;
+
+            if (sseg->xmit == 0 || LARGER_OR_EQUAL(sseg->seq, right))
+                break;
+
+            if (!sseg->sacked && sseg->len > 0 &&
+                LARGER_OR_EQUAL(sseg->seq, left) &&
+                SMALLER_OR_EQUAL(sseg->seq + sseg->len, right)) {
+                sseg->sacked = TRUE;
+                priv->sacked_bytes += sseg->len;
+                rack_update(self, sseg, now);
+            }
+        }
+    }
+}
+
+/* Whether the scoreboard shows the segment at snd_una as lost before three
+ * duplicate ACKs have arrived: RACK found it lost, or enough data above it
+ * was selectively acknowledged. When too little data is in flight for the
+ * threshold to ever be reached, it is lowered as in early retransmit
+ * (RFC 5827). */
+static gboolean
+sack_head_lost(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 n_segments, thresh = SACK_DUP_THRESH;
+
+    if (!priv->support_sack || priv->sacked_bytes == 0)
+        return FALSE;
+
+    if (rack_head_lost(self))
+        return TRUE;
+
+    n_segments = (priv->snd_nxt - priv->snd_una + priv->mss - 1) / priv->mss;
+    if (n_segments <= SACK_DUP_THRESH)
+        thresh = max(n_segments, 2) - 1;
+
+    return priv->sacked_bytes >= thresh * priv->mss;
+}
+
+/* Retransmit the first hole of the scoreboard which is known to be lost: with
+ * SACK_DUP_THRESH segments selectively acknowledged above it (RFC 6675, §4)
+ * and not retransmitted yet during the current recovery, or found lost by
+ * RACK since it was last sent. Returns 0 if nothing needed retransmitting, or
+ * the error from transmit(). */
+static int
+sack_retransmit(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 sacked_above = priv->sacked_bytes;
+    GList *iter;
+
+    for (iter = g_queue_peek_head_link(&priv->slist); iter;
+         iter = g_list_next(iter)) {
+        SSegment *sseg = iter->data;
+        int transmit_status;
+
+        if (sseg->xmit == 0 || sacked_above == 0)
+            break;
+
+        if (sseg->sacked) {
+            sacked_above -= sseg->len;
+            continue;
+        }
+
+        if (!sseg->lost &&
+            (sacked_above < SACK_DUP_THRESH * priv->mss ||
+             SMALLER(sseg->seq, priv->sack_rexmit)))
+            continue;
+
+        DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "SACK retransmit %u:%u",
+              sseg->seq, sseg->seq + sseg->len);
+        transmit_status = transmit(self, sseg, now);
+        if (transmit_status == 0 &&
+            LARGER(sseg->seq + sseg->len, priv->sack_rexmit))
+            priv->sack_rexmit = sseg->seq + sseg->len;
+
+        return transmit_status;
+    }
+
+    return 0;
+}
+
+/* Retransmit the segment at snd_una and enter fast recovery (RFC 6582, §3.2,
+ * step 2). Returns 0, or the error from transmit(). */
+static int
+fast_retransmit(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    SSegment *head = g_queue_peek_head(&priv->slist);
+    guint32 nInFlight;
+    int transmit_status;
+
+    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "enter recovery");
+    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
+
+    transmit_status = transmit(self, head, now);
+    if (transmit_status != 0)
+        return transmit_status;
+
+    priv->sack_rexmit = head->seq + head->len;
+    priv->recover = priv->snd_nxt;
+    nInFlight = priv->snd_nxt - priv->snd_una;
+    priv->cc.ops->enter_recovery(&priv->cc, nInFlight, now);
+    DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+          "%s: cwnd: %u ssthresh: %u (nInFlight: %u mss: %u)",
+          priv->cc.ops->name, priv->cc.cwnd, priv->cc.ssthresh,
+          nInFlight, priv->mss);
+    priv->dup_acks = 3;
+    priv->fast_recovery = TRUE;
+    priv->tlp_timer = 0;
+
+    return 0;
+}
+
+/* Whether a segment sent at @t1 and ending at @end1 was sent after one sent at
+ * @t2 and ending at @end2. */
+static gboolean
+rack_sent_after(guint32 t1, guint32 end1, guint32 t2, guint32 end2) {
+    long diff = time_diff(t1, t2);
+
+    return diff > 0 || (diff == 0 && LARGER(end1, end2));
+}
+
+/* Note the arrival of @sseg, newly acknowledged or selectively acknowledged
+ * (RFC 8985, §6.2, steps 1 and 2). */
+static void
+rack_update(PseudoTcpSocket *self, const SSegment *sseg, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    long rtt = time_diff(now, sseg->xmit_time);
+
+    if (!priv->use_rack || sseg->xmit == 0 || rtt < 0)
+        return;
+
+    /* An acknowledgement coming sooner than any round trip could be for an
+   * earlier transmission of the segment. */
+    if (sseg->xmit > 1 && (guint32) rtt < priv->rack_min_rtt)
+        return;
+
+    priv->rack_min_rtt = min(priv->rack_min_rtt, (guint32) rtt);
+
+    if (rack_sent_after(sseg->xmit_time, sseg->seq + sseg->len,
+                        priv->rack_xmit_time, priv->rack_end_seq)) {
+        priv->rack_xmit_time = sseg->xmit_time;
+        priv->rack_end_seq = sseg->seq + sseg->len;
+        priv->rack_rtt = rtt;
+    }
+}
+
+/* Mark the segments sent before the latest one known to have arrived as lost,
+ * once they are older than its round-trip time plus a reordering window of a
+ * quarter of the minimum round-trip time (RFC 8985, §6.2, step 5). Arms
+ * rack_timer for the first segment still within the window. Only holes below
+ * the highest selective acknowledgement are considered. */
+static void
+rack_detect_loss(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 sacked_above = priv->sacked_bytes;
+    guint32 reo_wnd, timeout = 0;
+    GList *iter;
+
+    priv->rack_timer = 0;
+    if (!priv->use_rack)
+        return;
+
+    reo_wnd = min(priv->rack_reo_wnd_mult * (priv->rack_min_rtt / 4),
+                  priv->rx_srtt);
+
+    for (iter = g_queue_peek_head_link(&priv->slist);
+         iter != NULL && sacked_above > 0; iter = g_list_next(iter)) {
+        SSegment *sseg = iter->data;
+        long remaining;
+
+        if (sseg->xmit == 0)
+            break;
+
+        if (sseg->sacked) {
+            sacked_above -= sseg->len;
+            continue;
+        }
+
+        if (sseg->lost ||
+            !rack_sent_after(priv->rack_xmit_time, priv->rack_end_seq,
+                             sseg->xmit_time, sseg->seq + sseg->len))
+            continue;
+
+        remaining = time_diff(sseg->xmit_time + priv->rack_rtt + reo_wnd, now);
+        if (remaining <= 0) {
+            DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "RACK: %u:%u lost",
+                  sseg->seq, sseg->seq + sseg->len);
+            sseg->lost = TRUE;
+        } else {
+            timeout = max(timeout, (guint32) remaining);
+        }
+    }
+
+    if (timeout != 0)
+        priv->rack_timer = now + timeout;
+}
+
+/* Whether RACK found the segment at snd_una lost. */
+static gboolean
+rack_head_lost(PseudoTcpSocket *self) {
+    SSegment *head = g_queue_peek_head(&self->priv->slist);
+
+    return head != NULL && head->lost;
+}
+
+/* A retransmission turned out to be spurious: widen the reordering window by
+ * a quarter of the minimum round-trip time, for the next 16 recoveries
+ * (RFC 8985, §6.2, step 4). */
+static void
+rack_reordering_seen(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    if (priv->rack_reo_wnd_mult < G_MAXUINT8)
+        priv->rack_reo_wnd_mult++;
+    priv->rack_reo_wnd_persist = 16;
+    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Spurious retransmission; reordering window "
+                                   "now %u/4 of the minimum RTT",
+          priv->rack_reo_wnd_mult);
+}
+
+/* Arm the probe timeout (RFC 8985, §7.2) while data is in flight outside of
+ * loss recovery, unless the retransmission timer would expire first. */
+static void
+tlp_arm(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 pto;
+
+    priv->tlp_timer = 0;
+    if (!priv->use_rack || priv->state != PSEUDO_TCP_ESTABLISHED ||
+        priv->snd_una == priv->snd_nxt || priv->dup_acks >= 3 ||
+        SMALLER(priv->snd_una, priv->recover) || priv->tlp_in_flight)
+        return;
+
+    if (priv->rx_srtt == 0) {
+        pto = DEF_RTO;
+    } else {
+        pto = 2 * priv->rx_srtt;
+        /* A lone segment may wait for the delayed ACK timer at the peer. */
+        if (priv->snd_nxt - priv->snd_una <= priv->mss)
+            pto += priv->ack_delay;
+    }
+
+    if (time_diff(now + pto, priv->rto_base + priv->rx_rto) < 0)
+        priv->tlp_timer = now + pto;
+}
+
+/* Resend the last segment sent and not selectively acknowledged, so that the
+ * acknowledgement it elicits reveals any loss at the tail of the flight. */
+static int
+tlp_send_probe(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    GList *link = g_queue_peek_head_link(&priv->unsent_slist);
+    int transmit_status;
+
+    priv->tlp_timer = 0;
+
+    /* Unsent segments are the tail of @slist. */
+    if (link != NULL)
+        link = ((SSegment *) link->data)->link.prev;
+    else
+        link = g_queue_peek_tail_link(&priv->slist);
+
+    while (link != NULL && ((SSegment *) link->data)->sacked)
+        link = link->prev;
+    if (link == NULL)
+        return 0;
+
+    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "tail loss probe %u:%u",
+          ((SSegment *) link->data)->seq,
+          ((SSegment *) link->data)->seq + ((SSegment *) link->data)->len);
+
+    transmit_status = transmit(self, link->data, now);
+    if (transmit_status != 0)
+        return transmit_status;
+
+    priv->tlp_in_flight = TRUE;
+    priv->tlp_end_seq = priv->snd_nxt;
+    priv->rto_base = now;
+
+    return 0;
+}
+
+/* Returns the index of the first range of @rlist which ends at or after @seq,
+ * found by binary search. */
+static guint
+rlist_find(PseudoTcpSocket *self, guint32 seq) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint lo = 0, hi = priv->rlist_len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+
+        if (SMALLER(priv->rlist[mid].seq + priv->rlist[mid].len, seq))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Records that [@seq, @seq + @len) is held out of order, merging it with the
+ * ranges it overlaps or touches. Only a new hole moves the ranges after it,
+ * and the array only grows when there are more holes than ever before. */
+static void
+rlist_add(PseudoTcpSocket *self, guint32 seq, guint32 len) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 end = seq + len;
+    guint first, last;
+
+    // Ranges [first, last) overlap or touch the new data.
+    first = rlist_find(self, seq);
+    for (last = first; last < priv->rlist_len; last++) {
+        if (LARGER(priv->rlist[last].seq, end))
+            break;
+    }
+
+    if (first == last) {
+        if (priv->rlist_len == priv->rlist_size) {
+            priv->rlist_size = max(2 * priv->rlist_size, 8);
+            priv->rlist = g_renew(RSegment, priv->rlist, priv->rlist_size);
+        }
+        memmove(&priv->rlist[first + 1], &priv->rlist[first],
+                (priv->rlist_len - first) * sizeof(RSegment));
+        priv->rlist_len++;
+        last = first + 1;
+    } else {
+        RSegment *tail = &priv->rlist[last - 1];
+
+        if (LARGER(seq, priv->rlist[first].seq))
+            seq = priv->rlist[first].seq;
+        if (LARGER(tail->seq + tail->len, end))
+            end = tail->seq + tail->len;
+        memmove(&priv->rlist[first + 1], &priv->rlist[last],
+                (priv->rlist_len - last) * sizeof(RSegment));
+        priv->rlist_len -= last - first - 1;
+    }
+
+    priv->rlist[first].seq = seq;
+    priv->rlist[first].len = end - seq;
+}
+
+/* Moves rcv_nxt past the data held out of order which now follows it.
+ * Returns whether there was any. */
+static gboolean
+rlist_recover(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    gboolean recovered = FALSE;
+    guint n = 0;
+
+    while (n < priv->rlist_len &&
+           SMALLER_OR_EQUAL(priv->rlist[n].seq, priv->rcv_nxt)) {
+        RSegment *rseg = &priv->rlist[n++];
+
+        if (LARGER(rseg->seq + rseg->len, priv->rcv_nxt)) {
+            guint32 nAdjust = (rseg->seq + rseg->len) - priv->rcv_nxt;
+
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Recovered %u bytes (%u -> %u)",
+                  nAdjust, priv->rcv_nxt, priv->rcv_nxt + nAdjust);
+            pseudo_tcp_fifo_consume_write_buffer(&priv->rbuf, nAdjust);
+            priv->rcv_nxt += nAdjust;
+            priv->rcv_wnd -= nAdjust;
+            recovered = TRUE;
+        }
+    }
+
+    if (n > 0) {
+        priv->rlist_len -= n;
+        memmove(&priv->rlist[0], &priv->rlist[n],
+                priv->rlist_len * sizeof(RSegment));
+    }
+
+    return recovered;
+}
+
+/* Top the pacing credit up for the time elapsed since it last was, and return
+ * whether @len bytes may be sent now. If not, t_pace is set to when they may
+ * be. Up to PACING_BURST_MS of data can be sent at once, so that the rate is
+ * still reached when the clock fires late. */
+static gboolean
+pacing_allows(PseudoTcpSocket *self, guint32 len, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 rate = priv->cc.pacing_rate;
+    guint32 burst;
+    long elapsed;
+
+    /* Nothing to pace by before the first round-trip time sample. */
+    if (!priv->use_pacing || rate == 0)
+        return TRUE;
+
+    burst = max(PACING_MIN_BURST * priv->mss,
+                (guint64) rate * PACING_BURST_MS / 1000);
+
+    elapsed = time_diff(now, priv->pace_stamp);
+    if (priv->pace_stamp == 0 || elapsed >= PACING_BURST_MS ||
+        elapsed < 0) {
+        priv->pace_credit = burst;
+    } else {
+        priv->pace_credit = min(burst, priv->pace_credit +
+                                               (guint64) rate * elapsed / 1000);
+    }
+    priv->pace_stamp = now;
+
+    if (priv->pace_credit >= len)
+        return TRUE;
+
+    priv->t_pace = now + max(1LU, ((guint64) (len - priv->pace_credit) * 1000 +
+                                   rate - 1) / rate);
+    return FALSE;
+}
+
+static void
+attempt_send_segments(PseudoTcpSocket *self, SendFlags sflags) {
     PseudoTcpSocketPrivate *priv = self->priv;
     guint32 now = get_current_time(self);
     gboolean bFirst = TRUE;
@@ -2098,7 +3448,7 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
     DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Attempting send with flags %u.", sflags);
 
     if (time_diff(now, priv->lastsend) > (long) priv->rx_rto) {
-        priv->cwnd = priv->mss;
+        priv->cc.ops->on_idle(&priv->cc, now);
     }
 
 
@@ -2112,11 +3462,17 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
         GList *iter;
         SSegment *sseg;
         int transmit_status;
+        guint32 probe_mtu = 0;
 
-        cwnd = priv->cwnd;
+        cwnd = priv->cc.cwnd;
         if ((priv->dup_acks == 1) || (priv->dup_acks == 2)) {// Limited Transmit
             cwnd += priv->dup_acks * priv->mss;
         }
+        /* A path MTU probe only takes one segment's worth of the congestion
+     * window, so that it does not hold back the segments following it. */
+        if (priv->pmtu_probe != 0) {
+            cwnd += priv->pmtu_probe - PACKET_OVERHEAD(priv) - priv->mss;
+        }
         nWindow = min(priv->snd_wnd, cwnd);
         nInFlight = priv->snd_nxt - priv->snd_una;
         nUseable = (nInFlight < nWindow) ? (nWindow - nInFlight) : 0;
@@ -2135,14 +3491,37 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
             }
         }
 
+        /* Send a path MTU probe in place of a full-sized segment, when there is
+     * enough data for it and no loss to recover from (RFC 4821, §7.4). */
+        if (nAvailable == priv->mss && priv->dup_acks == 0 &&
+            priv->state == PSEUDO_TCP_ESTABLISHED &&
+            !SMALLER(priv->snd_una, priv->recover) &&
+            (probe_mtu = pmtu_next_probe(self, now)) != 0) {
+            /* Segments much larger than a sixteenth of the peer's window
+       * slow the ACK clock down more than they save in overhead. */
+            guint32 probe_len = min(probe_mtu - PACKET_OVERHEAD(priv),
+                                    priv->snd_wnd / 16);
+
+            probe_mtu = probe_len + PACKET_OVERHEAD(priv);
+
+            /* Enough segments must follow the probe for its loss to be
+       * detected by duplicate ACKs rather than by a timeout. */
+            if (probe_len > priv->mss &&
+                snd_buffered - nInFlight >= probe_len + SACK_DUP_THRESH * priv->mss &&
+                nInFlight + probe_len <= priv->snd_wnd)
+                nAvailable = probe_len;
+            else
+                probe_mtu = 0;
+        }
+
         if (bFirst) {
             gsize available_space = pseudo_tcp_fifo_get_write_remaining(&priv->sbuf);
 
             bFirst = FALSE;
             DEBUG(PSEUDO_TCP_DEBUG_VERBOSE, "[cwnd: %u  nWindow: %u  nInFlight: %u "
                                             "nAvailable: %u nQueued: %" G_GSIZE_FORMAT " nEmpty: %" G_GSIZE_FORMAT "  nWaiting: %zu ssthresh: %u]",
-                  priv->cwnd, nWindow, nInFlight, nAvailable, snd_buffered,
-                  available_space, snd_buffered - nInFlight, priv->ssthresh);
+                  priv->cc.cwnd, nWindow, nInFlight, nAvailable, snd_buffered,
+                  available_space, snd_buffered - nInFlight, priv->cc.ssthresh);
         }
 
         if (sflags == sfDuplicateAck) {
@@ -2181,17 +3560,36 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
             return;
         sseg = iter->data;
 
+        // Wait for the pacing timer, but do not hold back an ACK
+        if (sflags != sfFin && sflags != sfRst &&
+            !pacing_allows(self, min(sseg->len, nAvailable), now)) {
+            if (sflags == sfImmediateAck ||
+                (sflags == sfDelayedAck && priv->t_ack)) {
+                packet(self, priv->snd_nxt, 0, 0, 0, now);
+            } else if (sflags == sfDelayedAck) {
+                priv->t_ack = now;
+            }
+            return;
+        }
+
         // If the segment is too large, break it into two
         if (sseg->len > nAvailable && sflags != sfFin && sflags != sfRst) {
-            SSegment *subseg = g_slice_new0(SSegment);
+            SSegment *subseg = sseg_new(self);
             subseg->seq = sseg->seq + nAvailable;
             subseg->len = sseg->len - nAvailable;
             subseg->flags = sseg->flags;
 
             sseg->len = nAvailable;
-            g_queue_insert_after(&priv->unsent_slist, iter, subseg);
-            g_queue_insert_after(&priv->slist, g_queue_find(&priv->slist, sseg),
-                                 subseg);
+            queue_insert_after_link(&priv->unsent_slist, iter,
+                                    &subseg->unsent_link);
+            queue_insert_after_link(&priv->slist, &sseg->link, &subseg->link);
+        }
+
+        if (probe_mtu != 0 && sseg->len == nAvailable) {
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Probing path MTU of %u bytes",
+                  probe_mtu);
+            priv->pmtu_probe = probe_mtu;
+            priv->pmtu_probe_seq = sseg->seq;
         }
 
         transmit_status = transmit(self, sseg, now);
@@ -2208,6 +3606,24 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
     }
 }
 
+static void
+attempt_send(PseudoTcpSocket *self, SendFlags sflags) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    /* Send what the window allows as one batch, if write_packets is set. */
+    priv->tx_corked++;
+    attempt_send_segments(self, sflags);
+    if (--priv->tx_corked > 0)
+        return;
+
+    tx_flush(self);
+    if (priv->tx_failed) {
+        priv->tx_failed = FALSE;
+        if (priv->state != PSEUDO_TCP_CLOSED)
+            closedown(self, ECONNABORTED, CLOSEDOWN_REMOTE);
+    }
+}
+
 /* If @source is %CLOSEDOWN_REMOTE, don’t send an RST packet, since closedown()
  * has been called as a result of an RST segment being received.
  * See: RFC 1122, §4.2.2.13. */
@@ -2267,12 +3683,55 @@ adjustMTU(PseudoTcpSocket *self) {
             break;
         }
     }
-    priv->mss = priv->mtu_advise - PACKET_OVERHEAD;
+    priv->mss = priv->mtu_advise - PACKET_OVERHEAD(priv);
+    priv->cc.mss = priv->mss;
     // !?! Should we reset priv->largest here?
     DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Adjusting mss to %u bytes", priv->mss);
     // Enforce minimums on ssthresh and cwnd
-    priv->ssthresh = max(priv->ssthresh, 2 * priv->mss);
-    priv->cwnd = max(priv->cwnd, priv->mss);
+    priv->cc.ssthresh = max(priv->cc.ssthresh, 2 * priv->mss);
+    priv->cc.cwnd = max(priv->cc.cwnd, priv->mss);
+}
+
+/* Returns the MTU to probe the path with next (RFC 4821, §7.2), or 0 if no
+ * probe should be sent now. */
+static guint32
+pmtu_next_probe(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    if (priv->pmtu_probe != 0 || priv->pmtu_max <= priv->mtu_advise)
+        return 0;
+
+    // Nothing failed yet: try the largest size first, as it usually works
+    if (priv->pmtu_high > priv->pmtu_max)
+        return priv->pmtu_max;
+
+    // Binary search between the current MTU and the smallest failed one
+    if (priv->pmtu_high > priv->mtu_advise + PMTU_SEARCH_GRANULARITY)
+        return (priv->mtu_advise + priv->pmtu_high) / 2;
+
+    if (time_diff(now, priv->pmtu_last_probe) < PMTU_RAISE_TIMER)
+        return 0;
+
+    priv->pmtu_high = priv->pmtu_max + 1;
+    return priv->pmtu_max;
+}
+
+static void
+pmtu_probe_done(PseudoTcpSocket *self, gboolean success, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Path MTU probe of %u bytes %s",
+          priv->pmtu_probe, success ? "succeeded" : "failed");
+
+    if (success) {
+        priv->mtu_advise = priv->pmtu_probe;
+        adjustMTU(self);
+    } else {
+        priv->pmtu_high = priv->pmtu_probe;
+    }
+
+    priv->pmtu_probe = 0;
+    priv->pmtu_last_probe = now;
 }
 
 static void
@@ -2313,6 +3772,16 @@ apply_option(PseudoTcpSocket *self, guint8 kind, const guint8 *data,
             DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "FIN-ACK support enabled.");
             apply_fin_ack_option(self);
             break;
+        case TCP_OPT_SACK:
+            /* SACK support; only used if enabled locally as well. */
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Peer supports SACK.");
+            break;
+        case TCP_OPT_CHANNELS:
+            /* Channel framing; only used if enabled locally with the same
+             * version. */
+            DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Peer frames channels, version %u.",
+                  len == 1 ? data[0] : 0);
+            break;
         case TCP_OPT_EOL:
         case TCP_OPT_NOOP:
             /* Nothing to do. */
@@ -2329,6 +3798,8 @@ parse_options(PseudoTcpSocket *self, const guint8 *data, guint32 len) {
     PseudoTcpSocketPrivate *priv = self->priv;
     gboolean has_window_scaling_option = FALSE;
     gboolean has_fin_ack_option = FALSE;
+    gboolean has_sack_option = FALSE;
+    gboolean has_channels_option = FALSE;
     guint32 pos = 0;
 
     // See http://www.freesoft.org/CIE/Course/Section4/8.htm for
@@ -2374,14 +3845,21 @@ parse_options(PseudoTcpSocket *self, const guint8 *data, guint32 len) {
             has_window_scaling_option = TRUE;
         else if (kind == TCP_OPT_FIN_ACK)
             has_fin_ack_option = TRUE;
+        else if (kind == TCP_OPT_SACK)
+            has_sack_option = TRUE;
+        else if (kind == TCP_OPT_CHANNELS)
+            has_channels_option = (opt_len == 1 &&
+                                   data[pos - 1] == CHANNELS_VERSION);
     }
 
     if (!has_window_scaling_option) {
         DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Peer doesn't support window scaling");
+        priv->rbuf_max = 0;
         if (priv->rwnd_scale > 0) {
             // Peer doesn't support TCP options and window scaling.
             // Revert receive buffer size to default value.
             resize_receive_buffer(self, DEFAULT_RCV_BUF_SIZE);
+            priv->rwnd_scale = 0;
             priv->swnd_scale = 0;
         }
     }
@@ -2390,6 +3868,16 @@ parse_options(PseudoTcpSocket *self, const guint8 *data, guint32 len) {
         DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Peer doesn't support FIN-ACK");
         priv->support_fin_ack = FALSE;
     }
+
+    if (!has_sack_option) {
+        DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Peer doesn't support SACK");
+        priv->support_sack = FALSE;
+    }
+
+    if (!has_channels_option && priv->support_channels) {
+        DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Peer doesn't frame channels the same way");
+        priv->support_channels = FALSE;
+    }
 }
 
 static void
@@ -2429,12 +3917,133 @@ resize_receive_buffer(PseudoTcpSocket *self, guint32 new_size) {
     g_assert(result);
     priv->rbuf_len = new_size;
     priv->rwnd_scale = scale_factor;
-    priv->ssthresh = new_size;
+    priv->cc.ssthresh = new_size;
 
     available_space = pseudo_tcp_fifo_get_write_remaining(&priv->rbuf);
     priv->rcv_wnd = available_space;
 }
 
+/* Takes up to @size bytes of buffer growth from the shared budget, returning
+ * how much was granted. */
+static guint32
+budget_charge(PseudoTcpSocket *self, guint32 size) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    PseudoTcpBufferBudget *budget = priv->budget;
+
+    if (budget != NULL) {
+        if (budget->used >= budget->limit)
+            return 0;
+        size = min(size, budget->limit - budget->used);
+        budget->used += size;
+    }
+
+    priv->budget_charged += size;
+    return size;
+}
+
+static void
+budget_release(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    if (priv->budget != NULL)
+        priv->budget->used -= min(priv->budget_charged, priv->budget->used);
+    priv->budget_charged = 0;
+}
+
+/* Estimates the round-trip time at the receiver, which may have no data of
+ * its own being acknowledged to time, from how long it takes to receive a
+ * window's worth of data. That is never less than a round trip, so the
+ * smallest sample is kept (as Linux's tcp_rcv_rtt_measure() does). */
+static void
+rcv_rtt_measure(PseudoTcpSocket *self, guint32 now) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+
+    if (priv->rcv_rtt_time != 0) {
+        long sample;
+
+        if (SMALLER(priv->rcv_nxt, priv->rcv_rtt_seq))
+            return;
+
+        sample = max(time_diff(now, priv->rcv_rtt_time), 1);
+        if (priv->rcv_rtt == 0 || (guint32) sample < priv->rcv_rtt)
+            priv->rcv_rtt = sample;
+    }
+
+    priv->rcv_rtt_seq = priv->rcv_nxt + priv->rcv_wnd;
+    priv->rcv_rtt_time = now;
+}
+
+/* Receive buffer auto-tuning, after Linux's dynamic right-sizing: once a
+ * round trip, the buffer is grown to twice what the application read during
+ * the last one, more if that is growing, so the sender is never limited by
+ * the advertised window while the application keeps up. */
+static void
+rcv_space_adjust(PseudoTcpSocket *self, gsize copied) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint32 now, rtt;
+    guint64 rcvwin;
+
+    if (priv->rbuf_max <= priv->rbuf_len)
+        return;
+
+    now = get_current_time(self);
+    priv->rcvq_copied += copied;
+
+    rtt = priv->rcv_rtt;
+    if (rtt == 0 || (priv->rx_srtt != 0 && priv->rx_srtt < rtt))
+        rtt = priv->rx_srtt;
+
+    if (rtt == 0 || time_diff(now, priv->rcvq_time) < (long) rtt)
+        return;
+
+    if (priv->rcvq_copied > priv->rcvq_space) {
+        rcvwin = 2 * (guint64) priv->rcvq_copied + 16 * priv->mss;
+        rcvwin += 2 * rcvwin * (priv->rcvq_copied - priv->rcvq_space) /
+                  priv->rcvq_space;
+        rcvwin = min(rcvwin, priv->rbuf_max);
+
+        /* Out-of-order data is kept in the free space of the buffer, which
+     * resizing it does not preserve, so wait for the holes to be filled. */
+        if (rcvwin > priv->rbuf_len && priv->rlist_len == 0) {
+            guint32 new_size = priv->rbuf_len +
+                               budget_charge(self, rcvwin - priv->rbuf_len);
+            gboolean result;
+
+            if (new_size > priv->rbuf_len) {
+                DEBUG(PSEUDO_TCP_DEBUG_NORMAL,
+                      "Growing receive buffer to %u (read %u in %u ms)",
+                      new_size, priv->rcvq_copied, rtt);
+                result = pseudo_tcp_fifo_set_capacity(&priv->rbuf, new_size);
+                g_assert(result);
+                priv->rbuf_len = new_size;
+            }
+        }
+
+        priv->rcvq_space = priv->rcvq_copied;
+    }
+
+    priv->rcvq_copied = 0;
+    priv->rcvq_time = now;
+}
+
+/* Send buffer auto-tuning: room for twice the congestion window, so that new
+ * data can be queued while a full window is in flight. */
+static void
+grow_send_buffer(PseudoTcpSocket *self) {
+    PseudoTcpSocketPrivate *priv = self->priv;
+    guint64 wanted = min(2 * (guint64) priv->cc.cwnd, priv->sbuf_max);
+    guint32 new_size;
+
+    if (wanted <= priv->sbuf_len)
+        return;
+
+    new_size = priv->sbuf_len + budget_charge(self, wanted - priv->sbuf_len);
+    if (new_size > priv->sbuf_len) {
+        DEBUG(PSEUDO_TCP_DEBUG_NORMAL, "Growing send buffer to %u", new_size);
+        resize_send_buffer(self, new_size);
+    }
+}
+
 gint pseudo_tcp_socket_get_available_bytes(PseudoTcpSocket *self) {
     PseudoTcpSocketPrivate *priv = self->priv;
 
@@ -2547,6 +4156,13 @@ set_state_established(PseudoTcpSocket *self) {
     set_state(self, PSEUDO_TCP_ESTABLISHED);
 
     adjustMTU(self);
+
+    // Start measuring what the application reads from about the initial
+    // window, and don't leave slow start at the initial receive buffer size
+    // when the buffers will grow.
+    priv->rcvq_space = min(priv->rbuf_len, 10 * priv->mss);
+    priv->rcvq_time = get_current_time(self);
+    priv->cc.ssthresh = max(priv->cc.ssthresh, priv->sbuf_max);
     if (priv->callbacks.PseudoTcpOpened)
         priv->callbacks.PseudoTcpOpened(self, priv->callbacks.user_data);
 }
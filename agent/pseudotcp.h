@@ -217,6 +217,27 @@ typedef enum {
     PSEUDO_TCP_SHUTDOWN_RDWR,
 } PseudoTcpShutdown;
 
+/**
+ * PseudoTcpCongestionControl:
+ * @PSEUDO_TCP_CONGESTION_CONTROL_RENO: NewReno (RFC 6582), the historical
+ * behaviour
+ * @PSEUDO_TCP_CONGESTION_CONTROL_CUBIC: CUBIC (RFC 8312), which regrows the
+ * window faster on paths with a high bandwidth-delay product
+ * @PSEUDO_TCP_CONGESTION_CONTROL_BBR: A model-based controller in the style of
+ * BBR, sizing the window from the measured bottleneck bandwidth and minimum
+ * round-trip time rather than from losses
+ *
+ * Congestion control algorithms which can be used by a #PseudoTcpSocket. See
+ * #PseudoTcpSocket:congestion-control.
+ *
+ * Since: 0.1.20
+ */
+typedef enum {
+    PSEUDO_TCP_CONGESTION_CONTROL_RENO,
+    PSEUDO_TCP_CONGESTION_CONTROL_CUBIC,
+    PSEUDO_TCP_CONGESTION_CONTROL_BBR,
+} PseudoTcpCongestionControl;
+
 /**
  * PseudoTcpCallbacks:
  * @user_data: A user defined pointer to be passed to the callbacks
@@ -242,6 +263,46 @@ typedef struct {
                                         const gchar *buffer, guint32 len, gpointer data);
 } PseudoTcpCallbacks;
 
+/**
+ * PseudoTcpWritePacketsFunc:
+ * @tcp: The #PseudoTcpSocket
+ * @messages: (array length=n_messages): The packets to send, each in a single
+ * buffer
+ * @n_messages: The number of packets in @messages
+ * @data: The @user_data of the #PseudoTcpCallbacks
+ *
+ * Sends several packets in one go, for instance with a single
+ * nice_socket_send_messages() call. Packets which are not sent are treated as
+ * lost, and retransmitted later. Unlike %PseudoTcpCallbacks:WritePacket, this
+ * cannot refuse a packet for being too large.
+ * <para> See also: pseudo_tcp_socket_set_write_packets_func() </para>
+ *
+ * Returns: The number of packets sent, or -1 if sending failed and the
+ * connection should be aborted
+ *
+ * Since: 0.1.20
+ */
+typedef gint (*PseudoTcpWritePacketsFunc)(PseudoTcpSocket *tcp,
+                                          const NiceOutputMessage *messages, guint n_messages, gpointer data);
+
+/**
+ * PseudoTcpBufferBudget:
+ * @limit: The number of bytes the sockets may grow their buffers by in total
+ * @used: The number of bytes currently taken, maintained by the sockets
+ *
+ * Memory shared by a group of pseudo-TCP sockets for growing their buffers
+ * beyond their initial sizes, so that auto-tuning cannot make them use more
+ * than @limit bytes on top of those between them. Buffers are not shrunk when
+ * the budget runs out, they only stop growing. See
+ * #PseudoTcpSocket:buffer-budget.
+ *
+ * Since: 0.1.20
+ */
+typedef struct {
+    gsize limit;
+    gsize used;
+} PseudoTcpBufferBudget;
+
 /**
  * pseudo_tcp_socket_new:
  * @conversation: The conversation id for the socket.
@@ -311,6 +372,55 @@ gboolean pseudo_tcp_socket_connect(PseudoTcpSocket *self);
  */
 gint pseudo_tcp_socket_recv(PseudoTcpSocket *self, char *buffer, size_t len);
 
+/**
+ * pseudo_tcp_socket_peek:
+ * @self: The #PseudoTcpSocket object.
+ * @buffer: (out): Return location for the received data
+ *
+ * Get the received data at the head of the receive buffer without copying
+ * it. Only the contiguous part of the data is returned; once it has been
+ * used, pseudo_tcp_socket_consume() must be called, and the rest can be
+ * retrieved with another call to this function.
+ *
+ * The same rules as for pseudo_tcp_socket_recv() apply.
+ *
+ * Returns: The number of bytes available at @buffer, 0 at the end of the
+ * stream, or -1 in case of error
+ *
+ * Since: 0.1.20
+ */
+gint pseudo_tcp_socket_peek(PseudoTcpSocket *self, const guint8 **buffer);
+
+/**
+ * pseudo_tcp_socket_consume:
+ * @self: The #PseudoTcpSocket object.
+ * @len: The number of bytes to drop
+ *
+ * Drop @len bytes returned by pseudo_tcp_socket_peek() from the receive
+ * buffer, making room for more data.
+ *
+ * Since: 0.1.20
+ */
+void pseudo_tcp_socket_consume(PseudoTcpSocket *self, gsize len);
+
+/**
+ * pseudo_tcp_socket_get_receive_region:
+ * @self: The #PseudoTcpSocket object.
+ * @len: (out): Return location for the length of the region
+ *
+ * Get the free part of the receive buffer where the next in-order data
+ * will be stored. A packet received into it, after a 24-byte header
+ * buffer, and passed to pseudo_tcp_socket_notify_message() has its data
+ * queued without being copied. The region is only valid until the next
+ * call into the socket.
+ *
+ * Returns: The region, or %NULL if packets can't be received in place at
+ * the moment
+ *
+ * Since: 0.1.20
+ */
+guint8 *pseudo_tcp_socket_get_receive_region(PseudoTcpSocket *self, gsize *len);
+
 
 /**
  * pseudo_tcp_socket_send:
@@ -456,13 +566,32 @@ void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self);
  * @self: The #PseudoTcpSocket object.
  * @mtu: The new MTU of the socket
  *
- * Set the MTU of the socket
+ * Set the MTU of the socket: the largest IP packet known to reach the peer.
+ * The segment size is derived from it by subtracting the pseudo-TCP header and
+ * #PseudoTcpSocket:transport-overhead. If #PseudoTcpSocket:max-mtu is larger,
+ * the socket probes for a larger MTU once connected.
  *
  * Since: 0.0.11
  */
 void pseudo_tcp_socket_notify_mtu(PseudoTcpSocket *self, guint16 mtu);
 
 
+/**
+ * pseudo_tcp_socket_set_write_packets_func:
+ * @self: The #PseudoTcpSocket object.
+ * @func: (nullable): The function to send batches of packets with, or %NULL
+ *
+ * Send the packets the socket produces in a burst, as when an acknowledgement
+ * opens the congestion window, through @func rather than one at a time through
+ * %PseudoTcpCallbacks:WritePacket, which is still used for lone packets and for
+ * path MTU probes.
+ *
+ * Since: 0.1.20
+ */
+void pseudo_tcp_socket_set_write_packets_func(PseudoTcpSocket *self,
+                                              PseudoTcpWritePacketsFunc func);
+
+
 /**
  * pseudo_tcp_socket_notify_packet:
  * @self: The #PseudoTcpSocket object.
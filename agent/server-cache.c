@@ -0,0 +1,227 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "server-cache.h"
+
+typedef struct {
+    NiceAddress local;  /* without port */
+    NiceAddress server;
+    NiceAddress mapped;
+    guint local_port;   /* port of the last answer */
+    guint n_preserved;  /* consecutive answers which kept the local port */
+    gint64 stamp;
+} MappedEntry;
+
+typedef struct {
+    NiceAddress server;
+    guint8 *msg;
+    gsize len;
+    gint64 stamp;
+} ChallengeEntry;
+
+static GMutex server_cache_mutex;
+static GSList *mapped_entries;    /* of MappedEntry */
+static GSList *challenge_entries; /* of ChallengeEntry */
+
+static gboolean
+entry_is_fresh(gint64 stamp, gint64 now, guint max_age) {
+    return now - stamp <= (gint64) max_age * G_USEC_PER_SEC;
+}
+
+static void
+challenge_entry_free(ChallengeEntry *entry) {
+    g_free(entry->msg);
+    g_slice_free(ChallengeEntry, entry);
+}
+
+static void
+server_cache_prune(gint64 now) {
+    GSList *i, *next;
+
+    for (i = mapped_entries; i; i = next) {
+        MappedEntry *entry = i->data;
+
+        next = i->next;
+        if (!entry_is_fresh(entry->stamp, now, NICE_SERVER_CACHE_MAX_AGE)) {
+            mapped_entries = g_slist_delete_link(mapped_entries, i);
+            g_slice_free(MappedEntry, entry);
+        }
+    }
+
+    for (i = challenge_entries; i; i = next) {
+        ChallengeEntry *entry = i->data;
+
+        next = i->next;
+        if (!entry_is_fresh(entry->stamp, now, NICE_SERVER_CACHE_MAX_AGE)) {
+            challenge_entries = g_slist_delete_link(challenge_entries, i);
+            challenge_entry_free(entry);
+        }
+    }
+}
+
+static MappedEntry *
+find_mapped_entry(const NiceAddress *local, const NiceAddress *server) {
+    GSList *i;
+
+    for (i = mapped_entries; i; i = i->next) {
+        MappedEntry *entry = i->data;
+
+        if (nice_address_equal_no_port(&entry->local, local) &&
+            nice_address_equal(&entry->server, server))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static ChallengeEntry *
+find_challenge_entry(const NiceAddress *server) {
+    GSList *i;
+
+    for (i = challenge_entries; i; i = i->next) {
+        ChallengeEntry *entry = i->data;
+
+        if (nice_address_equal(&entry->server, server))
+            return entry;
+    }
+
+    return NULL;
+}
+
+gboolean
+nice_server_cache_lookup_mapped(const NiceAddress *local,
+                                const NiceAddress *server, guint max_age,
+                                gboolean predict_port, NiceAddress *mapped) {
+    MappedEntry *entry;
+    guint local_port = nice_address_get_port(local);
+    gboolean found = FALSE;
+
+    g_mutex_lock(&server_cache_mutex);
+
+    entry = find_mapped_entry(local, server);
+    if (entry && entry_is_fresh(entry->stamp, g_get_monotonic_time(), max_age)) {
+        if (entry->local_port == local_port) {
+            *mapped = entry->mapped;
+            found = TRUE;
+        } else if (predict_port && entry->n_preserved >= 2) {
+            *mapped = entry->mapped;
+            nice_address_set_port(mapped, local_port);
+            found = TRUE;
+        }
+    }
+
+    g_mutex_unlock(&server_cache_mutex);
+
+    return found;
+}
+
+void
+nice_server_cache_add_mapped(const NiceAddress *local,
+                             const NiceAddress *server,
+                             const NiceAddress *mapped) {
+    MappedEntry *entry;
+    guint local_port = nice_address_get_port(local);
+    gboolean preserved = nice_address_get_port(mapped) == local_port;
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&server_cache_mutex);
+
+    server_cache_prune(now);
+
+    entry = find_mapped_entry(local, server);
+    if (entry == NULL) {
+        entry = g_slice_new0(MappedEntry);
+        entry->local = *local;
+        nice_address_set_port(&entry->local, 0);
+        entry->server = *server;
+        mapped_entries = g_slist_prepend(mapped_entries, entry);
+    } else if (!nice_address_equal_no_port(&entry->mapped, mapped)) {
+        /* The NAT moved, forget what it used to do. */
+        entry->n_preserved = 0;
+    }
+
+    entry->n_preserved = preserved ? entry->n_preserved + 1 : 0;
+    entry->mapped = *mapped;
+    entry->local_port = local_port;
+    entry->stamp = now;
+
+    g_mutex_unlock(&server_cache_mutex);
+}
+
+gsize
+nice_server_cache_lookup_challenge(const NiceAddress *server, guint max_age,
+                                   guint8 *buf, gsize buf_len) {
+    ChallengeEntry *entry;
+    gsize len = 0;
+
+    g_mutex_lock(&server_cache_mutex);
+
+    entry = find_challenge_entry(server);
+    if (entry && entry->len <= buf_len &&
+        entry_is_fresh(entry->stamp, g_get_monotonic_time(), max_age)) {
+        memcpy(buf, entry->msg, entry->len);
+        len = entry->len;
+    }
+
+    g_mutex_unlock(&server_cache_mutex);
+
+    return len;
+}
+
+void
+nice_server_cache_add_challenge(const NiceAddress *server,
+                                const guint8 *msg, gsize len) {
+    ChallengeEntry *entry;
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&server_cache_mutex);
+
+    server_cache_prune(now);
+
+    entry = find_challenge_entry(server);
+    if (entry == NULL) {
+        entry = g_slice_new0(ChallengeEntry);
+        entry->server = *server;
+        challenge_entries = g_slist_prepend(challenge_entries, entry);
+    }
+
+    g_free(entry->msg);
+    entry->msg = g_memdup(msg, len);
+    entry->len = len;
+    entry->stamp = now;
+
+    g_mutex_unlock(&server_cache_mutex);
+}
@@ -0,0 +1,81 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifndef __LIBNICE_SERVER_CACHE_H__
+#define __LIBNICE_SERVER_CACHE_H__
+
+/* Process-wide cache of what STUN and TURN servers told the agents, so that
+ * agents gathering candidates against the same servers don't all wait for
+ * the same answers. Every lookup gives the age, in seconds, beyond which an
+ * entry is ignored.
+ *
+ * Mapped addresses are kept per local IP address and STUN server. A lookup
+ * for the local port the server last saw returns the mapped address it
+ * reported. A lookup for another port only hits if it allows port
+ * prediction, and once two consecutive answers showed that the NAT keeps the
+ * local port, as 1:1 NATs and unNATed hosts do. It then returns the mapped
+ * IP address with the local port.
+ *
+ * TURN servers get their last authentication challenge kept. An Allocate
+ * built from it carries the realm and nonce right away, which saves the
+ * unauthenticated round trip. */
+
+#include <glib.h>
+
+#include "address.h"
+
+G_BEGIN_DECLS
+
+/* Entries older than this are dropped whatever age the lookups accept. */
+#define NICE_SERVER_CACHE_MAX_AGE 3600
+
+gboolean
+nice_server_cache_lookup_mapped(const NiceAddress *local,
+                                const NiceAddress *server, guint max_age,
+                                gboolean predict_port, NiceAddress *mapped);
+
+void
+nice_server_cache_add_mapped(const NiceAddress *local,
+                             const NiceAddress *server,
+                             const NiceAddress *mapped);
+
+/* Copies the last challenge of @server into @buf, and returns its length or
+ * 0 if there is none, or if it is too old or too large. */
+gsize
+nice_server_cache_lookup_challenge(const NiceAddress *server, guint max_age,
+                                   guint8 *buf, gsize buf_len);
+
+void
+nice_server_cache_add_challenge(const NiceAddress *server,
+                                const guint8 *msg, gsize len);
+
+G_END_DECLS
+
+#endif /* __LIBNICE_SERVER_CACHE_H__ */
@@ -118,6 +118,19 @@ void nice_stream_initialize_credentials(NiceStream *stream, NiceRNG *rng) {
    */
     stream->remote_ufrag[0] = 0;
     stream->remote_password[0] = 0;
+
+    nice_stream_reset_credentials(stream);
+}
+
+/*
+ * Drops the credentials cached by the components of the stream, to be
+ * called whenever the local or remote credentials change.
+ */
+void nice_stream_reset_credentials(NiceStream *stream) {
+    GSList *i;
+
+    for (i = stream->components; i; i = i->next)
+        nice_component_reset_credentials(i->data);
 }
 
 /*
@@ -133,6 +146,7 @@ void nice_stream_restart(NiceStream *stream, NiceAgent *agent) {
     stream->initial_binding_request_received = FALSE;
 
     nice_stream_initialize_credentials(stream, agent->rng);
+    conn_check_reset_request_templates(stream);
 
     for (i = stream->components; i; i = i->next) {
         NiceComponent *component = i->data;
@@ -116,6 +116,9 @@ nice_stream_find_component_by_id (NiceStream *stream, guint id);
 void
 nice_stream_initialize_credentials (NiceStream *stream, NiceRNG *rng);
 
+void
+nice_stream_reset_credentials (NiceStream *stream);
+
 void
 nice_stream_restart (NiceStream *stream, NiceAgent *agent);
 
@@ -262,6 +262,8 @@ nice_socket_is_based_on(NiceSocket *sock, NiceSocket *other) {
 void nice_socket_free(NiceSocket *sock) {
     if (sock) {
         sock->close(sock);
+        if (sock->release)
+            sock->release(sock);
         g_slice_free(NiceSocket, sock);
     }
 }
@@ -90,6 +90,9 @@ struct _NiceSocket {
                                   gpointer user_data);
     gboolean (*is_based_on)(NiceSocket *sock, NiceSocket *other);
     void (*close)(NiceSocket *sock);
+    /* If set, called by nice_socket_free() once the socket is closed, for
+   * its owner to give back what it tied to the socket, e.g. its port. */
+    void (*release)(NiceSocket *sock);
     void *priv;
 };
 
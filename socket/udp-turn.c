@@ -332,6 +332,8 @@ socket_close(NiceSocket *sock) {
 
     g_free(priv->send_buffer);
 
+    stun_agent_clear(&priv->agent);
+
     g_free(priv);
 
     sock->priv = NULL;
@@ -1238,6 +1240,23 @@ void nice_udp_turn_socket_cache_realm_nonce(NiceSocket *sock,
     g_mutex_unlock(&mutex);
 }
 
+/*
+ * Gives the socket's agent the long-term credential key @turn derived for
+ * the REALM of @msg, so that allocations on the same server share it.
+ */
+void nice_udp_turn_socket_share_long_term_key(NiceSocket *sock,
+                                              TurnServer *turn, StunMessage *msg) {
+    UdpTurnPriv *priv = sock->priv;
+
+    g_assert(sock->type == NICE_SOCKET_TYPE_UDP_TURN);
+
+    g_mutex_lock(&mutex);
+    turn_server_set_long_term_key(turn, &priv->agent, msg,
+                                  priv->username, priv->username_len,
+                                  priv->password, priv->password_len);
+    g_mutex_unlock(&mutex);
+}
+
 guint nice_udp_turn_socket_parse_recv_message(NiceSocket *sock, NiceSocket **from_sock,
                                               NiceInputMessage *message) {
     /* TODO: Speed this up in the common reliable case of having a 24-byte header
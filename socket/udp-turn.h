@@ -79,6 +79,10 @@ nice_udp_turn_socket_set_ms_connection_id (NiceSocket *sock, StunMessage *msg);
 void
 nice_udp_turn_socket_cache_realm_nonce (NiceSocket *sock, StunMessage *msg);
 
+void
+nice_udp_turn_socket_share_long_term_key (NiceSocket *sock,
+    struct _TurnServer *turn, StunMessage *msg);
+
 
 G_END_DECLS
 
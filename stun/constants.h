@@ -181,6 +181,20 @@
  */
 #define STUN_AGENT_MAX_SAVED_IDS 200
 
+/**
+ * STUN_AGENT_MAX_SAVED_IDS_LIMIT:
+ *
+ * Upper bound for the number of ongoing STUN transactions that can be set
+ * with stun_agent_set_max_transactions().
+ */
+#define STUN_AGENT_MAX_SAVED_IDS_LIMIT 16384
+
+/*
+ * Size of the hash index over the default transaction table, a power of two
+ * at least twice as large as STUN_AGENT_MAX_SAVED_IDS.
+ */
+#define STUN_AGENT_SAVED_IDS_INDEX_SIZE 512
+
 /**
  * STUN_AGENT_MAX_UNKNOWN_ATTRIBUTES:
  *
@@ -189,6 +203,15 @@
  */
 #define STUN_AGENT_MAX_UNKNOWN_ATTRIBUTES 256
 
+/**
+ * STUN_AGENT_MAX_HMAC_KEYS:
+ *
+ * Number of precomputed MESSAGE-INTEGRITY keys cached by a #StunAgent. This
+ * covers the local and remote passwords of a stream and the long-term keys
+ * of a TURN allocation.
+ */
+#define STUN_AGENT_MAX_HMAC_KEYS 4
+
 #define STUN_MAGIC_COOKIE 0x2112A442
 #define TURN_MAGIC_COOKIE 0x72c64bc6
 
@@ -53,6 +53,172 @@ static bool stun_agent_is_unknown(StunAgent *agent, uint16_t type);
 static unsigned stun_agent_find_unknowns(StunAgent *agent,
                                          const StunMessage *msg, uint16_t *list, unsigned max);
 
+/*
+ * The ongoing transactions are stored in a table of sent_ids_max slots, with
+ * a stack of the free slots and an open addressing (linear probing) index
+ * keyed by the transaction ID. An index entry holds the slot number + 1, 0
+ * marks an empty entry.
+ *
+ * The slots of the default table are the sent_ids of the agent itself and its
+ * index lives in the private part. A larger table set with
+ * stun_agent_set_max_transactions() is allocated in one block and stored in
+ * sent_ids_large.
+ */
+typedef struct {
+    StunAgentSavedIds *ids;
+    uint16_t *index;
+    uint16_t *free_ids;
+    unsigned index_mask;
+} StunAgentSentIdsTable;
+
+/*
+ * Everything a StunAgent allocates. It is created on first use, so that an
+ * agent which never sends a request nor authenticates a message does not
+ * need to be cleared.
+ */
+struct _StunAgentPrivate {
+    uint16_t sent_ids_index[STUN_AGENT_SAVED_IDS_INDEX_SIZE];
+    uint16_t sent_ids_free[STUN_AGENT_MAX_SAVED_IDS];
+    unsigned sent_ids_max;
+    unsigned sent_ids_n_free;
+    StunAgentSentIdsTable *sent_ids_large;
+    StunHmacKey *hmac_keys[STUN_AGENT_MAX_HMAC_KEYS];
+    unsigned next_hmac_key;
+    uint8_t *long_term_creds;
+    size_t long_term_realm_len;
+    size_t long_term_username_len;
+    size_t long_term_password_len;
+    uint8_t long_term_key[16];
+    StunMessageIndex message_index;
+};
+
+static void stun_agent_get_sent_ids(StunAgent *agent,
+                                    StunAgentSentIdsTable *table) {
+    StunAgentPrivate *priv = agent->priv;
+
+    if (priv->sent_ids_large) {
+        *table = *priv->sent_ids_large;
+    } else {
+        table->ids = agent->sent_ids;
+        table->index = priv->sent_ids_index;
+        table->free_ids = priv->sent_ids_free;
+        table->index_mask = STUN_AGENT_SAVED_IDS_INDEX_SIZE - 1;
+    }
+}
+
+static void stun_agent_reset_sent_ids(StunAgent *agent, unsigned max) {
+    StunAgentSentIdsTable table;
+    unsigned i;
+
+    stun_agent_get_sent_ids(agent, &table);
+
+    memset(table.index, 0, (table.index_mask + 1) * sizeof(uint16_t));
+    for (i = 0; i < max; i++) {
+        table.ids[i].valid = FALSE;
+        /* Hand out the lowest slots first */
+        table.free_ids[i] = max - 1 - i;
+    }
+    agent->priv->sent_ids_max = max;
+    agent->priv->sent_ids_n_free = max;
+}
+
+/*
+ * Returns the private part of @agent, creating it if needed, or NULL if it
+ * could not be allocated.
+ */
+static StunAgentPrivate *stun_agent_get_priv(StunAgent *agent) {
+    if (agent->priv == NULL) {
+        agent->priv = calloc(1, sizeof(StunAgentPrivate));
+        if (agent->priv == NULL)
+            return NULL;
+        stun_agent_reset_sent_ids(agent, STUN_AGENT_MAX_SAVED_IDS);
+    }
+
+    return agent->priv;
+}
+
+StunMessageIndex *stun_agent_get_message_index(StunAgent *agent, bool create) {
+    StunAgentPrivate *priv = create ? stun_agent_get_priv(agent) : agent->priv;
+
+    return priv ? &priv->message_index : NULL;
+}
+
+/* Transaction IDs are random, folding them is enough to spread them */
+static unsigned stun_agent_hash_id(const StunTransactionId id) {
+    uint32_t w[4];
+    uint32_t h;
+
+    memcpy(w, id, sizeof(w));
+    h = w[0] ^ w[1] ^ w[2] ^ w[3];
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+
+    return h;
+}
+
+/*
+ * Returns the position of @id in the index, or -1 if it is not an ongoing
+ * transaction.
+ */
+static int stun_agent_lookup_sent_id(const StunAgentSentIdsTable *table,
+                                     const StunTransactionId id) {
+    unsigned pos = stun_agent_hash_id(id) & table->index_mask;
+
+    while (table->index[pos] != 0) {
+        if (memcmp(id, table->ids[table->index[pos] - 1].id,
+                   sizeof(StunTransactionId)) == 0) {
+            return pos;
+        }
+        pos = (pos + 1) & table->index_mask;
+    }
+
+    return -1;
+}
+
+static void stun_agent_insert_sent_id(const StunAgentSentIdsTable *table,
+                                      unsigned slot) {
+    unsigned pos = stun_agent_hash_id(table->ids[slot].id) & table->index_mask;
+
+    while (table->index[pos] != 0)
+        pos = (pos + 1) & table->index_mask;
+
+    table->index[pos] = slot + 1;
+}
+
+/*
+ * Releases the slot referenced at index position @pos. The following entries
+ * of the probe sequence are shifted back, so that no tombstones are needed.
+ */
+static void stun_agent_remove_sent_id(StunAgent *agent,
+                                      const StunAgentSentIdsTable *table, unsigned pos) {
+    unsigned slot = table->index[pos] - 1;
+    unsigned next = pos;
+
+    table->ids[slot].valid = FALSE;
+    table->free_ids[agent->priv->sent_ids_n_free++] = slot;
+
+    table->index[pos] = 0;
+    for (;;) {
+        unsigned home;
+
+        next = (next + 1) & table->index_mask;
+        if (table->index[next] == 0)
+            break;
+
+        home = stun_agent_hash_id(table->ids[table->index[next] - 1].id) &
+               table->index_mask;
+        /* Move the entry back if its home position is not between the hole
+         * and its current position (cyclically) */
+        if ((next > pos && (home <= pos || home > next)) ||
+            (next < pos && (home <= pos && home > next))) {
+            table->index[pos] = table->index[next];
+            table->index[next] = 0;
+            pos = next;
+        }
+    }
+}
+
 void stun_agent_init(StunAgent *agent, const uint16_t *known_attributes,
                      StunCompatibility compatibility, StunAgentUsageFlags usage_flags) {
     int i;
@@ -64,9 +230,260 @@ void stun_agent_init(StunAgent *agent, const uint16_t *known_attributes,
     agent->ms_ice2_send_legacy_connchecks =
             compatibility == STUN_COMPATIBILITY_MSICE2;
 
-    for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
+    for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++)
         agent->sent_ids[i].valid = FALSE;
+    agent->priv = NULL;
+}
+
+void stun_agent_clear(StunAgent *agent) {
+    StunAgentPrivate *priv = agent->priv;
+    int i;
+
+    if (priv == NULL)
+        return;
+
+    for (i = 0; i < STUN_AGENT_MAX_HMAC_KEYS; i++)
+        stun_hmac_key_free(priv->hmac_keys[i]);
+    free(priv->long_term_creds);
+    free(priv->sent_ids_large);
+    free(priv);
+    agent->priv = NULL;
+
+    /* The index is gone, so is every ongoing transaction */
+    for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++)
+        agent->sent_ids[i].valid = FALSE;
+}
+
+/* Size of the block holding a table of @max slots and its index */
+static size_t stun_agent_sent_ids_large_size(unsigned max,
+                                             unsigned index_size) {
+    return sizeof(StunAgentSentIdsTable) +
+           max * sizeof(StunAgentSavedIds) +
+           (index_size + max) * sizeof(uint16_t);
+}
+
+static void stun_agent_sent_ids_large_link(StunAgentSentIdsTable *table,
+                                           unsigned max, unsigned index_size) {
+    table->ids = (StunAgentSavedIds *) (table + 1);
+    table->index = (uint16_t *) (table->ids + max);
+    table->free_ids = table->index + index_size;
+    table->index_mask = index_size - 1;
+}
+
+bool stun_agent_copy(StunAgent *dest, const StunAgent *src) {
+    const StunAgentPrivate *src_priv = src->priv;
+    StunAgentPrivate *priv;
+    int i;
+
+    memcpy(dest, src, sizeof(StunAgent));
+    dest->priv = NULL;
+
+    if (src_priv == NULL)
+        return TRUE;
+
+    priv = malloc(sizeof(StunAgentPrivate));
+    if (priv == NULL)
+        goto error;
+    memcpy(priv, src_priv, sizeof(StunAgentPrivate));
+    dest->priv = priv;
+
+    /* The precomputed keys are only a cache, the copy rebuilds its own */
+    for (i = 0; i < STUN_AGENT_MAX_HMAC_KEYS; i++) {
+        priv->hmac_keys[i] = NULL;
     }
+    priv->next_hmac_key = 0;
+    priv->long_term_creds = NULL;
+    priv->sent_ids_large = NULL;
+
+    if (src_priv->long_term_creds) {
+        size_t len = src_priv->long_term_realm_len +
+                     src_priv->long_term_username_len +
+                     src_priv->long_term_password_len + 1;
+
+        priv->long_term_creds = malloc(len);
+        if (priv->long_term_creds == NULL)
+            goto error;
+        memcpy(priv->long_term_creds, src_priv->long_term_creds, len);
+    }
+
+    if (src_priv->sent_ids_large) {
+        unsigned index_size = src_priv->sent_ids_large->index_mask + 1;
+        size_t size = stun_agent_sent_ids_large_size(src_priv->sent_ids_max,
+                                                     index_size);
+
+        priv->sent_ids_large = malloc(size);
+        if (priv->sent_ids_large == NULL)
+            goto error;
+        memcpy(priv->sent_ids_large, src_priv->sent_ids_large, size);
+        stun_agent_sent_ids_large_link(priv->sent_ids_large,
+                                       src_priv->sent_ids_max, index_size);
+    }
+
+    return TRUE;
+
+error:
+    stun_agent_clear(dest);
+    return FALSE;
+}
+
+bool stun_agent_set_max_transactions(StunAgent *agent,
+                                     unsigned max_transactions) {
+    StunAgentPrivate *priv;
+    StunAgentSentIdsTable *table;
+    unsigned index_size;
+
+    if (max_transactions == 0 ||
+        max_transactions > STUN_AGENT_MAX_SAVED_IDS_LIMIT) {
+        return FALSE;
+    }
+
+    priv = stun_agent_get_priv(agent);
+    if (priv == NULL || priv->sent_ids_n_free != priv->sent_ids_max)
+        return FALSE;
+
+    free(priv->sent_ids_large);
+    priv->sent_ids_large = NULL;
+
+    if (max_transactions > STUN_AGENT_MAX_SAVED_IDS) {
+        index_size = STUN_AGENT_SAVED_IDS_INDEX_SIZE;
+        while (index_size < 2 * max_transactions)
+            index_size *= 2;
+
+        table = malloc(stun_agent_sent_ids_large_size(max_transactions,
+                                                      index_size));
+        if (table == NULL) {
+            stun_agent_reset_sent_ids(agent, STUN_AGENT_MAX_SAVED_IDS);
+            return FALSE;
+        }
+
+        stun_agent_sent_ids_large_link(table, max_transactions, index_size);
+        priv->sent_ids_large = table;
+    }
+
+    stun_agent_reset_sent_ids(agent, max_transactions);
+
+    return TRUE;
+}
+
+/*
+ * Returns the precomputed key for @key, creating it if it is not cached yet.
+ * The oldest entry is replaced when the cache is full.
+ */
+static StunHmacKey *stun_agent_get_hmac_key(StunAgent *agent,
+                                            const uint8_t *key, size_t key_len) {
+    StunAgentPrivate *priv = stun_agent_get_priv(agent);
+    StunHmacKey *hkey;
+    int i;
+
+    if (priv == NULL)
+        return NULL;
+
+    for (i = 0; i < STUN_AGENT_MAX_HMAC_KEYS; i++) {
+        if (priv->hmac_keys[i] &&
+            stun_hmac_key_equal(priv->hmac_keys[i], key, key_len)) {
+            return priv->hmac_keys[i];
+        }
+    }
+
+    hkey = stun_hmac_key_new(key, key_len);
+    if (hkey == NULL)
+        return NULL;
+
+    i = priv->next_hmac_key;
+    stun_hmac_key_free(priv->hmac_keys[i]);
+    priv->hmac_keys[i] = hkey;
+    priv->next_hmac_key = (i + 1) % STUN_AGENT_MAX_HMAC_KEYS;
+
+    return hkey;
+}
+
+static bool stun_agent_has_long_term_key(const StunAgent *agent,
+                                         const uint8_t *realm, size_t realm_len,
+                                         const uint8_t *username, size_t username_len,
+                                         const uint8_t *password, size_t password_len) {
+    const StunAgentPrivate *priv = agent->priv;
+    const uint8_t *creds;
+
+    if (priv == NULL || priv->long_term_creds == NULL)
+        return FALSE;
+
+    creds = priv->long_term_creds;
+    return priv->long_term_realm_len == realm_len &&
+           priv->long_term_username_len == username_len &&
+           priv->long_term_password_len == password_len &&
+           memcmp(creds, realm, realm_len) == 0 &&
+           memcmp(creds + realm_len, username, username_len) == 0 &&
+           memcmp(creds + realm_len + username_len, password, password_len) == 0;
+}
+
+void stun_agent_set_long_term_key(StunAgent *agent,
+                                  const uint8_t *realm, size_t realm_len,
+                                  const uint8_t *username, size_t username_len,
+                                  const uint8_t *password, size_t password_len,
+                                  const uint8_t key[16]) {
+    StunAgentPrivate *priv;
+    uint8_t *creds;
+
+    if (stun_agent_has_long_term_key(agent, realm, realm_len,
+                                     username, username_len, password, password_len)) {
+        memcpy(agent->priv->long_term_key, key, sizeof(agent->priv->long_term_key));
+        return;
+    }
+
+    priv = stun_agent_get_priv(agent);
+    if (priv == NULL)
+        return;
+
+    creds = malloc(realm_len + username_len + password_len + 1);
+    if (creds == NULL)
+        return;
+
+    memcpy(creds, realm, realm_len);
+    memcpy(creds + realm_len, username, username_len);
+    memcpy(creds + realm_len + username_len, password, password_len);
+
+    free(priv->long_term_creds);
+    priv->long_term_creds = creds;
+    priv->long_term_realm_len = realm_len;
+    priv->long_term_username_len = username_len;
+    priv->long_term_password_len = password_len;
+    memcpy(priv->long_term_key, key, sizeof(priv->long_term_key));
+}
+
+/*
+ * Derives the long-term credential key, reusing the one of the last
+ * credentials the agent used if they did not change.
+ */
+static void stun_agent_long_term_key(StunAgent *agent,
+                                     const uint8_t *realm, size_t realm_len,
+                                     const uint8_t *username, size_t username_len,
+                                     const uint8_t *password, size_t password_len,
+                                     uint8_t md5[16]) {
+    if (stun_agent_has_long_term_key(agent, realm, realm_len,
+                                     username, username_len, password, password_len)) {
+        memcpy(md5, agent->priv->long_term_key, 16);
+        return;
+    }
+
+    stun_hash_creds(realm, realm_len, username, username_len,
+                    password, password_len, md5);
+    stun_agent_set_long_term_key(agent, realm, realm_len, username, username_len,
+                                 password, password_len, md5);
+}
+
+/*
+ * Computes the MESSAGE-INTEGRITY hash with the agent's cached key schedule,
+ * falling back to a one-shot computation if it could not be created.
+ */
+static void stun_agent_sha1(StunAgent *agent, const uint8_t *msg, size_t len,
+                            size_t msg_len, uint8_t *sha, const uint8_t *key, size_t key_len,
+                            int padding) {
+    StunHmacKey *hkey = stun_agent_get_hmac_key(agent, key, key_len);
+
+    if (hkey)
+        stun_sha1_with_key(hkey, msg, len, msg_len, sha, padding);
+    else
+        stun_sha1(msg, len, msg_len, sha, key, key_len, padding);
 }
 
 
@@ -137,6 +554,7 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
                                          const uint8_t *buffer, size_t buffer_len,
                                          StunMessageIntegrityValidate validater, void *validater_data) {
     StunTransactionId msg_id;
+    StunAgentSentIdsTable sent_ids;
     int len;
     uint8_t *username = NULL;
     uint16_t username_len;
@@ -170,6 +588,13 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
     msg->key_len = 0;
     msg->long_term_valid = FALSE;
 
+    /* All the lookups below and those done by the caller use this index. It
+     * is kept in the private part of the agent, which is not allocated just
+     * for it: an agent which never sends a request nor authenticates a
+     * message has few lookups to save. */
+    if (agent->priv)
+        stun_message_index_attributes(msg);
+
     /* TODO: reject it or not ? */
     if ((agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
          agent->compatibility == STUN_COMPATIBILITY_MSICE2) &&
@@ -190,24 +615,28 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
 
     if (stun_message_get_class(msg) == STUN_RESPONSE ||
         stun_message_get_class(msg) == STUN_ERROR) {
+        StunAgentSavedIds *saved;
+
+        if (agent->priv == NULL) {
+            return STUN_VALIDATION_UNMATCHED_RESPONSE;
+        }
+
         stun_message_id(msg, msg_id);
-        for (sent_id_idx = 0; sent_id_idx < STUN_AGENT_MAX_SAVED_IDS; sent_id_idx++) {
-            if (agent->sent_ids[sent_id_idx].valid == TRUE &&
-                agent->sent_ids[sent_id_idx].method == stun_message_get_method(msg) &&
-                memcmp(msg_id, agent->sent_ids[sent_id_idx].id,
-                       sizeof(StunTransactionId)) == 0) {
-
-                key = agent->sent_ids[sent_id_idx].key;
-                key_len = agent->sent_ids[sent_id_idx].key_len;
-                memcpy(long_term_key, agent->sent_ids[sent_id_idx].long_term_key,
-                       sizeof(long_term_key));
-                long_term_key_valid = agent->sent_ids[sent_id_idx].long_term_valid;
-                break;
-            }
+        stun_agent_get_sent_ids(agent, &sent_ids);
+        sent_id_idx = stun_agent_lookup_sent_id(&sent_ids, msg_id);
+        if (sent_id_idx == -1) {
+            return STUN_VALIDATION_UNMATCHED_RESPONSE;
         }
-        if (sent_id_idx == STUN_AGENT_MAX_SAVED_IDS) {
+
+        saved = &sent_ids.ids[sent_ids.index[sent_id_idx] - 1];
+        if (saved->method != stun_message_get_method(msg)) {
             return STUN_VALIDATION_UNMATCHED_RESPONSE;
         }
+
+        key = saved->key;
+        key_len = saved->key_len;
+        memcpy(long_term_key, saved->long_term_key, sizeof(long_term_key));
+        long_term_key_valid = saved->long_term_valid;
     }
 
     ignore_credentials =
@@ -276,9 +705,9 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
                     if (username == NULL || realm == NULL) {
                         return STUN_VALIDATION_UNAUTHORIZED;
                     }
-                    stun_hash_creds(realm, realm_len,
-                                    username, username_len,
-                                    key, key_len, md5);
+                    stun_agent_long_term_key(agent, realm, realm_len,
+                                             username, username_len,
+                                             key, key_len, md5);
                 }
 
                 memcpy(msg->long_term_key, md5, sizeof(md5));
@@ -286,26 +715,26 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
 
                 if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
                     agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-                    stun_sha1(msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
-                              sha, md5, sizeof(md5), TRUE);
+                    stun_agent_sha1(agent, msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
+                                           sha, md5, sizeof(md5), TRUE);
                 } else if (agent->compatibility == STUN_COMPATIBILITY_MSICE2) {
-                    stun_sha1(msg->buffer, hash + 20 - msg->buffer,
-                              stun_message_length(msg) - 20, sha, md5, sizeof(md5), TRUE);
+                    stun_agent_sha1(agent, msg->buffer, hash + 20 - msg->buffer,
+                                           stun_message_length(msg) - 20, sha, md5, sizeof(md5), TRUE);
                 } else {
-                    stun_sha1(msg->buffer, hash + 20 - msg->buffer,
-                              hash - msg->buffer, sha, md5, sizeof(md5), FALSE);
+                    stun_agent_sha1(agent, msg->buffer, hash + 20 - msg->buffer,
+                                           hash - msg->buffer, sha, md5, sizeof(md5), FALSE);
                 }
             } else {
                 if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
                     agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-                    stun_sha1(msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
-                              sha, key, key_len, TRUE);
+                    stun_agent_sha1(agent, msg->buffer, hash + 20 - msg->buffer, hash - msg->buffer,
+                                           sha, key, key_len, TRUE);
                 } else if (agent->compatibility == STUN_COMPATIBILITY_MSICE2) {
-                    stun_sha1(msg->buffer, hash + 20 - msg->buffer,
-                              stun_message_length(msg) - 20, sha, key, key_len, TRUE);
+                    stun_agent_sha1(agent, msg->buffer, hash + 20 - msg->buffer,
+                                           stun_message_length(msg) - 20, sha, key, key_len, TRUE);
                 } else {
-                    stun_sha1(msg->buffer, hash + 20 - msg->buffer,
-                              hash - msg->buffer, sha, key, key_len, FALSE);
+                    stun_agent_sha1(agent, msg->buffer, hash + 20 - msg->buffer,
+                                           hash - msg->buffer, sha, key, key_len, FALSE);
                 }
             }
 
@@ -340,8 +769,8 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
         }
     }
 
-    if (sent_id_idx != -1 && sent_id_idx < STUN_AGENT_MAX_SAVED_IDS) {
-        agent->sent_ids[sent_id_idx].valid = FALSE;
+    if (sent_id_idx != -1) {
+        stun_agent_remove_sent_id(agent, &sent_ids, sent_id_idx);
     }
 
     /* [MS-ICE2] 3.1.4.8.2 stop sending additional connectivity checks */
@@ -360,18 +789,19 @@ StunValidationStatus stun_agent_validate(StunAgent *agent, StunMessage *msg,
 }
 
 bool stun_agent_forget_transaction(StunAgent *agent, StunTransactionId id) {
-    int i;
+    StunAgentSentIdsTable sent_ids;
+    int pos;
 
-    for (i = 0; i < STUN_AGENT_MAX_SAVED_IDS; i++) {
-        if (agent->sent_ids[i].valid == TRUE &&
-            memcmp(id, agent->sent_ids[i].id,
-                   sizeof(StunTransactionId)) == 0) {
-            agent->sent_ids[i].valid = FALSE;
-            return TRUE;
-        }
-    }
+    if (agent->priv == NULL)
+        return FALSE;
 
-    return FALSE;
+    stun_agent_get_sent_ids(agent, &sent_ids);
+    pos = stun_agent_lookup_sent_id(&sent_ids, id);
+    if (pos == -1)
+        return FALSE;
+
+    stun_agent_remove_sent_id(agent, &sent_ids, pos);
+    return TRUE;
 }
 
 bool stun_agent_init_request(StunAgent *agent, StunMessage *msg,
@@ -541,7 +971,6 @@ size_t stun_agent_finish_message(StunAgent *agent, StunMessage *msg,
                                  const uint8_t *key, size_t key_len) {
     uint8_t *ptr;
     uint32_t fpr;
-    int saved_id_idx = 0;
     uint8_t md5[16];
     bool remember_transaction;
 
@@ -556,14 +985,9 @@ size_t stun_agent_finish_message(StunAgent *agent, StunMessage *msg,
         remember_transaction = FALSE;
     }
 
-    if (remember_transaction) {
-        for (saved_id_idx = 0; saved_id_idx < STUN_AGENT_MAX_SAVED_IDS; saved_id_idx++) {
-            if (agent->sent_ids[saved_id_idx].valid == FALSE) {
-                break;
-            }
-        }
-    }
-    if (saved_id_idx == STUN_AGENT_MAX_SAVED_IDS) {
+    if (remember_transaction &&
+        (stun_agent_get_priv(agent) == NULL ||
+         agent->priv->sent_ids_n_free == 0)) {
         stun_debug("WARNING: Saved IDs full. STUN message dropped.");
         return 0;
     }
@@ -591,9 +1015,9 @@ size_t stun_agent_finish_message(StunAgent *agent, StunMessage *msg,
             if (username == NULL || realm == NULL) {
                 skip = TRUE;
             } else {
-                stun_hash_creds(realm, realm_len,
-                                username, username_len,
-                                key, key_len, md5);
+                stun_agent_long_term_key(agent, realm, realm_len,
+                                         username, username_len,
+                                         key, key_len, md5);
                 memcpy(msg->long_term_key, md5, sizeof(msg->long_term_key));
                 msg->long_term_valid = TRUE;
             }
@@ -609,34 +1033,34 @@ size_t stun_agent_finish_message(StunAgent *agent, StunMessage *msg,
             if (agent->usage_flags & STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS) {
                 if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
                     agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-                    stun_sha1(msg->buffer, stun_message_length(msg),
-                              stun_message_length(msg) - 20, ptr, md5, sizeof(md5), TRUE);
+                    stun_agent_sha1(agent, msg->buffer, stun_message_length(msg),
+                                           stun_message_length(msg) - 20, ptr, md5, sizeof(md5), TRUE);
                 } else if (agent->compatibility == STUN_COMPATIBILITY_MSICE2) {
                     size_t minus = 20;
                     if (agent->usage_flags & STUN_AGENT_USAGE_USE_FINGERPRINT)
                         minus -= 8;
 
-                    stun_sha1(msg->buffer, stun_message_length(msg),
-                              stun_message_length(msg) - minus, ptr, md5, sizeof(md5), TRUE);
+                    stun_agent_sha1(agent, msg->buffer, stun_message_length(msg),
+                                           stun_message_length(msg) - minus, ptr, md5, sizeof(md5), TRUE);
                 } else {
-                    stun_sha1(msg->buffer, stun_message_length(msg),
-                              stun_message_length(msg) - 20, ptr, md5, sizeof(md5), FALSE);
+                    stun_agent_sha1(agent, msg->buffer, stun_message_length(msg),
+                                           stun_message_length(msg) - 20, ptr, md5, sizeof(md5), FALSE);
                 }
             } else {
                 if (agent->compatibility == STUN_COMPATIBILITY_RFC3489 ||
                     agent->compatibility == STUN_COMPATIBILITY_OC2007) {
-                    stun_sha1(msg->buffer, stun_message_length(msg),
-                              stun_message_length(msg) - 20, ptr, key, key_len, TRUE);
+                    stun_agent_sha1(agent, msg->buffer, stun_message_length(msg),
+                                           stun_message_length(msg) - 20, ptr, key, key_len, TRUE);
                 } else if (agent->compatibility == STUN_COMPATIBILITY_MSICE2) {
                     size_t minus = 20;
                     if (agent->usage_flags & STUN_AGENT_USAGE_USE_FINGERPRINT)
                         minus -= 8;
 
-                    stun_sha1(msg->buffer, stun_message_length(msg),
-                              stun_message_length(msg) - minus, ptr, key, key_len, TRUE);
+                    stun_agent_sha1(agent, msg->buffer, stun_message_length(msg),
+                                           stun_message_length(msg) - minus, ptr, key, key_len, TRUE);
                 } else {
-                    stun_sha1(msg->buffer, stun_message_length(msg),
-                              stun_message_length(msg) - 20, ptr, key, key_len, FALSE);
+                    stun_agent_sha1(agent, msg->buffer, stun_message_length(msg),
+                                           stun_message_length(msg) - 20, ptr, key, key_len, FALSE);
                 }
             }
 
@@ -662,14 +1086,24 @@ size_t stun_agent_finish_message(StunAgent *agent, StunMessage *msg,
 
 
     if (remember_transaction) {
-        stun_message_id(msg, agent->sent_ids[saved_id_idx].id);
-        agent->sent_ids[saved_id_idx].method = stun_message_get_method(msg);
-        agent->sent_ids[saved_id_idx].key = (uint8_t *) key;
-        agent->sent_ids[saved_id_idx].key_len = key_len;
-        memcpy(agent->sent_ids[saved_id_idx].long_term_key, msg->long_term_key,
+        StunAgentSentIdsTable sent_ids;
+        StunAgentSavedIds *saved;
+        unsigned saved_id_idx;
+
+        stun_agent_get_sent_ids(agent, &sent_ids);
+        saved_id_idx = sent_ids.free_ids[--agent->priv->sent_ids_n_free];
+        saved = &sent_ids.ids[saved_id_idx];
+
+        stun_message_id(msg, saved->id);
+        saved->method = stun_message_get_method(msg);
+        saved->key = (uint8_t *) key;
+        saved->key_len = key_len;
+        memcpy(saved->long_term_key, msg->long_term_key,
                sizeof(msg->long_term_key));
-        agent->sent_ids[saved_id_idx].long_term_valid = msg->long_term_valid;
-        agent->sent_ids[saved_id_idx].valid = TRUE;
+        saved->long_term_valid = msg->long_term_valid;
+        saved->valid = TRUE;
+
+        stun_agent_insert_sent_id(&sent_ids, saved_id_idx);
     }
 
     msg->key = (uint8_t *) key;
@@ -50,6 +50,10 @@
  * ids of the requests you send, so you can validate if a STUN response you
  * received should be processed by that agent or not.
  *
+ * Since 0.1.20, an agent allocates memory once it sends a request or
+ * authenticates a message, so it must be released with stun_agent_clear().
+ * An agent must not be copied by value either, use stun_agent_copy() instead.
+ *
  */
 
 
@@ -69,6 +73,17 @@
  */
 typedef struct stun_agent_t StunAgent;
 
+/**
+ * StunAgentPrivate:
+ *
+ * An opaque structure holding the state a #StunAgent allocates for itself,
+ * like its transaction index and its cached keys. It is released by
+ * stun_agent_clear().
+ *
+ * Since: 0.1.20
+ */
+typedef struct _StunAgentPrivate StunAgentPrivate;
+
 #include "debug.h"
 #include "stunmessage.h"
 
@@ -215,6 +230,7 @@ struct stun_agent_t {
     StunAgentUsageFlags usage_flags;
     const char *software_attribute;
     bool ms_ice2_send_legacy_connchecks;
+    StunAgentPrivate *priv;
 };
 
 /**
@@ -320,6 +336,86 @@ bool stun_agent_default_validater(StunAgent *agent,
 void stun_agent_init(StunAgent *agent, const uint16_t *known_attributes,
                      StunCompatibility compatibility, StunAgentUsageFlags usage_flags);
 
+/**
+ * stun_agent_clear:
+ * @agent: The #StunAgent to clear
+ *
+ * Frees the resources held by the @agent, like the precomputed
+ * MESSAGE-INTEGRITY keys, the cached long-term credential key or an enlarged
+ * transaction table. This must be called
+ * before the memory of an agent initialized with stun_agent_init() is released
+ * or before it gets initialized again. The @agent keeps its settings and can
+ * still be used after this call, but its ongoing transactions are forgotten
+ * and its transaction table is back to its default size.
+ *
+ * Since: 0.1.20
+ */
+void stun_agent_clear(StunAgent *agent);
+
+/**
+ * stun_agent_copy:
+ * @dest: The #StunAgent to initialize
+ * @src: The #StunAgent to copy
+ *
+ * Initializes @dest as a copy of @src, with the same settings, ongoing
+ * transactions and cached long-term credential key. The memory owned by @src
+ * is duplicated, so both agents must be cleared with stun_agent_clear() and
+ * either can be cleared first. @dest must not hold resources, it is
+ * overwritten without being cleared.
+ *
+ * Returns: %TRUE on success, %FALSE if memory could not be allocated, in which
+ * case @dest has the settings of @src but no ongoing transaction
+ *
+ * Since: 0.1.20
+ */
+bool stun_agent_copy(StunAgent *dest, const StunAgent *src);
+
+/**
+ * stun_agent_set_max_transactions:
+ * @agent: The #StunAgent
+ * @max_transactions: The maximum number of ongoing transactions
+ *
+ * Changes how many requests created by the @agent can wait for a response at
+ * the same time. By default, up to #STUN_AGENT_MAX_SAVED_IDS transactions are
+ * tracked and stun_agent_finish_message() fails when they are all in use.
+ * A value larger than #STUN_AGENT_MAX_SAVED_IDS allocates memory that is
+ * released by stun_agent_clear().
+ *
+ * This can only be changed while the @agent has no ongoing transaction.
+ *
+ * Returns: %TRUE on success, %FALSE if @max_transactions is 0 or larger than
+ * #STUN_AGENT_MAX_SAVED_IDS_LIMIT, or if transactions are ongoing
+ *
+ * Since: 0.1.20
+ */
+bool stun_agent_set_max_transactions(StunAgent *agent,
+                                     unsigned max_transactions);
+
+/**
+ * stun_agent_set_long_term_key:
+ * @agent: The #StunAgent
+ * @realm: The REALM the key was derived for
+ * @realm_len: The length of @realm
+ * @username: The username the key was derived for
+ * @username_len: The length of @username
+ * @password: The password the key was derived from
+ * @password_len: The length of @password
+ * @key: The MD5 long-term credential key of @username, @realm and @password
+ *
+ * Gives the @agent a long-term credential key that was already derived
+ * elsewhere, for instance by another agent talking to the same TURN server.
+ * The @agent keeps the key of the last credentials it used, so messages
+ * signed or validated with the same username, realm and password do not
+ * hash them again.
+ *
+ * Since: 0.1.20
+ */
+void stun_agent_set_long_term_key(StunAgent *agent,
+                                  const uint8_t *realm, size_t realm_len,
+                                  const uint8_t *username, size_t username_len,
+                                  const uint8_t *password, size_t password_len,
+                                  const uint8_t key[16]);
+
 /**
  * stun_agent_validate:
  * @agent: The #StunAgent
@@ -56,15 +56,178 @@ typedef struct _StunKeyBlob {
     BYTE key_data[0];
 } StunKeyBlob;
 #elif defined(HAVE_OPENSSL)
-#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
 #include <openssl/sha.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(LIBRESSL_VERSION_NUMBER)
+#define STUN_HMAC_USE_EVP_MAC 1
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #else
 #include <gnutls/crypto.h>
 #include <gnutls/gnutls.h>
 #endif
 
-void stun_sha1(const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
-               const void *key, size_t keylen, int padding) {
+#include <stdlib.h>
+
+struct _StunHmacKey {
+    const uint8_t *key;
+    size_t keylen;
+#if defined(USE_WIN32_CRYPTO)
+    /* CryptoAPI has no way to copy a keyed HMAC state, the raw key is
+     * imported again for every message */
+#elif defined(STUN_HMAC_USE_EVP_MAC)
+    EVP_MAC_CTX *ctx;
+#elif defined(HAVE_OPENSSL)
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || \
+        (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2070000fL)
+    HMAC_CTX stackctx;
+#endif
+    HMAC_CTX *ctx;
+#else
+    gnutls_hmac_hd_t handle;
+#endif
+};
+
+#if defined(USE_WIN32_CRYPTO)
+#elif defined(HAVE_OPENSSL)
+#ifdef NDEBUG
+#define TRY(x) x
+#else
+#define TRY(x)            \
+    do {                  \
+        int ret = x;      \
+        assert(ret == 1); \
+    } while (0)
+#endif
+#else
+#ifdef NDEBUG
+#define TRY(x) x
+#else
+#define TRY(x)            \
+    do {                  \
+        int ret = x;      \
+        assert(ret >= 0); \
+    } while (0)
+#endif
+#endif
+
+/*
+ * Computes the ipad/opad states for @key once. The key bytes are only
+ * referenced, they must outlive @hkey.
+ */
+static bool priv_hmac_key_init(StunHmacKey *hkey, const void *key,
+                               size_t keylen) {
+    hkey->key = key;
+    hkey->keylen = keylen;
+
+#if defined(USE_WIN32_CRYPTO)
+    return TRUE;
+#elif defined(STUN_HMAC_USE_EVP_MAC)
+    {
+        EVP_MAC *mac;
+        OSSL_PARAM params[2];
+
+        mac = EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
+        if (mac == NULL)
+            return FALSE;
+
+        hkey->ctx = EVP_MAC_CTX_new(mac);
+        /* The context keeps its own reference on the algorithm */
+        EVP_MAC_free(mac);
+        if (hkey->ctx == NULL)
+            return FALSE;
+
+        params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                     (char *) "SHA1", 0);
+        params[1] = OSSL_PARAM_construct_end();
+
+        if (EVP_MAC_init(hkey->ctx, key, keylen, params) != 1) {
+            EVP_MAC_CTX_free(hkey->ctx);
+            hkey->ctx = NULL;
+            return FALSE;
+        }
+        assert(EVP_MAC_CTX_get_mac_size(hkey->ctx) == 20);
+        return TRUE;
+    }
+#elif defined(HAVE_OPENSSL)
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || \
+        (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2070000fL)
+    hkey->ctx = &hkey->stackctx;
+    HMAC_CTX_init(hkey->ctx);
+#else
+    hkey->ctx = HMAC_CTX_new();
+    if (hkey->ctx == NULL)
+        return FALSE;
+#endif /* OPENSSL_VERSION_NUMBER */
+
+    assert(SHA_DIGEST_LENGTH == 20);
+
+    TRY(HMAC_Init_ex(hkey->ctx, key, keylen, EVP_sha1(), NULL));
+    return TRUE;
+#else
+    assert(gnutls_hmac_get_len(GNUTLS_MAC_SHA1) == 20);
+    return gnutls_hmac_init(&hkey->handle, GNUTLS_MAC_SHA1, key, keylen) >= 0;
+#endif /* HAVE_OPENSSL */
+}
+
+static void priv_hmac_key_clear(StunHmacKey *hkey) {
+#if defined(USE_WIN32_CRYPTO)
+#elif defined(STUN_HMAC_USE_EVP_MAC)
+    EVP_MAC_CTX_free(hkey->ctx);
+    hkey->ctx = NULL;
+#elif defined(HAVE_OPENSSL)
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || \
+        (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2070000fL)
+    HMAC_CTX_cleanup(hkey->ctx);
+#else
+    HMAC_CTX_free(hkey->ctx);
+#endif /* OPENSSL_VERSION_NUMBER */
+    hkey->ctx = NULL;
+#else
+    gnutls_hmac_deinit(hkey->handle, NULL);
+#endif /* HAVE_OPENSSL */
+}
+
+StunHmacKey *stun_hmac_key_new(const void *key, size_t keylen) {
+    StunHmacKey *hkey;
+    uint8_t *copy;
+
+    hkey = malloc(sizeof(StunHmacKey) + keylen);
+    if (hkey == NULL)
+        return NULL;
+
+    /* The key bytes are stored right after the structure, so that
+     * stun_hmac_key_equal() can be used on cached keys */
+    copy = (uint8_t *) (hkey + 1);
+    memcpy(copy, key, keylen);
+
+    if (!priv_hmac_key_init(hkey, copy, keylen)) {
+        free(hkey);
+        return NULL;
+    }
+
+    return hkey;
+}
+
+void stun_hmac_key_free(StunHmacKey *hkey) {
+    if (hkey == NULL)
+        return;
+
+    priv_hmac_key_clear(hkey);
+    free(hkey);
+}
+
+bool stun_hmac_key_equal(const StunHmacKey *hkey, const void *key,
+                         size_t keylen) {
+    return hkey->keylen == keylen && memcmp(hkey->key, key, keylen) == 0;
+}
+
+void stun_sha1_with_key(StunHmacKey *hkey, const uint8_t *msg, size_t len,
+                        size_t msg_len, uint8_t *sha, int padding) {
     uint16_t fakelen = htons(msg_len);
     uint8_t pad_char[64] = {0};
 
@@ -93,15 +256,15 @@ void stun_sha1(const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
         TRY(CryptAcquireContextW(&prov, NULL, NULL, PROV_RSA_FULL,
                                  CRYPT_VERIFYCONTEXT));
 
-        blob_size = sizeof(StunKeyBlob) + keylen;
+        blob_size = sizeof(StunKeyBlob) + hkey->keylen;
         blob = _malloca(blob_size);
         header = &blob->header;
         header->bType = PLAINTEXTKEYBLOB;
         header->bVersion = CUR_BLOB_VERSION;
         header->reserved = 0;
         header->aiKeyAlg = CALG_RC2;
-        blob->key_size = keylen;
-        memcpy(blob->key_data, key, keylen);
+        blob->key_size = hkey->keylen;
+        memcpy(blob->key_data, hkey->key, hkey->keylen);
         TRY(CryptImportKey(prov, (const BYTE *) blob, blob_size, 0,
                            CRYPT_IPSEC_HMAC_KEY, &key_handle));
         _freea(blob);
@@ -130,84 +293,77 @@ void stun_sha1(const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
         TRY(CryptDestroyKey(key_handle));
         TRY(CryptReleaseContext(prov, 0));
     }
-#elif defined(HAVE_OPENSSL)
+#elif defined(STUN_HMAC_USE_EVP_MAC)
     {
-#ifdef NDEBUG
-#define TRY(x) x;
-#else
-        int ret;
-#define TRY(x) \
-    ret = x;   \
-    assert(ret == 1);
-#endif
+        size_t outlen;
 
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || \
-        (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2070000fL)
-        HMAC_CTX stackctx;
-        HMAC_CTX *ctx = &stackctx;
-        HMAC_CTX_init(ctx);
-#else
-        HMAC_CTX *ctx = HMAC_CTX_new();
-#endif /* OPENSSL_VERSION_NUMBER */
-
-        assert(SHA_DIGEST_LENGTH == 20);
-
-        TRY(HMAC_Init_ex(ctx, key, keylen, EVP_sha1(), NULL));
+        /* A NULL key restarts from the precomputed inner state */
+        TRY(EVP_MAC_init(hkey->ctx, NULL, 0, NULL));
 
-        TRY(HMAC_Update(ctx, msg, 2));
-        TRY(HMAC_Update(ctx, (unsigned char *) &fakelen, 2));
-        TRY(HMAC_Update(ctx, msg + 4, len - 28));
+        TRY(EVP_MAC_update(hkey->ctx, msg, 2));
+        TRY(EVP_MAC_update(hkey->ctx, (unsigned char *) &fakelen, 2));
+        TRY(EVP_MAC_update(hkey->ctx, msg + 4, len - 28));
 
         /* RFC 3489 specifies that the message's size should be 64 bytes,
      and \x00 padding should be done */
         if (padding && ((len - 24) % 64) > 0) {
             uint16_t pad_size = 64 - ((len - 24) % 64);
 
-            TRY(HMAC_Update(ctx, pad_char, pad_size));
+            TRY(EVP_MAC_update(hkey->ctx, pad_char, pad_size));
         }
 
-        TRY(HMAC_Final(ctx, sha, NULL));
-
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || \
-        (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2070000fL)
-        HMAC_CTX_cleanup(ctx);
-#else
-        HMAC_CTX_free(ctx);
-#endif /* OPENSSL_VERSION_NUMBER */
+        TRY(EVP_MAC_final(hkey->ctx, sha, &outlen, 20));
     }
-#else
+#elif defined(HAVE_OPENSSL)
     {
-        gnutls_hmac_hd_t handle;
+        /* A NULL key restarts from the precomputed inner state */
+        TRY(HMAC_Init_ex(hkey->ctx, NULL, 0, NULL, NULL));
 
-#ifdef NDEBUG
-#define TRY(x) x;
-#else
-        int ret;
-#define TRY(x) \
-    ret = x;   \
-    assert(ret >= 0);
-#endif
+        TRY(HMAC_Update(hkey->ctx, msg, 2));
+        TRY(HMAC_Update(hkey->ctx, (unsigned char *) &fakelen, 2));
+        TRY(HMAC_Update(hkey->ctx, msg + 4, len - 28));
+
+        /* RFC 3489 specifies that the message's size should be 64 bytes,
+     and \x00 padding should be done */
+        if (padding && ((len - 24) % 64) > 0) {
+            uint16_t pad_size = 64 - ((len - 24) % 64);
 
-        assert(gnutls_hmac_get_len(GNUTLS_MAC_SHA1) == 20);
-        TRY(gnutls_hmac_init(&handle, GNUTLS_MAC_SHA1, key, keylen));
+            TRY(HMAC_Update(hkey->ctx, pad_char, pad_size));
+        }
 
-        TRY(gnutls_hmac(handle, msg, 2));
-        TRY(gnutls_hmac(handle, &fakelen, 2));
-        TRY(gnutls_hmac(handle, msg + 4, len - 28));
+        TRY(HMAC_Final(hkey->ctx, sha, NULL));
+    }
+#else
+    {
+        TRY(gnutls_hmac(hkey->handle, msg, 2));
+        TRY(gnutls_hmac(hkey->handle, &fakelen, 2));
+        TRY(gnutls_hmac(hkey->handle, msg + 4, len - 28));
 
         /* RFC 3489 specifies that the message's size should be 64 bytes,
      and \x00 padding should be done */
         if (padding && ((len - 24) % 64) > 0) {
             uint16_t pad_size = 64 - ((len - 24) % 64);
 
-            TRY(gnutls_hmac(handle, pad_char, pad_size));
+            TRY(gnutls_hmac(hkey->handle, pad_char, pad_size));
         }
 
-        gnutls_hmac_deinit(handle, sha);
-
-#undef TRY
+        /* Also resets the handle to its keyed state for the next message */
+        gnutls_hmac_output(hkey->handle, sha);
     }
 #endif /* HAVE_OPENSSL */
+#undef TRY
+}
+
+void stun_sha1(const uint8_t *msg, size_t len, size_t msg_len, uint8_t *sha,
+               const void *key, size_t keylen, int padding) {
+    StunHmacKey hkey;
+
+    if (!priv_hmac_key_init(&hkey, key, keylen)) {
+        memset(sha, 0, 20);
+        return;
+    }
+    stun_sha1_with_key(&hkey, msg, len, msg_len, sha, padding);
+    priv_hmac_key_clear(&hkey);
 }
 
 static const uint8_t *priv_trim_var(const uint8_t *var, size_t *var_len) {
@@ -53,6 +53,37 @@
 void stun_sha1(const uint8_t *msg, size_t len, size_t msg_len,
                uint8_t *sha, const void *key, size_t keylen, int padding);
 
+/*
+ * Precomputed HMAC-SHA1 key schedule (the ipad/opad hash states) for a
+ * credential that is used for many messages.
+ */
+typedef struct _StunHmacKey StunHmacKey;
+
+/*
+ * Creates a key schedule for @key, the key bytes are copied.
+ * @return the new key, or NULL on failure.
+ */
+StunHmacKey *stun_hmac_key_new(const void *key, size_t keylen);
+
+/*
+ * Frees a key created with stun_hmac_key_new(), NULL is ignored.
+ */
+void stun_hmac_key_free(StunHmacKey *hkey);
+
+/*
+ * @return TRUE if @hkey was created from the same key bytes.
+ */
+bool stun_hmac_key_equal(const StunHmacKey *hkey, const void *key,
+                         size_t keylen);
+
+/*
+ * Same as stun_sha1() but starts every message from the states precomputed
+ * in @hkey instead of deriving them from the raw key again.
+ * @hkey is used as scratch space, so it must not be shared between threads.
+ */
+void stun_sha1_with_key(StunHmacKey *hkey, const uint8_t *msg, size_t len,
+                        size_t msg_len, uint8_t *sha, int padding);
+
 /*
  * SIP H(A1) computation
  */
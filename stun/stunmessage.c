@@ -76,10 +76,107 @@ uint16_t stun_message_length(const StunMessage *msg) {
            STUN_MESSAGE_HEADER_LENGTH;
 }
 
+/*
+ * The attribute index is an open addressing (linear probing) table. An entry
+ * holds the offset of the attribute header from the end of the message
+ * header + 1, or 0 if it is empty. The attribute type is read back from the
+ * buffer, so it does not need to be stored.
+ */
+static unsigned stun_message_index_pos(uint16_t type) {
+    return (type ^ (type >> 6) ^ (type >> 12)) &
+           (STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE - 1);
+}
+
+/*
+ * Returns the index of @msg, or NULL if its agent did not index it. A message
+ * received later in the same buffer has another transaction ID, so comparing
+ * the header is enough to not trust the index of a previous message.
+ */
+static const StunMessageIndex *stun_message_get_index(const StunMessage *msg) {
+    const StunMessageIndex *idx;
+
+    if (msg->agent == NULL)
+        return NULL;
+
+    idx = stun_agent_get_message_index(msg->agent, FALSE);
+    if (idx == NULL || idx->buffer == NULL || idx->buffer != msg->buffer ||
+        memcmp(idx->header, msg->buffer, STUN_MESSAGE_HEADER_LENGTH) != 0) {
+        return NULL;
+    }
+
+    return idx;
+}
+
+void stun_message_drop_index(const StunMessage *msg) {
+    StunMessageIndex *idx;
+
+    if (msg->agent == NULL)
+        return;
+
+    idx = stun_agent_get_message_index(msg->agent, FALSE);
+    if (idx && idx->buffer == msg->buffer)
+        idx->buffer = NULL;
+}
+
+void stun_message_index_attributes(StunMessage *msg) {
+    StunMessageIndex *idx;
+    size_t length = stun_message_length(msg);
+    size_t offset = STUN_MESSAGE_ATTRIBUTES_POS;
+    unsigned count = 0;
+    bool after_integrity = FALSE;
+
+    if (msg->agent == NULL)
+        return;
+    idx = stun_agent_get_message_index(msg->agent, TRUE);
+    if (idx == NULL)
+        return;
+
+    idx->buffer = NULL;
+    memset(idx->offsets, 0, sizeof(idx->offsets));
+
+    while (offset < length) {
+        uint16_t atype = stun_getw(msg->buffer + offset);
+        size_t alen = stun_getw(msg->buffer + offset + STUN_ATTRIBUTE_TYPE_LEN);
+
+        /* Only the first occurrence of an attribute is indexed, and like
+         * stun_message_find(), only FINGERPRINT may be found after
+         * MESSAGE-INTEGRITY */
+        if (!after_integrity || atype == STUN_ATTRIBUTE_FINGERPRINT) {
+            unsigned pos = stun_message_index_pos(atype);
+
+            while (idx->offsets[pos] != 0 &&
+                   stun_getw(msg->buffer + STUN_MESSAGE_HEADER_LENGTH +
+                             idx->offsets[pos] - 1) != atype) {
+                pos = (pos + 1) & (STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE - 1);
+            }
+
+            if (idx->offsets[pos] == 0) {
+                if (++count > STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE * 3 / 4)
+                    return;
+                idx->offsets[pos] = offset - STUN_MESSAGE_HEADER_LENGTH + 1;
+            }
+        }
+
+        /* Nothing may come after FPR */
+        if (atype == STUN_ATTRIBUTE_FINGERPRINT)
+            break;
+        if (atype == STUN_ATTRIBUTE_MESSAGE_INTEGRITY)
+            after_integrity = TRUE;
+
+        if (!(msg->agent->usage_flags & STUN_AGENT_USAGE_NO_ALIGNED_ATTRIBUTES))
+            alen = stun_align(alen);
+
+        offset += STUN_ATTRIBUTE_VALUE_POS + alen;
+    }
+
+    idx->buffer = msg->buffer;
+    memcpy(idx->header, msg->buffer, STUN_MESSAGE_HEADER_LENGTH);
+}
 
 const void *
 stun_message_find(const StunMessage *msg, StunAttribute type,
                   uint16_t *palen) {
+    const StunMessageIndex *idx;
     size_t length = stun_message_length(msg);
     size_t offset = 0;
 
@@ -91,6 +188,27 @@ stun_message_find(const StunMessage *msg, StunAttribute type,
             type = STUN_ATTRIBUTE_REALM;
     }
 
+    idx = stun_message_get_index(msg);
+    if (idx) {
+        unsigned pos = stun_message_index_pos(type);
+
+        while (idx->offsets[pos] != 0) {
+            offset = STUN_MESSAGE_HEADER_LENGTH + idx->offsets[pos] - 1;
+            if (stun_getw(msg->buffer + offset) == type) {
+                uint16_t alen = stun_getw(msg->buffer + offset +
+                                          STUN_ATTRIBUTE_TYPE_LEN);
+
+                /* Never point past the message, whatever the buffer holds */
+                if (offset + STUN_ATTRIBUTE_VALUE_POS + alen > length)
+                    return NULL;
+                *palen = alen;
+                return msg->buffer + offset + STUN_ATTRIBUTE_VALUE_POS;
+            }
+            pos = (pos + 1) & (STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE - 1);
+        }
+        return NULL;
+    }
+
     offset = STUN_MESSAGE_ATTRIBUTES_POS;
 
     while (offset < length) {
@@ -317,6 +435,8 @@ stun_message_append(StunMessage *msg, StunAttribute type, size_t length) {
     if ((size_t) mlen + STUN_ATTRIBUTE_HEADER_LENGTH + length > msg->buffer_len)
         return NULL;
 
+    stun_message_drop_index(msg);
+
 
     a = msg->buffer + mlen;
     a = stun_setw(a, type);
@@ -618,6 +738,83 @@ int stun_message_validate_buffer_length(const uint8_t *msg, size_t length,
     return mlen;
 }
 
+/* Reads the 16-bit word at offset @pos of the vectored message. The vector
+ * index and the offset of its first byte are kept in @i and @base between
+ * calls, as the attributes are walked forward. */
+static bool stun_input_vector_getw(const StunInputVector *buffers,
+                                   int n_buffers, unsigned int *i, size_t *base, size_t pos,
+                                   uint16_t *value) {
+    uint8_t bytes[2];
+    unsigned int n;
+
+    for (n = 0; n < 2; n++, pos++) {
+        while ((n_buffers < 0 || *i < (unsigned int) n_buffers) &&
+               buffers[*i].buffer != NULL &&
+               *base + buffers[*i].size <= pos) {
+            *base += buffers[*i].size;
+            (*i)++;
+        }
+
+        if ((n_buffers >= 0 && *i >= (unsigned int) n_buffers) ||
+            buffers[*i].buffer == NULL)
+            return FALSE;
+
+        bytes[n] = buffers[*i].buffer[pos - *base];
+    }
+
+    *value = (bytes[0] << 8) | bytes[1];
+    return TRUE;
+}
+
+ssize_t stun_message_validate_buffer_length_vectored(StunInputVector *buffers,
+                                                     int n_buffers, size_t total_length, bool has_padding) {
+    ssize_t fast_retval;
+    unsigned int i = 0;
+    size_t base = 0;
+    size_t mlen;
+    size_t pos;
+
+    fast_retval = stun_message_validate_buffer_length_fast(buffers, n_buffers,
+                                                           total_length, has_padding);
+    if (fast_retval <= 0)
+        return fast_retval;
+
+    mlen = fast_retval;
+
+    /* Same walk as stun_message_validate_buffer_length(), without requiring
+     * the attributes to be in a single buffer */
+    for (pos = STUN_MESSAGE_HEADER_LENGTH; pos < mlen;) {
+        uint16_t word;
+        size_t alen;
+
+        if (mlen - pos < STUN_ATTRIBUTE_HEADER_LENGTH) {
+            stun_debug("STUN error: Incomplete STUN attribute header of length "
+                       "%u bytes!",
+                       (unsigned) (mlen - pos));
+            return STUN_MESSAGE_BUFFER_INVALID;
+        }
+
+        if (!stun_input_vector_getw(buffers, n_buffers, &i, &base,
+                                    pos + STUN_ATTRIBUTE_TYPE_LEN, &word))
+            return STUN_MESSAGE_BUFFER_INVALID;
+        alen = word;
+        if (has_padding)
+            alen = stun_align(alen);
+
+        pos += STUN_ATTRIBUTE_HEADER_LENGTH;
+
+        if (mlen - pos < alen) {
+            stun_debug("STUN error: %u instead of %u bytes for attribute!",
+                       (unsigned) (mlen - pos), (unsigned) alen);
+            return STUN_MESSAGE_BUFFER_INVALID;// no room for attribute value + padding
+        }
+
+        pos += alen;
+    }
+
+    return mlen;
+}
+
 void stun_message_id(const StunMessage *msg, StunTransactionId id) {
     memcpy(id, msg->buffer + STUN_MESSAGE_TRANS_ID_POS, STUN_MESSAGE_TRANS_ID_LEN);
 }
@@ -226,6 +226,10 @@ typedef enum {
  * defined by ICE draft 19
  * @STUN_ATTRIBUTE_ICE_CONTROLLING: The ICE-CONTROLLING optional attribute as
  * defined by ICE draft 19
+ * @STUN_ATTRIBUTE_RESPONSE_ORIGIN: The RESPONSE-ORIGIN optional attribute as
+ * defined by RFC5780 (Since: 0.1.20)
+ * @STUN_ATTRIBUTE_OTHER_ADDRESS: The OTHER-ADDRESS optional attribute as
+ * defined by RFC5780 (Since: 0.1.20)
  * @STUN_ATTRIBUTE_MS_SEQUENCE_NUMBER: The MS-SEQUENCE NUMBER optional attribute
  * as defined by [MS-TURN]
  * @STUN_ATTRIBUTE_CANDIDATE_IDENTIFIER: The CANDIDATE-IDENTIFIER optional
@@ -307,7 +311,9 @@ typedef enum {
     STUN_ATTRIBUTE_FINGERPRINT = 0x8028,               /* RFC5389 */
     STUN_ATTRIBUTE_ICE_CONTROLLED = 0x8029,            /* ICE-19 */
     STUN_ATTRIBUTE_ICE_CONTROLLING = 0x802A,           /* ICE-19 */
-    /* 0x802B-0x804F */                                /* reserved */
+    STUN_ATTRIBUTE_RESPONSE_ORIGIN = 0x802B,           /* RFC5780 */
+    STUN_ATTRIBUTE_OTHER_ADDRESS = 0x802C,             /* RFC5780 */
+    /* 0x802D-0x804F */                                /* reserved */
     STUN_ATTRIBUTE_MS_SEQUENCE_NUMBER = 0x8050,        /* MS-TURN */
     /* 0x8051-0x8053 */                                /* reserved */
     STUN_ATTRIBUTE_CANDIDATE_IDENTIFIER = 0x8054,      /* MS-ICE2 */
@@ -548,6 +554,26 @@ struct _StunMessage {
 bool stun_message_init(StunMessage *msg, StunClass c, StunMethod m,
                        const StunTransactionId id);
 
+/**
+ * stun_message_index_attributes:
+ * @msg: The #StunMessage
+ *
+ * Walks the attributes of a complete message once and records where each of
+ * them is, so that the following stun_message_find() calls do not need to
+ * scan the message again. stun_agent_validate() already does this for the
+ * messages it validates, once the agent has sent a request or authenticated
+ * a message.
+ *
+ * The index is kept by the agent of @msg, which only remembers the last
+ * message it indexed. It is only used for a message with the same buffer and
+ * the same header, so stun_message_init() and appending an attribute to @msg
+ * both make it unused. If the attributes of the buffer are modified in place
+ * without changing the header, this function must be called again.
+ *
+ * Since: 0.1.20
+ */
+void stun_message_index_attributes(StunMessage *msg);
+
 /**
  * stun_message_length:
  * @msg: The #StunMessage
@@ -939,6 +965,30 @@ typedef struct {
 ssize_t stun_message_validate_buffer_length_fast(StunInputVector *buffers,
                                                  int n_buffers, size_t total_length, bool has_padding);
 
+/**
+ * stun_message_validate_buffer_length_vectored:
+ * @buffers: (array length=n_buffers) (in caller-allocated): array of contiguous
+ * #StunInputVectors containing already-received message data
+ * @n_buffers: number of entries in @buffers or if -1 , then buffers is
+ *  terminated by a #StunInputVector with the buffer pointer being %NULL.
+ * @total_length: total number of valid bytes stored consecutively in @buffers
+ * @has_padding: %TRUE if attributes should be padded to 4-byte boundaries
+ *
+ * Performs the same checks as stun_message_validate_buffer_length(), header
+ * and attribute lengths included, directly on the @buffers. Unlike
+ * stun_message_validate_buffer_length_fast(), a success means the buffers
+ * hold a well-formed STUN message, so that they only need to be gathered for
+ * a message that is going to be parsed anyway.
+ *
+ * Returns: The length of the valid STUN message in the buffers.
+ * <para> See also: #STUN_MESSAGE_BUFFER_INCOMPLETE </para>
+ * <para> See also: #STUN_MESSAGE_BUFFER_INVALID </para>
+ *
+ * Since: 0.1.20
+ */
+ssize_t stun_message_validate_buffer_length_vectored(StunInputVector *buffers,
+                                                     int n_buffers, size_t total_length, bool has_padding);
+
 /**
  * stun_message_id:
  * @msg: The #StunMessage
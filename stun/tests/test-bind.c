@@ -250,6 +250,7 @@ static void bad_responses (void)
       (struct sockaddr *) &addr, &addrlen);
   assert (val == STUN_USAGE_BIND_RETURN_INVALID);
 
+  stun_agent_clear (&agent);
   close (fd);
   close (servfd);
 }
@@ -385,6 +386,7 @@ static void responses (void)
   assert (val == STUN_USAGE_BIND_RETURN_SUCCESS);
 
   /* End */
+  stun_agent_clear (&agent);
   close (servfd);
 
   val = close (fd);
@@ -398,6 +400,7 @@ static void keepalive (void)
   int val, servfd, fd;
 
   uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  uint8_t prev[STUN_MAX_MESSAGE_SIZE];
   size_t len;
   StunAgent agent;
   StunMessage msg;
@@ -432,6 +435,24 @@ static void keepalive (void)
       (struct sockaddr *)&addr, addrlen);
   assert (val >= 0);
 
+  /* Refreshed keep alive, with a fingerprint */
+  stun_agent_init (&agent, known_attributes,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+  len = stun_usage_bind_keepalive (&agent, &msg, buf, sizeof(buf));
+  assert (len == 28);
+  memcpy (prev, buf, len);
+
+  len = stun_usage_bind_keepalive_refresh (&agent, &msg);
+  assert (len == 28);
+  assert (memcmp (prev, buf, 8) == 0);
+  assert (memcmp (prev + 8, buf + 8, 12) != 0);
+  assert (stun_agent_validate (&agent, &msg, buf, len, NULL, NULL) ==
+      STUN_VALIDATION_SUCCESS);
+
+  val = sendto (fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL,
+      (struct sockaddr *)&addr, addrlen);
+  assert (val >= 0);
+
   /* End */
   close (servfd);
 
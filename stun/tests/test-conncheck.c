@@ -308,5 +308,58 @@ int main (void)
   stun_message_find_error (&resp, &code);
   assert (code == STUN_ERROR_ROLE_CONFLICT);
 
+  /* Requests built from a template match the ones built from scratch */
+  {
+    StunUsageIceConncheckTemplate *tmpl;
+    uint64_t tie2;
+    int i;
+
+    tmpl = stun_usage_ice_conncheck_template_new (&agent,
+        (uint8_t *) username, strlen (username), 0x12345678, NULL,
+        STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+    assert (tmpl != NULL);
+
+    for (i = 0; i < 4; i++) {
+      bool cand_use = (i & 1) != 0;
+      bool controlling = (i & 2) != 0;
+
+      len = stun_usage_ice_conncheck_create (&agent, &resp,
+          resp_buf, sizeof (resp_buf), (uint8_t *) username,
+          strlen (username), pass, pass_len, cand_use, controlling,
+          0x12345678, tie + i, NULL, STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+      assert (len > 0);
+      rlen = stun_usage_ice_conncheck_create_from_template (&agent, tmpl,
+          &req, req_buf, sizeof (req_buf), pass, pass_len, cand_use,
+          controlling, tie + i);
+      assert (rlen == len);
+
+      /* Only the transaction ID, integrity and fingerprint differ */
+      assert (memcmp (req_buf, resp_buf, 8) == 0);
+      assert (memcmp (req_buf + 20, resp_buf + 20, len - 20 - 32) == 0);
+      assert (memcmp (req_buf + 8, resp_buf + 8, 12) != 0);
+
+      assert (stun_agent_validate (&agent, &req, req_buf, rlen,
+              stun_agent_default_validater, validater_data) ==
+          STUN_VALIDATION_SUCCESS);
+      assert (stun_usage_ice_conncheck_priority (&req) == 0x12345678);
+      assert (stun_usage_ice_conncheck_use_candidate (&req) == cand_use);
+      assert (stun_message_find64 (&req, controlling ?
+              STUN_ATTRIBUTE_ICE_CONTROLLING : STUN_ATTRIBUTE_ICE_CONTROLLED,
+              &tie2) == STUN_MESSAGE_RETURN_SUCCESS);
+      assert (tie2 == tie + i);
+
+      stun_agent_forget_transaction (&agent, req_buf + 4);
+      stun_agent_forget_transaction (&agent, resp_buf + 4);
+    }
+
+    /* Too small a buffer */
+    assert (stun_usage_ice_conncheck_create_from_template (&agent, tmpl,
+            &req, req_buf, 20, pass, pass_len, true, true, tie) == 0);
+
+    stun_usage_ice_conncheck_template_free (tmpl);
+  }
+
+  stun_agent_clear (&agent);
+
   return 0;
 }
@@ -40,6 +40,7 @@
 #include <sys/types.h>
 
 #include "stun/stunagent.h"
+#include "stun/stunhmac.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -174,6 +175,86 @@ check_af (const char *name, int family, socklen_t addrlen)
   if (stun_message_append_xor_addr (&msg, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
           &addr, addrlen) != STUN_MESSAGE_RETURN_SUCCESS)
     fatal ("%s sockaddr xor test failed", name);
+
+  stun_agent_clear (&agent);
+}
+
+static size_t
+long_term_request (StunAgent *agent, StunMessage *msg, uint8_t *buf,
+    size_t len)
+{
+  static const uint8_t realm[] = "example.org";
+  static const uint8_t nonce[] = "f00d";
+
+  stun_agent_init_request (agent, msg, buf, len, STUN_ALLOCATE);
+  if (stun_message_append_bytes (msg, STUN_ATTRIBUTE_NONCE, nonce,
+          sizeof (nonce) - 1) != STUN_MESSAGE_RETURN_SUCCESS ||
+      stun_message_append_bytes (msg, STUN_ATTRIBUTE_REALM, realm,
+          sizeof (realm) - 1) != STUN_MESSAGE_RETURN_SUCCESS ||
+      stun_message_append_bytes (msg, STUN_ATTRIBUTE_USERNAME, usr,
+          sizeof (usr) - 1) != STUN_MESSAGE_RETURN_SUCCESS)
+    fatal ("Long-term request formatting failed");
+
+  len = stun_agent_finish_message (agent, msg, pwd, sizeof (pwd) - 1);
+  if (len == 0)
+    fatal ("Long-term request finishing failed");
+  return len;
+}
+
+static void
+check_long_term_key (void)
+{
+  static const uint8_t realm[] = "example.org";
+  uint8_t buf[200];
+  uint8_t key[16];
+  size_t len;
+  StunAgent agent, server;
+  StunMessage msg, msg2;
+
+  stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+  stun_agent_init (&server, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+
+  /* The key is derived on first use, then reused */
+  len = long_term_request (&agent, &msg, buf, sizeof (buf));
+  if (stun_agent_validate (&server, &msg2, buf, len, dynamic_check_validater,
+          NULL) != STUN_VALIDATION_SUCCESS)
+    fatal ("Long-term request validation failed");
+  len = long_term_request (&agent, &msg, buf, sizeof (buf));
+  if (stun_agent_validate (&server, &msg2, buf, len, dynamic_check_validater,
+          NULL) != STUN_VALIDATION_SUCCESS)
+    fatal ("Cached long-term key validation failed");
+
+  /* A key given for the same credentials replaces the derivation */
+  memset (key, 0x42, sizeof (key));
+  stun_agent_set_long_term_key (&agent, realm, sizeof (realm) - 1,
+      usr, sizeof (usr) - 1, pwd, sizeof (pwd) - 1, key);
+  len = long_term_request (&agent, &msg, buf, sizeof (buf));
+  if (stun_agent_validate (&server, &msg2, buf, len, dynamic_check_validater,
+          NULL) != STUN_VALIDATION_UNAUTHORIZED)
+    fatal ("Given long-term key was not used");
+
+  stun_hash_creds (realm, sizeof (realm) - 1, usr, sizeof (usr) - 1,
+      pwd, sizeof (pwd) - 1, key);
+  stun_agent_set_long_term_key (&agent, realm, sizeof (realm) - 1,
+      usr, sizeof (usr) - 1, pwd, sizeof (pwd) - 1, key);
+  len = long_term_request (&agent, &msg, buf, sizeof (buf));
+  if (stun_agent_validate (&server, &msg2, buf, len, dynamic_check_validater,
+          NULL) != STUN_VALIDATION_SUCCESS)
+    fatal ("Given long-term key validation failed");
+
+  /* Keys given for other credentials are not used */
+  memset (key, 0x42, sizeof (key));
+  stun_agent_set_long_term_key (&agent, realm, sizeof (realm) - 1,
+      usr, sizeof (usr) - 1, (const uint8_t *) "other", 5, key);
+  len = long_term_request (&agent, &msg, buf, sizeof (buf));
+  if (stun_agent_validate (&server, &msg2, buf, len, dynamic_check_validater,
+          NULL) != STUN_VALIDATION_SUCCESS)
+    fatal ("Long-term key of other credentials was used");
+
+  stun_agent_clear (&agent);
+  stun_agent_clear (&server);
 }
 
 int main (void)
@@ -266,5 +347,9 @@ int main (void)
   check_af ("IPv6", AF_INET6, sizeof (struct sockaddr_in6));
 #endif
 
+  check_long_term_key ();
+
+  stun_agent_clear (&agent);
+
   return 0;
 }
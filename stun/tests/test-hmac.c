@@ -75,6 +75,37 @@ static void test_hmac (const uint8_t *key, const uint8_t *str,
     exit (1);
 }
 
+static void test_hmac_key (const uint8_t *key, const uint8_t *str,
+    const uint8_t *expected) {
+  StunHmacKey *hkey;
+  uint8_t hmac[20];
+  size_t msg_len = 300;
+  int i;
+
+  hkey = stun_hmac_key_new (key, strlen ((const char *) key));
+  if (hkey == NULL)
+    exit (1);
+
+  if (!stun_hmac_key_equal (hkey, key, strlen ((const char *) key)) ||
+      stun_hmac_key_equal (hkey, "other", 5))
+    exit (1);
+
+  /* The precomputed key must give the same result every time it is reused */
+  for (i = 0; i < 3; i++) {
+    memset (hmac, 0, sizeof (hmac));
+    stun_sha1_with_key (hkey, str, strlen ((const char *) str), msg_len, hmac,
+        TRUE /* padding */);
+
+    printf ("Precomputed HMAC of '%s' with key '%s' is : ", str, key);
+    print_bytes (hmac, sizeof (hmac));
+
+    if (memcmp (hmac, expected, sizeof (hmac)))
+      exit (1);
+  }
+
+  stun_hmac_key_free (hkey);
+}
+
 int main (void)
 {
   const uint8_t hmac1[] = { 0x83, 0x5a, 0x9b, 0x05, 0xea,
@@ -86,5 +117,9 @@ int main (void)
              (const uint8_t *) "some complicated input string which is over 44 bytes long",
              hmac1);
 
+  test_hmac_key ((const uint8_t *) "key",
+             (const uint8_t *) "some complicated input string which is over 44 bytes long",
+             hmac1);
+
   return 0;
 }
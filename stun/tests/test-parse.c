@@ -39,6 +39,7 @@
 
 #include "stun/stunagent.h"
 #include "stun/stunhmac.h"
+#include "stun/utils.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -69,6 +70,39 @@ static void fatal (const char *msg, ...)
 }
 
 
+/* Checks the vectored validation of the first @len bytes of @msg, split in
+ * two at every offset and in single bytes, against the contiguous one */
+static void validate_vectored (const uint8_t *msg, unsigned len)
+{
+  StunInputVector vectors[STUN_MAX_MESSAGE_SIZE_IPV6 + 1];
+  int expected = stun_message_validate_buffer_length (msg, len, TRUE);
+  unsigned i;
+
+  for (i = 0; i <= len; i++)
+  {
+    vectors[0].buffer = msg;
+    vectors[0].size = i;
+    vectors[1].buffer = msg + i;
+    vectors[1].size = len - i;
+    if (stun_message_validate_buffer_length_vectored (vectors, 2, len,
+            TRUE) != expected)
+      fatal ("%u/%u vectored message test failed at %u", len, len, i);
+  }
+
+  for (i = 0; i < len; i++)
+  {
+    vectors[i].buffer = msg + i;
+    vectors[i].size = 1;
+  }
+  vectors[len].buffer = NULL;
+  vectors[len].size = 0;
+  if (len > 0 &&
+      stun_message_validate_buffer_length_vectored (vectors, -1, len,
+          TRUE) != expected)
+    fatal ("%u/%u single byte vectored message test failed", len, len);
+}
+
+
 static void validate (const uint8_t *msg, unsigned len)
 {
   unsigned i = 1;
@@ -78,11 +112,44 @@ static void validate (const uint8_t *msg, unsigned len)
     size_t vlen = stun_message_validate_buffer_length (msg, i, TRUE);
     if ((vlen & 3) || (vlen != ((i >= len) * len)))
       fatal ("%u/%u short message test failed", i, len);
+    if (i <= len)
+      validate_vectored (msg, i);
   }
   while (i++ < (len + 4));
 }
 
 
+/* Compares the indexed lookups of a validated message with a full scan */
+static void check_index (const StunMessage *msg)
+{
+  static const uint16_t extra_types[] = {
+    0x8022, 0x8028, 0x8029, 0x802A, 0x8070, 0xC001,
+    0xff00, 0xff01, 0xff02, 0xff03, 0xff04, 0xff05, 0xff06, 0xff07
+  };
+  static uint8_t copy[STUN_MAX_MESSAGE_SIZE];
+  StunMessage scan = {0};
+  unsigned i;
+
+  /* The agent only trusts its index for the buffer it indexed */
+  memcpy (copy, msg->buffer, stun_message_length (msg));
+  scan.agent = msg->agent;
+  scan.buffer = copy;
+  scan.buffer_len = msg->buffer_len;
+
+  for (i = 0; i < 0x40 + sizeof (extra_types) / sizeof (extra_types[0]); i++) {
+    uint16_t type = i < 0x40 ? i : extra_types[i - 0x40];
+    uint16_t len1 = 0, len2 = 0;
+    const void *ptr1, *ptr2;
+
+    ptr1 = stun_message_find (msg, type, &len1);
+    ptr2 = stun_message_find (&scan, type, &len2);
+    if ((ptr1 == NULL) != (ptr2 == NULL) ||
+        (ptr1 && ((const uint8_t *) ptr1 - msg->buffer !=
+                  (const uint8_t *) ptr2 - copy || len1 != len2)))
+      fatal ("Attribute index mismatch for 0x%04x", type);
+  }
+}
+
 /* Tests for generic message validation routines */
 static void test_message (void)
 {
@@ -255,6 +322,9 @@ static void test_message (void)
     fatal ("Badness 2 test failed");
   if (stun_message_validate_buffer_length (bad3, sizeof (bad3), TRUE) != 0)
     fatal ("Badness 3 test failed");
+  validate_vectored (bad1, sizeof (bad1));
+  validate_vectored (bad2, sizeof (bad2));
+  validate_vectored (bad3, sizeof (bad3));
   validate (simple_resp, 20);
   validate (old_ind, 20);
   validate (fpr_resp, 36);
@@ -282,6 +352,9 @@ static void test_message (void)
     fatal ("Class test failed");
   if (stun_message_get_method (&msg) != 0x525)
     fatal ("Method test failed");
+
+  stun_agent_clear (&agent);
+  stun_agent_clear (&agent2);
 }
 
 
@@ -385,6 +458,8 @@ static void test_attribute (void)
           test_attribute_validater, (void *) "good_guy") != STUN_VALIDATION_SUCCESS)
     fatal ("good password validation failed");
 
+  check_index (&msg);
+
   if (stun_message_has_attribute (&msg, 0xff00))
     fatal ("Absent attribute test failed");
   if (!stun_message_has_attribute (&msg, 0xff01))
@@ -448,6 +523,7 @@ static void test_attribute (void)
                                   "\xde\xfa\xce\xd0""\xfa\xce\xde\xed", 16))
     fatal ("IPv6 address test failed");
 
+  stun_agent_clear (&agent);
 }
 
 static const char vector_username[] = "evtj:h6vY";
@@ -623,6 +699,10 @@ static void test_vectors (void)
 
   puts ("Checking test vectors...");
 
+  validate_vectored (req, sizeof (req));
+  validate_vectored (respv4, sizeof (respv4));
+  validate_vectored (respv6, sizeof (respv6));
+
   if (stun_agent_validate (&agent, &msg2, req2, sizeof(req2),
           test_vector_validater, (void *) 1) != STUN_VALIDATION_SUCCESS)
     fatal ("Request test vector authentication failed");
@@ -697,6 +777,7 @@ static void test_vectors (void)
   if (ntohs (addr.ip6.sin6_port) != 32853)
     fatal ("Response test vector IPv6 port failed");
 
+  stun_agent_clear (&agent);
 
   puts ("Done.");
 }
@@ -728,11 +809,240 @@ static void test_hash_creds (void)
 
 }
 
+static void test_index (void)
+{
+  static const uint16_t known_attributes[] =  {
+    STUN_ATTRIBUTE_USERNAME,
+    STUN_ATTRIBUTE_MESSAGE_INTEGRITY,
+    STUN_ATTRIBUTE_PRIORITY,
+    STUN_ATTRIBUTE_USE_CANDIDATE,
+    STUN_ATTRIBUTE_SOFTWARE,
+    STUN_ATTRIBUTE_FINGERPRINT,
+    STUN_ATTRIBUTE_ICE_CONTROLLING,
+    0
+  };
+  StunAgent agent;
+  StunMessage msg, parsed;
+  uint8_t buf[1024], buf2[1024];
+  size_t len;
+  uint16_t alen;
+  uint32_t prio;
+  unsigned i;
+
+  puts ("Testing the attribute index...");
+
+  stun_agent_init (&agent, known_attributes, STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_USE_FINGERPRINT | STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  stun_agent_init_request (&agent, &msg, buf, sizeof (buf), STUN_BINDING);
+  stun_message_append_string (&msg, STUN_ATTRIBUTE_USERNAME, "user:name");
+  stun_message_append32 (&msg, STUN_ATTRIBUTE_PRIORITY, 1234);
+  /* Only the first occurrence must be found */
+  stun_message_append32 (&msg, STUN_ATTRIBUTE_PRIORITY, 5678);
+  stun_message_append_flag (&msg, STUN_ATTRIBUTE_USE_CANDIDATE);
+  stun_message_append64 (&msg, STUN_ATTRIBUTE_ICE_CONTROLLING, 42);
+  for (i = 0; i < 8; i++)
+    stun_message_append32 (&msg, 0xff00 + i, i);
+  len = stun_agent_finish_message (&agent, &msg, (uint8_t *) "pass", 4);
+  if (len == 0)
+    fatal ("Cannot finish message");
+
+  /* Appending drops the index of a message being built */
+  if (stun_message_find (&msg, STUN_ATTRIBUTE_FINGERPRINT, &alen) == NULL)
+    fatal ("FINGERPRINT not found in built message");
+
+  if (stun_agent_validate (&agent, &parsed, buf, len, NULL, NULL) !=
+      STUN_VALIDATION_SUCCESS)
+    fatal ("Message validation failed");
+  check_index (&parsed);
+
+  /* Another message of the same length received in the same buffer, and
+   * looked up without being validated, must not use the previous index */
+  stun_agent_init_request (&agent, &msg, buf2, sizeof (buf2), STUN_BINDING);
+  stun_message_append32 (&msg, STUN_ATTRIBUTE_PRIORITY, 4321);
+  stun_message_append_string (&msg, STUN_ATTRIBUTE_USERNAME, "user:name");
+  stun_message_append64 (&msg, STUN_ATTRIBUTE_ICE_CONTROLLING, 24);
+  stun_message_append_flag (&msg, STUN_ATTRIBUTE_USE_CANDIDATE);
+  for (i = 0; i < 8; i++)
+    stun_message_append32 (&msg, 0xff00 + i, i);
+  stun_message_append32 (&msg, 0xff07, 0);
+  if (stun_agent_finish_message (&agent, &msg, (uint8_t *) "pass", 4) != len)
+    fatal ("Cannot build a message of the same length");
+  memcpy (buf, buf2, len);
+
+  memset (&parsed, 0xaa, sizeof (parsed));
+  parsed.agent = &agent;
+  parsed.buffer = buf;
+  parsed.buffer_len = len;
+  if (stun_message_find32 (&parsed, STUN_ATTRIBUTE_PRIORITY, &prio) !=
+      STUN_MESSAGE_RETURN_SUCCESS || prio != 4321)
+    fatal ("Stale index used for a new message in the same buffer");
+  check_index (&parsed);
+
+  /* Too many different attributes to be indexed */
+  stun_agent_init_request (&agent, &msg, buf, sizeof (buf), STUN_BINDING);
+  for (i = 0; i < STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE; i++)
+    stun_message_append_flag (&msg, 0xfe00 + i);
+  stun_message_index_attributes (&msg);
+  for (i = 0; i < STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE; i++)
+    if (stun_message_find_flag (&msg, 0xfe00 + i) !=
+        STUN_MESSAGE_RETURN_SUCCESS)
+      fatal ("Attribute 0x%04x not found in unindexed message", 0xfe00 + i);
+
+  stun_agent_clear (&agent);
+
+  puts ("Done!");
+}
+
+#define N_TRANSACTIONS 1000
+
+static void test_transactions (void)
+{
+  static const uint16_t known_attributes[] =  {
+    STUN_ATTRIBUTE_SOFTWARE,
+    STUN_ATTRIBUTE_FINGERPRINT,
+    0
+  };
+  static uint8_t reqs[N_TRANSACTIONS][64];
+  static size_t reqs_len[N_TRANSACTIONS];
+  StunAgent agent, server;
+  StunMessage msg, req;
+  uint8_t buf[64];
+  size_t len;
+  unsigned i;
+
+  puts ("Testing the transaction table...");
+
+  stun_agent_init (&agent, known_attributes, STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_USE_FINGERPRINT | STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+  stun_agent_init (&server, known_attributes, STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_USE_FINGERPRINT | STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  if (stun_agent_set_max_transactions (&agent, 0))
+    fatal ("Zero transactions accepted");
+  if (stun_agent_set_max_transactions (&agent,
+          STUN_AGENT_MAX_SAVED_IDS_LIMIT + 1))
+    fatal ("Too many transactions accepted");
+  if (!stun_agent_set_max_transactions (&agent, N_TRANSACTIONS))
+    fatal ("Cannot enlarge the transaction table");
+
+  for (i = 0; i < N_TRANSACTIONS; i++) {
+    stun_agent_init_request (&agent, &msg, reqs[i], sizeof (reqs[i]),
+        STUN_BINDING);
+    reqs_len[i] = stun_agent_finish_message (&agent, &msg, NULL, 0);
+    if (reqs_len[i] == 0)
+      fatal ("Request %u dropped", i);
+  }
+
+  stun_agent_init_request (&agent, &msg, buf, sizeof (buf), STUN_BINDING);
+  if (stun_agent_finish_message (&agent, &msg, NULL, 0) != 0)
+    fatal ("Request accepted with a full transaction table");
+
+  if (stun_agent_set_max_transactions (&agent, 10))
+    fatal ("Transaction table resized with ongoing transactions");
+
+  /* Answer every other request, in reverse order */
+  for (i = N_TRANSACTIONS; i-- > 0;) {
+    if (i % 2)
+      continue;
+
+    if (stun_agent_validate (&server, &req, reqs[i], reqs_len[i], NULL,
+            NULL) != STUN_VALIDATION_SUCCESS)
+      fatal ("Request %u validation failed", i);
+    stun_agent_init_response (&server, &msg, buf, sizeof (buf), &req);
+    len = stun_agent_finish_message (&server, &msg, NULL, 0);
+
+    if (stun_agent_validate (&agent, &msg, buf, len, NULL, NULL) !=
+        STUN_VALIDATION_SUCCESS)
+      fatal ("Response %u validation failed", i);
+    if (stun_agent_validate (&agent, &msg, buf, len, NULL, NULL) !=
+        STUN_VALIDATION_UNMATCHED_RESPONSE)
+      fatal ("Response %u matched twice", i);
+  }
+
+  for (i = 1; i < N_TRANSACTIONS; i += 2) {
+    StunTransactionId id;
+
+    stun_agent_validate (&server, &req, reqs[i], reqs_len[i], NULL, NULL);
+    stun_message_id (&req, id);
+    if (!stun_agent_forget_transaction (&agent, id))
+      fatal ("Transaction %u not found", i);
+    if (stun_agent_forget_transaction (&agent, id))
+      fatal ("Transaction %u forgotten twice", i);
+  }
+
+  if (!stun_agent_set_max_transactions (&agent, 10))
+    fatal ("Cannot shrink the empty transaction table");
+
+  stun_agent_clear (&agent);
+  stun_agent_clear (&server);
+
+  puts ("Done!");
+}
+
+static void test_copy (void)
+{
+  static const uint16_t known_attributes[] =  {
+    STUN_ATTRIBUTE_SOFTWARE,
+    STUN_ATTRIBUTE_FINGERPRINT,
+    0
+  };
+  static const uint8_t realm[] = "example.org";
+  static const uint8_t usr[] = "user";
+  static const uint8_t pwd[] = "secret";
+  uint8_t key[16] = { 0 };
+  uint8_t req_buf[64], buf[64];
+  size_t req_len, len;
+  StunAgent agent, copy, server;
+  StunMessage msg, req;
+
+  puts ("Testing agent copies...");
+
+  stun_agent_init (&agent, known_attributes, STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_USE_FINGERPRINT | STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+  stun_agent_init (&server, known_attributes, STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_USE_FINGERPRINT | STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  if (!stun_agent_set_max_transactions (&agent, 2 * STUN_AGENT_MAX_SAVED_IDS))
+    fatal ("Cannot enlarge the transaction table");
+  stun_agent_set_long_term_key (&agent, realm, sizeof (realm) - 1,
+      usr, sizeof (usr) - 1, pwd, sizeof (pwd) - 1, key);
+
+  stun_agent_init_request (&agent, &msg, req_buf, sizeof (req_buf),
+      STUN_BINDING);
+  req_len = stun_agent_finish_message (&agent, &msg, NULL, 0);
+  if (req_len == 0)
+    fatal ("Request dropped");
+
+  if (!stun_agent_copy (&copy, &agent))
+    fatal ("Agent copy failed");
+
+  /* The copy owns its memory, so it outlives the original */
+  stun_agent_clear (&agent);
+
+  if (stun_agent_validate (&server, &req, req_buf, req_len, NULL, NULL) !=
+      STUN_VALIDATION_SUCCESS)
+    fatal ("Request validation failed");
+  stun_agent_init_response (&server, &msg, buf, sizeof (buf), &req);
+  len = stun_agent_finish_message (&server, &msg, NULL, 0);
+  if (stun_agent_validate (&copy, &msg, buf, len, NULL, NULL) !=
+      STUN_VALIDATION_SUCCESS)
+    fatal ("Response to the copied transaction not matched");
+
+  stun_agent_clear (&copy);
+  stun_agent_clear (&server);
+
+  puts ("Done!");
+}
+
 int main (void)
 {
   test_message ();
   test_attribute ();
   test_vectors ();
   test_hash_creds ();
+  test_index ();
+  test_transactions ();
+  test_copy ();
   return 0;
 }
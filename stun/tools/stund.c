@@ -47,6 +47,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -59,6 +60,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #endif
 
 #ifdef HAVE_UNISTD_H
@@ -87,6 +90,30 @@
 /** Default port for STUN binding discovery */
 #define IPPORT_STUN  3478
 
+/* Several workers can only share the port through SO_REUSEPORT, and
+ * batching needs both recvmmsg() and sendmmsg(). */
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+# define STUND_THREADS 1
+#endif
+
+#if defined(STUND_THREADS) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+# define STUND_BATCH 1
+#endif
+
+/** Number of datagrams received or sent per system call */
+#define STUND_BATCH_SIZE 32
+
+/** Upper bound for the -t option */
+#define STUND_MAX_WORKERS 256
+
+/** Size of the per-datagram buffers of the batched path; larger requests
+ * are truncated by the kernel and dropped */
+#define STUND_BUFFER_SIZE STUN_MAX_MESSAGE_SIZE_IPV6
+
+/* RFC5780 CHANGE-REQUEST flags */
+#define STUND_CHANGE_IP   0x4
+#define STUND_CHANGE_PORT 0x2
+
 #include "stun/stunagent.h"
 #include "stund.h"
 
@@ -94,19 +121,89 @@ static const uint16_t known_attributes[] =  {
   0
 };
 
+static const uint16_t known_attributes_rfc5780[] =  {
+  STUN_ATTRIBUTE_CHANGE_REQUEST,
+  0
+};
+
+typedef union {
+  struct sockaddr addr;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+  struct sockaddr_storage storage;
+} StundAddress;
+
+typedef struct {
+  int family;
+  int protocol;
+  unsigned port;
+  unsigned workers;
+  bool stats;
+  bool rfc5780;
+} StundConfig;
+
+#ifdef STUND_THREADS
+typedef atomic_ullong StundCounter;
+# define stund_counter_add(c, n) \
+  atomic_fetch_add_explicit ((c), (n), memory_order_relaxed)
+# define stund_counter_get(c) \
+  atomic_load_explicit ((c), memory_order_relaxed)
+#else
+typedef unsigned long long StundCounter;
+# define stund_counter_add(c, n) (*(c) += (n))
+# define stund_counter_get(c) (*(c))
+#endif
+
+typedef struct {
+  StundCounter received;   /* datagrams read from the socket */
+  StundCounter responses;  /* success responses sent */
+  StundCounter errors;     /* error responses sent */
+  StundCounter dropped;    /* invalid datagrams, or failed sends */
+} StundCounters;
+
+/*
+ * State owned by one worker. Agents and buffers are set up once, so the
+ * receive loop never allocates.
+ */
+typedef struct {
+  const StundConfig *config;
+  int sock;
+  StunAgent oldagent;
+  StunAgent newagent;
+  StundCounters counters;
+#ifdef STUND_THREADS
+  pthread_t thread;
+#endif
+#ifdef STUND_BATCH
+  struct mmsghdr in[STUND_BATCH_SIZE];
+  struct mmsghdr out[STUND_BATCH_SIZE];
+  struct iovec in_iov[STUND_BATCH_SIZE];
+  struct iovec out_iov[STUND_BATCH_SIZE];
+  StundAddress sources[STUND_BATCH_SIZE];
+  uint8_t control[STUND_BATCH_SIZE][CMSG_SPACE (sizeof (struct in6_pktinfo))];
+  uint8_t requests[STUND_BATCH_SIZE][STUND_BUFFER_SIZE];
+  uint8_t responses[STUND_BATCH_SIZE][STUND_BUFFER_SIZE];
+#endif
+} StundWorker;
+
 /*
  * Creates a listening socket
  */
 int listen_socket (int fam, int type, int proto, unsigned int port)
+{
+  return listen_socket_reuse (fam, type, proto, port, false);
+}
+
+/*
+ * Creates a listening socket, optionally sharing the port with other
+ * sockets of the same process through SO_REUSEPORT
+ */
+int listen_socket_reuse (int fam, int type, int proto, unsigned int port,
+    bool reuse)
 {
   int yes = 1;
   int fd = socket (fam, type, proto);
-  union {
-    struct sockaddr addr;
-    struct sockaddr_in in;
-    struct sockaddr_in6 in6;
-    struct sockaddr_storage storage;
-  } addr;
+  StundAddress addr;
 
   if (fd == -1)
   {
@@ -137,6 +234,21 @@ int listen_socket (int fam, int type, int proto, unsigned int port)
       assert (0);  /* should never be reached */
   }
 
+  if (reuse)
+  {
+#ifdef SO_REUSEPORT
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const char *) &yes,
+            sizeof (yes)))
+    {
+      perror ("Error sharing IP port");
+      goto error;
+    }
+#else
+    fprintf (stderr, "Error sharing IP port: SO_REUSEPORT not supported\n");
+    goto error;
+#endif
+  }
+
   if (bind (fd, &addr.addr, sizeof (struct sockaddr_storage)))
   {
     perror ("Error opening IP port");
@@ -179,60 +291,90 @@ error:
   return -1;
 }
 
-static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
+/*
+ * Builds the answer to the datagram in @buf into @out.
+ * @local is the address the request was received on, if known; it is
+ * echoed in RESPONSE-ORIGIN when running as a RFC5780 server.
+ * Returns the length of the answer, or 0 if nothing should be sent.
+ */
+static size_t stund_answer (StundWorker *w, const uint8_t *buf, size_t len,
+    const StundAddress *src, socklen_t src_len, const StundAddress *local,
+    uint8_t *out, size_t out_size)
 {
-  union {
-    struct sockaddr_storage storage;
-    struct sockaddr addr;
-  } addr;
-  socklen_t addr_len;
-  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
-  size_t buf_len = 0;
-  size_t len = 0;
   StunMessage request;
   StunMessage response;
   StunValidationStatus validation;
   StunAgent *agent = NULL;
+  uint32_t change = 0;
 
-  addr_len = sizeof (struct sockaddr_storage);
-  len = recvfrom (sock, buf, sizeof(buf), 0, &addr.addr, &addr_len);
-  if (len == (size_t)-1)
-    return -1;
-
-  validation = stun_agent_validate (newagent, &request, buf, len, NULL, 0);
+  validation = stun_agent_validate (&w->newagent, &request, buf, len, NULL, 0);
 
   if (validation == STUN_VALIDATION_SUCCESS) {
-    agent = newagent;
+    agent = &w->newagent;
   }
   else {
-    validation = stun_agent_validate (oldagent, &request, buf, len, NULL, 0);
-    agent = oldagent;
+    validation = stun_agent_validate (&w->oldagent, &request, buf, len,
+        NULL, 0);
+    agent = &w->oldagent;
   }
 
   /* Unknown attributes */
   if (validation == STUN_VALIDATION_UNKNOWN_REQUEST_ATTRIBUTE)
   {
-    buf_len = stun_agent_build_unknown_attributes_error (agent, &response, buf,
-        sizeof (buf), &request);
-    goto send_buf;
+    return stun_agent_build_unknown_attributes_error (agent, &response,
+        out, out_size, &request);
   }
 
   /* Mal-formatted packets */
   if (validation != STUN_VALIDATION_SUCCESS ||
       stun_message_get_class (&request) != STUN_REQUEST) {
-    return -1;
+    return 0;
   }
 
   switch (stun_message_get_method (&request))
   {
     case STUN_BINDING:
-      stun_agent_init_response (agent, &response, buf, sizeof (buf), &request);
+      if (w->config->rfc5780 &&
+          stun_message_find32 (&request, STUN_ATTRIBUTE_CHANGE_REQUEST,
+              &change) == STUN_MESSAGE_RETURN_SUCCESS &&
+          (change & (STUND_CHANGE_IP | STUND_CHANGE_PORT)))
+      {
+        /* There is no alternate address nor port to answer from */
+        uint16_t ids[2] = {
+          htons (STUN_ATTRIBUTE_CHANGE_REQUEST),
+          htons (STUN_ATTRIBUTE_CHANGE_REQUEST)
+        };
+
+        if (!stun_agent_init_error (agent, &response, out, out_size,
+                &request, STUN_ERROR_UNKNOWN_ATTRIBUTE) ||
+            stun_message_append_bytes (&response,
+                STUN_ATTRIBUTE_UNKNOWN_ATTRIBUTES, ids,
+                stun_message_has_cookie (&request) ? 2 : 4) !=
+            STUN_MESSAGE_RETURN_SUCCESS)
+          return 0;
+        return stun_agent_finish_message (agent, &response, NULL, 0);
+      }
+
+      stun_agent_init_response (agent, &response, out, out_size, &request);
       if (stun_message_has_cookie (&request))
         stun_message_append_xor_addr (&response,
-            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, &addr.storage, addr_len);
+            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, &src->storage, src_len);
       else
          stun_message_append_addr (&response, STUN_ATTRIBUTE_MAPPED_ADDRESS,
-             &addr.addr, addr_len);
+             &src->addr, src_len);
+
+      if (w->config->rfc5780 && local != NULL)
+      {
+        StundAddress origin = *local;
+
+        if (origin.addr.sa_family == AF_INET)
+          origin.in.sin_port = htons (w->config->port);
+        else
+          origin.in6.sin6_port = htons (w->config->port);
+        stun_message_append_addr (&response, STUN_ATTRIBUTE_RESPONSE_ORIGIN,
+            &origin.addr, origin.addr.sa_family == AF_INET ?
+            sizeof (struct sockaddr_in) : sizeof (struct sockaddr_in6));
+      }
       break;
 
     case STUN_SHARED_SECRET:
@@ -244,33 +386,306 @@ static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
     case STUN_CREATEPERMISSION:
     case STUN_CHANNELBIND:
     default:
-      if (!stun_agent_init_error (agent, &response, buf, sizeof (buf),
+      if (!stun_agent_init_error (agent, &response, out, out_size,
               &request, STUN_ERROR_BAD_REQUEST))
-        return -1;
+        return 0;
   }
 
-  buf_len = stun_agent_finish_message (agent, &response, NULL, 0);
-send_buf:
-  len = sendto (sock, buf, buf_len, 0, &addr.addr, addr_len);
-  return (len < buf_len) ? -1 : 0;
+  return stun_agent_finish_message (agent, &response, NULL, 0);
 }
 
+/*
+ * Counts an answer built by stund_answer() once it was sent
+ */
+static void stund_count_sent (StundWorker *w, const uint8_t *msg)
+{
+  /* The C0 bit of the message type is only set in error responses */
+  if (msg[1] & 0x10)
+    stund_counter_add (&w->counters.errors, 1);
+  else
+    stund_counter_add (&w->counters.responses, 1);
+}
 
-static int run (int family, int protocol, unsigned port)
+#ifndef STUND_BATCH
+static int dgram_process (StundWorker *w)
 {
-  StunAgent oldagent;
-  StunAgent newagent;
-  int sock = listen_socket (family, SOCK_DGRAM, protocol, port);
-  if (sock == -1)
+  StundAddress addr;
+  socklen_t addr_len;
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  uint8_t out[STUN_MAX_MESSAGE_SIZE];
+  size_t buf_len = 0;
+  ssize_t len = 0;
+
+  addr_len = sizeof (struct sockaddr_storage);
+  len = recvfrom (w->sock, buf, sizeof(buf), 0, &addr.addr, &addr_len);
+  if (len < 0)
+    return -1;
+  stund_counter_add (&w->counters.received, 1);
+
+  buf_len = stund_answer (w, buf, len, &addr, addr_len, NULL, out,
+      sizeof (out));
+  if (buf_len == 0)
+  {
+    stund_counter_add (&w->counters.dropped, 1);
     return -1;
+  }
 
-  stun_agent_init (&oldagent, known_attributes,
+  len = sendto (w->sock, out, buf_len, 0, &addr.addr, addr_len);
+  if (len < (ssize_t) buf_len)
+  {
+    stund_counter_add (&w->counters.dropped, 1);
+    return -1;
+  }
+  stund_count_sent (w, out);
+  return 0;
+}
+#endif
+
+#ifdef STUND_BATCH
+/*
+ * Retrieves the local address a datagram was received on from its
+ * IP_PKTINFO/IPV6_PKTINFO control message.
+ */
+static bool stund_local_address (struct msghdr *hdr, int family,
+    StundAddress *local)
+{
+  struct cmsghdr *cmsg;
+
+  memset (local, 0, sizeof (*local));
+  for (cmsg = CMSG_FIRSTHDR (hdr); cmsg != NULL; cmsg = CMSG_NXTHDR (hdr, cmsg))
+  {
+#ifdef IP_PKTINFO
+    if (family == AF_INET && cmsg->cmsg_level == SOL_IP &&
+        cmsg->cmsg_type == IP_PKTINFO)
+    {
+      struct in_pktinfo info;
+
+      memcpy (&info, CMSG_DATA (cmsg), sizeof (info));
+      local->in.sin_family = AF_INET;
+      local->in.sin_addr = info.ipi_addr;
+      return true;
+    }
+#endif
+    if (family == AF_INET6 && cmsg->cmsg_level == SOL_IPV6 &&
+        cmsg->cmsg_type == IPV6_PKTINFO)
+    {
+      struct in6_pktinfo info;
+
+      memcpy (&info, CMSG_DATA (cmsg), sizeof (info));
+      local->in6.sin6_family = AF_INET6;
+      local->in6.sin6_addr = info.ipi6_addr;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Receives up to STUND_BATCH_SIZE datagrams with one recvmmsg() call, and
+ * sends the answers back with one sendmmsg() call.
+ */
+static int dgram_process_batch (StundWorker *w)
+{
+  StundAddress local;
+  int n, i, sent;
+  unsigned n_out = 0;
+
+  for (i = 0; i < STUND_BATCH_SIZE; i++)
+  {
+    struct msghdr *hdr = &w->in[i].msg_hdr;
+
+    w->in_iov[i].iov_base = w->requests[i];
+    w->in_iov[i].iov_len = STUND_BUFFER_SIZE;
+    hdr->msg_name = &w->sources[i];
+    hdr->msg_namelen = sizeof (w->sources[i]);
+    hdr->msg_iov = &w->in_iov[i];
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = w->config->rfc5780 ? w->control[i] : NULL;
+    hdr->msg_controllen = w->config->rfc5780 ? sizeof (w->control[i]) : 0;
+    hdr->msg_flags = 0;
+  }
+
+  n = recvmmsg (w->sock, w->in, STUND_BATCH_SIZE, MSG_WAITFORONE, NULL);
+  if (n <= 0)
+    return -1;
+  stund_counter_add (&w->counters.received, n);
+
+  for (i = 0; i < n; i++)
+  {
+    struct msghdr *hdr = &w->in[i].msg_hdr;
+    bool has_local = false;
+    size_t len;
+
+    if (hdr->msg_flags & MSG_TRUNC)
+    {
+      stund_counter_add (&w->counters.dropped, 1);
+      continue;
+    }
+
+    if (w->config->rfc5780)
+      has_local = stund_local_address (hdr, w->config->family, &local);
+
+    len = stund_answer (w, w->requests[i], w->in[i].msg_len, &w->sources[i],
+        hdr->msg_namelen, has_local ? &local : NULL, w->responses[n_out],
+        STUND_BUFFER_SIZE);
+    if (len == 0)
+    {
+      stund_counter_add (&w->counters.dropped, 1);
+      continue;
+    }
+
+    w->out_iov[n_out].iov_base = w->responses[n_out];
+    w->out_iov[n_out].iov_len = len;
+    memset (&w->out[n_out], 0, sizeof (w->out[n_out]));
+    w->out[n_out].msg_hdr.msg_name = &w->sources[i];
+    w->out[n_out].msg_hdr.msg_namelen = hdr->msg_namelen;
+    w->out[n_out].msg_hdr.msg_iov = &w->out_iov[n_out];
+    w->out[n_out].msg_hdr.msg_iovlen = 1;
+    n_out++;
+  }
+
+  for (sent = 0; sent < (int) n_out;)
+  {
+    int ret = sendmmsg (w->sock, w->out + sent, n_out - sent, 0);
+    int j;
+
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      /* Skip the datagram that failed, and carry on with the others */
+      stund_counter_add (&w->counters.dropped, 1);
+      sent++;
+      continue;
+    }
+    for (j = sent; j < sent + ret; j++)
+      stund_count_sent (w, w->responses[j]);
+    sent += ret;
+  }
+
+  return 0;
+}
+#endif
+
+static int worker_init (StundWorker *w, const StundConfig *config)
+{
+  bool reuse = config->workers > 1;
+  int yes = 1;
+
+  memset (w, 0, sizeof (*w));
+  w->config = config;
+
+  w->sock = listen_socket_reuse (config->family, SOCK_DGRAM, config->protocol,
+      config->port, reuse);
+  if (w->sock == -1)
+    return -1;
+
+  if (config->rfc5780)
+  {
+#ifdef IP_PKTINFO
+    if (config->family == AF_INET)
+      setsockopt (w->sock, SOL_IP, IP_PKTINFO, (const char *) &yes,
+          sizeof (yes));
+#endif
+#ifdef IPV6_PKTINFO
+    if (config->family == AF_INET6)
+      setsockopt (w->sock, SOL_IPV6, IPV6_RECVPKTINFO, (const char *) &yes,
+          sizeof (yes));
+#endif
+  }
+  (void) yes;
+
+  stun_agent_init (&w->oldagent,
+      config->rfc5780 ? known_attributes_rfc5780 : known_attributes,
       STUN_COMPATIBILITY_RFC3489, 0);
-  stun_agent_init (&newagent, known_attributes,
+  stun_agent_init (&w->newagent,
+      config->rfc5780 ? known_attributes_rfc5780 : known_attributes,
       STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
 
+  return 0;
+}
+
+static void *worker_run (void *data)
+{
+  StundWorker *w = data;
+
+  for (;;)
+  {
+#ifdef STUND_BATCH
+    dgram_process_batch (w);
+#else
+    dgram_process (w);
+#endif
+  }
+
+  return NULL;
+}
+
+#ifdef STUND_THREADS
+/*
+ * Prints the aggregated counters of all workers once per second
+ */
+static void print_stats (StundWorker *workers, unsigned n_workers)
+{
+  unsigned long long last_received = 0;
+
   for (;;)
-    dgram_process (sock, &oldagent, &newagent);
+  {
+    unsigned long long received = 0, responses = 0, errors = 0, dropped = 0;
+    unsigned i;
+
+    sleep (1);
+    for (i = 0; i < n_workers; i++)
+    {
+      received += stund_counter_get (&workers[i].counters.received);
+      responses += stund_counter_get (&workers[i].counters.responses);
+      errors += stund_counter_get (&workers[i].counters.errors);
+      dropped += stund_counter_get (&workers[i].counters.dropped);
+    }
+    fprintf (stderr, "%llu req/s, received %llu, responses %llu, "
+        "errors %llu, dropped %llu\n", received - last_received, received,
+        responses, errors, dropped);
+    last_received = received;
+  }
+}
+#endif
+
+static int run (const StundConfig *config)
+{
+  StundWorker *workers;
+  unsigned i;
+
+  workers = malloc (config->workers * sizeof (StundWorker));
+  if (workers == NULL)
+    return -1;
+
+  for (i = 0; i < config->workers; i++)
+  {
+    if (worker_init (&workers[i], config))
+      return -1;
+  }
+
+#ifdef STUND_THREADS
+  /* The first worker runs in the main thread, unless it prints the
+   * counters */
+  for (i = config->stats ? 0 : 1; i < config->workers; i++)
+  {
+    int err = pthread_create (&workers[i].thread, NULL, worker_run,
+        &workers[i]);
+
+    if (err != 0)
+    {
+      fprintf (stderr, "Error starting worker: %s\n", strerror (err));
+      return -1;
+    }
+  }
+
+  if (config->stats)
+    print_stats (workers, config->workers);
+#endif
+
+  worker_run (&workers[0]);
+  return 0;
 }
 
 
@@ -285,10 +700,13 @@ static void exit_handler (int signum)
 
 int main (int argc, char *argv[])
 {
-  int family = AF_INET;
-  unsigned port = IPPORT_STUN;
+  StundConfig config;
   int i;
-
+#ifdef _SC_NPROCESSORS_ONLN
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+#else
+  long cpus = 1;
+#endif
 
 #ifdef _WIN32
   WSADATA wsadata;
@@ -300,6 +718,17 @@ int main (int argc, char *argv[])
 
 #endif
 
+  memset (&config, 0, sizeof (config));
+  config.family = AF_INET;
+  config.protocol = IPPROTO_UDP;
+  config.port = IPPORT_STUN;
+#ifdef STUND_THREADS
+  config.workers = cpus > 0 ? (cpus < STUND_MAX_WORKERS ? cpus :
+      STUND_MAX_WORKERS) : 1;
+#else
+  (void) cpus;
+  config.workers = 1;
+#endif
 
   for (i = 1; i < argc; ++i)
   {
@@ -307,11 +736,35 @@ int main (int argc, char *argv[])
 
     if (strcmp (arg, "-4") == 0)
     {
-      family = AF_INET;
+      config.family = AF_INET;
     }
     else if (strcmp (arg, "-6") == 0)
     {
-      family = AF_INET6;
+      config.family = AF_INET6;
+    }
+    else if (strcmp (arg, "-r") == 0)
+    {
+      config.rfc5780 = true;
+    }
+    else if (strcmp (arg, "-s") == 0)
+    {
+      config.stats = true;
+    }
+    else if (strcmp (arg, "-t") == 0 && i + 1 < argc)
+    {
+      int n = atoi (argv[++i]);
+
+      if (n < 1 || n > STUND_MAX_WORKERS)
+      {
+        fprintf (stderr, "Invalid number of workers '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+#ifndef STUND_THREADS
+      if (n > 1)
+        fprintf (stderr, "Workers not supported, running a single one\n");
+      n = 1;
+#endif
+      config.workers = n;
     }
     else if (arg[0] < '0' || arg[0] > '9')
     {
@@ -319,13 +772,13 @@ int main (int argc, char *argv[])
     }
     else
     {
-      port = atoi (arg);
+      config.port = atoi (arg);
       break;
     }
   }
 
   signal (SIGINT, exit_handler);
   signal (SIGTERM, exit_handler);
-  return run (family, IPPROTO_UDP, port) ? EXIT_FAILURE : EXIT_SUCCESS;
+  return run (&config) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
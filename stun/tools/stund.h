@@ -40,6 +40,8 @@
 # define NICE_STUN_STUND_H 1
 
 int listen_socket (int fam, int type, int proto, unsigned port);
+int listen_socket_reuse (int fam, int type, int proto, unsigned port,
+    bool reuse);
 ssize_t send_safe (int fd, const struct msghdr *msg);
 ssize_t recv_safe (int fd, struct msghdr *msg);
 
@@ -0,0 +1,733 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * STUN/TURN load generator: sends Binding, Allocate, Refresh or ChannelBind
+ * requests at a fixed rate from many simulated clients, and reports the
+ * transaction latency distribution, retransmissions and, if the server
+ * runs locally, its CPU time per request.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stun/stunagent.h"
+#include "stun/usages/bind.h"
+#include "stun/usages/turn.h"
+#include "stun/usages/timer.h"
+
+/** Lifetime requested by the Refresh requests, in seconds */
+#define LOAD_REFRESH_LIFETIME 600
+
+/** First TURN channel number, see RFC 5766 section 11 */
+#define LOAD_CHANNEL_MIN 0x4000
+#define LOAD_CHANNEL_MAX 0x7FFF
+
+typedef enum {
+  LOAD_BINDING,
+  LOAD_ALLOCATE,
+  LOAD_REFRESH,
+  LOAD_CHANNELBIND,
+  LOAD_N_METHODS
+} LoadMethod;
+
+static const char *method_names[LOAD_N_METHODS] = {
+  "binding", "allocate", "refresh", "channelbind"
+};
+
+typedef struct {
+  unsigned long long sent;
+  unsigned long long success;
+  unsigned long long errors;
+  unsigned long long retransmissions;
+  unsigned long long timeouts;
+  uint32_t *latencies;   /* microseconds, one per completed transaction */
+  size_t n_latencies;
+  size_t latencies_size;
+} LoadStats;
+
+typedef struct {
+  int fd;
+  StunAgent agent;
+  StunTimer timer;
+  bool busy;
+  LoadMethod method;       /* method of the pending transaction */
+  uint64_t start;          /* time of the first transmission */
+  StunTransactionId id;
+  uint8_t req[STUN_MAX_MESSAGE_SIZE_IPV6];
+  size_t req_len;
+  bool allocated;
+  bool has_auth;           /* auth_msg holds the last 401/438 answer */
+  StunMessage auth_msg;
+  uint8_t auth[STUN_MAX_MESSAGE_SIZE_IPV6];
+  uint16_t channel;
+} LoadClient;
+
+typedef struct {
+  LoadMethod method;
+  unsigned clients;
+  unsigned rate;
+  unsigned duration;
+  uint8_t *username;
+  size_t username_len;
+  uint8_t *password;
+  size_t password_len;
+  struct sockaddr_storage peer;
+  long server_pid;
+} LoadConfig;
+
+static uint64_t now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Returns the user and system time used by process @pid in clock ticks, or
+ * -1 if it cannot be read.
+ */
+static long long process_cpu_ticks (long pid)
+{
+  char path[64];
+  char buf[1024];
+  const char *p;
+  unsigned long utime, stime;
+  FILE *f;
+  size_t len;
+
+  snprintf (path, sizeof (path), "/proc/%ld/stat", pid);
+  f = fopen (path, "r");
+  if (f == NULL)
+    return -1;
+  len = fread (buf, 1, sizeof (buf) - 1, f);
+  fclose (f);
+  buf[len] = '\0';
+
+  /* The command name may contain spaces, skip past it */
+  p = strrchr (buf, ')');
+  if (p == NULL ||
+      sscanf (p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+          &utime, &stime) != 2)
+    return -1;
+
+  return utime + stime;
+}
+
+static void stats_add_latency (LoadStats *stats, uint32_t latency)
+{
+  if (stats->n_latencies == stats->latencies_size)
+  {
+    size_t size = stats->latencies_size ? stats->latencies_size * 2 : 4096;
+    uint32_t *l = realloc (stats->latencies, size * sizeof (*l));
+
+    if (l == NULL)
+      return;
+    stats->latencies = l;
+    stats->latencies_size = size;
+  }
+  stats->latencies[stats->n_latencies++] = latency;
+}
+
+static int compare_latency (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static uint32_t percentile (const LoadStats *stats, double p)
+{
+  size_t i = (size_t) (p * stats->n_latencies);
+
+  if (stats->n_latencies == 0)
+    return 0;
+  if (i >= stats->n_latencies)
+    i = stats->n_latencies - 1;
+  return stats->latencies[i];
+}
+
+/*
+ * Picks the next request of @client: TURN methods other than Allocate need
+ * an allocation first, and in Allocate mode every allocation is released
+ * again with a zero-lifetime Refresh.
+ */
+static LoadMethod client_next_method (const LoadConfig *config,
+    const LoadClient *client)
+{
+  switch (config->method)
+  {
+    case LOAD_BINDING:
+      return LOAD_BINDING;
+    case LOAD_ALLOCATE:
+      return client->allocated ? LOAD_REFRESH : LOAD_ALLOCATE;
+    case LOAD_REFRESH:
+    case LOAD_CHANNELBIND:
+    default:
+      return client->allocated ? config->method : LOAD_ALLOCATE;
+  }
+}
+
+static size_t build_channel_bind (const LoadConfig *config,
+    LoadClient *client, StunMessage *msg)
+{
+  uint8_t *realm = NULL, *nonce = NULL;
+  uint16_t realm_len = 0, nonce_len = 0;
+
+  if (client->has_auth)
+  {
+    realm = (uint8_t *) stun_message_find (&client->auth_msg,
+        STUN_ATTRIBUTE_REALM, &realm_len);
+    nonce = (uint8_t *) stun_message_find (&client->auth_msg,
+        STUN_ATTRIBUTE_NONCE, &nonce_len);
+  }
+
+  if (++client->channel > LOAD_CHANNEL_MAX)
+    client->channel = LOAD_CHANNEL_MIN;
+
+  stun_agent_init_request (&client->agent, msg, client->req,
+      sizeof (client->req), STUN_CHANNELBIND);
+  if (stun_message_append32 (msg, STUN_ATTRIBUTE_CHANNEL_NUMBER,
+          (uint32_t) client->channel << 16) != STUN_MESSAGE_RETURN_SUCCESS ||
+      stun_message_append_xor_addr (msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS,
+          &config->peer, sizeof (config->peer)) !=
+      STUN_MESSAGE_RETURN_SUCCESS)
+    return 0;
+
+  if (nonce != NULL && stun_message_append_bytes (msg, STUN_ATTRIBUTE_NONCE,
+          nonce, nonce_len) != STUN_MESSAGE_RETURN_SUCCESS)
+    return 0;
+  if (realm != NULL && stun_message_append_bytes (msg, STUN_ATTRIBUTE_REALM,
+          realm, realm_len) != STUN_MESSAGE_RETURN_SUCCESS)
+    return 0;
+  if (nonce != NULL && realm != NULL && stun_message_append_bytes (msg,
+          STUN_ATTRIBUTE_USERNAME, config->username, config->username_len) !=
+      STUN_MESSAGE_RETURN_SUCCESS)
+    return 0;
+
+  return stun_agent_finish_message (&client->agent, msg, config->password,
+      config->password_len);
+}
+
+static bool client_send (const LoadConfig *config, LoadClient *client,
+    LoadStats *stats)
+{
+  StunMessage msg;
+  StunMessage *auth = client->has_auth ? &client->auth_msg : NULL;
+  size_t len = 0;
+
+  client->method = client_next_method (config, client);
+
+  switch (client->method)
+  {
+    case LOAD_BINDING:
+      len = stun_usage_bind_create (&client->agent, &msg, client->req,
+          sizeof (client->req));
+      break;
+    case LOAD_ALLOCATE:
+      len = stun_usage_turn_create (&client->agent, &msg, client->req,
+          sizeof (client->req), auth, STUN_USAGE_TURN_REQUEST_PORT_NORMAL,
+          -1, -1, config->username, config->username_len, config->password,
+          config->password_len, STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+      break;
+    case LOAD_REFRESH:
+      len = stun_usage_turn_create_refresh (&client->agent, &msg, client->req,
+          sizeof (client->req), auth,
+          config->method == LOAD_ALLOCATE ? 0 : LOAD_REFRESH_LIFETIME,
+          config->username, config->username_len, config->password,
+          config->password_len, STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+      break;
+    case LOAD_CHANNELBIND:
+      len = build_channel_bind (config, client, &msg);
+      break;
+    case LOAD_N_METHODS:
+    default:
+      break;
+  }
+
+  if (len == 0)
+  {
+    fprintf (stderr, "Error building %s request\n",
+        method_names[client->method]);
+    return false;
+  }
+
+  client->req_len = len;
+  stun_message_id (&msg, client->id);
+  client->busy = true;
+  client->start = now_us ();
+  stun_timer_start (&client->timer, STUN_TIMER_DEFAULT_TIMEOUT,
+      STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
+  stats[client->method].sent++;
+
+  /* Failures, such as ICMP errors reported on the connected socket, show
+   * up as timeouts */
+  send (client->fd, client->req, len, 0);
+  return true;
+}
+
+static void client_recv (const LoadConfig *config, LoadClient *client,
+    LoadStats *stats)
+{
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+  StunMessage msg;
+  StunValidationStatus valid;
+  ssize_t len;
+  int code;
+
+  len = recv (client->fd, buf, sizeof (buf), MSG_DONTWAIT);
+  if (len <= 0 || !client->busy)
+    return;
+
+  valid = stun_agent_validate (&client->agent, &msg, buf, len, NULL, NULL);
+  if (valid == STUN_VALIDATION_UNAUTHORIZED)
+  {
+    /* A matched answer we cannot authenticate, such as an error without
+     * MESSAGE-INTEGRITY from a plain STUN server, still ends the
+     * transaction */
+    stun_agent_forget_transaction (&client->agent, client->id);
+    client->busy = false;
+    stats_add_latency (&stats[client->method], now_us () - client->start);
+    stats[client->method].errors++;
+    return;
+  }
+  if (valid != STUN_VALIDATION_SUCCESS)
+    return;
+
+  client->busy = false;
+  stats_add_latency (&stats[client->method], now_us () - client->start);
+
+  if (stun_message_get_class (&msg) == STUN_RESPONSE)
+  {
+    stats[client->method].success++;
+    if (client->method == LOAD_ALLOCATE)
+      client->allocated = true;
+    else if (client->method == LOAD_REFRESH && config->method == LOAD_ALLOCATE)
+      client->allocated = false;
+    return;
+  }
+
+  stats[client->method].errors++;
+  if (stun_message_find_error (&msg, &code) != STUN_MESSAGE_RETURN_SUCCESS)
+    return;
+
+  switch (code)
+  {
+    case STUN_ERROR_UNAUTHORIZED:
+    case STUN_ERROR_STALE_NONCE:
+      /* Keep the challenge for the long-term credentials, and answer it
+       * right away as a real client would */
+      if (client->has_auth && code == STUN_ERROR_UNAUTHORIZED)
+        break;
+      memcpy (client->auth, buf, len);
+      client->auth_msg.buffer = client->auth;
+      client->auth_msg.buffer_len = len;
+      client->has_auth = true;
+      client_send (config, client, stats);
+      break;
+    case STUN_ERROR_ALLOCATION_MISMATCH:
+      client->allocated = (client->method == LOAD_ALLOCATE);
+      break;
+    default:
+      break;
+  }
+}
+
+static void client_check_timer (LoadClient *client, LoadStats *stats)
+{
+  switch (stun_timer_refresh (&client->timer))
+  {
+    case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+      stats[client->method].timeouts++;
+      stun_agent_forget_transaction (&client->agent, client->id);
+      client->busy = false;
+      break;
+    case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+      stats[client->method].retransmissions++;
+      send (client->fd, client->req, client->req_len, 0);
+      break;
+    case STUN_USAGE_TIMER_RETURN_SUCCESS:
+    default:
+      break;
+  }
+}
+
+static int run (const LoadConfig *config, const struct addrinfo *server)
+{
+  LoadClient *clients;
+  struct pollfd *fds;
+  LoadStats stats[LOAD_N_METHODS];
+  uint64_t start, end, next_tick, next_timers, interval, now;
+  unsigned long long skipped = 0;
+  long long cpu_start = -1, cpu_end = -1;
+  unsigned next_client = 0;
+  unsigned i, busy;
+  int m;
+
+  clients = calloc (config->clients, sizeof (LoadClient));
+  fds = calloc (config->clients, sizeof (struct pollfd));
+  if (clients == NULL || fds == NULL)
+    return -1;
+  memset (stats, 0, sizeof (stats));
+
+  for (i = 0; i < config->clients; i++)
+  {
+    LoadClient *client = &clients[i];
+
+    client->fd = socket (server->ai_family, SOCK_DGRAM, 0);
+    if (client->fd == -1 ||
+        connect (client->fd, server->ai_addr, server->ai_addrlen))
+    {
+      perror ("Error creating client socket");
+      return -1;
+    }
+    fds[i].fd = client->fd;
+    fds[i].events = POLLIN;
+
+    if (config->method == LOAD_BINDING)
+      stun_agent_init (&client->agent, STUN_ALL_KNOWN_ATTRIBUTES,
+          STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+    else
+      stun_agent_init (&client->agent, STUN_ALL_KNOWN_ATTRIBUTES,
+          STUN_COMPATIBILITY_RFC5389,
+          STUN_AGENT_USAGE_ADD_SOFTWARE |
+          STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+    client->channel = LOAD_CHANNEL_MIN - 1 + i % (LOAD_CHANNEL_MAX -
+        LOAD_CHANNEL_MIN);
+  }
+
+  if (config->server_pid > 0)
+  {
+    cpu_start = process_cpu_ticks (config->server_pid);
+    if (cpu_start < 0)
+      fprintf (stderr, "Cannot read CPU usage of process %ld\n",
+          config->server_pid);
+  }
+
+  interval = 1000000 / config->rate;
+  if (interval == 0)
+    interval = 1;
+  start = now_us ();
+  end = start + (uint64_t) config->duration * 1000000;
+  next_tick = next_timers = start;
+
+  for (;;)
+  {
+    int timeout;
+
+    now = now_us ();
+
+    /* Open loop: requests are due at a fixed rate, whether or not the
+     * previous ones were answered */
+    while (next_tick <= now && next_tick < end)
+    {
+      for (i = 0; i < config->clients; i++)
+      {
+        LoadClient *client = &clients[(next_client + i) % config->clients];
+
+        if (!client->busy)
+          break;
+      }
+      if (i == config->clients)
+      {
+        skipped++;
+      }
+      else
+      {
+        next_client = (next_client + i) % config->clients;
+        if (!client_send (config, &clients[next_client], stats))
+          return -1;
+        next_client = (next_client + 1) % config->clients;
+      }
+      next_tick += interval;
+    }
+
+    if (now >= next_timers)
+    {
+      busy = 0;
+      for (i = 0; i < config->clients; i++)
+      {
+        if (clients[i].busy)
+        {
+          client_check_timer (&clients[i], stats);
+          busy += clients[i].busy;
+        }
+      }
+      next_timers = now + 10000;
+
+      /* After the deadline, wait for the outstanding transactions */
+      if (now >= end && busy == 0)
+        break;
+    }
+
+    if (next_tick < end)
+      timeout = next_tick > now ? (next_tick - now + 999) / 1000 : 0;
+    else
+      timeout = 10;
+    if (timeout > 10)
+      timeout = 10;
+
+    if (poll (fds, config->clients, timeout) > 0)
+    {
+      for (i = 0; i < config->clients; i++)
+      {
+        if (fds[i].revents & POLLIN)
+          client_recv (config, &clients[i], stats);
+      }
+    }
+  }
+
+  if (cpu_start >= 0)
+    cpu_end = process_cpu_ticks (config->server_pid);
+
+  printf ("%-12s %10s %10s %8s %8s %8s %9s %9s %9s %9s\n", "method", "sent",
+      "success", "errors", "retrans", "timeouts", "p50(us)", "p99(us)",
+      "p999(us)", "max(us)");
+  for (m = 0; m < LOAD_N_METHODS; m++)
+  {
+    LoadStats *s = &stats[m];
+
+    if (s->sent == 0)
+      continue;
+    qsort (s->latencies, s->n_latencies, sizeof (uint32_t), compare_latency);
+    printf ("%-12s %10llu %10llu %8llu %8llu %8llu %9u %9u %9u %9u\n",
+        method_names[m], s->sent, s->success, s->errors, s->retransmissions,
+        s->timeouts, percentile (s, 0.5), percentile (s, 0.99),
+        percentile (s, 0.999),
+        s->n_latencies ? s->latencies[s->n_latencies - 1] : 0);
+    free (s->latencies);
+  }
+
+  if (skipped)
+    printf ("%llu requests skipped, all clients busy\n", skipped);
+
+  if (cpu_start >= 0 && cpu_end >= 0)
+  {
+    unsigned long long total = 0;
+    double cpu_us = (double) (cpu_end - cpu_start) * 1000000 /
+        sysconf (_SC_CLK_TCK);
+
+    for (m = 0; m < LOAD_N_METHODS; m++)
+      total += stats[m].sent + stats[m].retransmissions;
+    printf ("server CPU: %.0f us total, %.2f us per request\n", cpu_us,
+        total ? cpu_us / total : 0.0);
+  }
+
+  for (i = 0; i < config->clients; i++)
+  {
+    close (clients[i].fd);
+    stun_agent_clear (&clients[i].agent);
+  }
+  free (clients);
+  free (fds);
+
+  return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+  struct addrinfo hints, *res = NULL;
+  const char *server = NULL, *port = "3478", *peer = NULL;
+  LoadConfig config;
+  int family = AF_UNSPEC;
+  int ai_flags = 0;
+  int i, m, ret;
+
+  memset (&config, 0, sizeof (config));
+  config.method = LOAD_BINDING;
+  config.clients = 64;
+  config.rate = 1000;
+  config.duration = 10;
+  config.username = (uint8_t *) "user";
+  config.password = (uint8_t *) "pass";
+
+  for (i = 1; i < argc; ++i)
+  {
+    const char *arg = argv[i];
+
+    if (arg[0] != '-')
+      break;
+
+    if (strcmp (arg, "--ipv4") == 0 || strcmp (arg, "-4") == 0)
+    {
+      family = AF_INET;
+    }
+    else if (strcmp (arg, "--ipv6") == 0 || strcmp (arg, "-6") == 0)
+    {
+      family = AF_INET6;
+    }
+    else if (strcmp (arg, "--numeric") == 0 || strcmp (arg, "-n") == 0)
+    {
+      ai_flags |= AI_NUMERICHOST;
+    }
+    else if ((strcmp (arg, "--method") == 0 || strcmp (arg, "-m") == 0) &&
+        i + 1 < argc)
+    {
+      arg = argv[++i];
+      for (m = 0; m < LOAD_N_METHODS; m++)
+        if (strcmp (arg, method_names[m]) == 0)
+          break;
+      if (m == LOAD_N_METHODS)
+      {
+        fprintf (stderr, "Unknown method '%s'\n", arg);
+        return 2;
+      }
+      config.method = m;
+    }
+    else if ((strcmp (arg, "--clients") == 0 || strcmp (arg, "-c") == 0) &&
+        i + 1 < argc)
+    {
+      config.clients = atoi (argv[++i]);
+    }
+    else if ((strcmp (arg, "--rate") == 0 || strcmp (arg, "-r") == 0) &&
+        i + 1 < argc)
+    {
+      config.rate = atoi (argv[++i]);
+    }
+    else if ((strcmp (arg, "--duration") == 0 || strcmp (arg, "-d") == 0) &&
+        i + 1 < argc)
+    {
+      config.duration = atoi (argv[++i]);
+    }
+    else if ((strcmp (arg, "--username") == 0 || strcmp (arg, "-u") == 0) &&
+        i + 1 < argc)
+    {
+      config.username = (uint8_t *) argv[++i];
+    }
+    else if ((strcmp (arg, "--password") == 0 || strcmp (arg, "-p") == 0) &&
+        i + 1 < argc)
+    {
+      config.password = (uint8_t *) argv[++i];
+    }
+    else if (strcmp (arg, "--peer") == 0 && i + 1 < argc)
+    {
+      peer = argv[++i];
+    }
+    else if ((strcmp (arg, "--server-pid") == 0 || strcmp (arg, "-P") == 0) &&
+        i + 1 < argc)
+    {
+      config.server_pid = atol (argv[++i]);
+    }
+    else if (strcmp (arg, "--help") == 0 || strcmp (arg, "-h") == 0)
+    {
+      printf ("Usage: %s [options] <server> [port number]\n"
+              "Generates STUN/TURN load and measures transaction latency\n"
+              "\n"
+              "  -4, --ipv4          Force IP version 4\n"
+              "  -6, --ipv6          Force IP version 6\n"
+              "  -n, --numeric       Server in numeric form\n"
+              "  -m, --method NAME   binding, allocate, refresh or channelbind\n"
+              "  -c, --clients N     Number of simulated clients (64)\n"
+              "  -r, --rate N        Requests per second (1000)\n"
+              "  -d, --duration N    Test duration in seconds (10)\n"
+              "  -u, --username NAME TURN username\n"
+              "  -p, --password PASS TURN password\n"
+              "      --peer ADDRESS  ChannelBind peer (the server address)\n"
+              "  -P, --server-pid N  Report the CPU time of a local server\n"
+              "\n", argv[0]);
+      return 0;
+    }
+    else if (strcmp (arg, "--version") == 0 || strcmp (arg, "-V") == 0)
+    {
+      printf ("stunload: STUN/TURN load generator (%s v%s)\n",
+              PACKAGE, VERSION);
+      return 0;
+    } else {
+      fprintf (stderr, "Unexpected command line argument '%s'\n", arg);
+      return 2;
+    }
+  }
+
+  if (i < argc)
+    server = argv[i++];
+  if (i < argc)
+    port = argv[i++];
+  if (i < argc)
+  {
+    fprintf (stderr, "%s: extra parameter `%s'\n", argv[0], argv[i]);
+    return 2;
+  }
+
+  if (config.clients == 0 || config.rate == 0 || config.duration == 0)
+  {
+    fprintf (stderr, "%s: clients, rate and duration must be positive\n",
+        argv[0]);
+    return 2;
+  }
+  config.username_len = strlen ((const char *) config.username);
+  config.password_len = strlen ((const char *) config.password);
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = ai_flags;
+  ret = getaddrinfo (server, port, &hints, &res);
+  if (ret)
+  {
+    fprintf (stderr, "%s (port %s): %s\n", server, port, gai_strerror (ret));
+    return 1;
+  }
+  memcpy (&config.peer, res->ai_addr, res->ai_addrlen);
+
+  if (peer != NULL)
+  {
+    struct addrinfo *peer_res;
+
+    ret = getaddrinfo (peer, port, &hints, &peer_res);
+    if (ret)
+    {
+      fprintf (stderr, "%s: %s\n", peer, gai_strerror (ret));
+      freeaddrinfo (res);
+      return 1;
+    }
+    memcpy (&config.peer, peer_res->ai_addr, peer_res->ai_addrlen);
+    freeaddrinfo (peer_res);
+  }
+
+  ret = run (&config, res) ? 1 : 0;
+  freeaddrinfo (res);
+
+  return ret;
+}
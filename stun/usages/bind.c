@@ -64,6 +64,8 @@
 
 
 #include "../stunagent.h"
+#include "../stunhmac.h"
+#include "../utils.h"
 #include "bind.h"
 
 #include "timer.h"
@@ -190,6 +192,41 @@ stun_usage_bind_keepalive(StunAgent *agent, StunMessage *msg,
 }
 
 
+size_t
+stun_usage_bind_keepalive_refresh(StunAgent *agent, StunMessage *msg) {
+    StunTransactionId id;
+    const uint8_t *fpr;
+    uint16_t fpr_len, value;
+
+    if (stun_message_get_class(msg) != STUN_INDICATION ||
+        stun_message_get_method(msg) != STUN_BINDING)
+        return 0;
+
+    /* Drop the old FINGERPRINT, stun_agent_finish_message() appends it
+     * again over the new transaction ID */
+    fpr = stun_message_find(msg, STUN_ATTRIBUTE_FINGERPRINT, &fpr_len);
+    if (fpr != NULL) {
+        value = htons(fpr - STUN_ATTRIBUTE_HEADER_LENGTH -
+                      (msg->buffer + STUN_MESSAGE_HEADER_LENGTH));
+        memcpy(msg->buffer + STUN_MESSAGE_LENGTH_POS, &value, sizeof(value));
+    }
+    stun_message_drop_index(msg);
+
+    stun_make_transid(id);
+    if (agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
+        agent->compatibility == STUN_COMPATIBILITY_MSICE2) {
+        /* Keep the magic cookie */
+        memcpy(msg->buffer + STUN_MESSAGE_TRANS_ID_POS + 4, id + 4,
+               STUN_MESSAGE_TRANS_ID_LEN - 4);
+    } else {
+        memcpy(msg->buffer + STUN_MESSAGE_TRANS_ID_POS, id,
+               STUN_MESSAGE_TRANS_ID_LEN);
+    }
+
+    return stun_agent_finish_message(agent, msg, NULL, 0);
+}
+
+
 typedef struct stun_trans_s {
 
     int fd;
@@ -556,6 +593,7 @@ StunUsageBindReturn stun_usage_bind_run(const struct sockaddr *srv,
 done:
     if (trans.fd != -1)
         stun_trans_deinit(&trans);
+    stun_agent_clear(&agent);
 
     return bind_ret;
 }
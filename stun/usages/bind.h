@@ -139,6 +139,22 @@ StunUsageBindReturn stun_usage_bind_process (StunMessage *msg,
 size_t stun_usage_bind_keepalive (StunAgent *agent, StunMessage *msg,
     uint8_t *buf, size_t len);
 
+/**
+ * stun_usage_bind_keepalive_refresh:
+ * @agent: The #StunAgent that built the message
+ * @msg: A #StunMessage previously built by stun_usage_bind_keepalive()
+ *
+ * Turns a keepalive built earlier with stun_usage_bind_keepalive() into a
+ * new one, in place: only the transaction ID and the FINGERPRINT are
+ * written again. This saves re-encoding the whole indication when it is
+ * sent periodically from the same buffer.
+ * Returns: The length of the message to send, or 0 if @msg is not a
+ * binding indication.
+ *
+ * Since: 0.1.20
+ */
+size_t stun_usage_bind_keepalive_refresh (StunAgent *agent, StunMessage *msg);
+
 /**
  * stun_usage_bind_run:
  * @srv: A pointer to the #sockaddr structure representing the STUN server's
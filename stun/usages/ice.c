@@ -54,6 +54,8 @@
 
 
 #include "../stunagent.h"
+#include "../stunhmac.h"
+#include "../utils.h"
 
 /** ICE connectivity checks **/
 #include "ice.h"
@@ -136,6 +138,173 @@ stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
 }
 
 
+struct _StunUsageIceConncheckTemplate {
+  /* Header, SOFTWARE, PRIORITY, ICE-CONTROLLING/CONTROLLED, USERNAME and
+   * the MS-ICE2 attributes, encoded without USE-CANDIDATE */
+  uint8_t *buffer;
+  size_t length;
+  /* Where USE-CANDIDATE is inserted, right after SOFTWARE */
+  size_t use_candidate_offset;
+  /* Position of the ICE-CONTROLLING/CONTROLLED attribute, 0 if none */
+  size_t control_offset;
+};
+
+
+StunUsageIceConncheckTemplate *
+stun_usage_ice_conncheck_template_new (StunAgent *agent,
+    const uint8_t *username, const size_t username_len,
+    uint32_t priority, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility)
+{
+  StunUsageIceConncheckTemplate *tmpl;
+  uint8_t buffer[STUN_MAX_MESSAGE_SIZE_IPV6];
+  StunMessage msg;
+  size_t use_candidate_offset, control_offset = 0;
+  size_t length;
+
+  if (!stun_agent_init_request (agent, &msg, buffer, sizeof (buffer),
+          STUN_BINDING))
+    return NULL;
+
+  use_candidate_offset = stun_message_length (&msg);
+
+  if (compatibility == STUN_USAGE_ICE_COMPATIBILITY_RFC5245 ||
+      compatibility == STUN_USAGE_ICE_COMPATIBILITY_MSICE2) {
+    if (stun_message_append32 (&msg, STUN_ATTRIBUTE_PRIORITY, priority) !=
+        STUN_MESSAGE_RETURN_SUCCESS)
+      return NULL;
+
+    /* The role and tie-breaker are stamped on each request */
+    control_offset = stun_message_length (&msg);
+    if (stun_message_append64 (&msg, STUN_ATTRIBUTE_ICE_CONTROLLING, 0) !=
+        STUN_MESSAGE_RETURN_SUCCESS)
+      return NULL;
+  }
+
+  if (username && username_len > 0) {
+    if (stun_message_append_bytes (&msg, STUN_ATTRIBUTE_USERNAME,
+            username, username_len) != STUN_MESSAGE_RETURN_SUCCESS)
+      return NULL;
+  }
+
+  if (compatibility == STUN_USAGE_ICE_COMPATIBILITY_MSICE2 &&
+      candidate_identifier) {
+    size_t identifier_len = strlen (candidate_identifier);
+    size_t attribute_len = (identifier_len + 3) & ~(size_t) 3;
+    uint8_t *identifier;
+    StunMessageReturn val;
+
+    identifier = calloc (1, attribute_len + 1);
+    if (identifier == NULL)
+      return NULL;
+    memcpy (identifier, candidate_identifier, identifier_len);
+
+    val = stun_message_append_bytes (&msg,
+        STUN_ATTRIBUTE_CANDIDATE_IDENTIFIER, identifier, attribute_len);
+    free (identifier);
+
+    if (val != STUN_MESSAGE_RETURN_SUCCESS)
+      return NULL;
+
+    if (stun_message_append32 (&msg,
+            STUN_ATTRIBUTE_MS_IMPLEMENTATION_VERSION, 2) !=
+        STUN_MESSAGE_RETURN_SUCCESS)
+      return NULL;
+  }
+
+  length = stun_message_length (&msg);
+
+  tmpl = malloc (sizeof (*tmpl) + length);
+  if (tmpl == NULL)
+    return NULL;
+
+  tmpl->buffer = (uint8_t *) (tmpl + 1);
+  memcpy (tmpl->buffer, buffer, length);
+  tmpl->length = length;
+  tmpl->use_candidate_offset = use_candidate_offset;
+  tmpl->control_offset = control_offset;
+
+  return tmpl;
+}
+
+
+void
+stun_usage_ice_conncheck_template_free (StunUsageIceConncheckTemplate *tmpl)
+{
+  free (tmpl);
+}
+
+
+size_t
+stun_usage_ice_conncheck_create_from_template (StunAgent *agent,
+    const StunUsageIceConncheckTemplate *tmpl, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint64_t tie)
+{
+  StunTransactionId id;
+  size_t offset = tmpl->use_candidate_offset;
+  size_t length = tmpl->length;
+  uint16_t value;
+
+  /* USE-CANDIDATE is only ever sent along with the ICE attributes */
+  if (tmpl->control_offset == 0)
+    cand_use = FALSE;
+  if (cand_use)
+    length += STUN_ATTRIBUTE_HEADER_LENGTH;
+
+  if (length > buffer_len)
+    return 0;
+
+  msg->buffer = buffer;
+  msg->buffer_len = buffer_len;
+  msg->agent = agent;
+  msg->key = NULL;
+  msg->key_len = 0;
+  msg->long_term_valid = FALSE;
+  stun_message_drop_index (msg);
+
+  memcpy (buffer, tmpl->buffer, offset);
+  if (cand_use) {
+    value = htons (STUN_ATTRIBUTE_USE_CANDIDATE);
+    memcpy (buffer + offset, &value, sizeof (value));
+    memset (buffer + offset + STUN_ATTRIBUTE_TYPE_LEN, 0,
+        STUN_ATTRIBUTE_LENGTH_LEN);
+    offset += STUN_ATTRIBUTE_HEADER_LENGTH;
+  }
+  memcpy (buffer + offset, tmpl->buffer + tmpl->use_candidate_offset,
+      tmpl->length - tmpl->use_candidate_offset);
+
+  value = htons (length - STUN_MESSAGE_HEADER_LENGTH);
+  memcpy (buffer + STUN_MESSAGE_LENGTH_POS, &value, sizeof (value));
+
+  if (tmpl->control_offset != 0) {
+    uint8_t *attr = buffer + tmpl->control_offset + (offset -
+        tmpl->use_candidate_offset);
+    uint32_t tab[2];
+
+    value = htons (controlling ? STUN_ATTRIBUTE_ICE_CONTROLLING :
+        STUN_ATTRIBUTE_ICE_CONTROLLED);
+    memcpy (attr, &value, sizeof (value));
+
+    tab[0] = htonl ((uint32_t) (tie >> 32));
+    tab[1] = htonl ((uint32_t) tie);
+    memcpy (attr + STUN_ATTRIBUTE_VALUE_POS, tab, sizeof (tab));
+  }
+
+  /* Same transaction ID layout as stun_agent_init_request() */
+  stun_make_transid (id);
+  memcpy (buffer + STUN_MESSAGE_TRANS_ID_POS, id, STUN_MESSAGE_TRANS_ID_LEN);
+  if (agent->compatibility == STUN_COMPATIBILITY_RFC5389 ||
+      agent->compatibility == STUN_COMPATIBILITY_MSICE2) {
+    uint32_t cookie = htonl (STUN_MAGIC_COOKIE);
+    memcpy (buffer + STUN_MESSAGE_TRANS_ID_POS, &cookie, sizeof (cookie));
+  }
+
+  return stun_agent_finish_message (agent, msg, password, password_len);
+}
+
+
 StunUsageIceReturn stun_usage_ice_conncheck_process (StunMessage *msg,
     struct sockaddr_storage *addr, socklen_t *addrlen,
     StunUsageIceCompatibility compatibility)
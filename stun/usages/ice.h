@@ -159,6 +159,95 @@ stun_usage_ice_conncheck_create (StunAgent *agent, StunMessage *msg,
     StunUsageIceCompatibility compatibility);
 
 
+/**
+ * StunUsageIceConncheckTemplate:
+ *
+ * An opaque structure holding the pre-encoded attributes of the ICE
+ * connectivity checks sent over one candidate pair.
+ * See stun_usage_ice_conncheck_template_new().
+ *
+ * Since: 0.1.20
+ */
+typedef struct _StunUsageIceConncheckTemplate StunUsageIceConncheckTemplate;
+
+/**
+ * stun_usage_ice_conncheck_template_new:
+ * @agent: The #StunAgent that will send the requests
+ * @username: The username to use in the requests
+ * @username_len: The length of @username
+ * @priority: The value of the PRIORITY attribute
+ * @candidate_identifier: The foundation value to put in the
+ * CANDIDATE-IDENTIFIER attribute
+ * @compatibility: The compatibility mode to use for building the conncheck
+ * requests
+ *
+ * Encodes once the parts of an ICE connectivity check that do not change
+ * from one request to the next on a given candidate pair. Requests are then
+ * built with stun_usage_ice_conncheck_create_from_template(), which only
+ * has to stamp a new transaction ID, the USE-CANDIDATE flag, the role and
+ * the MESSAGE-INTEGRITY and FINGERPRINT attributes.
+ *
+ * The template must be rebuilt if the credentials of the pair, or the
+ * SOFTWARE attribute or compatibility of @agent change.
+ *
+ * Returns: A new #StunUsageIceConncheckTemplate to free with
+ * stun_usage_ice_conncheck_template_free(), or %NULL if the attributes do
+ * not fit in a STUN message.
+ *
+ * Since: 0.1.20
+ */
+StunUsageIceConncheckTemplate *
+stun_usage_ice_conncheck_template_new (StunAgent *agent,
+    const uint8_t *username, const size_t username_len,
+    uint32_t priority, const char *candidate_identifier,
+    StunUsageIceCompatibility compatibility);
+
+/**
+ * stun_usage_ice_conncheck_template_free:
+ * @tmpl: The #StunUsageIceConncheckTemplate to free, or %NULL
+ *
+ * Frees a template created by stun_usage_ice_conncheck_template_new().
+ *
+ * Since: 0.1.20
+ */
+void
+stun_usage_ice_conncheck_template_free (StunUsageIceConncheckTemplate *tmpl);
+
+/**
+ * stun_usage_ice_conncheck_create_from_template:
+ * @agent: The #StunAgent to use to build the request
+ * @tmpl: The #StunUsageIceConncheckTemplate of the candidate pair
+ * @msg: The #StunMessage to build
+ * @buffer: The buffer to use for creating the #StunMessage
+ * @buffer_len: The size of the @buffer
+ * @password: The key to use for building the MESSAGE-INTEGRITY
+ * @password_len: The length of @password
+ * @cand_use: Set to %TRUE to append the USE-CANDIDATE flag to the request
+ * @controlling: Set to %TRUE if you are the controlling agent or set to
+ * %FALSE if you are the controlled agent.
+ * @tie: The value of the tie-breaker to put in the ICE-CONTROLLED or
+ * ICE-CONTROLLING attribute
+ *
+ * Builds an ICE connectivity check STUN message from a template. The
+ * message is identical to the one stun_usage_ice_conncheck_create() would
+ * build from the same arguments, and is registered as a new transaction of
+ * @agent the same way.
+ * If the compatibility of the template is not
+ * #STUN_USAGE_ICE_COMPATIBILITY_RFC5245 or
+ * #STUN_USAGE_ICE_COMPATIBILITY_MSICE2, the @cand_use, @controlling and
+ * @tie arguments are not used.
+ * Returns: The length of the message built.
+ *
+ * Since: 0.1.20
+ */
+size_t
+stun_usage_ice_conncheck_create_from_template (StunAgent *agent,
+    const StunUsageIceConncheckTemplate *tmpl, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    const uint8_t *password, const size_t password_len,
+    bool cand_use, bool controlling, uint64_t tie);
+
+
 /**
  * stun_usage_ice_conncheck_process:
  * @msg: The #StunMessage to process
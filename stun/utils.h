@@ -71,6 +71,23 @@ StunMessageReturn stun_xor_address(const StunMessage *msg,
                                    struct sockaddr_storage *addr, socklen_t addrlen,
                                    uint32_t magic_cookie);
 
+/*
+ * The attribute index of the last message indexed by an agent, see
+ * stun_message_index_attributes(). It lives in the private part of the agent
+ * and is only trusted for a message with the same buffer and header.
+ */
+#define STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE 64
+
+typedef struct {
+    const uint8_t *buffer;
+    uint8_t header[STUN_MESSAGE_HEADER_LENGTH];
+    uint16_t offsets[STUN_MESSAGE_ATTRIBUTE_INDEX_SIZE];
+} StunMessageIndex;
+
+StunMessageIndex *stun_agent_get_message_index(StunAgent *agent, bool create);
+
+void stun_message_drop_index(const StunMessage *msg);
+
 
 #ifdef __cplusplus
 }
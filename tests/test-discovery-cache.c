@@ -0,0 +1,212 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * Unit test for the server-reflexive addresses shared between agents by
+ * the discovery-cache-ttl property.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ *
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "agent.h"
+
+#include "socket/socket.h"
+#include "stunagent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The address the fake STUN server reports, which must differ from the
+ * host candidate for the server-reflexive candidate to be kept */
+#define MAPPED_IP "192.0.2.1"
+
+static NiceSocket *server_sock;
+static StunAgent server_agent;
+static guint server_requests;
+
+static GHashTable *signalled;  /* candidate address and type -> count */
+static guint srflx_signalled;
+static gboolean gathering_done;
+
+static void
+cb_new_candidate_full (NiceAgent *agent, NiceCandidate *candidate,
+    gpointer data)
+{
+  gchar addr[INET6_ADDRSTRLEN];
+  gchar *key;
+  guint n;
+
+  nice_address_to_string (&candidate->addr, addr);
+  key = g_strdup_printf ("%u %s:%u %u", candidate->type, addr,
+      nice_address_get_port (&candidate->addr), candidate->transport);
+  n = GPOINTER_TO_UINT (g_hash_table_lookup (signalled, key));
+  g_hash_table_insert (signalled, key, GUINT_TO_POINTER (n + 1));
+
+  if (candidate->type == NICE_CANDIDATE_TYPE_SERVER_REFLEXIVE)
+    srflx_signalled++;
+}
+
+static void
+cb_candidate_gathering_done (NiceAgent *agent, guint stream_id,
+    gpointer data)
+{
+  gathering_done = TRUE;
+}
+
+/*
+ * Answers the Binding requests received by the fake STUN server with
+ * MAPPED_IP and the port of the sender.
+ */
+static void
+serve_stun (void)
+{
+  gchar buf[STUN_MAX_MESSAGE_SIZE];
+  uint8_t rbuf[STUN_MAX_MESSAGE_SIZE];
+  NiceAddress from, mapped;
+  StunMessage req, msg;
+  struct sockaddr_storage ss;
+  gint len;
+  size_t rlen;
+
+  while ((len = nice_socket_recv (server_sock, &from, sizeof (buf), buf)) > 0) {
+    if (stun_agent_validate (&server_agent, &req, (uint8_t *) buf, len,
+            NULL, NULL) != STUN_VALIDATION_SUCCESS ||
+        stun_message_get_class (&req) != STUN_REQUEST)
+      continue;
+
+    server_requests++;
+
+    g_assert_true (nice_address_set_from_string (&mapped, MAPPED_IP));
+    nice_address_set_port (&mapped, nice_address_get_port (&from));
+    nice_address_copy_to_sockaddr (&mapped, (struct sockaddr *) &ss);
+
+    g_assert_true (stun_agent_init_response (&server_agent, &msg, rbuf,
+            sizeof (rbuf), &req));
+    g_assert_cmpint (stun_message_append_addr (&msg,
+            STUN_ATTRIBUTE_MAPPED_ADDRESS, (struct sockaddr *) &ss,
+            sizeof (struct sockaddr_in)), ==, STUN_MESSAGE_RETURN_SUCCESS);
+    rlen = stun_agent_finish_message (&server_agent, &msg, NULL, 0);
+    g_assert_cmpuint (rlen, >, 0);
+
+    nice_socket_send (server_sock, &from, rlen, (gchar *) rbuf);
+  }
+}
+
+/*
+ * Gathers the candidates of a new agent with the discovery cache enabled,
+ * with its only component on @port, and checks that each candidate was
+ * signalled exactly once.
+ */
+static void
+gather_once (guint port)
+{
+  NiceAgent *agent;
+  NiceAddress addr;
+  GHashTableIter iter;
+  gpointer count;
+  gint64 deadline;
+  guint stream_id;
+
+  signalled = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  srflx_signalled = 0;
+  gathering_done = FALSE;
+
+  agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+  g_object_set (agent, "ice-tcp", FALSE, "upnp", FALSE,
+      "stun-server", "127.0.0.1",
+      "stun-server-port", nice_address_get_port (&server_sock->addr),
+      "discovery-cache-ttl", 60, NULL);
+
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+  nice_agent_add_local_address (agent, &addr);
+
+  g_signal_connect (agent, "new-candidate-full",
+      G_CALLBACK (cb_new_candidate_full), NULL);
+  g_signal_connect (agent, "candidate-gathering-done",
+      G_CALLBACK (cb_candidate_gathering_done), NULL);
+
+  stream_id = nice_agent_add_stream (agent, 1);
+  nice_agent_set_port_range (agent, stream_id, 1, port, port);
+  g_assert_true (nice_agent_gather_candidates (agent, stream_id));
+
+  deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (!gathering_done) {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    while (g_main_context_iteration (NULL, FALSE));
+    serve_stun ();
+    g_usleep (1000);
+  }
+
+  g_assert_cmpuint (srflx_signalled, ==, 1);
+  g_hash_table_iter_init (&iter, signalled);
+  while (g_hash_table_iter_next (&iter, NULL, &count))
+    g_assert_cmpuint (GPOINTER_TO_UINT (count), ==, 1);
+
+  nice_agent_remove_stream (agent, stream_id);
+  g_object_unref (agent);
+  g_hash_table_unref (signalled);
+}
+
+int main (void)
+{
+  static const uint16_t known_attributes[] = { 0 };
+  NiceAddress addr;
+  NiceSocket *tmpsock;
+  guint port;
+
+#ifdef G_OS_WIN32
+  WSADATA w;
+
+  WSAStartup(0x0202, &w);
+#endif
+
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+  server_sock = nice_udp_bsd_socket_new (&addr, NULL);
+  g_assert_true (server_sock != NULL);
+  stun_agent_init (&server_agent, known_attributes,
+      STUN_COMPATIBILITY_RFC3489, STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  /* note: find a free local port for both agents to use in turn */
+  tmpsock = nice_udp_bsd_socket_new (&addr, NULL);
+  g_assert_true (tmpsock != NULL);
+  port = nice_address_get_port (&tmpsock->addr);
+  nice_socket_free (tmpsock);
+
+  /* step: the first agent asks the server */
+  gather_once (port);
+  g_assert_cmpuint (server_requests, ==, 1);
+
+  /* step: the second agent, on the same local port, uses its answer */
+  gather_once (port);
+  g_assert_cmpuint (server_requests, ==, 1);
+
+  stun_agent_clear (&server_agent);
+  nice_socket_free (server_sock);
+
+#ifdef G_OS_WIN32
+  WSACleanup();
+#endif
+  return 0;
+}
@@ -44,9 +44,18 @@
 #include "candidate-priv.h"
 
 #include "socket/socket.h"
+#include "stun/usages/ice.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/* Junk STUN sent at a connected agent, and the CPU time allowed to
+ * process each packet of it. Dropping one costs a few microseconds, the
+ * bound leaves room for slow machines and sanitizers. */
+#define JUNK_PACKETS 2000
+#define JUNK_BATCH 100
+#define JUNK_MAX_USEC_PER_PACKET 1000
 
 
 
@@ -280,6 +289,164 @@ get_port (NiceAgent *agent, guint stream_id, guint component_id)
   return port;
 }
 
+/*
+ * Waits for the response to transaction @id on @sock, counting the
+ * rejections of the junk sent before in @skipped. Returns TRUE on a
+ * success response.
+ */
+static gboolean
+wait_stun_response (NiceSocket *sock, const StunTransactionId id,
+    guint *skipped)
+{
+  gint64 deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  gchar rbuf[STUN_MAX_MESSAGE_SIZE];
+  NiceAddress from;
+
+  while (g_get_monotonic_time () < deadline) {
+    StunMessage msg = { 0 };
+    StunTransactionId rid;
+    gint len;
+
+    while (g_main_context_iteration (NULL, FALSE));
+
+    len = nice_socket_recv (sock, &from, sizeof (rbuf), rbuf);
+    if (len <= 0) {
+      g_usleep (1000);
+      continue;
+    }
+
+    msg.buffer = (uint8_t *) rbuf;
+    msg.buffer_len = len;
+    stun_message_id (&msg, rid);
+    if (memcmp (rid, id, sizeof (StunTransactionId)) == 0)
+      return stun_message_get_class (&msg) == STUN_RESPONSE;
+    (*skipped)++;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Sends unauthenticated binding requests (unknown ufrag, wrong
+ * password) and responses to transactions nobody started from one
+ * source at @target, stream @stream_id of @agent. The agent must answer
+ * far fewer requests than it received, as the source quickly runs out
+ * of its rejection budget, but a valid check from the same source must
+ * still be answered, as must checks sent between the junk. The CPU time
+ * spent on the junk alone is measured.
+ */
+static void
+flood_junk_stun (NiceAgent *agent, guint stream_id, const gchar *remote_ufrag,
+    const NiceAddress *target)
+{
+  static const uint16_t known_attributes[] = {
+    STUN_ATTRIBUTE_USERNAME,
+    STUN_ATTRIBUTE_MESSAGE_INTEGRITY,
+    STUN_ATTRIBUTE_FINGERPRINT,
+    STUN_ATTRIBUTE_PRIORITY,
+    STUN_ATTRIBUTE_ICE_CONTROLLING,
+    0
+  };
+  static const uint8_t key[] = "not-the-password";
+  NiceSocket *tmpsock;
+  GError *error = NULL;
+  StunAgent stunagent;
+  StunMessage msg;
+  StunTransactionId id;
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  gchar rbuf[STUN_MAX_MESSAGE_SIZE];
+  gchar *ufrag = NULL, *pwd = NULL, *username;
+  NiceAddress from;
+  clock_t start, cpu = 0;
+  guint sent = 0, replies = 0, checks = 0;
+  gdouble usec_per_packet;
+
+  tmpsock = nice_udp_bsd_socket_new (NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_true (nice_agent_get_local_credentials (agent, stream_id,
+          &ufrag, &pwd));
+  username = g_strconcat (ufrag, ":", remote_ufrag, NULL);
+
+  stun_agent_init (&stunagent, known_attributes,
+      STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS |
+      STUN_AGENT_USAGE_USE_FINGERPRINT);
+
+  while (sent < JUNK_PACKETS) {
+    guint k;
+
+    for (k = 0; k < JUNK_BATCH; k++, sent++) {
+      size_t len;
+
+      if (k % 2 == 0) {
+        g_assert_true (stun_agent_init_request (&stunagent, &msg, buf,
+                sizeof (buf), STUN_BINDING));
+        g_assert_cmpint (stun_message_append_string (&msg,
+                STUN_ATTRIBUTE_USERNAME, "bogus:ufrag"), ==,
+            STUN_MESSAGE_RETURN_SUCCESS);
+        len = stun_agent_finish_message (&stunagent, &msg, key,
+            sizeof (key) - 1);
+        stun_message_id (&msg, id);
+        stun_agent_forget_transaction (&stunagent, id);
+      } else {
+        guint w;
+
+        for (w = 0; w < sizeof (id); w++)
+          id[w] = g_random_int_range (0, 256);
+        memset (&msg, 0, sizeof (msg));
+        msg.agent = &stunagent;
+        msg.buffer = buf;
+        msg.buffer_len = sizeof (buf);
+        g_assert_true (stun_message_init (&msg, STUN_RESPONSE, STUN_BINDING,
+                id));
+        len = stun_agent_finish_message (&stunagent, &msg, NULL, 0);
+      }
+      g_assert_cmpuint (len, >, 0);
+
+      nice_socket_send (tmpsock, target, len, (gchar *) buf);
+    }
+
+    start = clock ();
+    while (g_main_context_iteration (NULL, FALSE));
+    cpu += clock () - start;
+
+    while (nice_socket_recv (tmpsock, &from, sizeof (rbuf), rbuf) > 0)
+      replies++;
+
+    /* note: a valid check from the flooding source is still answered */
+    {
+      size_t len;
+
+      len = stun_usage_ice_conncheck_create (&stunagent, &msg, buf,
+          sizeof (buf), (uint8_t *) username, strlen (username),
+          (uint8_t *) pwd, strlen (pwd), FALSE, TRUE, 0x6e0001ff,
+          g_random_int (), NULL, STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+      g_assert_cmpuint (len, >, 0);
+      stun_message_id (&msg, id);
+
+      nice_socket_send (tmpsock, target, len, (gchar *) buf);
+      g_assert_true (wait_stun_response (tmpsock, id, &replies));
+      stun_agent_forget_transaction (&stunagent, id);
+      checks++;
+    }
+  }
+
+  usec_per_packet = (gdouble) cpu * G_USEC_PER_SEC / CLOCKS_PER_SEC / sent;
+  g_debug ("test-drop-invalid: %u junk STUN packets, %.1f us CPU each, "
+      "%u replies, %u checks answered", sent, usec_per_packet, replies,
+      checks);
+
+  g_assert_cmpfloat (usec_per_packet, <, JUNK_MAX_USEC_PER_PACKET);
+  g_assert_cmpuint (replies, <, JUNK_PACKETS / 4);
+
+  stun_agent_clear (&stunagent);
+  nice_socket_free (tmpsock);
+  g_free (username);
+  g_free (ufrag);
+  g_free (pwd);
+}
+
 static int run_full_test (NiceAgent *lagent, NiceAgent *ragent, NiceAddress *baseaddr, guint ready, guint failed)
 {
   guint ls_id, rs_id;
@@ -431,6 +598,18 @@ static int run_full_test (NiceAgent *lagent, NiceAgent *ragent, NiceAddress *bas
     nice_socket_send (tmpsock, &remote_cand->addr, 4, "ABCD");
     nice_socket_send (tmpsock, &local_cand->addr, 5, "ABCDE");
     nice_socket_free (tmpsock);
+
+    /* note: flood the right agent with junk STUN, which must be dropped
+     * cheaply and must not disturb the established pair */
+    {
+      gchar *lufrag = NULL, *lpwd = NULL;
+
+      g_assert_true (nice_agent_get_local_credentials (lagent, ls_id,
+              &lufrag, &lpwd));
+      flood_junk_stun (ragent, rs_id, lufrag, &remote_cand->addr);
+      g_free (lufrag);
+      g_free (lpwd);
+    }
   }
 
   /* note: test payload send and receive */
@@ -95,12 +95,122 @@ test_ipv6 (void)
 }
 #endif /* G_OS_UNIX */
 
+#ifdef HAVE_LINUX_RTNETLINK_H
+static gboolean
+cb_interfaces_changed (gpointer data)
+{
+  (*(guint *) data)++;
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+iterate (GMainContext *context)
+{
+  while (g_main_context_iteration (context, FALSE));
+}
+
+/* The enumeration is cached until a notification arrives on the
+ * subscription, which also wakes up every watch exactly once. The
+ * subscription is replaced with a socket pair to fake the notifications. */
+static void
+test_cache (void)
+{
+  GMainContext *context1, *context2;
+  GSource *watch1, *watch2;
+  guint changed1 = 0, changed2 = 0;
+  GList *ips1, *ips2, *i, *j;
+  NiceAddress addr;
+  guint if_index;
+  gint sv[2];
+
+  g_assert_cmpint (socketpair (AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv),
+      ==, 0);
+  g_assert_cmpint (interfaces_cache_fd, ==, -2);
+  interfaces_cache_fd = sv[0];
+
+  /* step: lookups are cached, and return copies */
+  ips1 = nice_interfaces_get_local_ips (TRUE);
+  g_assert_true (cached_local_ips_valid[1]);
+  ips2 = nice_interfaces_get_local_ips (TRUE);
+  g_assert_cmpuint (g_list_length (ips1), ==, g_list_length (ips2));
+  for (i = ips1, j = ips2; i; i = i->next, j = j->next) {
+    g_assert_true (i->data != j->data);
+    g_assert_cmpstr (i->data, ==, j->data);
+  }
+  g_list_free_full (ips2, g_free);
+
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+  if_index = nice_interfaces_get_if_index_by_addr (&addr);
+  g_assert_true (cached_if_indexes != NULL);
+  g_assert_cmpuint (nice_interfaces_get_if_index_by_addr (&addr), ==,
+      if_index);
+
+  /* step: two watches in two contexts */
+  context1 = g_main_context_new ();
+  context2 = g_main_context_new ();
+  watch1 = nice_interfaces_watch_source_new ();
+  watch2 = nice_interfaces_watch_source_new ();
+  g_assert_true (watch1 != NULL && watch2 != NULL);
+  g_source_set_callback (watch1, cb_interfaces_changed, &changed1, NULL);
+  g_source_set_callback (watch2, cb_interfaces_changed, &changed2, NULL);
+  g_source_attach (watch1, context1);
+  g_source_attach (watch2, context2);
+
+  iterate (context1);
+  iterate (context2);
+  g_assert_cmpuint (changed1, ==, 0);
+  g_assert_cmpuint (changed2, ==, 0);
+  g_assert_true (cached_local_ips_valid[1]);
+
+  /* step: a notification read by the first watch wakes up the second one */
+  g_assert_cmpint (send (sv[1], "x", 1, 0), ==, 1);
+  iterate (context1);
+  g_assert_cmpuint (changed1, ==, 1);
+  g_assert_false (cached_local_ips_valid[1]);
+  g_assert_true (cached_if_indexes == NULL);
+  iterate (context2);
+  g_assert_cmpuint (changed2, ==, 1);
+  iterate (context1);
+  iterate (context2);
+  g_assert_cmpuint (changed1, ==, 1);
+  g_assert_cmpuint (changed2, ==, 1);
+
+  /* step: a notification read by a lookup wakes up both watches */
+  ips2 = nice_interfaces_get_local_ips (TRUE);
+  g_assert_true (cached_local_ips_valid[1]);
+  g_list_free_full (ips2, g_free);
+  g_assert_cmpint (send (sv[1], "x", 1, 0), ==, 1);
+  ips2 = nice_interfaces_get_local_ips (TRUE);
+  g_assert_cmpuint (g_list_length (ips1), ==, g_list_length (ips2));
+  g_list_free_full (ips2, g_free);
+  g_assert_cmpuint (nice_interfaces_get_if_index_by_addr (&addr), ==,
+      if_index);
+  iterate (context1);
+  iterate (context2);
+  g_assert_cmpuint (changed1, ==, 2);
+  g_assert_cmpuint (changed2, ==, 2);
+
+  g_source_destroy (watch1);
+  g_source_unref (watch1);
+  g_source_destroy (watch2);
+  g_source_unref (watch2);
+  g_assert_true (interfaces_watches == NULL);
+  g_main_context_unref (context1);
+  g_main_context_unref (context2);
+  g_list_free_full (ips1, g_free);
+  close (sv[1]);
+}
+#endif /* HAVE_LINUX_RTNETLINK_H */
+
 int
 main (void)
 {
 #ifdef G_OS_UNIX
   test_ipv4 ();
   test_ipv6 ();
+#endif
+#ifdef HAVE_LINUX_RTNETLINK_H
+  test_cache ();
 #endif
   return 0;
 }
@@ -0,0 +1,457 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <locale.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "test-pseudotcp-link.h"
+
+
+/**
+ * A benchmark for the pseudotcp socket. This connects two sockets through a
+ * simulated link and transfers data from the left one to the right one. The
+ * link has a bottleneck of the given bandwidth with a drop-tail queue,
+ * followed by a fixed propagation delay, and can add random jitter, losses
+ * and reordering, independently in each direction. Jitter larger than the
+ * serialisation time of a packet reorders packets too.
+ *
+ * Everything runs on a virtual clock, so a run takes as long as the CPU needs
+ * rather than as long as the transfer would, and the results only depend on
+ * the options and the --seed: two runs with the same arguments send exactly
+ * the same packets. This makes it suitable for comparing congestion control
+ * and buffering changes offline, for example:
+ *     test-pseudotcp-bench -n 16384 -b 50000 -d 40 -l 0.5 -c cubic
+ *     test-pseudotcp-bench -n 16384 -b 50000 -d 40 -l 0.5 -c bbr
+ *
+ * At the end, it prints:
+ *  - the goodput, as payload delivered per second of virtual time;
+ *  - the retransmission ratio, as payload bytes sent again over payload bytes;
+ *  - the RTT inflation, as the round-trip times measured by the sender
+ *    through the timestamp echoes of the right socket, over the propagation
+ *    round-trip time;
+ *  - the CPU time spent per payload byte, for both sockets and the simulator
+ *    together.
+ *
+ * Without options, a small transfer is run so that this can be part of
+ * `make check` and doesn’t bit rot. A few lossy runs with a fixed seed are
+ * part of it too.
+ */
+
+/* Virtual time at which the connection starts; the sockets treat a time of 0
+ * as unset. */
+#define START_TIME (G_USEC_PER_SEC)
+
+TestPseudoTcpLink sim;
+GRand *prng = NULL;
+
+guint8 *payload = NULL;
+gsize total_sent = 0;
+gsize total_received = 0;
+guint64 finish_time = 0;
+gboolean corrupted = FALSE;
+
+/* Statistics. */
+guint32 snd_max = 0;
+gboolean snd_max_set = FALSE;
+gsize retransmitted = 0;
+GArray *rtt_samples = NULL;  /* guint32, in ms */
+
+/* Configuration options. */
+gint64 seed = 1;
+guint size = 1024;  /* KiB */
+guint bandwidth = 10000;  /* kbit/s, or 0 for unlimited */
+guint delay = 20;  /* ms, one way */
+guint jitter = 0;  /* ms */
+gdouble loss = 0;  /* % */
+gdouble reorder = 0;  /* % */
+guint reorder_delay = 5;  /* ms */
+guint queue_size = 0;  /* KiB, or 0 for one bandwidth-delay product */
+guint mtu = 1500;
+guint start_mtu = 0;  /* or 0 for mtu */
+guint max_mtu = 0;
+gchar *congestion_control = NULL;
+gboolean no_sack = FALSE;
+gboolean no_rack = FALSE;
+guint min_rto = 1000;
+gboolean pacing = FALSE;
+guint time_limit = 3600;  /* s */
+
+
+static void
+account_segment (TestPseudoTcpLink *link, PseudoTcpSocket *sock,
+    const guint8 *buf, gsize len)
+{
+  guint32 seq;
+  gsize payload_len;
+
+  if (sock != link->left || len < HEADER_SIZE || (buf[13] & FLAG_CTL))
+    return;
+
+  /* Data segments carry no SACK blocks. */
+  payload_len = len - HEADER_SIZE - buf[12] * 8;
+  if (payload_len == 0)
+    return;
+
+  memcpy (&seq, buf + 4, sizeof (seq));
+  seq = GUINT32_FROM_BE (seq);
+
+  if (!snd_max_set) {
+    snd_max = seq;
+    snd_max_set = TRUE;
+  }
+
+  if ((gint32) (seq - snd_max) < 0)
+    retransmitted += MIN (payload_len, snd_max - seq);
+
+  if ((gint32) (seq + payload_len - snd_max) > 0)
+    snd_max = seq + payload_len;
+}
+
+static void
+sample_rtt (TestPseudoTcpLink *link, PseudoTcpSocket *sock,
+    const guint8 *buf, gsize len)
+{
+  guint32 ts_echo;
+  guint32 rtt;
+
+  if (sock != link->left || len < HEADER_SIZE)
+    return;
+
+  memcpy (&ts_echo, buf + 20, sizeof (ts_echo));
+  ts_echo = GUINT32_FROM_BE (ts_echo);
+  if (ts_echo == 0)
+    return;
+
+  rtt = link->now / 1000 - ts_echo;
+  g_array_append_val (rtt_samples, rtt);
+}
+
+static void
+write_to_sock (PseudoTcpSocket *sock)
+{
+  while (total_sent < (gsize) size * 1024) {
+    gint len;
+
+    len = pseudo_tcp_socket_send (sock, (gchar *) payload + total_sent,
+        size * 1024 - total_sent);
+    if (len <= 0)
+      break;
+
+    total_sent += len;
+  }
+}
+
+static void
+opened (PseudoTcpSocket *sock, gpointer data)
+{
+  if (sock == sim.left)
+    write_to_sock (sock);
+}
+
+static void
+readable (PseudoTcpSocket *sock, gpointer data)
+{
+  gchar buf[16384];
+  gint len;
+
+  if (sock != sim.right)
+    return;
+
+  while ((len = pseudo_tcp_socket_recv (sock, buf, sizeof (buf))) > 0) {
+    if (memcmp (buf, payload + total_received, len) != 0)
+      corrupted = TRUE;
+
+    total_received += len;
+  }
+
+  if (total_received == (gsize) size * 1024 && finish_time == 0)
+    finish_time = sim.now;
+}
+
+static void
+writable (PseudoTcpSocket *sock, gpointer data)
+{
+  if (sock == sim.left)
+    write_to_sock (sock);
+}
+
+static void
+closed (PseudoTcpSocket *sock, guint32 err, gpointer data)
+{
+  g_printerr ("%s socket closed with error %u\n",
+      (sock == sim.left) ? "Left" : "Right", err);
+}
+
+/* Run the simulation until the whole payload has been received, or the time
+ * limit is reached. */
+static void
+run (void)
+{
+  guint64 deadline = START_TIME + (guint64) time_limit * G_USEC_PER_SEC;
+
+  test_pseudo_tcp_link_connect (&sim);
+
+  while (finish_time == 0 && sim.now < deadline) {
+    if (!test_pseudo_tcp_link_step (&sim))
+      break;
+  }
+}
+
+static gint
+compare_guint32 (gconstpointer a, gconstpointer b)
+{
+  guint32 ua = *(const guint32 *) a, ub = *(const guint32 *) b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static void
+print_results (gdouble cpu_time)
+{
+  gsize total = (gsize) size * 1024;
+  gdouble elapsed = (finish_time - START_TIME) / (gdouble) G_USEC_PER_SEC;
+  gdouble goodput = total * 8 / elapsed / 1000;  /* kbit/s */
+  gdouble base_rtt = 2 * delay;
+  gdouble mean_rtt = 0;
+  guint32 median_rtt = 0, p95_rtt = 0;
+  guint i;
+
+  if (rtt_samples->len > 0) {
+    for (i = 0; i < rtt_samples->len; i++)
+      mean_rtt += g_array_index (rtt_samples, guint32, i);
+    mean_rtt /= rtt_samples->len;
+
+    g_array_sort (rtt_samples, compare_guint32);
+    median_rtt = g_array_index (rtt_samples, guint32, rtt_samples->len / 2);
+    p95_rtt = g_array_index (rtt_samples, guint32,
+        rtt_samples->len * 95 / 100);
+  }
+
+  g_print ("Transferred %" G_GSIZE_FORMAT " bytes in %.3f s\n", total, elapsed);
+  g_print ("Goodput: %.1f kbit/s", goodput);
+  if (bandwidth > 0)
+    g_print (" (%.1f%% of the bottleneck)", 100 * goodput / bandwidth);
+  g_print ("\n");
+  g_print ("Retransmitted: %" G_GSIZE_FORMAT " bytes (%.2f%%)\n",
+      retransmitted, 100.0 * retransmitted / total);
+  g_print ("Packets: %u sent, %u lost, %u dropped at the bottleneck "
+      "(left to right); %u sent, %u lost, %u dropped (right to left)\n",
+      sim.directions[0].n_sent, sim.directions[0].n_lost,
+      sim.directions[0].n_overflowed, sim.directions[1].n_sent,
+      sim.directions[1].n_lost, sim.directions[1].n_overflowed);
+  if (base_rtt > 0) {
+    g_print ("RTT: %.0f ms propagation, mean %.1f ms (×%.2f), median %u ms "
+        "(×%.2f), 95th percentile %u ms (×%.2f)\n", base_rtt,
+        mean_rtt, mean_rtt / base_rtt, median_rtt, median_rtt / base_rtt,
+        p95_rtt, p95_rtt / base_rtt);
+  } else {
+    g_print ("RTT: mean %.1f ms, median %u ms, 95th percentile %u ms\n",
+        mean_rtt, median_rtt, p95_rtt);
+  }
+  g_print ("CPU: %.1f ns/byte\n", cpu_time * 1e9 / total);
+}
+
+static GOptionEntry entries[] = {
+  { "seed", 's', 0, G_OPTION_ARG_INT64, &seed, "PRNG seed", "N" },
+  { "size", 'n', 0, G_OPTION_ARG_INT, &size,
+    "Amount of data to transfer", "KiB" },
+  { "bandwidth", 'b', 0, G_OPTION_ARG_INT, &bandwidth,
+    "Bandwidth of the bottleneck, or 0 for unlimited", "KBIT/S" },
+  { "delay", 'd', 0, G_OPTION_ARG_INT, &delay,
+    "One-way propagation delay", "MS" },
+  { "jitter", 'j', 0, G_OPTION_ARG_INT, &jitter,
+    "Largest random delay added to each packet", "MS" },
+  { "loss", 'l', 0, G_OPTION_ARG_DOUBLE, &loss,
+    "Percentage of packets lost", "P" },
+  { "reorder", 'r', 0, G_OPTION_ARG_DOUBLE, &reorder,
+    "Percentage of packets held back by --reorder-delay", "P" },
+  { "reorder-delay", 0, 0, G_OPTION_ARG_INT, &reorder_delay,
+    "Extra delay of the reordered packets", "MS" },
+  { "queue", 'q', 0, G_OPTION_ARG_INT, &queue_size,
+    "Size of the bottleneck queue, or 0 for one bandwidth-delay product",
+    "KiB" },
+  { "mtu", 0, 0, G_OPTION_ARG_INT, &mtu,
+    "Size above which packets are dropped, counting IPv4 and UDP headers",
+    "M" },
+  { "start-mtu", 0, 0, G_OPTION_ARG_INT, &start_mtu,
+    "MTU the sockets start from, or 0 for --mtu", "M" },
+  { "max-mtu", 0, 0, G_OPTION_ARG_INT, &max_mtu,
+    "Largest MTU the sockets probe the path for, or 0 to disable probing",
+    "M" },
+  { "congestion-control", 'c', 0, G_OPTION_ARG_STRING, &congestion_control,
+    "Congestion control algorithm (reno, cubic or bbr)", "NAME" },
+  { "no-sack", 0, 0, G_OPTION_ARG_NONE, &no_sack,
+    "Disable selective acknowledgements", NULL },
+  { "no-rack", 0, 0, G_OPTION_ARG_NONE, &no_rack,
+    "Disable RACK loss detection and tail loss probes", NULL },
+  { "min-rto", 0, 0, G_OPTION_ARG_INT, &min_rto,
+    "Lower bound of the retransmission timeout", "MS" },
+  { "pacing", 0, 0, G_OPTION_ARG_NONE, &pacing,
+    "Pace segments out at the congestion control rate", NULL },
+  { "time-limit", 't', 0, G_OPTION_ARG_INT, &time_limit,
+    "Virtual time after which the transfer is abandoned", "S" },
+  { NULL }
+};
+
+int main (int argc, char *argv[])
+{
+  PseudoTcpCallbacks cbs = {
+    &sim, opened, readable, writable, closed,
+    test_pseudo_tcp_link_write_packet
+  };
+  GOptionContext *context;
+  GError *error = NULL;
+  PseudoTcpCongestionControl cc = PSEUDO_TCP_CONGESTION_CONTROL_RENO;
+  clock_t cpu_start;
+  gint retval = 0;
+  guint i;
+
+  setlocale (LC_ALL, "");
+
+  /* Configuration. */
+  context = g_option_context_new ("— benchmark the pseudotcp socket");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("Option parsing failed: %s\n", error->message);
+    goto context_error;
+  }
+
+  if (size == 0) {
+    g_printerr ("Option parsing failed: %s\n", "Size must be positive.");
+    goto context_error;
+  }
+
+  if (loss >= 100 || loss < 0 || reorder > 100 || reorder < 0) {
+    g_printerr ("Option parsing failed: %s\n",
+        "Percentages must be between 0 and 100, and loss below 100.");
+    goto context_error;
+  }
+
+  if (start_mtu == 0)
+    start_mtu = mtu;
+
+  if (MIN (mtu, start_mtu) <= TRANSPORT_OVERHEAD + HEADER_SIZE) {
+    g_printerr ("Option parsing failed: %s\n", "MTU is too small.");
+    goto context_error;
+  }
+
+  if (congestion_control == NULL ||
+      g_strcmp0 (congestion_control, "reno") == 0) {
+    cc = PSEUDO_TCP_CONGESTION_CONTROL_RENO;
+  } else if (g_strcmp0 (congestion_control, "cubic") == 0) {
+    cc = PSEUDO_TCP_CONGESTION_CONTROL_CUBIC;
+  } else if (g_strcmp0 (congestion_control, "bbr") == 0) {
+    cc = PSEUDO_TCP_CONGESTION_CONTROL_BBR;
+  } else {
+    g_printerr ("Option parsing failed: %s\n",
+        "Unknown congestion control algorithm.");
+    goto context_error;
+  }
+
+  g_option_context_free (context);
+
+  g_print ("Using seed: %" G_GINT64_FORMAT ", size: %u KiB, bandwidth: %u "
+      "kbit/s, delay: %u ms, jitter: %u ms, loss: %.2f%%, reordering: %.2f%%, "
+      "SACK: %s, RACK: %s, pacing: %s, congestion control: %s\n", seed, size,
+      bandwidth, delay, jitter, loss, reorder, no_sack ? "no" : "yes",
+      no_rack ? "no" : "yes", pacing ? "yes" : "no",
+      congestion_control ? congestion_control : "reno");
+
+  prng = g_rand_new_with_seed (seed);
+  rtt_samples = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  payload = g_malloc ((gsize) size * 1024);
+  for (i = 0; i < size * 1024 / sizeof (guint32); i++)
+    ((guint32 *) payload)[i] = g_rand_int (prng);
+
+  test_pseudo_tcp_link_init (&sim, START_TIME);
+  sim.bandwidth = bandwidth;
+  sim.delay = delay;
+  sim.jitter = jitter;
+  sim.loss = loss;
+  sim.reorder = reorder;
+  sim.reorder_delay = reorder_delay;
+  sim.queue_size = queue_size;
+  sim.mtu = mtu;
+  sim.prng = prng;
+  sim.packet_sent = account_segment;
+  sim.packet_received = sample_rtt;
+
+  sim.left = g_object_new (PSEUDO_TCP_SOCKET_TYPE, "conversation", 0,
+      "callbacks", &cbs, "support-sack", !no_sack,
+      "congestion-control", cc, "transport-overhead", TRANSPORT_OVERHEAD,
+      "rack", !no_rack, "min-rto", min_rto, "pacing", pacing,
+      "max-mtu", max_mtu, NULL);
+  sim.right = g_object_new (PSEUDO_TCP_SOCKET_TYPE, "conversation", 0,
+      "callbacks", &cbs, "support-sack", !no_sack,
+      "transport-overhead", TRANSPORT_OVERHEAD, "rack", !no_rack,
+      "min-rto", min_rto, "max-mtu", max_mtu, NULL);
+
+  pseudo_tcp_socket_notify_mtu (sim.left, start_mtu);
+  pseudo_tcp_socket_notify_mtu (sim.right, start_mtu);
+
+  cpu_start = clock ();
+  run ();
+
+  if (corrupted) {
+    g_printerr ("Received data does not match what was sent.\n");
+    retval = 1;
+  } else if (finish_time == 0) {
+    g_printerr ("Transfer incomplete: %" G_GSIZE_FORMAT " of %u bytes "
+        "received.\n", total_received, size * 1024);
+    retval = 1;
+  } else {
+    print_results ((gdouble) (clock () - cpu_start) / CLOCKS_PER_SEC);
+  }
+
+  g_object_unref (sim.left);
+  g_object_unref (sim.right);
+
+  test_pseudo_tcp_link_clear (&sim);
+  g_array_unref (rtt_samples);
+  g_free (payload);
+  g_rand_free (prng);
+  g_free (congestion_control);
+
+  return retval;
+
+context_error:
+  g_printerr ("\n%s\n", g_option_context_get_help (context, TRUE, NULL));
+  g_option_context_free (context);
+
+  return 1;
+}
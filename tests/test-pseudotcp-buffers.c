@@ -0,0 +1,385 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * Unit test for the buffer auto-tuning of the pseudotcp socket, for the
+ * reassembly of the segments it receives out of order, and for the packets it
+ * sends in batches.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ *
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "test-pseudotcp-link.h"
+
+#define DELAY 10  /* ms, one way */
+#define DEFAULT_RCV_BUF_SIZE (60 * 1024)  /* NOTE: Must match pseudotcp.c. */
+#define NO_SCALE 0xFF
+
+/* One end of the connection: the left one is 0, the right one is 1. */
+typedef struct {
+  PseudoTcpSocket *sock;
+  guint8 scale;       /* window scale it sent, or NO_SCALE */
+  gsize to_send;      /* bytes to send to the other end */
+  gsize sent;
+  gsize received;
+  gboolean closed;
+  guint32 error;      /* of the closed callback */
+} End;
+
+typedef enum {
+  BATCH_SEND_ALL,
+  BATCH_SEND_HALF,  /* the first half of each batch, rounded up */
+  BATCH_FAIL,       /* from the left end, once it sent data */
+} BatchMode;
+
+static End ends[2];
+static TestPseudoTcpLink sim;
+
+static BatchMode batch_mode;
+static guint n_batches;
+static guint max_batch;
+
+static End *
+end_of (PseudoTcpSocket *sock)
+{
+  return (sock == ends[0].sock) ? &ends[0] : &ends[1];
+}
+
+static guint8
+payload_byte (End *from, gsize offset)
+{
+  return (offset * 31 + (from == &ends[0] ? 7 : 11)) & 0xFF;
+}
+
+/* Records the window scale option of a connection request. */
+static void
+parse_connect (TestPseudoTcpLink *link, PseudoTcpSocket *sock,
+    const guint8 *buf, gsize len)
+{
+  End *end = end_of (sock);
+  gsize pos = HEADER_SIZE + buf[12] * 8;
+
+  if (len < HEADER_SIZE || len <= pos || !(buf[13] & FLAG_CTL) || buf[pos] != CTL_CONNECT)
+    return;
+
+  for (pos++; pos + 2 <= len; pos += 2 + buf[pos + 1]) {
+    if (buf[pos] == TCP_OPT_WND_SCALE && buf[pos + 1] == 1 && pos + 2 < len)
+      end->scale = buf[pos + 2];
+  }
+}
+
+static gint
+write_packets (PseudoTcpSocket *sock, const NiceOutputMessage *messages,
+    guint n_messages, gpointer user_data)
+{
+  guint n_sent = n_messages;
+  guint k;
+
+  g_assert_cmpuint (n_messages, >, 0);
+  n_batches++;
+  max_batch = MAX (max_batch, n_messages);
+
+  if (batch_mode == BATCH_FAIL && sock == ends[0].sock && ends[0].sent > 0)
+    return -1;
+  if (batch_mode == BATCH_SEND_HALF)
+    n_sent = (n_messages + 1) / 2;
+
+  for (k = 0; k < n_sent; k++) {
+    g_assert_cmpuint (messages[k].n_buffers, ==, 1);
+    test_pseudo_tcp_link_write_packet (sock, messages[k].buffers[0].buffer,
+        messages[k].buffers[0].size, user_data);
+  }
+
+  return n_sent;
+}
+
+static void
+write_to_sock (PseudoTcpSocket *sock)
+{
+  End *end = end_of (sock);
+  guint8 buf[8192];
+
+  while (end->sent < end->to_send) {
+    gsize len = MIN (sizeof (buf), end->to_send - end->sent);
+    gsize i;
+    gint n;
+
+    for (i = 0; i < len; i++)
+      buf[i] = payload_byte (end, end->sent + i);
+
+    n = pseudo_tcp_socket_send (sock, (gchar *) buf, len);
+    if (n <= 0)
+      break;
+    end->sent += n;
+  }
+}
+
+static void
+opened (PseudoTcpSocket *sock, gpointer data)
+{
+  write_to_sock (sock);
+}
+
+static void
+readable (PseudoTcpSocket *sock, gpointer data)
+{
+  End *end = end_of (sock);
+  End *from = (end == &ends[0]) ? &ends[1] : &ends[0];
+  guint8 buf[8192];
+  gint len, i;
+
+  while ((len = pseudo_tcp_socket_recv (sock, (gchar *) buf,
+              sizeof (buf))) > 0) {
+    for (i = 0; i < len; i++)
+      g_assert_cmpuint (buf[i], ==, payload_byte (from, end->received + i));
+    end->received += len;
+  }
+}
+
+static void
+writable (PseudoTcpSocket *sock, gpointer data)
+{
+  write_to_sock (sock);
+}
+
+static void
+closed (PseudoTcpSocket *sock, guint32 err, gpointer data)
+{
+  End *end = end_of (sock);
+
+  end->closed = TRUE;
+  end->error = err;
+}
+
+static PseudoTcpCallbacks cbs = {
+  &sim, opened, readable, writable, closed, test_pseudo_tcp_link_write_packet
+};
+
+static void
+ends_init (gsize left_to_send, gsize right_to_send)
+{
+  guint k;
+
+  for (k = 0; k < 2; k++) {
+    memset (&ends[k], 0, sizeof (End));
+    ends[k].sock = pseudo_tcp_socket_new (0, &cbs);
+    ends[k].scale = NO_SCALE;
+    pseudo_tcp_socket_notify_mtu (ends[k].sock, 1400);
+  }
+  ends[0].to_send = left_to_send;
+  ends[1].to_send = right_to_send;
+
+  /* The sockets treat a time of 0 as unset. */
+  test_pseudo_tcp_link_init (&sim, G_USEC_PER_SEC);
+  sim.left = ends[0].sock;
+  sim.right = ends[1].sock;
+  sim.delay = DELAY;
+  sim.packet_sent = parse_connect;
+
+  batch_mode = BATCH_SEND_ALL;
+  n_batches = max_batch = 0;
+}
+
+static void
+ends_set_batched (BatchMode mode)
+{
+  guint k;
+
+  batch_mode = mode;
+  for (k = 0; k < 2; k++)
+    pseudo_tcp_socket_set_write_packets_func (ends[k].sock, write_packets);
+}
+
+static void
+ends_clear (void)
+{
+  guint k;
+
+  for (k = 0; k < 2; k++)
+    g_clear_object (&ends[k].sock);
+  test_pseudo_tcp_link_clear (&sim);
+}
+
+/* Connects the ends and runs on a virtual clock until both received what the
+ * other had to send, or one of them closed. */
+static void
+run (void)
+{
+  guint64 deadline = sim.now + 600 * G_USEC_PER_SEC;
+
+  test_pseudo_tcp_link_connect (&sim);
+
+  while (ends[0].received < ends[1].to_send ||
+      ends[1].received < ends[0].to_send) {
+    g_assert_cmpuint (sim.now, <, deadline);
+    if (ends[0].closed || ends[1].closed)
+      return;
+
+    if (!test_pseudo_tcp_link_step (&sim))
+      g_assert_not_reached ();
+  }
+}
+
+/* The default ceiling of the receive buffer, 4 MiB, needs a window scale of
+ * 7, which the buffer then grows into. */
+static void
+test_window_scale (void)
+{
+  guint rcv_buf_max, rcv_buf;
+
+  ends_init (4 * 1024 * 1024, 0);
+
+  g_object_get (ends[1].sock, "rcv-buf-max", &rcv_buf_max, NULL);
+  g_assert_cmpuint (rcv_buf_max, ==, 4 * 1024 * 1024);
+
+  run ();
+
+  g_assert_false (ends[0].closed || ends[1].closed);
+  g_assert_cmpuint (ends[0].scale, ==, 7);
+  g_assert_cmpuint (ends[1].scale, ==, 7);
+
+  g_object_get (ends[1].sock, "rcv-buf", &rcv_buf, NULL);
+  g_assert_cmpuint (rcv_buf, >, 0xFFFF);
+  g_assert_cmpuint (rcv_buf, <=, 4 * 1024 * 1024);
+
+  ends_clear ();
+}
+
+/* A peer with auto-tuning off keeps an unscaled window, and data flows both
+ * ways with one which auto-tunes. */
+static void
+test_peer_without_auto_tuning (void)
+{
+  guint rcv_buf;
+
+  ends_init (1024 * 1024, 1024 * 1024);
+  g_object_set (ends[1].sock, "rcv-buf-max", 0, "snd-buf-max", 0, NULL);
+
+  run ();
+
+  g_assert_false (ends[0].closed || ends[1].closed);
+  g_assert_cmpuint (ends[0].scale, ==, 7);
+  g_assert_cmpuint (ends[1].scale, ==, 0);
+
+  g_object_get (ends[1].sock, "rcv-buf", &rcv_buf, NULL);
+  g_assert_cmpuint (rcv_buf, ==, DEFAULT_RCV_BUF_SIZE);
+  g_object_get (ends[0].sock, "rcv-buf", &rcv_buf, NULL);
+  g_assert_cmpuint (rcv_buf, >=, DEFAULT_RCV_BUF_SIZE);
+
+  ends_clear ();
+}
+
+/* Segments delayed by up to four times the propagation delay, a tenth of
+ * them twice, are put back in order, with and without SACK. */
+static void
+test_reordered (void)
+{
+  gboolean sack;
+  GRand *prng;
+
+  for (sack = FALSE; sack <= TRUE; sack++) {
+    prng = g_rand_new_with_seed (42);
+    ends_init (1024 * 1024, 256 * 1024);
+    sim.jitter = 4 * DELAY;
+    sim.duplicate = 10;
+    sim.prng = prng;
+    g_object_set (ends[0].sock, "support-sack", sack, NULL);
+    g_object_set (ends[1].sock, "support-sack", sack, NULL);
+
+    run ();
+
+    g_assert_false (ends[0].closed || ends[1].closed);
+
+    ends_clear ();
+    g_rand_free (prng);
+  }
+}
+
+/* Bursts go out in batches, as large as the window allows. */
+static void
+test_batched (void)
+{
+  ends_init (1024 * 1024, 0);
+  ends_set_batched (BATCH_SEND_ALL);
+
+  run ();
+
+  g_assert_false (ends[0].closed || ends[1].closed);
+  g_assert_cmpuint (n_batches, >, 0);
+  g_assert_cmpuint (max_batch, >, 1);
+
+  ends_clear ();
+}
+
+/* The packets left out of a batch are lost, and sent again. */
+static void
+test_batch_partial (void)
+{
+  ends_init (256 * 1024, 0);
+  ends_set_batched (BATCH_SEND_HALF);
+
+  run ();
+
+  g_assert_false (ends[0].closed || ends[1].closed);
+  g_assert_cmpuint (max_batch, >, 1);
+
+  ends_clear ();
+}
+
+/* A batch which fails aborts the connection. */
+static void
+test_batch_failed (void)
+{
+  ends_init (256 * 1024, 0);
+  ends_set_batched (BATCH_FAIL);
+
+  run ();
+
+  g_assert_true (ends[0].closed);
+  g_assert_cmpuint (ends[0].error, ==, ECONNABORTED);
+  g_assert_cmpuint (ends[1].received, <, ends[0].to_send);
+  g_assert_cmpint (pseudo_tcp_socket_send (ends[0].sock, "x", 1), ==, -1);
+
+  ends_clear ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/pseudotcp/buffers/window-scale", test_window_scale);
+  g_test_add_func ("/pseudotcp/buffers/peer-without-auto-tuning",
+      test_peer_without_auto_tuning);
+  g_test_add_func ("/pseudotcp/buffers/reordered", test_reordered);
+  g_test_add_func ("/pseudotcp/buffers/batched", test_batched);
+  g_test_add_func ("/pseudotcp/buffers/batch-partial", test_batch_partial);
+  g_test_add_func ("/pseudotcp/buffers/batch-failed", test_batch_failed);
+
+  return g_test_run ();
+}
@@ -199,15 +199,19 @@ create_sockets (Data *data, gboolean support_fin_ack)
     data, opened, readable, writable, closed, write_packet
   };
 
+  /* SACK is disabled so that the SYN segments only carry the window scale and
+   * FIN–ACK options, which the sequence numbers below are computed from. */
   data->left = g_object_new (PSEUDO_TCP_SOCKET_TYPE,
       "conversation", 0,
       "callbacks", &cbs,
       "support-fin-ack", support_fin_ack,
+      "support-sack", FALSE,
       NULL);
   data->right = g_object_new (PSEUDO_TCP_SOCKET_TYPE,
       "conversation", 0,
       "callbacks", &cbs,
       "support-fin-ack", support_fin_ack,
+      "support-sack", FALSE,
       NULL);
 
   g_debug ("Left: %p, right: %p", data->left, data->right);
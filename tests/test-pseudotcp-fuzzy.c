@@ -73,8 +73,25 @@
  * errors which are detected can be reproduced by providing the same input file
  * and seed (using the --seed option). The seed is printed out at the beginning
  * of each test run.
+ *
+ * Packets can also be dropped at random (using the --drop-rate option), in
+ * which case the throughput of the transfer is printed at the end. Comparing it
+ * with and without --no-sack shows the effect of selective acknowledgements on
+ * a lossy path, for example:
+ *     test-pseudotcp-fuzzy -l 0 --drop-rate 5 rand rand-copy
+ *
+ * Likewise, the --congestion-control option selects the algorithm used by the
+ * sending socket (reno, cubic or bbr).
+ *
+ * Path MTU probing is enabled with --max-mtu, and --path-mtu drops the packets
+ * larger than the given size (counting IPv4 and UDP headers), for example:
+ *     test-pseudotcp-fuzzy -l 0 --max-mtu 9000 --path-mtu 1500 rand rand-copy
+ *
+ * Time-based loss detection and tail loss probes are disabled with --no-rack,
+ * and --min-rto sets the lower bound of the retransmission timeout.
  */
 
+#define TRANSPORT_OVERHEAD 28  /* bytes of IPv4 and UDP headers */
 
 PseudoTcpSocket *left;
 PseudoTcpSocket *right;
@@ -101,6 +118,17 @@ guint32 fuzz_start_pos = 1;  /* bytes into stream payload; after the SYN-ACKs */
 guint n_changes_lambda = 1;  /* lambda parameter for a Poisson distribution
                               * controlling the number of mutations made to each
                               * packet */
+guint drop_rate = 0;  /* percentage of packets dropped */
+gboolean no_sack = FALSE;
+gchar *congestion_control = NULL;
+guint max_mtu = 0;
+gboolean no_rack = FALSE;
+guint min_rto = 1000;
+guint path_mtu = 0;
+
+/* Number of packets dropped so far, and start of the transfer. */
+guint n_dropped = 0;
+gint64 start_time = 0;
 
 
 static void
@@ -273,7 +301,7 @@ fuzz_packet (guint8 *buf, guint32 len, guint32 stream_pos)
 #define HEADER_LENGTH 24 /* bytes; or thereabouts (include some options) */
 
   /* Do we want to fuzz this packet? */
-  if (stream_pos < fuzz_start_pos) {
+  if (stream_pos < fuzz_start_pos || n_changes_lambda == 0) {
     return len;
   }
 
@@ -317,10 +345,22 @@ write_packet (PseudoTcpSocket *sock, const gchar *buffer, guint32 len,
   PseudoTcpState state;
   g_object_get (sock, "state", &state, NULL);
 
-  data = g_malloc (sizeof(struct notify_data) + len);
-
   g_debug ("Socket %p(%d) Writing : %d bytes", sock, state, len);
 
+  if ((sock == left ? left_stream_pos : right_stream_pos) >= fuzz_start_pos &&
+      g_rand_int_range (prng, 0, 100) < (gint32) drop_rate) {
+    g_debug ("Dropping packet");
+    n_dropped++;
+    return WR_SUCCESS;
+  }
+
+  if (path_mtu > 0 && len + TRANSPORT_OVERHEAD > path_mtu) {
+    g_debug ("Dropping packet larger than the path MTU");
+    return WR_SUCCESS;
+  }
+
+  data = g_malloc (sizeof(struct notify_data) + len);
+
   memcpy (data->buffer, buffer, len);
   data->len = len;
 
@@ -383,6 +423,20 @@ static GOptionEntry entries[] = {
   { "fuzz-n-changes-lambda", 'l', 0, G_OPTION_ARG_INT, &n_changes_lambda,
     "Lambda value for the Poisson distribution controlling the number of "
     "changes made to each packet", "λ" },
+  { "drop-rate", 'd', 0, G_OPTION_ARG_INT, &drop_rate,
+    "Percentage of packets to drop", "P" },
+  { "no-sack", 0, 0, G_OPTION_ARG_NONE, &no_sack,
+    "Disable selective acknowledgements", NULL },
+  { "congestion-control", 'c', 0, G_OPTION_ARG_STRING, &congestion_control,
+    "Congestion control algorithm (reno, cubic or bbr)", "NAME" },
+  { "max-mtu", 0, 0, G_OPTION_ARG_INT, &max_mtu,
+    "Largest MTU to probe the path for", "M" },
+  { "path-mtu", 0, 0, G_OPTION_ARG_INT, &path_mtu,
+    "Size above which packets are dropped", "P" },
+  { "no-rack", 0, 0, G_OPTION_ARG_NONE, &no_rack,
+    "Disable RACK loss detection and tail loss probes", NULL },
+  { "min-rto", 0, 0, G_OPTION_ARG_INT, &min_rto,
+    "Lower bound of the retransmission timeout", "MS" },
   { NULL }
 };
 
@@ -393,6 +447,7 @@ int main (int argc, char *argv[])
   };
   GOptionContext *context;
   GError *error = NULL;
+  PseudoTcpCongestionControl cc = PSEUDO_TCP_CONGESTION_CONTROL_RENO;
 
   setlocale (LC_ALL, "");
 
@@ -405,9 +460,28 @@ int main (int argc, char *argv[])
     goto context_error;
   }
 
-  if (n_changes_lambda == 0) {
+  if (n_changes_lambda == 0 && drop_rate == 0 && path_mtu == 0) {
     g_printerr ("Option parsing failed: %s\n",
-        "Lambda values must be positive.");
+        "Lambda values must be positive unless packets are dropped.");
+    goto context_error;
+  }
+
+  if (drop_rate >= 100) {
+    g_printerr ("Option parsing failed: %s\n",
+        "Drop rate must be below 100%.");
+    goto context_error;
+  }
+
+  if (congestion_control == NULL ||
+      g_strcmp0 (congestion_control, "reno") == 0) {
+    cc = PSEUDO_TCP_CONGESTION_CONTROL_RENO;
+  } else if (g_strcmp0 (congestion_control, "cubic") == 0) {
+    cc = PSEUDO_TCP_CONGESTION_CONTROL_CUBIC;
+  } else if (g_strcmp0 (congestion_control, "bbr") == 0) {
+    cc = PSEUDO_TCP_CONGESTION_CONTROL_BBR;
+  } else {
+    g_printerr ("Option parsing failed: %s\n",
+        "Unknown congestion control algorithm.");
     goto context_error;
   }
 
@@ -427,19 +501,30 @@ int main (int argc, char *argv[])
   /* Set up the main loop and sockets. */
   main_loop = g_main_loop_new (NULL, FALSE);
 
-  g_print ("Using seed: %" G_GINT64_FORMAT ", start position: %u, λ: %u\n",
-      seed, fuzz_start_pos, n_changes_lambda);
+  g_print ("Using seed: %" G_GINT64_FORMAT ", start position: %u, λ: %u, "
+      "drop rate: %u%%, SACK: %s, congestion control: %s\n", seed,
+      fuzz_start_pos, n_changes_lambda, drop_rate, no_sack ? "no" : "yes",
+      congestion_control ? congestion_control : "reno");
   prng = g_rand_new_with_seed (seed);
 
   pseudo_tcp_set_debug_level (PSEUDO_TCP_DEBUG_VERBOSE);
 
-  left = pseudo_tcp_socket_new (0, &cbs);
-  right = pseudo_tcp_socket_new (0, &cbs);
+  left = g_object_new (PSEUDO_TCP_SOCKET_TYPE, "conversation", 0,
+      "callbacks", &cbs, "support-sack", !no_sack,
+      "congestion-control", cc, "transport-overhead", TRANSPORT_OVERHEAD,
+      "max-mtu", max_mtu, "rack", !no_rack, "min-rto", min_rto, NULL);
+  right = g_object_new (PSEUDO_TCP_SOCKET_TYPE, "conversation", 0,
+      "callbacks", &cbs, "support-sack", !no_sack,
+      "transport-overhead", TRANSPORT_OVERHEAD, "max-mtu", max_mtu,
+      "rack", !no_rack, "min-rto", min_rto, NULL);
   g_debug ("Left: %p. Right: %p", left, right);
 
-  pseudo_tcp_socket_notify_mtu (left, 1496);
-  pseudo_tcp_socket_notify_mtu (right, 1496);
+  pseudo_tcp_socket_notify_mtu (left,
+      (path_mtu > 0) ? MIN (path_mtu, 1496) : 1496);
+  pseudo_tcp_socket_notify_mtu (right,
+      (path_mtu > 0) ? MIN (path_mtu, 1496) : 1496);
 
+  start_time = g_get_monotonic_time ();
   pseudo_tcp_socket_connect (left);
   adjust_clock (left);
   adjust_clock (right);
@@ -448,6 +533,14 @@ int main (int argc, char *argv[])
   g_main_loop_run (main_loop);
   g_main_loop_unref (main_loop);
 
+  if (drop_rate > 0) {
+    gdouble elapsed = (g_get_monotonic_time () - start_time) / 1000000.0;
+
+    g_print ("Transferred %d bytes in %.2f s (%.1f KiB/s), %u packets "
+        "dropped\n", total_wrote, elapsed, total_wrote / 1024.0 / elapsed,
+        n_dropped);
+  }
+
   g_object_unref (left);
   g_object_unref (right);
 
@@ -458,6 +551,8 @@ int main (int argc, char *argv[])
   if (out != NULL)
     fclose (out);
 
+  g_free (congestion_control);
+
   return retval;
 
 context_error:
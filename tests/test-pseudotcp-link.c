@@ -0,0 +1,198 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "test-pseudotcp-link.h"
+
+typedef struct {
+  guint64 arrival;  /* µs */
+  PseudoTcpSocket *to;
+  gsize len;
+  guint8 buf[];
+} Packet;
+
+static gint
+packet_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const Packet *pa = a, *pb = b;
+
+  /* Packets with the same arrival time stay in the order they were sent. */
+  return (pa->arrival > pb->arrival) - (pa->arrival < pb->arrival);
+}
+
+/* Serialisation time of @len bytes on the bottleneck, in µs. */
+static guint64
+transmission_time (TestPseudoTcpLink *link, gsize len)
+{
+  if (link->bandwidth == 0)
+    return 0;
+
+  return (len + TRANSPORT_OVERHEAD) * 8000 / link->bandwidth;
+}
+
+void
+test_pseudo_tcp_link_init (TestPseudoTcpLink *link, guint64 start)
+{
+  memset (link, 0, sizeof (*link));
+  link->now = start;
+  g_queue_init (&link->packets);
+}
+
+void
+test_pseudo_tcp_link_clear (TestPseudoTcpLink *link)
+{
+  g_queue_foreach (&link->packets, (GFunc) g_free, NULL);
+  g_queue_clear (&link->packets);
+}
+
+PseudoTcpWriteResult
+test_pseudo_tcp_link_write_packet (PseudoTcpSocket *sock, const gchar *buffer,
+    guint32 len, gpointer user_data)
+{
+  TestPseudoTcpLink *link = user_data;
+  TestPseudoTcpLinkDirection *direction;
+  guint64 queue_limit, backlog;
+  guint copies = 1;
+
+  if (link->mtu > 0 && len + TRANSPORT_OVERHEAD > link->mtu)
+    return WR_TOO_LARGE;
+
+  if (link->packet_sent != NULL)
+    link->packet_sent (link, sock, (const guint8 *) buffer, len);
+
+  direction = &link->directions[(sock == link->left) ? 0 : 1];
+  direction->n_sent++;
+
+  /* Tail drop at the bottleneck. */
+  if (direction->free_at < link->now)
+    direction->free_at = link->now;
+
+  backlog = direction->free_at - link->now;
+  if (link->queue_size > 0)
+    queue_limit = transmission_time (link,
+        link->queue_size * 1024 - TRANSPORT_OVERHEAD);
+  else
+    queue_limit = MAX (2 * link->delay * 1000,
+        10 * transmission_time (link, link->mtu));
+  if (link->bandwidth > 0 && backlog > queue_limit) {
+    direction->n_overflowed++;
+    return WR_SUCCESS;
+  }
+
+  direction->free_at += transmission_time (link, len);
+
+  /* Random losses and duplicates happen after the bottleneck. */
+  if (link->loss > 0 && g_rand_double_range (link->prng, 0, 100) < link->loss) {
+    direction->n_lost++;
+    return WR_SUCCESS;
+  }
+
+  if (link->duplicate > 0 &&
+      g_rand_double_range (link->prng, 0, 100) < link->duplicate)
+    copies = 2;
+
+  while (copies-- > 0) {
+    Packet *packet = g_malloc (sizeof (Packet) + len);
+
+    packet->arrival = direction->free_at + link->delay * 1000;
+    if (link->jitter > 0)
+      packet->arrival += g_rand_int_range (link->prng, 0, link->jitter * 1000);
+    if (link->reorder > 0 &&
+        g_rand_double_range (link->prng, 0, 100) < link->reorder)
+      packet->arrival += link->reorder_delay * 1000;
+    packet->to = (sock == link->left) ? link->right : link->left;
+    packet->len = len;
+    memcpy (packet->buf, buffer, len);
+
+    g_queue_insert_sorted (&link->packets, packet, packet_compare, NULL);
+  }
+
+  return WR_SUCCESS;
+}
+
+/* Starts the clocks of both sockets and connects the left one. */
+void
+test_pseudo_tcp_link_connect (TestPseudoTcpLink *link)
+{
+  pseudo_tcp_socket_set_time (link->left, link->now / 1000);
+  pseudo_tcp_socket_set_time (link->right, link->now / 1000);
+  pseudo_tcp_socket_connect (link->left);
+}
+
+/* Advances the clock to the next packet arrival or socket timeout, and
+ * processes it. Returns FALSE if nothing is scheduled anymore. */
+gboolean
+test_pseudo_tcp_link_step (TestPseudoTcpLink *link)
+{
+  PseudoTcpSocket *socks[2] = { link->left, link->right };
+  guint64 timeouts[2], next = G_MAXUINT64;
+  gboolean clocks[2];
+  Packet *packet;
+  guint k;
+
+  for (k = 0; k < 2; k++) {
+    timeouts[k] = 0;
+    clocks[k] = pseudo_tcp_socket_get_next_clock (socks[k], &timeouts[k]);
+    if (clocks[k])
+      next = MIN (next, timeouts[k] * 1000);
+  }
+
+  packet = g_queue_peek_head (&link->packets);
+  if (packet != NULL)
+    next = MIN (next, packet->arrival);
+
+  if (next == G_MAXUINT64)
+    return FALSE;
+
+  link->now = MAX (link->now, next);
+  for (k = 0; k < 2; k++)
+    pseudo_tcp_socket_set_time (socks[k], link->now / 1000);
+
+  while ((packet = g_queue_peek_head (&link->packets)) != NULL &&
+      packet->arrival <= link->now) {
+    g_queue_pop_head (&link->packets);
+
+    if (link->packet_received != NULL)
+      link->packet_received (link, packet->to, packet->buf, packet->len);
+    pseudo_tcp_socket_notify_packet (packet->to, (gchar *) packet->buf,
+        packet->len);
+    g_free (packet);
+  }
+
+  for (k = 0; k < 2; k++) {
+    if (clocks[k] && timeouts[k] * 1000 <= link->now)
+      pseudo_tcp_socket_notify_clock (socks[k]);
+  }
+
+  return TRUE;
+}
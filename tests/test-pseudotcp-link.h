@@ -0,0 +1,102 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "pseudotcp.h"
+
+#define TRANSPORT_OVERHEAD 28  /* bytes of IPv4 and UDP headers */
+
+/* Layout of the segments. NOTE: Must match pseudotcp.c. */
+#define HEADER_SIZE 24
+#define FLAG_CTL 0x02
+#define CTL_CONNECT 0
+#define TCP_OPT_WND_SCALE 3
+
+/* One direction of the link. */
+typedef struct {
+  guint64 free_at;  /* µs at which the bottleneck becomes idle */
+  guint n_sent;
+  guint n_lost;
+  guint n_overflowed;
+} TestPseudoTcpLinkDirection;
+
+typedef struct _TestPseudoTcpLink TestPseudoTcpLink;
+
+typedef void (*TestPseudoTcpLinkPacketFunc) (TestPseudoTcpLink *link,
+    PseudoTcpSocket *sock, const guint8 *buf, gsize len);
+
+/*
+ * A simulated link between two pseudo-TCP sockets, on a virtual clock. Each
+ * direction has a bottleneck of the given bandwidth with a drop-tail queue,
+ * followed by a fixed propagation delay, and can add random jitter, losses,
+ * duplicates and reordering. Everything only depends on the configuration and
+ * on the state of @prng, so runs are reproducible.
+ *
+ * The callbacks of both sockets must have the link as user data and
+ * test_pseudo_tcp_link_write_packet() as write function.
+ */
+struct _TestPseudoTcpLink {
+  PseudoTcpSocket *left;
+  PseudoTcpSocket *right;
+
+  /* Configuration, the same both ways. */
+  guint bandwidth;  /* kbit/s, or 0 for unlimited */
+  guint delay;  /* ms, one way */
+  guint jitter;  /* ms */
+  gdouble loss;  /* % */
+  gdouble duplicate;  /* % */
+  gdouble reorder;  /* % */
+  guint reorder_delay;  /* ms */
+  guint queue_size;  /* KiB, or 0 for one bandwidth-delay product */
+  guint mtu;  /* counting TRANSPORT_OVERHEAD, or 0 for unlimited */
+  GRand *prng;  /* unowned; needed for jitter, losses, duplicates and
+                 * reordering */
+
+  /* Optional, called for each packet written by @sock, and for each packet
+   * delivered to @sock. */
+  TestPseudoTcpLinkPacketFunc packet_sent;
+  TestPseudoTcpLinkPacketFunc packet_received;
+  gpointer user_data;
+
+  guint64 now;  /* µs */
+  TestPseudoTcpLinkDirection directions[2];  /* left to right, then right to
+                                              * left */
+
+  /*< private >*/
+  GQueue packets;  /* sorted by arrival time */
+};
+
+void test_pseudo_tcp_link_init (TestPseudoTcpLink *link, guint64 start);
+void test_pseudo_tcp_link_clear (TestPseudoTcpLink *link);
+PseudoTcpWriteResult test_pseudo_tcp_link_write_packet (PseudoTcpSocket *sock,
+    const gchar *buffer, guint32 len, gpointer user_data);
+void test_pseudo_tcp_link_connect (TestPseudoTcpLink *link);
+gboolean test_pseudo_tcp_link_step (TestPseudoTcpLink *link);
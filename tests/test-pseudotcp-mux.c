@@ -0,0 +1,603 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+
+#include "pseudotcp-mux.h"
+
+#define N_CHANNELS 3
+
+/* One direction of the connection: a byte pipe of bounded capacity, standing
+ * in for the pseudo-TCP socket. */
+typedef struct {
+  GByteArray *pipe;
+  gsize capacity;
+  guint readable[N_CHANNELS];
+  guint writable[N_CHANNELS];
+  guint closed[N_CHANNELS];
+} Side;
+
+typedef struct {
+  Side left_side, right_side;
+  PseudoTcpMux *left;  /* owned; writes into left_side */
+  PseudoTcpMux *right;  /* owned; writes into right_side */
+  GRand *rand;  /* owned */
+} Data;
+
+
+static gssize
+side_write (PseudoTcpMux *mux, const guint8 *buf, gsize len,
+    gpointer user_data)
+{
+  Side *side = user_data;
+  gsize n = MIN (len, side->capacity - side->pipe->len);
+
+  if (n == 0)
+    return -1;
+
+  g_byte_array_append (side->pipe, buf, n);
+  return n;
+}
+
+static void
+side_channel_readable (PseudoTcpMux *mux, guint16 channel, gpointer user_data)
+{
+  Side *side = user_data;
+
+  if (channel < N_CHANNELS)
+    side->readable[channel]++;
+}
+
+static void
+side_channel_writable (PseudoTcpMux *mux, guint16 channel, gpointer user_data)
+{
+  Side *side = user_data;
+
+  if (channel < N_CHANNELS)
+    side->writable[channel]++;
+}
+
+static void
+side_channel_closed (PseudoTcpMux *mux, guint16 channel, gpointer user_data)
+{
+  Side *side = user_data;
+
+  if (channel < N_CHANNELS)
+    side->closed[channel]++;
+}
+
+static void
+data_init (Data *data, gsize capacity)
+{
+  PseudoTcpMuxCallbacks left_cbs = {
+    &data->left_side, side_write, side_channel_readable, side_channel_writable,
+    side_channel_closed
+  };
+  PseudoTcpMuxCallbacks right_cbs = {
+    &data->right_side, side_write, side_channel_readable, side_channel_writable,
+    side_channel_closed
+  };
+
+  memset (data, 0, sizeof (*data));
+  data->left_side.pipe = g_byte_array_new ();
+  data->left_side.capacity = capacity;
+  data->right_side.pipe = g_byte_array_new ();
+  data->right_side.capacity = capacity;
+
+  left_cbs.user_data = &data->left_side;
+  right_cbs.user_data = &data->right_side;
+  data->left = pseudo_tcp_mux_new (&left_cbs);
+  data->right = pseudo_tcp_mux_new (&right_cbs);
+  pseudo_tcp_mux_start (data->left);
+  pseudo_tcp_mux_start (data->right);
+
+  /* Deterministic chunking, so failures can be reproduced. */
+  data->rand = g_rand_new_with_seed (42);
+}
+
+static void
+data_clear (Data *data)
+{
+  pseudo_tcp_mux_free (data->left);
+  pseudo_tcp_mux_free (data->right);
+  g_byte_array_unref (data->left_side.pipe);
+  g_byte_array_unref (data->right_side.pipe);
+  g_rand_free (data->rand);
+}
+
+/* Deliver up to @max bytes of what @from has written to @to, as the
+ * pseudo-TCP socket would. */
+static void
+deliver (Side *from, PseudoTcpMux *to, gsize max)
+{
+  gsize n = MIN (max, from->pipe->len);
+
+  if (n == 0)
+    return;
+
+  g_assert (pseudo_tcp_mux_receive (to, from->pipe->data, n));
+  g_byte_array_remove_range (from->pipe, 0, n);
+}
+
+static void
+deliver_random (Data *data)
+{
+  deliver (&data->left_side, data->right,
+      g_rand_int_range (data->rand, 1, 20000));
+  deliver (&data->right_side, data->left,
+      g_rand_int_range (data->rand, 1, 20000));
+}
+
+static guint8 *
+random_buffer (Data *data, gsize len)
+{
+  guint8 *buf = g_malloc (len);
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    buf[i] = g_rand_int (data->rand);
+
+  return buf;
+}
+
+/* Send @total bytes on every channel from left to right, reading channel 1
+ * in small pieces, and check everything arrives intact and in order. */
+static void
+transfer (gsize capacity)
+{
+  Data data;
+  const gsize total = 256 * 1024;
+  guint8 *src[N_CHANNELS];
+  gsize sent[N_CHANNELS] = { 0, }, received[N_CHANNELS] = { 0, };
+  guint8 buf[5000];
+  guint c, i;
+
+  data_init (&data, capacity);
+
+  for (c = 0; c < N_CHANNELS; c++)
+    src[c] = random_buffer (&data, total);
+
+  for (i = 0; received[0] < total || received[1] < total ||
+      received[2] < total; i++) {
+    g_assert_cmpuint (i, <, 1000000);
+
+    for (c = 0; c < N_CHANNELS; c++) {
+      gssize len;
+
+      if (sent[c] == total)
+        continue;
+
+      len = pseudo_tcp_mux_send (data.left, c, src[c] + sent[c],
+          MIN (3000, total - sent[c]));
+      if (len < 0) {
+        g_assert_cmpint (pseudo_tcp_mux_get_error (data.left), ==,
+            EWOULDBLOCK);
+        continue;
+      }
+
+      sent[c] += len;
+      if (sent[c] == total)
+        pseudo_tcp_mux_close_channel (data.left, c);
+    }
+
+    deliver (&data.left_side, data.right,
+        g_rand_int_range (data.rand, 1, 20000));
+
+    for (c = 0; c < N_CHANNELS; c++) {
+      gssize len;
+
+      len = pseudo_tcp_mux_recv (data.right, c, buf,
+          (c == 1) ? 500 : sizeof (buf));
+      if (len > 0) {
+        g_assert (memcmp (buf, src[c] + received[c], len) == 0);
+        received[c] += len;
+      } else if (len == 0) {
+        g_assert_cmpuint (received[c], ==, total);
+      } else {
+        g_assert_cmpint (pseudo_tcp_mux_get_error (data.right), ==,
+            EWOULDBLOCK);
+      }
+    }
+
+    deliver (&data.right_side, data.left,
+        g_rand_int_range (data.rand, 1, 20000));
+    pseudo_tcp_mux_flush (data.left);
+  }
+
+  /* The FINs follow the last data. */
+  for (i = 0; i < 100; i++) {
+    pseudo_tcp_mux_flush (data.left);
+    deliver_random (&data);
+  }
+
+  for (c = 0; c < N_CHANNELS; c++) {
+    g_assert (pseudo_tcp_mux_is_eof (data.right, c));
+    g_assert_cmpint (pseudo_tcp_mux_recv (data.right, c, buf, sizeof (buf)),
+        ==, 0);
+    g_assert_cmpuint (data.right_side.readable[c], >, 0);
+    g_free (src[c]);
+  }
+
+  data_clear (&data);
+}
+
+static void
+pseudotcp_mux_transfer (void)
+{
+  transfer (20000);
+}
+
+static void
+pseudotcp_mux_transfer_tiny_pipe (void)
+{
+  /* Smaller than a frame header. */
+  transfer (5);
+}
+
+/* A channel which is never read must not hold up the others. */
+static void
+pseudotcp_mux_head_of_line (void)
+{
+  Data data;
+  const gsize total = 16 * PSEUDO_TCP_MUX_WINDOW;
+  guint8 *src;
+  gsize sent = 0, received = 0;
+  guint8 buf[4096];
+  guint i;
+
+  data_init (&data, 20000);
+  src = random_buffer (&data, total);
+
+  /* Fill the window of channel 1. */
+  while (pseudo_tcp_mux_send (data.left, 1, src, 1000) > 0)
+    deliver_random (&data);
+
+  for (i = 0; received < total; i++) {
+    gssize len;
+
+    g_assert_cmpuint (i, <, 100000);
+
+    if (sent < total) {
+      len = pseudo_tcp_mux_send (data.left, 2, src + sent,
+          MIN (4000, total - sent));
+      if (len > 0)
+        sent += len;
+    }
+
+    deliver_random (&data);
+
+    len = pseudo_tcp_mux_recv (data.right, 2, buf, sizeof (buf));
+    if (len > 0) {
+      g_assert (memcmp (buf, src + received, len) == 0);
+      received += len;
+    }
+
+    pseudo_tcp_mux_flush (data.left);
+  }
+
+  /* Channel 1 has exactly one window outstanding. */
+  g_assert_cmpuint (pseudo_tcp_mux_get_available_bytes (data.right, 1), ==,
+      PSEUDO_TCP_MUX_WINDOW);
+
+  g_free (src);
+  data_clear (&data);
+}
+
+/* Higher priority channels are served first. */
+static void
+pseudotcp_mux_priority (void)
+{
+  Data data;
+  const gsize total = 128 * 1024;
+  guint8 *src;
+  gsize sent[N_CHANNELS] = { 0, }, received[N_CHANNELS] = { 0, };
+  guint done_at[N_CHANNELS] = { 0, };
+  guint8 buf[8192];
+  guint c, i;
+
+  data_init (&data, 3000);
+  src = random_buffer (&data, total);
+
+  pseudo_tcp_mux_set_priority (data.left, 2, 10);
+
+  for (i = 1; done_at[1] == 0 || done_at[2] == 0; i++) {
+    g_assert_cmpuint (i, <, 100000);
+
+    for (c = 1; c < N_CHANNELS; c++) {
+      gssize len;
+
+      if (sent[c] < total) {
+        len = pseudo_tcp_mux_send (data.left, c, src + sent[c],
+            total - sent[c]);
+        if (len > 0)
+          sent[c] += len;
+      }
+    }
+
+    deliver_random (&data);
+
+    for (c = 1; c < N_CHANNELS; c++) {
+      gssize len;
+
+      len = pseudo_tcp_mux_recv (data.right, c, buf, sizeof (buf));
+      if (len > 0) {
+        received[c] += len;
+        if (received[c] == total)
+          done_at[c] = i;
+      }
+    }
+
+    pseudo_tcp_mux_flush (data.left);
+  }
+
+  g_assert_cmpuint (done_at[2], <, done_at[1]);
+
+  g_free (src);
+  data_clear (&data);
+}
+
+static void
+pseudotcp_mux_closed (void)
+{
+  Data data;
+  guint8 buf[16];
+  guint i;
+
+  data_init (&data, 20000);
+
+  g_assert_cmpint (pseudo_tcp_mux_send (data.left, 1, (guint8 *) "hello", 5),
+      ==, 5);
+  pseudo_tcp_mux_close_channel (data.left, 1);
+  g_assert_cmpint (pseudo_tcp_mux_send (data.left, 1, (guint8 *) "x", 1),
+      ==, -1);
+  g_assert_cmpint (pseudo_tcp_mux_get_error (data.left), ==, EPIPE);
+
+  for (i = 0; i < 10; i++)
+    deliver_random (&data);
+
+  /* Queued data is delivered before the end of the channel. */
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.right, 1, buf, sizeof (buf)),
+      ==, 5);
+  g_assert (memcmp (buf, "hello", 5) == 0);
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.right, 1, buf, sizeof (buf)),
+      ==, 0);
+
+  /* The channel is forgotten once closed both ways and read to its end. */
+  g_assert_cmpuint (data.right_side.closed[1], ==, 0);
+  pseudo_tcp_mux_close_channel (data.right, 1);
+  g_assert_cmpuint (data.right_side.closed[1], ==, 1);
+
+  for (i = 0; i < 10; i++)
+    deliver_random (&data);
+
+  g_assert_cmpuint (data.left_side.closed[1], ==, 0);
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.left, 1, buf, sizeof (buf)),
+      ==, 0);
+  g_assert_cmpuint (data.left_side.closed[1], ==, 1);
+
+  /* The end of the connection ends every channel. */
+  pseudo_tcp_mux_receive_eof (data.left);
+  g_assert (pseudo_tcp_mux_is_eof (data.left, 2));
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.left, 2, buf, sizeof (buf)),
+      ==, 0);
+
+  data_clear (&data);
+}
+
+/* A side may open a channel again as soon as it forgot it, before the peer
+ * read the end of the previous one. */
+static void
+pseudotcp_mux_reopen (void)
+{
+  Data data;
+  guint8 buf[16];
+  guint readable;
+
+  data_init (&data, 20000);
+
+  g_assert_cmpint (pseudo_tcp_mux_send (data.left, 1, (guint8 *) "old", 3),
+      ==, 3);
+  pseudo_tcp_mux_close_channel (data.left, 1);
+  pseudo_tcp_mux_close_channel (data.right, 1);
+  deliver (&data.left_side, data.right, G_MAXSIZE);
+  deliver (&data.right_side, data.left, G_MAXSIZE);
+
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.left, 1, buf, sizeof (buf)),
+      ==, 0);
+  g_assert_cmpuint (data.left_side.closed[1], ==, 1);
+
+  g_assert_cmpint (pseudo_tcp_mux_send (data.left, 1, (guint8 *) "new", 3),
+      ==, 3);
+  pseudo_tcp_mux_close_channel (data.left, 1);
+  deliver (&data.left_side, data.right, G_MAXSIZE);
+
+  /* The previous channel is read to its end first, then the new one takes
+   * its place. */
+  readable = data.right_side.readable[1];
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.right, 1, buf, sizeof (buf)),
+      ==, 3);
+  g_assert (memcmp (buf, "old", 3) == 0);
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.right, 1, buf, sizeof (buf)),
+      ==, 0);
+  g_assert_cmpuint (data.right_side.closed[1], ==, 1);
+  g_assert_cmpuint (data.right_side.readable[1], ==, readable + 1);
+
+  g_assert (!pseudo_tcp_mux_is_eof (data.right, 1));
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.right, 1, buf, sizeof (buf)),
+      ==, 3);
+  g_assert (memcmp (buf, "new", 3) == 0);
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.right, 1, buf, sizeof (buf)),
+      ==, 0);
+
+  /* Both ways work on the new channel. */
+  g_assert_cmpint (pseudo_tcp_mux_send (data.right, 1, (guint8 *) "back", 4),
+      ==, 4);
+  pseudo_tcp_mux_close_channel (data.right, 1);
+  g_assert_cmpuint (data.right_side.closed[1], ==, 2);
+  deliver (&data.right_side, data.left, G_MAXSIZE);
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.left, 1, buf, sizeof (buf)),
+      ==, 4);
+  g_assert (memcmp (buf, "back", 4) == 0);
+  g_assert_cmpint (pseudo_tcp_mux_recv (data.left, 1, buf, sizeof (buf)),
+      ==, 0);
+  g_assert_cmpuint (data.left_side.closed[1], ==, 2);
+
+  data_clear (&data);
+}
+
+/* Nothing is written before the mux is started, and the queued data can be
+ * taken back if the peer does not use the framing. */
+static void
+pseudotcp_mux_start (void)
+{
+  Side side = { 0, };
+  PseudoTcpMuxCallbacks cbs = {
+    &side, side_write, side_channel_readable, side_channel_writable,
+    side_channel_closed
+  };
+  PseudoTcpMux *mux;
+  GBytes *bytes;
+
+  side.pipe = g_byte_array_new ();
+  side.capacity = 20000;
+  mux = pseudo_tcp_mux_new (&cbs);
+
+  g_assert_cmpint (pseudo_tcp_mux_send (mux, 0, (guint8 *) "hello", 5),
+      ==, 5);
+  g_assert_cmpint (pseudo_tcp_mux_send (mux, 1, (guint8 *) "world", 5),
+      ==, 5);
+  g_assert_cmpuint (side.pipe->len, ==, 0);
+
+  bytes = pseudo_tcp_mux_take_send_queue (mux, 0);
+  g_assert (bytes != NULL);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 5);
+  g_assert (memcmp (g_bytes_get_data (bytes, NULL), "hello", 5) == 0);
+  g_bytes_unref (bytes);
+  g_assert (pseudo_tcp_mux_take_send_queue (mux, 0) == NULL);
+
+  /* Once started, only the data left in the queues is sent. */
+  pseudo_tcp_mux_start (mux);
+  g_assert_cmpuint (side.pipe->len, ==, 8 + 5);
+
+  pseudo_tcp_mux_free (mux);
+  g_byte_array_unref (side.pipe);
+}
+
+/* A readable callback may close channels and get them freed while others
+ * still have to be notified. */
+static void
+closing_channel_readable (PseudoTcpMux *mux, guint16 channel,
+    gpointer user_data)
+{
+  Side *side = user_data;
+  guint8 buf[16];
+  guint16 i;
+
+  side->readable[channel]++;
+
+  for (i = 1; i < N_CHANNELS; i++)
+    while (pseudo_tcp_mux_recv (mux, i, buf, sizeof (buf)) > 0);
+}
+
+static void
+pseudotcp_mux_close_from_callback (void)
+{
+  Data data;
+  PseudoTcpMuxCallbacks cbs = {
+    &data.right_side, side_write, closing_channel_readable,
+    side_channel_writable, side_channel_closed
+  };
+  guint16 i;
+
+  data_init (&data, 20000);
+  pseudo_tcp_mux_free (data.right);
+  data.right = pseudo_tcp_mux_new (&cbs);
+  pseudo_tcp_mux_start (data.right);
+
+  for (i = 1; i < N_CHANNELS; i++) {
+    /* note: channels only end once closed by both sides */
+    pseudo_tcp_mux_close_channel (data.right, i);
+    g_assert_cmpint (pseudo_tcp_mux_send (data.left, i, (guint8 *) "x", 1),
+        ==, 1);
+    pseudo_tcp_mux_close_channel (data.left, i);
+  }
+
+  /* Every channel is readable at once: the first callback reads all of
+   * them to their end, which frees them, so the others are not notified. */
+  deliver (&data.left_side, data.right, G_MAXSIZE);
+
+  for (i = 1; i < N_CHANNELS; i++)
+    g_assert_cmpuint (data.right_side.closed[i], ==, 1);
+  g_assert_cmpuint (data.right_side.readable[1], ==, 1);
+  g_assert_cmpuint (data.right_side.readable[2], ==, 0);
+
+  data_clear (&data);
+}
+
+static void
+pseudotcp_mux_invalid (void)
+{
+  Data data;
+  const guint8 bad_type[8] = { 7, 0, 0, 1, 0, 0, 0, 0 };
+  const guint8 oversized[8] = { 0, 0, 0, 1, 0xff, 0xff, 0xff, 0xff };
+
+  data_init (&data, 20000);
+  g_assert (!pseudo_tcp_mux_receive (data.right, bad_type, sizeof (bad_type)));
+  g_assert_cmpint (pseudo_tcp_mux_get_error (data.right), ==, ECONNABORTED);
+  g_assert (!pseudo_tcp_mux_receive (data.left, oversized,
+      sizeof (oversized)));
+  data_clear (&data);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/pseudotcp/mux/transfer", pseudotcp_mux_transfer);
+  g_test_add_func ("/pseudotcp/mux/transfer/tiny-pipe",
+      pseudotcp_mux_transfer_tiny_pipe);
+  g_test_add_func ("/pseudotcp/mux/head-of-line", pseudotcp_mux_head_of_line);
+  g_test_add_func ("/pseudotcp/mux/priority", pseudotcp_mux_priority);
+  g_test_add_func ("/pseudotcp/mux/closed", pseudotcp_mux_closed);
+  g_test_add_func ("/pseudotcp/mux/reopen", pseudotcp_mux_reopen);
+  g_test_add_func ("/pseudotcp/mux/start", pseudotcp_mux_start);
+  g_test_add_func ("/pseudotcp/mux/close-from-callback",
+      pseudotcp_mux_close_from_callback);
+  g_test_add_func ("/pseudotcp/mux/invalid", pseudotcp_mux_invalid);
+
+  g_test_run ();
+
+  return 0;
+}
@@ -109,12 +109,12 @@ static void opened (PseudoTcpSocket *sock, gpointer data)
 
 static void readable (PseudoTcpSocket *sock, gpointer data)
 {
-  gchar buf[1024];
+  const guint8 *buf;
   gint len;
   g_debug ("Socket %p Readable", sock);
 
   do {
-    len = pseudo_tcp_socket_recv (sock, buf, sizeof(buf));
+    len = pseudo_tcp_socket_peek (sock, &buf);
 
     if (len > 0) {
       g_debug ("Read %d bytes", len);
@@ -132,13 +132,14 @@ static void readable (PseudoTcpSocket *sock, gpointer data)
           }
         }
       } else {
-        if (len == 26 && strncmp (buf, "abcdefghijklmnopqrstuvwxyz", len) == 0) {
+        if (len == 26 && strncmp ((const gchar *) buf, "abcdefghijklmnopqrstuvwxyz", len) == 0) {
           pseudo_tcp_socket_close (sock, FALSE);
         } else {
-          g_debug ("Error reading data.. read %d bytes : %s", len, buf);
+          g_debug ("Error reading data.. read %d bytes : %.*s", len, len, buf);
           exit (-1);
         }
       }
+      pseudo_tcp_socket_consume (sock, len);
     } else if (len == 0) {
       pseudo_tcp_socket_close (sock, FALSE);
     }
@@ -173,8 +174,34 @@ struct notify_data {
 static gboolean notify_packet (gpointer user_data)
 {
   struct notify_data *data = (struct notify_data*) user_data;
-
-  pseudo_tcp_socket_notify_packet (data->sock, data->buffer, data->len);
+  static guint8 spill[65536];
+  guint8 header[24];
+  guint8 *region;
+  gsize region_len;
+
+  /* Deliver data packets the way the agent receives them when it can:
+   * straight into the receive buffer, spilling over into another buffer */
+  region = pseudo_tcp_socket_get_receive_region (data->sock, &region_len);
+
+  if (region && data->len > sizeof (header)) {
+    GInputVector bufs[] = {
+      { header, sizeof (header) },
+      { region, region_len },
+      { spill, sizeof (spill) },
+    };
+    NiceInputMessage message = { bufs, G_N_ELEMENTS (bufs), NULL, data->len };
+    gsize body_len = data->len - sizeof (header);
+    gsize head_len = MIN (body_len, region_len);
+
+    memcpy (header, data->buffer, sizeof (header));
+    memcpy (region, data->buffer + sizeof (header), head_len);
+    memcpy (spill, data->buffer + sizeof (header) + head_len,
+        body_len - head_len);
+
+    pseudo_tcp_socket_notify_message (data->sock, &message);
+  } else {
+    pseudo_tcp_socket_notify_packet (data->sock, data->buffer, data->len);
+  }
   adjust_clock (data->sock);
 
   g_free (data);
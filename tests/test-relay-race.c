@@ -0,0 +1,306 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * Unit test for the TURN servers raced by the relay-race-count property.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ *
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "agent.h"
+
+#include "socket/socket.h"
+#include "stunagent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TURN_USER "user"
+#define TURN_PASS "pass"
+#define TURN_REALM "realm"
+#define N_SERVERS 2
+
+/* A minimal TURN server, which challenges the first Allocate, grants the
+ * authenticated ones, and answers the first deletion of an allocation with
+ * a stale nonce. The authenticated Allocate is held until all the servers
+ * got theirs, so that the first server always wins the race. */
+typedef struct {
+  NiceSocket *sock;
+  StunAgent agent;
+  gchar held[STUN_MAX_MESSAGE_SIZE];
+  gint held_len;         /* length of the held Allocate, or 0 */
+  NiceAddress held_from;
+  guint allocations;     /* Allocate requests granted */
+  guint deletes;         /* Refresh requests with a 0 lifetime received */
+  guint deletes_stale;   /* of which were answered with a stale nonce */
+} FakeTurnServer;
+
+static FakeTurnServer servers[N_SERVERS];
+static gboolean holding = TRUE;
+static guint relayed_signalled;
+static gboolean gathering_done;
+
+static void
+cb_new_candidate_full (NiceAgent *agent, NiceCandidate *candidate,
+    gpointer data)
+{
+  if (candidate->type == NICE_CANDIDATE_TYPE_RELAYED)
+    relayed_signalled++;
+}
+
+static void
+cb_candidate_gathering_done (NiceAgent *agent, guint stream_id,
+    gpointer data)
+{
+  gathering_done = TRUE;
+}
+
+static void
+cb_closed (GObject *src, GAsyncResult *res, gpointer data)
+{
+  *((gboolean *)data) = TRUE;
+}
+
+static bool
+turn_validater (StunAgent *agent, StunMessage *message, uint8_t *username,
+    uint16_t username_len, uint8_t **password, size_t *password_len,
+    void *user_data)
+{
+  if (username_len != strlen (TURN_USER) ||
+      memcmp (username, TURN_USER, username_len) != 0)
+    return FALSE;
+
+  *password = (uint8_t *) TURN_PASS;
+  *password_len = strlen (TURN_PASS);
+  return TRUE;
+}
+
+static void
+turn_send_error (FakeTurnServer *server, StunMessage *req,
+    const NiceAddress *to, StunError code, const gchar *nonce)
+{
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  StunMessage msg;
+  size_t len;
+
+  g_assert_true (stun_agent_init_error (&server->agent, &msg, buf,
+          sizeof (buf), req, code));
+  g_assert_cmpint (stun_message_append_string (&msg, STUN_ATTRIBUTE_REALM,
+          TURN_REALM), ==, STUN_MESSAGE_RETURN_SUCCESS);
+  g_assert_cmpint (stun_message_append_string (&msg, STUN_ATTRIBUTE_NONCE,
+          nonce), ==, STUN_MESSAGE_RETURN_SUCCESS);
+  len = stun_agent_finish_message (&server->agent, &msg, NULL, 0);
+  g_assert_cmpuint (len, >, 0);
+
+  nice_socket_send (server->sock, to, len, (gchar *) buf);
+}
+
+static void
+turn_answer (FakeTurnServer *server, gchar *buf, gint len,
+    const NiceAddress *from)
+{
+  uint8_t rbuf[STUN_MAX_MESSAGE_SIZE];
+  StunMessage req, msg;
+  StunValidationStatus valid;
+  struct sockaddr_storage ss;
+  uint32_t lifetime = 600;
+  size_t rlen;
+
+  valid = stun_agent_validate (&server->agent, &req, (uint8_t *) buf, len,
+      turn_validater, NULL);
+
+  if (valid == STUN_VALIDATION_UNAUTHORIZED_BAD_REQUEST) {
+    turn_send_error (server, &req, from, STUN_ERROR_UNAUTHORIZED, "nonce");
+    return;
+  }
+  g_assert_cmpint (valid, ==, STUN_VALIDATION_SUCCESS);
+  g_assert_cmpint (stun_message_get_class (&req), ==, STUN_REQUEST);
+
+  if (stun_message_get_method (&req) == STUN_REFRESH) {
+    g_assert_cmpint (stun_message_find32 (&req, STUN_ATTRIBUTE_LIFETIME,
+            &lifetime), ==, STUN_MESSAGE_RETURN_SUCCESS);
+    if (lifetime == 0) {
+      server->deletes++;
+      if (server->deletes_stale == 0) {
+        server->deletes_stale++;
+        turn_send_error (server, &req, from, STUN_ERROR_STALE_NONCE,
+            "nonce2");
+        return;
+      }
+    }
+  } else {
+    g_assert_cmpint (stun_message_get_method (&req), ==, STUN_ALLOCATE);
+    if (holding) {
+      memcpy (server->held, buf, len);
+      server->held_len = len;
+      server->held_from = *from;
+      return;
+    }
+    server->allocations++;
+  }
+
+  g_assert_true (stun_agent_init_response (&server->agent, &msg, rbuf,
+          sizeof (rbuf), &req));
+  g_assert_cmpint (stun_message_append32 (&msg, STUN_ATTRIBUTE_LIFETIME,
+          lifetime), ==, STUN_MESSAGE_RETURN_SUCCESS);
+  if (stun_message_get_method (&req) == STUN_ALLOCATE) {
+    /* note: the address of the server is used as the relayed address */
+    nice_address_copy_to_sockaddr (&server->sock->addr,
+        (struct sockaddr *) &ss);
+    g_assert_cmpint (stun_message_append_xor_addr (&msg,
+            STUN_ATTRIBUTE_XOR_RELAYED_ADDRESS, &ss,
+            sizeof (struct sockaddr_in)), ==, STUN_MESSAGE_RETURN_SUCCESS);
+    nice_address_copy_to_sockaddr (from, (struct sockaddr *) &ss);
+    g_assert_cmpint (stun_message_append_xor_addr (&msg,
+            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, &ss,
+            sizeof (struct sockaddr_in)), ==, STUN_MESSAGE_RETURN_SUCCESS);
+  }
+  rlen = stun_agent_finish_message (&server->agent, &msg,
+      (uint8_t *) TURN_PASS, strlen (TURN_PASS));
+  g_assert_cmpuint (rlen, >, 0);
+
+  nice_socket_send (server->sock, from, rlen, (gchar *) rbuf);
+}
+
+static void
+turn_serve (FakeTurnServer *server)
+{
+  gchar buf[STUN_MAX_MESSAGE_SIZE];
+  NiceAddress from;
+  gint len;
+
+  while ((len = nice_socket_recv (server->sock, &from, sizeof (buf), buf)) > 0)
+    turn_answer (server, buf, len, &from);
+}
+
+static void
+run_for (gint64 usec)
+{
+  gint64 end = g_get_monotonic_time () + usec;
+  guint k;
+
+  while (g_get_monotonic_time () < end) {
+    while (g_main_context_iteration (NULL, FALSE));
+    for (k = 0; k < N_SERVERS; k++)
+      turn_serve (&servers[k]);
+
+    /* note: grant the held allocations in the order of the servers */
+    for (k = 0; k < N_SERVERS && holding; k++)
+      if (servers[k].held_len == 0)
+        break;
+    if (holding && k == N_SERVERS) {
+      holding = FALSE;
+      for (k = 0; k < N_SERVERS; k++)
+        turn_answer (&servers[k], servers[k].held, servers[k].held_len,
+            &servers[k].held_from);
+    }
+
+    g_usleep (1000);
+  }
+}
+
+int main (void)
+{
+  NiceAgent *agent;
+  NiceAddress addr;
+  gboolean closed = FALSE;
+  gint64 deadline;
+  guint stream_id;
+  guint k;
+
+#ifdef G_OS_WIN32
+  WSADATA w;
+
+  WSAStartup(0x0202, &w);
+#endif
+
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+
+  for (k = 0; k < N_SERVERS; k++) {
+    servers[k].sock = nice_udp_bsd_socket_new (&addr, NULL);
+    g_assert_true (servers[k].sock != NULL);
+    stun_agent_init (&servers[k].agent, STUN_ALL_KNOWN_ATTRIBUTES,
+        STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+  }
+
+  agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+  g_object_set (agent, "ice-tcp", FALSE, "upnp", FALSE,
+      "relay-race-count", 1, NULL);
+  nice_agent_add_local_address (agent, &addr);
+
+  g_signal_connect (agent, "new-candidate-full",
+      G_CALLBACK (cb_new_candidate_full), NULL);
+  g_signal_connect (agent, "candidate-gathering-done",
+      G_CALLBACK (cb_candidate_gathering_done), NULL);
+
+  stream_id = nice_agent_add_stream (agent, 1);
+  for (k = 0; k < N_SERVERS; k++)
+    g_assert_true (nice_agent_set_relay_info (agent, stream_id, 1,
+            "127.0.0.1", nice_address_get_port (&servers[k].sock->addr),
+            TURN_USER, TURN_PASS, NICE_RELAY_TYPE_TURN_UDP));
+
+  g_assert_true (nice_agent_gather_candidates (agent, stream_id));
+
+  /* step: both servers grant an allocation, the first one wins */
+  deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (!gathering_done) {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    run_for (1000);
+  }
+
+  /* step: the loser deletes its allocation, and deletes it again with the
+   * new nonce. Once that is answered, nothing is retransmitted. */
+  run_for (2 * G_USEC_PER_SEC);
+
+  g_assert_cmpuint (relayed_signalled, ==, 1);
+  for (k = 0; k < N_SERVERS; k++)
+    g_assert_cmpuint (servers[k].allocations, >=, 1);
+  g_assert_cmpuint (servers[0].deletes, ==, 0);
+  g_assert_cmpuint (servers[1].deletes, ==, 2);
+
+  /* step: closing the agent deletes the allocation of the winner */
+  nice_agent_remove_stream (agent, stream_id);
+  nice_agent_close_async (agent, cb_closed, &closed);
+  g_clear_object (&agent);
+
+  deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (!closed) {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    run_for (1000);
+  }
+
+  g_assert_cmpuint (servers[0].deletes, >=, 1);
+  g_assert_cmpuint (servers[1].deletes, ==, 2);
+
+  for (k = 0; k < N_SERVERS; k++) {
+    stun_agent_clear (&servers[k].agent);
+    nice_socket_free (servers[k].sock);
+  }
+
+#ifdef G_OS_WIN32
+  WSACleanup();
+#endif
+  return 0;
+}
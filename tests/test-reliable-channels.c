@@ -0,0 +1,300 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * Unit test for the reliable channels of the reliable-channels property,
+ * used through nice_agent_get_channel_io_stream().
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ *
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "agent.h"
+
+#include <string.h>
+
+typedef struct {
+  NiceAgent *agent;
+  guint stream_id;
+  gboolean writable;
+} Peer;
+
+static Peer left, right;
+
+static void
+cb_candidate_gathering_done (NiceAgent *agent, guint stream_id,
+    gpointer data)
+{
+  Peer *self = data;
+  Peer *other = (self == &left) ? &right : &left;
+  gchar *ufrag = NULL, *password = NULL;
+  GSList *cands;
+
+  nice_agent_get_local_credentials (agent, stream_id, &ufrag, &password);
+  nice_agent_set_remote_credentials (other->agent, other->stream_id, ufrag,
+      password);
+  g_free (ufrag);
+  g_free (password);
+
+  cands = nice_agent_get_local_candidates (agent, stream_id, 1);
+  g_assert_true (cands != NULL);
+  nice_agent_set_remote_candidates (other->agent, other->stream_id, 1, cands);
+  g_slist_free_full (cands, (GDestroyNotify) nice_candidate_free);
+}
+
+static void
+cb_reliable_transport_writable (NiceAgent *agent, guint stream_id,
+    guint component_id, gpointer data)
+{
+  Peer *self = data;
+
+  self->writable = TRUE;
+}
+
+static void
+peer_init (Peer *peer, gboolean controlling, gboolean channels)
+{
+  NiceAddress addr;
+  NiceAgentOption flags = NICE_AGENT_OPTION_RELIABLE;
+
+  if (channels)
+    flags |= NICE_AGENT_OPTION_RELIABLE_CHANNELS;
+
+  peer->agent = nice_agent_new_full (NULL, NICE_COMPATIBILITY_RFC5245, flags);
+  peer->writable = FALSE;
+  g_object_set (peer->agent, "controlling-mode", controlling,
+      "upnp", FALSE, "ice-tcp", FALSE, NULL);
+
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+  nice_agent_add_local_address (peer->agent, &addr);
+
+  g_signal_connect (peer->agent, "candidate-gathering-done",
+      G_CALLBACK (cb_candidate_gathering_done), peer);
+  g_signal_connect (peer->agent, "reliable-transport-writable",
+      G_CALLBACK (cb_reliable_transport_writable), peer);
+
+  peer->stream_id = nice_agent_add_stream (peer->agent, 1);
+  g_assert_cmpuint (peer->stream_id, >, 0);
+}
+
+static void
+peer_clear (Peer *peer)
+{
+  nice_agent_remove_stream (peer->agent, peer->stream_id);
+  g_clear_object (&peer->agent);
+}
+
+/* Connects both peers, and waits for both ends of the pseudo-TCP connection
+ * to be up. */
+static void
+connect_peers (void)
+{
+  gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+
+  g_assert_true (nice_agent_gather_candidates (left.agent, left.stream_id));
+  g_assert_true (nice_agent_gather_candidates (right.agent, right.stream_id));
+
+  while (!left.writable || !right.writable) {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    g_main_context_iteration (NULL, TRUE);
+  }
+}
+
+/* Reads exactly @len bytes from @stream, or up to its end if @len is 0 and
+ * then checks that the end was reached. */
+static void
+read_channel (GIOStream *stream, guint8 *buf, gsize len)
+{
+  GPollableInputStream *input;
+  gint64 deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  gsize got = 0;
+
+  input = G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (stream));
+
+  for (;;) {
+    GError *error = NULL;
+    guint8 eof_buf[1];
+    gssize n;
+
+    if (len > 0)
+      n = g_pollable_input_stream_read_nonblocking (input, buf + got,
+          len - got, NULL, &error);
+    else
+      n = g_pollable_input_stream_read_nonblocking (input, eof_buf,
+          sizeof (eof_buf), NULL, &error);
+
+    if (n < 0) {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+      g_clear_error (&error);
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      g_main_context_iteration (NULL, TRUE);
+      continue;
+    }
+
+    if (len == 0) {
+      g_assert_cmpint (n, ==, 0);
+      return;
+    }
+
+    g_assert_cmpint (n, >, 0);
+    got += n;
+    if (got == len)
+      return;
+  }
+}
+
+static void
+write_channel (GIOStream *stream, const gchar *data)
+{
+  GOutputStream *output = g_io_stream_get_output_stream (stream);
+  GError *error = NULL;
+  gsize written = 0;
+
+  g_assert_true (g_output_stream_write_all (output, data, strlen (data),
+          &written, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (written, ==, strlen (data));
+}
+
+/* Channels carry their data independently, and end independently. */
+static void
+test_channels (void)
+{
+  GIOStream *l1, *l2, *r1, *r2;
+  guint8 buf[16];
+
+  peer_init (&left, TRUE, TRUE);
+  peer_init (&right, FALSE, TRUE);
+
+  /* note: data written before the connection is up is queued */
+  l1 = nice_agent_get_channel_io_stream (left.agent, left.stream_id, 1, 1);
+  l2 = nice_agent_get_channel_io_stream (left.agent, left.stream_id, 1, 2);
+  g_assert_true (l1 != NULL && l2 != NULL);
+  g_assert_true (l1 != l2);
+  write_channel (l1, "one");
+
+  connect_peers ();
+
+  write_channel (l2, "two");
+  g_assert_true (g_output_stream_close (g_io_stream_get_output_stream (l2),
+          NULL, NULL));
+
+  /* Channel 2 is read first and to its end, channel 1 is left open. */
+  r2 = nice_agent_get_channel_io_stream (right.agent, right.stream_id, 1, 2);
+  read_channel (r2, buf, 3);
+  g_assert_true (memcmp (buf, "two", 3) == 0);
+  read_channel (r2, NULL, 0);
+
+  r1 = nice_agent_get_channel_io_stream (right.agent, right.stream_id, 1, 1);
+  read_channel (r1, buf, 3);
+  g_assert_true (memcmp (buf, "one", 3) == 0);
+
+  /* The same channel gives the same stream while it is in use. */
+  g_assert_true (nice_agent_get_channel_io_stream (right.agent,
+          right.stream_id, 1, 1) == r1);
+  g_object_unref (r1);
+
+  g_object_unref (l1);
+  g_object_unref (l2);
+  g_object_unref (r1);
+  g_object_unref (r2);
+
+  peer_clear (&left);
+  peer_clear (&right);
+}
+
+/* A peer without channels gets the component as plain pseudo-TCP, and the
+ * other channels fail. */
+static void
+test_fallback (void)
+{
+  GPollableOutputStream *output;
+  GIOStream *l1;
+  GError *error = NULL;
+  gint64 deadline;
+  gchar buf[16];
+  gsize got = 0;
+
+  peer_init (&left, TRUE, TRUE);
+  peer_init (&right, FALSE, FALSE);
+
+  l1 = nice_agent_get_channel_io_stream (left.agent, left.stream_id, 1, 1);
+
+  connect_peers ();
+
+  output = G_POLLABLE_OUTPUT_STREAM (g_io_stream_get_output_stream (l1));
+  g_assert_cmpint (g_pollable_output_stream_write_nonblocking (output, "x", 1,
+          NULL, &error), ==, -1);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED);
+  g_clear_error (&error);
+
+  /* Channel 0 is sent unframed. */
+  g_assert_cmpint (nice_agent_send (left.agent, left.stream_id, 1, 5,
+          "hello"), ==, 5);
+
+  deadline = g_get_monotonic_time () + 10 * G_USEC_PER_SEC;
+  while (got < 5) {
+    gssize n;
+
+    n = nice_agent_recv_nonblocking (right.agent, right.stream_id, 1,
+        (guint8 *) buf + got, sizeof (buf) - got, NULL, &error);
+    if (n < 0) {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+      g_clear_error (&error);
+      g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+      g_main_context_iteration (NULL, TRUE);
+      continue;
+    }
+    got += n;
+  }
+  g_assert_cmpuint (got, ==, 5);
+  g_assert_true (memcmp (buf, "hello", 5) == 0);
+
+  g_object_unref (l1);
+
+  peer_clear (&left);
+  peer_clear (&right);
+}
+
+int
+main (int argc, char *argv[])
+{
+#ifdef G_OS_WIN32
+  WSADATA w;
+
+  WSAStartup(0x0202, &w);
+#endif
+
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/reliable-channels/channels", test_channels);
+  g_test_add_func ("/reliable-channels/fallback", test_fallback);
+
+  g_test_run ();
+
+#ifdef G_OS_WIN32
+  WSACleanup();
+#endif
+  return 0;
+}
@@ -34,9 +34,86 @@
 
 #include "agent.h"
 
+#include "socket/socket.h"
+
 #include <stdlib.h>
 #include <string.h>
 
+/* Creates an agent with a single component on @min_port to @max_port of the
+ * loopback, and returns the port of its host candidate, or 0 if gathering
+ * failed. */
+static guint
+gather_in_range (NiceAgent **agent, guint min_port, guint max_port)
+{
+  NiceAddress addr;
+  GSList *cands;
+  guint stream_id;
+  guint port = 0;
+
+  *agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+  g_object_set (*agent, "ice-tcp", FALSE, "upnp", FALSE, NULL);
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+  nice_agent_add_local_address (*agent, &addr);
+
+  stream_id = nice_agent_add_stream (*agent, 1);
+  nice_agent_set_port_range (*agent, stream_id, 1, min_port, max_port);
+  if (!nice_agent_gather_candidates (*agent, stream_id))
+    return 0;
+
+  cands = nice_agent_get_local_candidates (*agent, stream_id, 1);
+  g_assert_true (cands != NULL);
+  port = nice_address_get_port (&((NiceCandidate *) cands->data)->addr);
+  g_slist_free_full (cands, (GDestroyNotify) nice_candidate_free);
+
+  g_assert_cmpuint (port, >=, min_port);
+  g_assert_cmpuint (port, <=, max_port);
+  return port;
+}
+
+/* Two agents of the process sharing a range of two ports get one each, a
+ * third one finds the range full, and gets the port of the first one once
+ * it is freed. */
+static void
+test_shared_range (void)
+{
+  NiceAgent *agent1, *agent2, *agent3;
+  NiceSocket *sock1, *sock2;
+  NiceAddress addr;
+  guint min_port, port1, port2;
+
+  /* note: look for two consecutive free ports */
+  g_assert_true (nice_address_set_from_string (&addr, "127.0.0.1"));
+  for (min_port = 20000; min_port < 60000; min_port += 2) {
+    nice_address_set_port (&addr, min_port);
+    sock1 = nice_udp_bsd_socket_new (&addr, NULL);
+    nice_address_set_port (&addr, min_port + 1);
+    sock2 = nice_udp_bsd_socket_new (&addr, NULL);
+    nice_socket_free (sock1);
+    nice_socket_free (sock2);
+    if (sock1 && sock2)
+      break;
+  }
+  g_assert_cmpuint (min_port, <, 60000);
+
+  port1 = gather_in_range (&agent1, min_port, min_port + 1);
+  port2 = gather_in_range (&agent2, min_port, min_port + 1);
+  g_assert_cmpuint (port1, !=, 0);
+  g_assert_cmpuint (port2, !=, 0);
+  g_assert_cmpuint (port1, !=, port2);
+
+  g_assert_cmpuint (gather_in_range (&agent3, min_port, min_port + 1), ==, 0);
+  g_object_unref (agent3);
+
+  g_object_unref (agent1);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_assert_cmpuint (gather_in_range (&agent3, min_port, min_port + 1), ==,
+      port1);
+
+  g_object_unref (agent2);
+  g_object_unref (agent3);
+}
+
 int main (int argc, char **argv)
 {
   NiceAgent *agent;
@@ -67,6 +144,8 @@ int main (int argc, char **argv)
 
   g_object_unref (agent);
 
+  test_shared_range ();
+
 #ifdef G_OS_WIN32
   WSACleanup();
 #endif